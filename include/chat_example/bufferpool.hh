@@ -0,0 +1,145 @@
+// bufferpool.hh
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Size-class allocator for the buffers and objects the server churns
+// through: outbound frames, their shared_ptr control blocks, receive buffers
+// and sessions. Freed blocks go onto a free list of the freeing thread and
+// are handed out again by the next allocation of the same class on that
+// thread, so in steady state a frame costs no malloc/free at all and the
+// heap does not fragment into odd sizes.
+//
+// Sizes are rounded up to a power of two between 64 bytes and 64 KiB, larger
+// requests go straight to operator new. Each thread keeps at most about
+// 256 KiB per class, anything freed beyond that is returned to the heap.
+class BufferPool {
+public:
+    static constexpr size_t kMinBlock = 64;
+    static constexpr size_t kMaxBlock = 64 * 1024;
+    static constexpr size_t kClasses = std::countr_zero(kMaxBlock) - std::countr_zero(kMinBlock) + 1;
+    static constexpr size_t kMaxCachedBytes = 256 * 1024;
+
+    static void* allocate(size_t bytes) {
+        if (bytes > kMaxBlock) {
+            return ::operator new(bytes);
+        }
+        size_t size_class = classOf(bytes);
+        Cache* cache = threadCache();
+        if (cache && cache->heads[size_class]) {
+            FreeBlock* block = cache->heads[size_class];
+            cache->heads[size_class] = block->next;
+            --cache->counts[size_class];
+            return block;
+        }
+        return ::operator new(blockSize(size_class));
+    }
+
+    static void deallocate(void* pointer, size_t bytes) {
+        if (bytes > kMaxBlock) {
+            ::operator delete(pointer);
+            return;
+        }
+        size_t size_class = classOf(bytes);
+        Cache* cache = threadCache();
+        if (!cache || cache->counts[size_class] >= maxCached(size_class)) {
+            ::operator delete(pointer);
+            return;
+        }
+        auto* block = static_cast<FreeBlock*>(pointer);
+        block->next = cache->heads[size_class];
+        cache->heads[size_class] = block;
+        ++cache->counts[size_class];
+    }
+
+    // Blocks waiting on this thread's free lists
+    static size_t cachedBlocks() {
+        Cache* cache = threadCache();
+        size_t blocks = 0;
+        if (cache) {
+            for (uint32_t count : cache->counts) {
+                blocks += count;
+            }
+        }
+        return blocks;
+    }
+
+    static constexpr size_t classOf(size_t bytes) {
+        return bytes <= kMinBlock ? 0 : std::bit_width(bytes - 1) - std::countr_zero(kMinBlock);
+    }
+
+    static constexpr size_t blockSize(size_t size_class) { return kMinBlock << size_class; }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct Cache {
+        std::array<FreeBlock*, kClasses> heads{};
+        std::array<uint32_t, kClasses> counts{};
+
+        ~Cache() {
+            for (FreeBlock* head : heads) {
+                while (head) {
+                    FreeBlock* next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+            destroyed() = true;
+        }
+    };
+
+    static constexpr size_t maxCached(size_t size_class) {
+        return std::max<size_t>(4, kMaxCachedBytes / blockSize(size_class));
+    }
+
+    // Trivially destructible, so still readable while the thread's other
+    // thread_locals are being torn down
+    static bool& destroyed() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    // Null once the thread is exiting, blocks freed then go to the heap
+    static Cache* threadCache() {
+        if (destroyed()) {
+            return nullptr;
+        }
+        static thread_local Cache cache;
+        return &cache;
+    }
+};
+
+// Standard allocator on top of BufferPool
+template<typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "BufferPool blocks only have default alignment");
+
+    PoolAllocator() noexcept = default;
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(BufferPool::allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t count) noexcept {
+        BufferPool::deallocate(pointer, count * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+};
+
+// Byte buffer whose storage comes from the pool
+using PooledBytes = std::vector<uint8_t, PoolAllocator<uint8_t>>;
@@ -5,20 +5,52 @@
 #include <string>
 #include <deque>
 #include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 
+#include "compression.hh"
+#include "coroutine.hh"
+#include "log.hh"
 #include "packet.hh"
+#include "receivebuffer.hh"
 #include "signal.hh"
+#include "writequeue.hh"
 
+// What a later connection needs to log in again without the password, and
+// without being sent the history it already has
+struct ResumeState {
+    std::string token;
+    HistoryId last_seen = 0;
+};
+
+// A client either owns its io_context and thread, started by start(), or
+// runs on an io_context supplied by the caller, so any number of clients can
+// share a fixed pool of I/O threads. Either way all of a client's work runs
+// on its own strand and the signals behave the same. Once connected, reading
+// and writing are two coroutines on that strand.
 class ChatClient {
 public:
-    ChatClient(const std::string& name);
+    ChatClient(const std::string& name, WriteBatchLimits write_limits = {});
+    // Runs on `io_context`, which the caller runs on as many threads as it
+    // likes. start() does nothing. stop() closes the connection and waits for
+    // the client's outstanding handlers, after which the client may be
+    // destroyed; it must not be called from one of those handlers.
+    ChatClient(boost::asio::io_context& io_context, const std::string& name, WriteBatchLimits write_limits = {});
     void start();
     void stop();
 
     Signal<const std::string&, const std::string&> Connect;
     Signal<const std::string&> SendMessage;
+    Signal<RoomId, const std::string&> SendRoomMessage;
+    Signal<RoomId> JoinRoom;
+    Signal<RoomId> LeaveRoom;
     Signal<const std::string&, const std::string&> CreateUser;
     Signal<const std::string&, const std::string&> Login;
+    // Reported through on_login_response like a Login
+    Signal<ResumeState> Resume;
     Signal<> Close;
 
     Signal<> on_disconnected;
@@ -26,36 +58,90 @@ public:
     Signal<bool> on_login_response;
     Signal<bool> on_create_account_response;
     Signal<const std::string&, const std::string&> on_message_received;
+    // Messages from rooms other than the lobby
+    Signal<RoomId, const std::string&, const std::string&> on_room_message_received;
 
     bool is_logged_in() const {return logged_in_;}
+    // Empty token until logged in
+    ResumeState resume_state() const;
 private:
+    ChatClient(std::unique_ptr<boost::asio::io_context> owned_io_context,
+               boost::asio::io_context* shared_io_context,
+               const std::string& name,
+               WriteBatchLimits write_limits);
+
+    // Counts a pending completion handler, so a shared-mode stop() can wait
+    // for the last one to finish
+    template<typename Handler>
+    auto tracked(Handler handler);
+
     void connect(const std::string& host, const std::string& port);
     void write(const std::string& msg);
     void close();
     bool is_open() const { return !closed_; }
     void login(const std::string& username, const std::string& password);
+    void resume(const ResumeState& state);
     void create_user(const std::string& username, const std::string& password);
-    void send_message(const std::string& message);
+    void send_message(const std::string& message, RoomId room = kLobbyRoom);
 
-    void do_read();
-    void do_write();
-    void do_read_header();
-    void do_read_body();
+    boost::asio::awaitable<void> read_loop();
+    // Sends the queue while there is one, then waits for write()
+    boost::asio::awaitable<void> write_loop();
     void write(const Packet& packet);
 
-    boost::asio::io_context io_context_;
+    std::unique_ptr<boost::asio::io_context> owned_io_context_;  // null in shared mode
+    boost::asio::io_context& io_context_;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    boost::asio::ip::tcp::resolver resolver_;
     boost::asio::ip::tcp::socket socket_;
-    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard_;
+    std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work_guard_;
     std::thread io_thread_;
+    // Only touched on the strand
+    size_t outstanding_ = 0;
+    std::shared_ptr<std::promise<void>> drained_;
     std::string name_;
-    std::vector<uint8_t> read_msg_;
+    ReceiveBuffer read_buffer_{64 * 1024};
     std::deque<std::vector<uint8_t>> write_msgs_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    boost::asio::steady_timer write_wanted_;
+    WriteBatchLimits write_limits_;
     std::atomic<bool> closed_{false};
     std::atomic<bool> logged_in_ = false;
+    // What the server agreed to at login, and the buffer compressed frames
+    // from it are inflated into. Strand only.
+    uint32_t capabilities_ = 0;
+    CompressionConfig compression_;
+    std::vector<uint8_t> inflated_;
+    // Written on the strand, read by resume_state() from anywhere
+    mutable std::mutex resume_mutex_;
+    ResumeState resume_state_;
 
-    void handle_packet(const std::vector<uint8_t>& packet_data);
+    DecodeResult handle_packet(std::span<const uint8_t> packet_data);
+    void on_packet(const LoginSuccessPacketView& packet);
+    void on_packet(const LoginFailedPacketView& packet);
+    void on_packet(const AccountCreatedPacketView& packet);
+    void on_packet(const AccountExistsPacketView& packet);
+    void on_packet(const RateLimitedPacketView& packet);
+    void on_packet(const ChatMessagePacketView& packet);
+    void on_packet(const ChatMessageBatchPacketView& packet);
+    void on_chat_line(RoomId room, std::string_view sender, std::string_view message);
+    void saw_history(HistoryId id);
+    // The server checking we are still there
+    void on_packet(const PingPacketView& packet);
+    // Handles the frames inside, which may not be compressed again
+    DecodeResult on_compressed(const CompressedPacketView& packet);
+    // Client-to-server packets have no business arriving here
+    template<typename View>
+    void on_packet(const View& /*packet*/) {
+        logWarn("[CLIENT {}] Received unexpected packet type from server: {}", name_, static_cast<int>(View::type));
+    }
 
 
-    uint32_t next_packet_size_ = 0;
     bool account_created_ = false;
+    // Login, Resume or CreateUser for each request still to be answered,
+    // oldest first. The server answers them in order, and a RateLimited
+    // reply does not say which kind it refuses. Strand only.
+    std::deque<PacketType> pending_requests_;
+    // Takes the oldest request off, if there was one
+    std::optional<PacketType> answered();
 };
@@ -2,63 +2,445 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <chrono>
 #include <string>
 #include <unordered_map>
-#include <set>
 #include <memory>
 #include <deque>
+#include <functional>
 #include <atomic>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <vector>
 #include "packet.hh"
+#include "clusterbus.h"
+#include "compression.hh"
+#include "coroutine.hh"
 #include "databaseadapter.hh"
+#include "historycache.hh"
+#include "log.hh"
+#include "loginlimiter.hh"
+#include "metrics.hh"
+#include "metricsserver.h"
+#include "receivebuffer.hh"
+#include "resumetoken.hh"
+#include "slottable.hh"
+#include "writequeue.hh"
 
 class ChatServer;
 
+// Deadlines after which a session is closed, so dead and stuck connections
+// do not linger in every broadcast. 0 turns one off.
+struct SessionTimeouts {
+    // From accept until a successful login
+    std::chrono::milliseconds login{30000};
+    // From the first byte of a frame until its last, so a trickle of bytes
+    // cannot hold a receive buffer forever
+    std::chrono::milliseconds frame{10000};
+    // Without anything read from the client
+    std::chrono::milliseconds idle{90000};
+    // Sessions that negotiated kCapKeepalive are pinged after this long
+    // without anything read, so a quiet but live client is not closed as idle
+    std::chrono::milliseconds ping_interval{30000};
+};
+
+struct AcceptLimits {
+    // Open sessions, 0 for no limit. At the limit the server stops accepting
+    // and new connections wait in the listen backlog.
+    size_t max_connections = 0;
+    // New connections per second, with bursts of as many, 0 for no limit
+    uint32_t max_per_second = 0;
+    // Wait before trying again once full or after a failed accept
+    std::chrono::milliseconds backoff{100};
+    // Connections taken off the backlog each time the listener is ready, so
+    // a burst of them is not one trip through the reactor apiece
+    size_t batch = 16;
+};
+
+// Options set on the sockets of sessions, 0 keeping the kernel's default
+struct SocketTuning {
+    // Writes are batched already, Nagle would only hold back the last
+    // frame of a batch until the previous one is acknowledged
+    bool no_delay = true;
+    // SO_SNDBUF and SO_RCVBUF, in bytes. Set on the listener so accepted
+    // sockets have them from the handshake on; setting either turns off the
+    // kernel's autotuning of that buffer.
+    int send_buffer = 0;
+    int receive_buffer = 0;
+    // TCP_NOTSENT_LOWAT, in bytes. Keeps what a slow client has not been
+    // sent in the session's write queue, where backpressure sees it, rather
+    // than in the kernel.
+    int notsent_lowat = 0;
+};
+
+// How ChatServer::drain() lets go of its sessions
+struct DrainConfig {
+    // Sessions are closed one after another over this long, so their clients
+    // reconnect to the next release a few at a time instead of all at once
+    std::chrono::milliseconds spread{10000};
+    // A closing session still sends what was queued for it, and is cut off
+    // if that or the client's goodbye takes longer than this
+    std::chrono::milliseconds flush_timeout{2000};
+};
+
+struct ChatServerConfig {
+    WriteBatchLimits write_batch;
+    PacketLimits packet_limits = PacketLimits::forClients();
+    size_t receive_buffer_size = 16 * 1024;
+    BackpressureConfig backpressure;
+    // Chat messages replayed to a user on login
+    size_t history_size = 50;
+    LoginLimits login_limits;
+    // Rooms a session may be in besides the lobby
+    size_t max_rooms_per_session = 64;
+    // Port of the Prometheus scrape endpoint, 0 for none
+    unsigned short metrics_port = 0;
+    CompressionConfig compression;
+    // How long a busy room collects chat lines into one ChatMessageBatch for
+    // sessions that negotiated kCapMessageBatches, 0 to send every line as
+    // it comes. The first line after a quiet tick still goes out at once.
+    std::chrono::microseconds batch_interval{0};
+    SessionTimeouts timeouts;
+    AcceptLimits accept;
+    SocketTuning socket_tuning;
+    // The other nodes this one shares its broadcasts with. Without a port
+    // and peers the node is on its own.
+    ClusterConfig cluster;
+    // Lets the next release bind the same port while this one drains. The
+    // kernel spreads new connections over both listeners until this one
+    // closes its socket.
+    bool reuse_port = false;
+    // A listening socket inherited from the previous release, adopted
+    // instead of binding the port, -1 for none. See listener_handle().
+    int listen_fd = -1;
+    DrainConfig drain;
+    // Every LoginSuccess carries a token that logs the client in again
+    // with a Resume, without its password
+    ResumeConfig resume;
+};
+
+// How often each slow-consumer policy fired, summed over all sessions
+struct BackpressureCounters {
+    std::atomic<uint64_t> drop_events{0};
+    std::atomic<uint64_t> frames_dropped{0};
+    std::atomic<uint64_t> read_pauses{0};
+    std::atomic<uint64_t> disconnects{0};
+};
+
+// The server's hot-path metrics, registered up front so that updating one
+// is a plain atomic add. Durations are in nanoseconds.
+struct ServerMetrics {
+    explicit ServerMetrics(MetricsRegistry& registry);
+
+    std::array<Counter*, PacketViews::size> packets_received{};
+    Counter& packets_rejected;
+    Histogram& packet_handling;
+    Counter& bytes_received;
+    Counter& bytes_sent;
+    Counter& reads;
+    Counter& writes;
+    Counter& frames_sent;
+    Gauge& sessions;
+    Gauge& write_queue_bytes;
+    Gauge& write_queue_frames;
+    Counter& broadcasts;
+    Counter& broadcast_deliveries;
+    Histogram& broadcast_duration;
+    Counter& frames_compressed;
+    Counter& compression_saved_bytes;
+    Counter& batches;
+    Counter& batched_lines;
+    Counter& cluster_published;
+    Counter& cluster_received;
+    Counter& login_timeouts;
+    Counter& frame_timeouts;
+    Counter& idle_timeouts;
+    Counter& pings_sent;
+    Counter& accept_backoffs;
+    Counter& resumes;
+    Counter& resumes_rejected;
+    Histogram& db_store;
+    Histogram& db_authenticate;
+    Histogram& db_create_user;
+    Histogram& db_recent_messages;
+};
+
+// Every completion handler of a session runs on the strand its socket was
+// accepted on, so a session is only ever touched by one thread at a time.
+// deliver() and stop() may be called from any thread.
+//
+// Reading and writing are two coroutines on that strand, each holding the
+// session for as long as it runs, so a frame costs neither a reference count
+// nor a handler of its own.
 class ChatSession : public std::enable_shared_from_this<ChatSession> {
 public:
+    // Gets a function to call, on the strand, once the check has finished
+    using CredentialCheck = std::function<void(std::function<void()> done)>;
+
     ChatSession(boost::asio::ip::tcp::socket socket, ChatServer& server);
 
+    boost::asio::any_io_executor get_executor() { return socket_.get_executor(); }
+
     void start();
-    void deliver(const Packet& packet);
+    template<std::derived_from<Packet> P>
+    void deliver(const P& packet) { deliver(Packet::prepareSharedPacket(packet)); }
+    void deliver(SharedFrame frame);
     void stop();
+    // Sends what is queued by `when`, drops anything delivered after that,
+    // shuts down its side of the connection and waits for the client to
+    // hang up, within DrainConfig::flush_timeout
+    void close_at(std::chrono::steady_clock::time_point when);
     void set_username(const std::string& username);
     const std::string& get_username() const;
+    // Peer address, empty if the socket was already gone when accepted
+    const std::string& get_address() const { return address_; }
+    // Runs credential checks one at a time, so their replies keep the order
+    // of the requests even though hashing completes asynchronously. Must be
+    // called on the strand.
+    void queue_credential_check(CredentialCheck check);
+
+    // Negotiated at login, read by broadcasts on any thread
+    bool compresses() const { return capabilities_.load(std::memory_order_relaxed) & kCapCompressedFrames; }
+    bool batches() const { return capabilities_.load(std::memory_order_relaxed) & kCapMessageBatches; }
+    bool keepalive() const { return capabilities_.load(std::memory_order_relaxed) & kCapKeepalive; }
+    void set_capabilities(uint32_t capabilities) { capabilities_.store(capabilities, std::memory_order_relaxed); }
+
+    // Lobby lines up to this id went out with the replay at login, so only
+    // newer ones are sent live. None are before login. Set under the
+    // history's lock, see HistoryCache::replay().
+    void set_replayed_through(HistoryId id) { replayed_through_.store(id, std::memory_order_release); }
+    HistoryId replayed_through() const { return replayed_through_.load(std::memory_order_acquire); }
+    bool wants_line(HistoryId id) const { return id == 0 || id > replayed_through(); }
+
+    // Where the server's registry keeps this session
+    SlotHandle get_handle() const { return handle_; }
+    void set_handle(SlotHandle handle) { handle_ = handle; }
+
+    // Rooms joined besides the lobby, with the session's handle in each
+    // room's member table. Strand only.
+    struct RoomMembership {
+        RoomId room;
+        SlotHandle handle;
+    };
+    const std::vector<RoomMembership>& get_rooms() const { return rooms_; }
+    bool in_room(RoomId room) const;
+    void add_room(RoomId room, SlotHandle handle) { rooms_.push_back({room, handle}); }
+    // Returns the membership handle, invalid if the session was not in the room
+    SlotHandle remove_room(RoomId room);
 
 private:
-    void do_read_header();
-    void do_read_body();
-    void do_write();
+    boost::asio::awaitable<void> read_loop(std::shared_ptr<ChatSession> self);
+    // Sends the queue while there is one, then waits for deliver()
+    boost::asio::awaitable<void> write_loop(std::shared_ptr<ChatSession> self);
+    void apply_backpressure();
+    void resume_reads();
+    void run_credential_check();
+    // Moves the server's queue gauges by what this session's queue changed
+    void update_queue_metrics();
+    // Closes the session once one of its SessionTimeouts has passed, pings
+    // it when due and waits for the next deadline. Strand only.
+    void check_deadlines();
+    void arm_deadline(std::chrono::steady_clock::time_point when);
+    void begin_close();
 
     boost::asio::ip::tcp::socket socket_;
     ChatServer& server_;
     std::string username_;
-    uint32_t next_packet_size_;
-    std::vector<uint8_t> read_msg_;
-    std::deque<std::vector<uint8_t>> write_msgs_;
+    std::string address_;
+    ReceiveBuffer read_buffer_;
+    FrameQueue write_msgs_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    bool reads_paused_ = false;
+    // The read loop waits on reads_resumed_ until resume_reads()
+    bool read_stalled_ = false;
+    boost::asio::steady_timer reads_resumed_;
+    boost::asio::steady_timer write_wanted_;
+    std::deque<CredentialCheck> credential_checks_;
+    SlotHandle handle_;
+    std::vector<RoomMembership> rooms_;
+    // Queue size last added to the server's gauges
+    size_t reported_queue_bytes_ = 0;
+    size_t reported_queue_frames_ = 0;
+    std::atomic<uint32_t> capabilities_{0};
+    std::atomic<HistoryId> replayed_through_{std::numeric_limits<HistoryId>::max()};
+    // For check_deadlines(), strand only
+    boost::asio::steady_timer deadline_timer_;
+    bool deadline_armed_ = false;
+    std::chrono::steady_clock::time_point accepted_at_;
+    // Or when the client last stopped waiting for a credential check
+    std::chrono::steady_clock::time_point last_read_;
+    std::chrono::steady_clock::time_point last_ping_;
+    // When the frame at the front of the receive buffer started to arrive
+    std::optional<std::chrono::steady_clock::time_point> frame_started_;
+    uint32_t pings_ = 0;
+    // Set by close_at(), closing_ once it has passed, send_shut_ once the
+    // queue went out
+    std::optional<std::chrono::steady_clock::time_point> close_at_;
+    bool closing_ = false;
+    bool send_shut_ = false;
 };
 
+// The io_context may be run from any number of threads. Each session is
+// serialized by its own strand and the participant registry is guarded by a
+// mutex, so broadcasts from different sessions proceed in parallel.
+//
+// Every connection is in the lobby. Other rooms keep their own member list,
+// so a message to a room only costs as much as the room has members.
 class ChatServer {
 public:
     ChatServer(boost::asio::io_context& io_context, short port,
-               std::shared_ptr<DatabaseAdapter> db_adapter);
+               std::shared_ptr<DatabaseAdapter> db_adapter,
+               ChatServerConfig config = {});
 
+    // Stops accepting and closes every session on the spot. Returns without
+    // waiting for their handlers, which run on the io_context as usual.
     void stop();
-    void handle_packet(std::shared_ptr<ChatSession> sender, const std::vector<uint8_t>& packet_data);
-    void broadcast(const Packet& packet, std::shared_ptr<ChatSession> sender);
+    // Stops accepting and closes the sessions gracefully over
+    // config().drain.spread, see ChatSession::close_at(). `done` is called
+    // on an io thread once the last session is gone. Any thread, once.
+    void drain(std::function<void()> done = {});
+    bool draining() const { return draining_; }
+    // The listening socket, handed to the next release (inherited across
+    // exec, or sent over a unix socket) before drain() closes this
+    // process's copy. Connections waiting in its backlog are then picked up
+    // by the new process instead of being reset.
+    int listener_handle() { return acceptor_.native_handle(); }
+    DecodeResult handle_packet(std::shared_ptr<ChatSession> sender, std::span<const uint8_t> packet_data);
+    // Encode once, every recipient queues a reference to the same bytes
+    template<std::derived_from<Packet> P>
+    void broadcast(const P& packet, std::shared_ptr<ChatSession> sender, RoomId room = kLobbyRoom) {
+        broadcast(Packet::prepareSharedPacket(packet), std::move(sender), room);
+    }
+    void broadcast(SharedFrame frame, std::shared_ptr<ChatSession> sender, RoomId room = kLobbyRoom);
+    // A chat line, which may be held back for a ChatMessageBatch. Both go to
+    // the other nodes of a cluster as well.
+    void broadcast_message(const ChatMessage& msg, HistoryId history_id, SharedFrame frame,
+                           std::shared_ptr<ChatSession> sender);
     void leave(std::shared_ptr<ChatSession> participant);
 
+    const ChatServerConfig& config() const { return config_; }
+    BackpressureCounters& backpressure_counters() { return backpressure_counters_; }
+    MetricsRegistry& metrics_registry() { return metrics_registry_; }
+    ServerMetrics& metrics() { return metrics_; }
+    // Null unless the node is part of a cluster
+    ClusterBus* cluster() { return cluster_.get(); }
+
 private:
+    void on_packet(const std::shared_ptr<ChatSession>& sender, const LoginPacketView& packet);
+    void on_packet(const std::shared_ptr<ChatSession>& sender, const CreateUserPacketView& packet);
+    void on_packet(const std::shared_ptr<ChatSession>& sender, const ChatMessagePacketView& packet);
+    void on_packet(const std::shared_ptr<ChatSession>& sender, const JoinRoomPacketView& packet);
+    void on_packet(const std::shared_ptr<ChatSession>& sender, const LeaveRoomPacketView& packet);
+    void on_packet(const std::shared_ptr<ChatSession>& sender, const PingPacketView& packet);
+    void on_packet(const std::shared_ptr<ChatSession>& sender, const ResumePacketView& packet);
+    // Reading it was all it took
+    void on_packet(const std::shared_ptr<ChatSession>& /*sender*/, const PongPacketView& /*packet*/) {}
+    // handle_packet() without the timing, for the frames inside a compressed one too
+    DecodeResult handle_frame(const std::shared_ptr<ChatSession>& sender, std::span<const uint8_t> packet_data);
+    // Handles the frames inside, which may not be compressed again
+    DecodeResult on_compressed(const std::shared_ptr<ChatSession>& sender, const CompressedPacketView& packet);
+    // Server-to-client packets have no business arriving here
+    template<typename View>
+    void on_packet(const std::shared_ptr<ChatSession>& /*sender*/, const View& /*packet*/) {
+        logWarn("[SERVER] Received unexpected packet type from client: {}", static_cast<int>(View::type));
+    }
+
+    void open_listener(unsigned short port);
     void do_accept();
+    // Takes up to the rest of a batch of connections waiting in the backlog
+    void accept_backlog();
+    // False once the server is stopping, the session is closed then
+    bool start_session(boost::asio::ip::tcp::socket socket);
+    // Stops accepting, for both stop() and drain(). Any thread.
+    void close_listener();
+    void finish_drain(std::function<void()> done);
+    // How long until the next connection may be accepted, zero for now
+    std::chrono::steady_clock::duration accept_delay();
+    void accept_after(std::chrono::steady_clock::duration delay);
     void authenticate_user(const std::string& username,
                            const std::string& password,
-                           std::function<void(bool)> callback);
+                           AuthCallback callback);
     void create_user(const std::string& username,
                      const std::string& password,
-                     std::function<void(bool)> callback);
-    void load_recent_messages(std::shared_ptr<ChatSession> session);
+                     AuthCallback callback);
+    // What the client asked for that this server supports
+    uint32_t negotiate(uint32_t offered) const;
+    // Logs in a session whose user has proven who they are and replays the
+    // history since `last_seen`, 0 for all of it. On the session's strand.
+    void admit(const std::shared_ptr<ChatSession>& session, const std::string& username, uint32_t capabilities,
+               HistoryId last_seen);
+    void load_recent_messages(std::shared_ptr<ChatSession> session, HistoryId admitted);
+    // The compressed version of `frame`, null if that does not make it smaller
+    SharedFrame compress(const PooledBytes& frame);
+    void publish(RoomId room, ClusterFrameKind kind, const SharedFrame& frame);
+    void on_cluster_frame(RoomId room, ClusterFrameKind kind, SharedFrame frame);
+    // Local sessions only
+    void deliver_message(const ChatMessage& msg, HistoryId history_id, SharedFrame frame,
+                         std::shared_ptr<ChatSession> sender);
+    template<typename Filter>
+    void fan_out(const SharedFrame& frame, const std::shared_ptr<ChatSession>& sender, RoomId room, Filter&& filter);
+    struct RoomBatch;
+    void arm_batch(RoomId room, RoomBatch& batch);
+    void flush_batch(RoomId room);
+    void join(std::shared_ptr<ChatSession> participant);
+    std::shared_ptr<const std::vector<std::shared_ptr<ChatSession>>> participants_snapshot();
+    std::shared_ptr<const std::vector<std::shared_ptr<ChatSession>>> room_snapshot(RoomId room);
+    void join_room(const std::shared_ptr<ChatSession>& participant, RoomId room);
+    void leave_room(RoomId room, SlotHandle handle);
 
     boost::asio::io_context& io_context_;
+    // Where the acceptor and its timer are used, by close_listener() too
+    boost::asio::strand<boost::asio::io_context::executor_type> accept_strand_;
     boost::asio::ip::tcp::acceptor acceptor_;
-    std::set<std::shared_ptr<ChatSession>> participants_;
+    // Accepts happen one at a time, so these need no lock
+    boost::asio::steady_timer accept_timer_;
+    double accept_tokens_ = 0;
+    std::chrono::steady_clock::time_point accept_refilled_;
+    std::mutex participants_mutex_;
+    // Dense, so rebuilding the snapshot is a straight copy and leave is O(1)
+    SlotTable<std::shared_ptr<ChatSession>> participants_;
+    // Rebuilt lazily after a join or leave, broadcasts iterate it without the lock
+    std::shared_ptr<const std::vector<std::shared_ptr<ChatSession>>> participants_snapshot_;
+    struct Room {
+        SlotTable<std::shared_ptr<ChatSession>> members;
+        std::shared_ptr<const std::vector<std::shared_ptr<ChatSession>>> snapshot;
+    };
+    // Every room but the lobby, dropped once its last member leaves.
+    // Guarded by participants_mutex_.
+    std::unordered_map<RoomId, Room> rooms_;
     std::atomic<bool> stop_flag_;
+    std::atomic<bool> draining_{false};
+    // Called by the leave() that empties participants_ while draining.
+    // Guarded by participants_mutex_.
+    std::function<void()> drained_;
     std::shared_ptr<DatabaseAdapter> db_adapter_;
+    ChatServerConfig config_;
+    BackpressureCounters backpressure_counters_;
+    HistoryCache history_;
+    // Made up at startup, the HistoryIds a token's holder saw only mean
+    // something to the process that gave them out
+    uint64_t epoch_;
+    ResumeTokens resume_tokens_;
+    LoginLimiter login_limiter_;
+    MetricsRegistry metrics_registry_;
+    ServerMetrics metrics_;
+    std::unique_ptr<MetricsServer> metrics_server_;
+    std::unique_ptr<ClusterBus> cluster_;
+
+    // Lines held back in one room until its tick ends
+    struct BatchedLine {
+        std::shared_ptr<ChatSession> from;
+        std::string sender;
+        std::string message;
+        HistoryId history_id;
+    };
+    struct RoomBatch {
+        explicit RoomBatch(boost::asio::io_context& io_context) : timer(io_context) {}
+        boost::asio::steady_timer timer;
+        std::vector<BatchedLine> lines;
+    };
+    // A room is here while its tick runs, dropped after a tick without lines
+    std::mutex batches_mutex_;
+    std::unordered_map<RoomId, RoomBatch> batches_;
 };
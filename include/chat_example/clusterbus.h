@@ -0,0 +1,76 @@
+// clusterbus.h
+#pragma once
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "packet.hh"
+
+struct ClusterConfig {
+    // Unique in the cluster, sent to every peer when the link comes up
+    uint32_t node_id = 0;
+    // Port the other nodes connect to, 0 for none
+    unsigned short port = 0;
+    // "host:port" of every other node's bus port
+    std::vector<std::string> peers;
+    // A peer this far behind is dropped and dialled again
+    size_t max_queued_bytes = 64 * 1024 * 1024;
+    std::chrono::milliseconds reconnect_interval{1000};
+};
+
+// Full mesh of one-way TCP links between ChatServer nodes. Every node dials
+// every peer and publishes its own broadcasts on those links; what it
+// receives comes in over the links the peers dialled. Frames are never
+// passed on, so each one crosses exactly one link to each node.
+//
+// A frame goes out as a ClusterForward header followed by the bytes the
+// origin node already encoded, and the receiving node fans those out again
+// as they are. Frames from one node arrive in the order it published them.
+// A frame published while a link is down is lost for that peer.
+//
+// The links carry no authentication and belong on a private network.
+class ClusterBus {
+public:
+    // Called on the link's strand with every frame a peer forwards
+    using FrameHandler = std::function<void(RoomId room, ClusterFrameKind kind, SharedFrame frame)>;
+
+    ClusterBus(boost::asio::io_context& io_context, const ClusterConfig& config, FrameHandler handler);
+
+    // Queues `frame` for every connected peer. Any thread.
+    void publish(RoomId room, ClusterFrameKind kind, const SharedFrame& frame);
+    void stop();
+
+    // 0 if the bus does not listen
+    unsigned short port() const;
+    // Peers we currently have an outgoing link to
+    size_t connected_peers() const { return connected_peers_.load(std::memory_order_relaxed); }
+    // Links given up on because the peer fell too far behind
+    uint64_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+private:
+    class PeerLink;
+    class InboundLink;
+
+    void do_accept();
+
+    boost::asio::io_context& io_context_;
+    ClusterConfig config_;
+    FrameHandler handler_;
+    // The listener and the timer that waits out a failed accept
+    boost::asio::strand<boost::asio::io_context::executor_type> accept_strand_;
+    std::optional<boost::asio::ip::tcp::acceptor> acceptor_;
+    boost::asio::steady_timer accept_timer_;
+    std::vector<std::shared_ptr<PeerLink>> peers_;
+    std::mutex inbound_mutex_;
+    std::vector<std::weak_ptr<InboundLink>> inbound_;
+    std::atomic<bool> stopped_{false};
+    std::atomic<size_t> connected_peers_{0};
+    std::atomic<uint64_t> overflows_{0};
+};
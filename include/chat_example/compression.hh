@@ -0,0 +1,90 @@
+// compression.hh
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "packet.hh"
+
+struct CompressionConfig {
+    // Offered to clients that ask for kCapCompressedFrames at login
+    bool enabled = true;
+    // Smaller frames are sent as they are, deflate would barely shrink them
+    size_t threshold = 256;
+    // zlib level, 1 is fastest and 9 smallest
+    int level = 6;
+    // Largest payload a peer may make us inflate
+    uint32_t max_inflated_size = 64 * 1024;
+};
+
+// Compressed frames carry one or more complete frames, deflated as a raw
+// deflate stream primed with a dictionary of chat text and frame headers.
+// Each compressed frame stands on its own, so a broadcast is compressed once
+// and the same bytes are queued for every recipient that negotiated it.
+//
+// The dictionary is part of the protocol: changing it needs a new
+// capability bit.
+namespace compression_detail {
+
+// Bytes written to `out`, 0 if the result does not fit into `capacity`
+size_t deflate(std::span<const uint8_t> raw, uint8_t* out, size_t capacity, int level);
+// True if `data` inflates to exactly `size` bytes
+bool inflate(std::span<const uint8_t> data, uint8_t* out, size_t size);
+
+// Length prefix, type byte, inflated size and the data's string header
+constexpr size_t kHeaderSize = sizeof(uint32_t) + sizeof(PacketType) + sizeof(uint32_t) + sizeof(uint32_t);
+
+}
+
+// Wraps `frames` in a Compressed frame, the same bytes CompressedPacket
+// would encode. Nothing when that would not make them smaller.
+template<typename Buffer = std::vector<uint8_t>>
+std::optional<Buffer> compressFrames(std::span<const uint8_t> frames, int level) {
+    using compression_detail::kHeaderSize;
+    if (frames.size() <= kHeaderSize || frames.size() > kMaxFrameSize) {
+        return std::nullopt;
+    }
+    // Anything that needs more room than the frames themselves is not worth it
+    Buffer frame(frames.size());
+    size_t size = compression_detail::deflate(frames, frame.data() + kHeaderSize, frames.size() - kHeaderSize, level);
+    if (size == 0) {
+        return std::nullopt;
+    }
+    uint32_t body_size = static_cast<uint32_t>(kHeaderSize - sizeof(uint32_t) + size);
+    uint32_t inflated_size = static_cast<uint32_t>(frames.size());
+    uint32_t data_size = static_cast<uint32_t>(size);
+    uint8_t* out = frame.data();
+    std::memcpy(out, &body_size, sizeof(uint32_t));
+    out = FieldCodec<PacketType>::write(out + sizeof(uint32_t), PacketType::Compressed);
+    out = FieldCodec<uint32_t>::write(out, inflated_size);
+    FieldCodec<uint32_t>::write(out, data_size);
+    frame.resize(kHeaderSize + size);
+    return frame;
+}
+
+// Shared version for the server's write queues, null when not worth it
+inline SharedFrame compressSharedFrame(const PooledBytes& frames, int level) {
+    auto compressed = compressFrames<PooledBytes>(frames, level);
+    if (!compressed) {
+        return nullptr;
+    }
+    return std::allocate_shared<const PooledBytes>(PoolAllocator<PooledBytes>(), std::move(*compressed));
+}
+
+// Inflates the frames inside `packet` into `out`. False if they would be
+// larger than `max_size` or do not inflate to the size the packet states.
+inline bool inflateFrames(const CompressedPacketView& packet, uint32_t max_size, std::vector<uint8_t>& out) {
+    uint32_t size = packet.getInflatedSize();
+    if (size == 0 || size > max_size) {
+        return false;
+    }
+    out.resize(size);
+    auto data = packet.getData();
+    return compression_detail::inflate(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(data.data()), data.size()),
+                                       out.data(), size);
+}
@@ -0,0 +1,22 @@
+// coroutine.hh
+#pragma once
+
+#include <boost/asio.hpp>
+#include <exception>
+
+// Completion handler for boost::asio::co_spawn. What escapes a coroutine is
+// rethrown out of io_context::run(), as it would be from a plain completion
+// handler, instead of vanishing the way boost::asio::detached lets it.
+inline void rethrowEscaped(std::exception_ptr error) {
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// A timer that never expires, awaited by a coroutine that has nothing to do
+// until another handler on its strand wakes it with cancel()
+inline boost::asio::steady_timer makeWakeup(const boost::asio::any_io_executor& executor) {
+    boost::asio::steady_timer timer(executor);
+    timer.expires_at(boost::asio::steady_timer::time_point::max());
+    return timer;
+}
@@ -0,0 +1,50 @@
+// credentialhasher.hh
+#pragma once
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <functional>
+#include <string>
+
+struct CredentialHasherConfig {
+    size_t threads = 2;
+    // Requests beyond this many queued or running are refused outright
+    size_t max_pending = 256;
+    // bcrypt work factor, each step doubles the cost of a hash
+    unsigned cost = 10;
+};
+
+// Hashes and verifies passwords with bcrypt on a small pool of its own. A
+// slow KDF costs tens of milliseconds per call, which must never run on a
+// network thread. The pool size bounds how much CPU logins can take from
+// chat traffic, and the pending cap bounds how far a login storm can queue
+// up behind it.
+//
+// Callbacks run on a pool thread. hash() and verify() return false, without
+// ever calling back, when the queue is full.
+class CredentialHasher {
+public:
+    using HashCallback = std::function<void(bool success, std::string hash)>;
+    using VerifyCallback = std::function<void(bool match)>;
+
+    explicit CredentialHasher(CredentialHasherConfig config = {});
+    ~CredentialHasher();
+
+    bool hash(std::string password, HashCallback callback);
+    bool verify(std::string password, std::string hash, VerifyCallback callback);
+
+    size_t pending() const { return pending_; }
+    // Waits for everything queued so far
+    void join() { pool_.join(); }
+
+    // Synchronous versions, for the pool and for tests
+    static bool hashNow(const std::string& password, unsigned cost, std::string& hash);
+    static bool verifyNow(const std::string& password, const std::string& hash);
+
+private:
+    bool reserve();
+
+    CredentialHasherConfig config_;
+    boost::asio::thread_pool pool_;
+    std::atomic<size_t> pending_{0};
+};
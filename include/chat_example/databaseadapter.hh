@@ -1,28 +1,138 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <functional>
 #include <memory>
+#include <atomic>
 #include <chrono>
+#include <mutex>
+#include <unordered_map>
 #include <boost/asio.hpp>
 
+#include "credentialhasher.hh"
+
 // Forward declarations
 class ChatMessage;
 class UserCredentials;
 
+// What became of a login or a new account. Busy says nothing about the
+// credentials, the request was turned away unchecked because the password
+// hasher is saturated.
+enum class AuthResult : uint8_t {
+    Ok,
+    Rejected,  // wrong password, unknown user or a name that is taken
+    Busy
+};
+
 // Callback types for async operations
-using AuthCallback = std::function<void(bool)>;
+using AuthCallback = std::function<void(AuthResult)>;
 using StoreMessageCallback = std::function<void(bool)>;
-using GetMessagesCallback = std::function<void(const std::vector<ChatMessage>&)>;
+// Query results are shared and immutable, so handing them to a callback (or
+// to several) never copies the messages
+using MessageSnapshot = std::shared_ptr<const std::vector<ChatMessage>>;
+using GetMessagesCallback = std::function<void(MessageSnapshot)>;
 
 struct ChatMessage {
     std::string sender;
     std::string content;
     std::chrono::system_clock::time_point timestamp;
+    uint32_t room = 0;  // RoomId, the lobby by default
+
+    ChatMessage(std::string s, std::string c)
+        : sender(std::move(s)), content(std::move(c)), timestamp(std::chrono::system_clock::now()) {}
 
-    ChatMessage(const std::string& s, const std::string& c)
-        : sender(s), content(c), timestamp(std::chrono::system_clock::now()) {}
+    ChatMessage(std::string s, std::string c, std::chrono::system_clock::time_point t)
+        : sender(std::move(s)), content(std::move(c)), timestamp(t) {}
+};
+
+// Index of the first message in a timestamp ordered sequence of `size`
+// messages for which `before(message)` is false. `at(i)` returns message i.
+template<typename At, typename Before>
+size_t partitionByTime(size_t size, At at, Before before) {
+    size_t first = 0;
+    while (size > 0) {
+        size_t half = size / 2;
+        if (before(at(first + half))) {
+            first += half + 1;
+            size -= half + 1;
+        } else {
+            size = half;
+        }
+    }
+    return first;
+}
+
+// Fixed-capacity history of the most recent messages, oldest first. Once
+// full, every new message overwrites the oldest one, so memory stays flat no
+// matter how long the server runs. Messages are kept in timestamp order,
+// which makes time range queries a binary search.
+class MessageRing {
+public:
+    explicit MessageRing(size_t capacity)
+        : capacity_(std::max<size_t>(1, capacity)) {
+        slots_.reserve(capacity_);
+    }
+
+    size_t size() const { return slots_.size(); }
+    size_t capacity() const { return capacity_; }
+
+    // Message `index`, counting from the oldest
+    const ChatMessage& operator[](size_t index) const {
+        return slots_[(head_ + index) % slots_.size()];
+    }
+
+    void push(ChatMessage message) {
+        if (slots_.size() < capacity_) {
+            slots_.push_back(std::move(message));
+        } else {
+            slots_[head_] = std::move(message);
+            head_ = (head_ + 1) % capacity_;
+        }
+        // Messages from different threads can arrive slightly out of order,
+        // move the newest one back to where its timestamp belongs
+        for (size_t i = slots_.size() - 1; i > 0 && at(i - 1).timestamp > at(i).timestamp; --i) {
+            std::swap(at(i - 1), at(i));
+        }
+    }
+
+    // The last `limit` messages
+    MessageSnapshot recent(size_t limit) const {
+        auto messages = std::make_shared<std::vector<ChatMessage>>();
+        size_t count = std::min(limit, slots_.size());
+        messages->reserve(count);
+        for (size_t i = slots_.size() - count; i < slots_.size(); ++i) {
+            messages->push_back((*this)[i]);
+        }
+        return messages;
+    }
+
+    // Messages with start <= timestamp <= end, in O(log n + k)
+    MessageSnapshot range(std::chrono::system_clock::time_point start,
+                          std::chrono::system_clock::time_point end) const {
+        auto at = [this](size_t i) -> const ChatMessage& { return (*this)[i]; };
+        size_t first = partitionByTime(slots_.size(), at, [&](const ChatMessage& msg) { return msg.timestamp < start; });
+        size_t last = partitionByTime(slots_.size(), at, [&](const ChatMessage& msg) { return msg.timestamp <= end; });
+        auto messages = std::make_shared<std::vector<ChatMessage>>();
+        if (first < last) {
+            messages->reserve(last - first);
+            for (size_t i = first; i < last; ++i) {
+                messages->push_back((*this)[i]);
+            }
+        }
+        return messages;
+    }
+
+private:
+    ChatMessage& at(size_t index) {
+        return slots_[(head_ + index) % slots_.size()];
+    }
+
+    size_t capacity_;
+    std::vector<ChatMessage> slots_;
+    size_t head_ = 0;  // slot of the oldest message once full
 };
 
 class DatabaseAdapter {
@@ -42,6 +152,29 @@ public:
     virtual void storeMessage(const ChatMessage& message,
                               StoreMessageCallback callback) = 0;
 
+    // Stores a batch as one unit and calls `callback` once for all of it.
+    // Backends that can commit several messages in one transaction or sync
+    // should override this; by default every message is stored on its own.
+    virtual void storeMessages(std::vector<ChatMessage> messages,
+                               StoreMessageCallback callback) {
+        if (messages.empty()) {
+            callback(true);
+            return;
+        }
+        auto remaining = std::make_shared<std::atomic<size_t>>(messages.size());
+        auto succeeded = std::make_shared<std::atomic<bool>>(true);
+        for (const auto& message : messages) {
+            storeMessage(message, [remaining, succeeded, callback](bool success) {
+                if (!success) {
+                    *succeeded = false;
+                }
+                if (--*remaining == 0) {
+                    callback(*succeeded);
+                }
+            });
+        }
+    }
+
     virtual void getRecentMessages(size_t limit,
                                    GetMessagesCallback callback) = 0;
 
@@ -50,6 +183,60 @@ public:
                                         std::chrono::system_clock::time_point end,
                                         GetMessagesCallback callback) = 0;
 
+    // The calls above for coroutines, or any other Asio completion token:
+    //   AuthResult result = co_await db.asyncAuthenticateUser(name, password, boost::asio::use_awaitable);
+    // The result is handed over on the token's executor, whichever thread
+    // the adapter finished on.
+    template<typename CompletionToken>
+    auto asyncAuthenticateUser(const std::string& username, const std::string& password, CompletionToken&& token) {
+        return boost::asio::async_initiate<CompletionToken, void(AuthResult)>(
+            [this](auto handler, const std::string& username, const std::string& password) {
+                authenticateUser(username, password, completeOnExecutor(std::move(handler)));
+            }, token, username, password);
+    }
+
+    template<typename CompletionToken>
+    auto asyncCreateUser(const std::string& username, const std::string& password, CompletionToken&& token) {
+        return boost::asio::async_initiate<CompletionToken, void(AuthResult)>(
+            [this](auto handler, const std::string& username, const std::string& password) {
+                createUser(username, password, completeOnExecutor(std::move(handler)));
+            }, token, username, password);
+    }
+
+    template<typename CompletionToken>
+    auto asyncStoreMessage(const ChatMessage& message, CompletionToken&& token) {
+        return boost::asio::async_initiate<CompletionToken, void(bool)>(
+            [this](auto handler, const ChatMessage& message) {
+                storeMessage(message, completeOnExecutor(std::move(handler)));
+            }, token, message);
+    }
+
+    template<typename CompletionToken>
+    auto asyncStoreMessages(std::vector<ChatMessage> messages, CompletionToken&& token) {
+        return boost::asio::async_initiate<CompletionToken, void(bool)>(
+            [this](auto handler, std::vector<ChatMessage> messages) {
+                storeMessages(std::move(messages), completeOnExecutor(std::move(handler)));
+            }, token, std::move(messages));
+    }
+
+    template<typename CompletionToken>
+    auto asyncGetRecentMessages(size_t limit, CompletionToken&& token) {
+        return boost::asio::async_initiate<CompletionToken, void(MessageSnapshot)>(
+            [this](auto handler, size_t limit) {
+                getRecentMessages(limit, completeOnExecutor(std::move(handler)));
+            }, token, limit);
+    }
+
+    template<typename CompletionToken>
+    auto asyncGetMessagesByTimeRange(std::chrono::system_clock::time_point start,
+                                     std::chrono::system_clock::time_point end,
+                                     CompletionToken&& token) {
+        return boost::asio::async_initiate<CompletionToken, void(MessageSnapshot)>(
+            [this](auto handler, std::chrono::system_clock::time_point start, std::chrono::system_clock::time_point end) {
+                getMessagesByTimeRange(start, end, completeOnExecutor(std::move(handler)));
+            }, token, start, end);
+    }
+
 protected:
     // Utility method to post callbacks to io_context
     template<typename Callback, typename... Args>
@@ -60,62 +247,124 @@ protected:
             callback(args...);
         });
     }
+
+private:
+    // A callback that hands its result to the completion handler on the
+    // handler's own executor, keeping that executor busy until then. Shared,
+    // since the callbacks are copyable and the handlers only move.
+    template<typename Handler>
+    static auto completeOnExecutor(Handler handler) {
+        auto work = boost::asio::make_work_guard(handler);
+        auto shared = std::make_shared<Handler>(std::move(handler));
+        return [shared, work](auto result) {
+            boost::asio::dispatch(work.get_executor(), [shared, result = std::move(result)]() mutable {
+                std::move(*shared)(std::move(result));
+            });
+        };
+    }
 };
 
-// In-memory implementation for testing
+// In-memory implementation for testing. Safe to call from several io_context
+// threads at once. Only the last `history_capacity` messages are kept.
+// Passwords are only ever kept as bcrypt hashes, computed off the
+// io_context by the adapter's own CredentialHasher.
 class InMemoryDatabaseAdapter : public DatabaseAdapter {
 public:
-    InMemoryDatabaseAdapter(boost::asio::io_context& io_context)
-        : io_context_(io_context) {}
+    InMemoryDatabaseAdapter(boost::asio::io_context& io_context,
+                            size_t history_capacity = 10000,
+                            CredentialHasherConfig hasher = {})
+        : io_context_(io_context),
+        messages_(history_capacity),
+        hasher_(hasher) {}
 
     void authenticateUser(const std::string& username,
                           const std::string& password,
                           AuthCallback callback) override {
-        auto it = users_.find(username);
-        bool success = (it != users_.end() && it->second == password);
-        postCallback(io_context_, callback, success);
+        std::string hash;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = users_.find(username);
+            if (it == users_.end()) {
+                postCallback(io_context_, callback, AuthResult::Rejected);
+                return;
+            }
+            hash = it->second;
+        }
+        bool queued = hasher_.verify(password, std::move(hash), [this, callback](bool match) {
+            postCallback(io_context_, callback, match ? AuthResult::Ok : AuthResult::Rejected);
+        });
+        if (!queued) {
+            postCallback(io_context_, callback, AuthResult::Busy);
+        }
     }
 
     void createUser(const std::string& username,
                     const std::string& password,
                     AuthCallback callback) override {
-        bool success = users_.find(username) == users_.end();
-        if (success) {
-            users_[username] = password;
+        {
+            // Don't spend a hash on a name that is already taken
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (users_.count(username)) {
+                postCallback(io_context_, callback, AuthResult::Rejected);
+                return;
+            }
+        }
+        bool queued = hasher_.hash(password, [this, username, callback](bool hashed, std::string hash) {
+            bool success = false;
+            if (hashed) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                success = users_.emplace(username, std::move(hash)).second;
+            }
+            postCallback(io_context_, callback, success ? AuthResult::Ok : AuthResult::Rejected);
+        });
+        if (!queued) {
+            postCallback(io_context_, callback, AuthResult::Busy);
         }
-        postCallback(io_context_, callback, success);
     }
 
     void storeMessage(const ChatMessage& message,
                       StoreMessageCallback callback) override {
-        messages_.push_back(message);
+        std::lock_guard<std::mutex> lock(mutex_);
+        messages_.push(message);
+        recent_snapshot_.reset();
+        postCallback(io_context_, callback, true);
+    }
+
+    void storeMessages(std::vector<ChatMessage> messages,
+                       StoreMessageCallback callback) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& message : messages) {
+            messages_.push(std::move(message));
+        }
+        recent_snapshot_.reset();
         postCallback(io_context_, callback, true);
     }
 
     void getRecentMessages(size_t limit,
                            GetMessagesCallback callback) override {
-        std::vector<ChatMessage> recent;
-        auto start = messages_.size() > limit ?
-                         messages_.end() - limit :
-                         messages_.begin();
-        recent.assign(start, messages_.end());
-        postCallback(io_context_, callback, recent);
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Every login asks for the same history, share it until the next store
+        if (!recent_snapshot_ || recent_snapshot_limit_ != limit) {
+            recent_snapshot_ = messages_.recent(limit);
+            recent_snapshot_limit_ = limit;
+        }
+        postCallback(io_context_, callback, recent_snapshot_);
     }
 
     void getMessagesByTimeRange(std::chrono::system_clock::time_point start,
                                 std::chrono::system_clock::time_point end,
                                 GetMessagesCallback callback) override {
-        std::vector<ChatMessage> filtered;
-        std::copy_if(messages_.begin(), messages_.end(),
-                     std::back_inserter(filtered),
-                     [&](const ChatMessage& msg) {
-                         return msg.timestamp >= start && msg.timestamp <= end;
-                     });
-        postCallback(io_context_, callback, filtered);
+        std::lock_guard<std::mutex> lock(mutex_);
+        postCallback(io_context_, callback, messages_.range(start, end));
     }
 
 private:
     boost::asio::io_context& io_context_;
-    std::unordered_map<std::string, std::string> users_;
-    std::vector<ChatMessage> messages_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::string> users_;  // username to password hash
+    MessageRing messages_;
+    MessageSnapshot recent_snapshot_;
+    size_t recent_snapshot_limit_ = 0;
+    // Last, so pending hashes finish before the rest is torn down
+    CredentialHasher hasher_;
 };
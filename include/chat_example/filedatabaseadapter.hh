@@ -0,0 +1,102 @@
+// filedatabaseadapter.hh
+#pragma once
+
+#include <boost/asio.hpp>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "databaseadapter.hh"
+
+// Persistent DatabaseAdapter backed by an append-only log file. Users and
+// the newest `history_capacity` messages are replayed from the log into
+// memory at startup, every change is appended (and optionally fsynced)
+// before its callback fires.
+//
+// Older messages stay on disk. The log is indexed in blocks of consecutive
+// message records, each with the span of timestamps in it, so a time range
+// that reaches past what is kept in memory reads just the blocks it
+// overlaps. That index is all that grows with the history, a few dozen
+// bytes per thousand messages.
+//
+// All work runs on a fixed-size worker pool owned by the adapter, never on
+// the network io_context. Results are posted back to the io_context, so a
+// slow disk only delays the callbacks, not the sessions' I/O. Writes are
+// serialized on a strand of the pool to keep the log in order, reads run on
+// any worker in parallel. Passwords are stored as bcrypt hashes, computed
+// on a separate CredentialHasher so logins cannot starve the log writer.
+class FileDatabaseAdapter : public DatabaseAdapter {
+public:
+    FileDatabaseAdapter(boost::asio::io_context& io_context,
+                        const std::filesystem::path& path,
+                        size_t worker_threads = 2,
+                        bool sync_writes = true,
+                        CredentialHasherConfig hasher = {},
+                        size_t history_capacity = 10000);
+    ~FileDatabaseAdapter() override;
+
+    void authenticateUser(const std::string& username,
+                          const std::string& password,
+                          AuthCallback callback) override;
+
+    void createUser(const std::string& username,
+                    const std::string& password,
+                    AuthCallback callback) override;
+
+    void storeMessage(const ChatMessage& message,
+                      StoreMessageCallback callback) override;
+
+    // One append and one sync for the whole batch
+    void storeMessages(std::vector<ChatMessage> messages,
+                       StoreMessageCallback callback) override;
+
+    // At most history_capacity of them
+    void getRecentMessages(size_t limit,
+                           GetMessagesCallback callback) override;
+
+    void getMessagesByTimeRange(std::chrono::system_clock::time_point start,
+                                std::chrono::system_clock::time_point end,
+                                GetMessagesCallback callback) override;
+
+private:
+    // A run of consecutive records in the log and the timestamps of the
+    // messages among them
+    struct LogBlock {
+        uint64_t offset;
+        uint64_t end;
+        int64_t first_ticks;
+        int64_t last_ticks;
+        size_t messages = 0;
+    };
+
+    void load();
+    bool append(const std::vector<uint8_t>& record);
+    void insert(ChatMessage message, uint64_t offset, size_t size);
+    MessageSnapshot readRange(const std::vector<LogBlock>& blocks, int64_t start, int64_t end) const;
+
+    boost::asio::io_context& io_context_;
+    std::filesystem::path path_;
+    bool sync_writes_;
+    boost::asio::thread_pool pool_;
+    boost::asio::strand<boost::asio::thread_pool::executor_type> write_strand_;
+    int log_fd_ = -1;
+    CredentialHasher hasher_;
+
+    std::shared_mutex mutex_;
+    std::unordered_map<std::string, std::string> users_;  // username to password hash
+    MessageRing recent_;
+    // Newest timestamp pushed out of recent_, ranges from before it are
+    // read from the log
+    std::chrono::system_clock::time_point evicted_until_ = std::chrono::system_clock::time_point::min();
+    std::vector<LogBlock> blocks_;
+    // End of the last complete record, only touched by the write strand
+    // once the log is loaded. A failed append is cut back to it.
+    uint64_t log_size_ = 0;
+
+    std::mutex recent_mutex_;
+    MessageSnapshot recent_snapshot_;
+    size_t recent_snapshot_limit_ = 0;
+};
@@ -6,6 +6,8 @@
 #include <iostream>
 #include <mutex>
 
+#include "log.hh"
+
 template<typename T>
 std::string to_string_custom(const T& t) {
     std::ostringstream oss;
@@ -49,14 +51,10 @@ std::string format(const char* fmt, const Args&... args) {
 // Global mutex for synchronizing cout access
 extern std::mutex cout_mutex;
 
+// Formats at run time and queues the line at Info level on the async log,
+// see log.hh. New code should use logInfo() and friends, which check the
+// format string at compile time and can be filtered by level.
 template<typename... Args>
 void dbgln(const char* fmt, const Args&... args) {
-    // Format the string
-    std::string formatted_str = format(fmt, args...);
-
-    // Lock the mutex before accessing cout
-    std::lock_guard<std::mutex> lock(cout_mutex);
-
-    // Print the formatted string and add a newline
-    std::cout << formatted_str << std::endl;
+    Log::write(LogLevel::Info, format(fmt, args...));
 }
@@ -0,0 +1,86 @@
+// groupcommitdatabaseadapter.hh
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "databaseadapter.hh"
+
+struct GroupCommitConfig {
+    // How long the first message of a batch may wait for company
+    std::chrono::microseconds max_delay{500};
+    // A batch this large is committed immediately
+    size_t max_batch = 256;
+};
+
+// Decorator that collects storeMessage calls and hands them to the wrapped
+// adapter as one storeMessages batch, so a persistent backend pays for one
+// transaction or sync per batch instead of one per chat line. Every callback
+// of a batch completes together once the batch is committed. Raising
+// max_delay trades per-message latency for throughput.
+//
+// Messages waiting for their batch are not yet visible to the read methods,
+// which are forwarded to the wrapped adapter unchanged. Must be owned by a
+// shared_ptr, the batch timer only holds a weak reference.
+class GroupCommitDatabaseAdapter : public DatabaseAdapter,
+                                   public std::enable_shared_from_this<GroupCommitDatabaseAdapter> {
+public:
+    GroupCommitDatabaseAdapter(boost::asio::io_context& io_context,
+                               std::shared_ptr<DatabaseAdapter> inner,
+                               GroupCommitConfig config = {});
+    ~GroupCommitDatabaseAdapter() override;
+
+    void authenticateUser(const std::string& username,
+                          const std::string& password,
+                          AuthCallback callback) override;
+
+    void createUser(const std::string& username,
+                    const std::string& password,
+                    AuthCallback callback) override;
+
+    void storeMessage(const ChatMessage& message,
+                      StoreMessageCallback callback) override;
+
+    void storeMessages(std::vector<ChatMessage> messages,
+                       StoreMessageCallback callback) override;
+
+    void getRecentMessages(size_t limit,
+                           GetMessagesCallback callback) override;
+
+    void getMessagesByTimeRange(std::chrono::system_clock::time_point start,
+                                std::chrono::system_clock::time_point end,
+                                GetMessagesCallback callback) override;
+
+    // Commits whatever is pending right away, behind any batch already on
+    // its way to the wrapped adapter
+    void flush();
+
+private:
+    struct Batch {
+        std::vector<ChatMessage> messages;
+        std::vector<StoreMessageCallback> callbacks;
+    };
+
+    void take_batch();
+    void commit_ready();
+    void commit(Batch batch);
+
+    std::shared_ptr<DatabaseAdapter> inner_;
+    GroupCommitConfig config_;
+    std::mutex mutex_;
+    boost::asio::steady_timer timer_;
+    Batch pending_;
+    // Bumped every time a batch is taken, so a timer armed for an earlier
+    // batch does not cut the next one short
+    uint64_t generation_ = 0;
+    // Batches taken but not yet handed to the wrapped adapter, oldest first.
+    // Only the thread that finds nobody committing hands them over, so
+    // they reach it in the order they were taken.
+    std::deque<Batch> ready_;
+    bool committing_ = false;
+};
@@ -0,0 +1,259 @@
+// historycache.hh
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ranges>
+#include <vector>
+
+#include "packet.hh"
+
+// The last few chat messages, already encoded, for replay on login. Frames
+// are appended as they are broadcast and the oldest are trimmed beyond the
+// capacity, so history is never encoded twice. A login gets the whole
+// history as one contiguous blob of frames that is shared by every session
+// until the next message arrives; replaying it is a single queued write.
+//
+// Every line gets the next HistoryId as it is encoded, so a client that
+// comes back knowing the newest id it saw can be sent only what is newer.
+// The ids in the cache are consecutive and end at lastId().
+//
+// The cache starts out unseeded. Until the first seed() it has no idea what
+// came before it, so blob() returns nothing and the caller has to fetch the
+// history from the database. Lines appended meanwhile are kept all the same
+// and the fetched ones go in before them, under ids left free for that.
+class HistoryCache {
+public:
+    explicit HistoryCache(size_t capacity) : capacity_(capacity) {}
+
+    // Appends the frame `encode(id)` makes for the next id and returns it.
+    // The first line appended unseeded skips a capacity's worth of ids, so
+    // the seed has room below it.
+    template<typename Encode>
+    SharedFrame append(Encode&& encode) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!seeded_ && frames_.empty()) {
+            version_ += capacity_;
+        }
+        SharedFrame frame = encode(++version_);
+        if (capacity_ == 0) {
+            return frame;
+        }
+        bytes_ += frame->size();
+        frames_.push_back(frame);
+        while (frames_.size() > capacity_) {
+            bytes_ -= frames_.front()->size();
+            frames_.pop_front();
+        }
+        blob_.reset();
+        compressed_blob_.reset();
+        return frame;
+    }
+
+    // Current history as one frame blob, null while unseeded
+    SharedFrame blob() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return seeded_ ? currentBlob() : nullptr;
+    }
+
+    // The blob for sessions that negotiated compression, compressed once per
+    // version of the history. `compress` returns null when compressing does
+    // not pay, the plain blob is shared then.
+    template<typename Compress>
+    SharedFrame compressedBlob(Compress&& compress) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return seeded_ ? currentCompressedBlob(compress) : nullptr;
+    }
+
+    // Calls `deliver(frames, after, last)` with the lock held. `frames` are
+    // the lines after `last_seen` as one blob, everything kept if
+    // `last_seen` is older than that and empty if nothing is newer, `after`
+    // is the id they follow and `last` the newest id. A line is either in
+    // the blob or appended once deliver returns, so a caller that queues the
+    // blob from deliver and then sends on the lines newer than `last` sends
+    // none twice and none out of order.
+    //
+    // With `compressed`, the blob is compressed when that pays, as with
+    // compressedBlob(). Unseeded, frames is null and both ids are the newest,
+    // the caller passes `last` on to seed() once it has fetched the history.
+    template<typename Compress, typename Deliver>
+    void replay(HistoryId last_seen, bool compressed, Compress&& compress, Deliver&& deliver) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!seeded_) {
+            deliver(SharedFrame(), version_, version_);
+            return;
+        }
+        replayLocked(last_seen, compressed, compress, deliver);
+    }
+
+    // The newest id given out
+    HistoryId lastId() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return version_;
+    }
+
+    // Installs `count` lines fetched from the database, `encode(i, id)`
+    // making the frame for line i, oldest first, in front of the lines
+    // appended since the cache was created. The fetch may have caught the
+    // oldest of those too, the newest fetched lines that match them by sender
+    // and message are only kept once. Ignored once seeded.
+    template<typename Encode>
+    bool seed(size_t count, Encode&& encode) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return seedLocked(count, encode);
+    }
+
+    // As seed(), then delivers as replay() would what a session let in
+    // unseeded at `admitted` has not had live: the fetched lines and those
+    // appended up to `admitted`. Delivered before the lock is let go, so no
+    // append comes in between, and also when another fetch seeded first.
+    template<typename Encode, typename Compress, typename Deliver>
+    bool seed(size_t count, Encode&& encode, HistoryId admitted, bool compressed, Compress&& compress,
+              Deliver&& deliver) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bool seeded = seedLocked(count, encode);
+        replayThroughLocked(std::max(admitted, seed_last_), compressed, compress, deliver);
+        return seeded;
+    }
+
+    // Concatenates frames into one blob
+    template<typename Frames>
+    static SharedFrame join(const Frames& frames, size_t bytes) {
+        auto blob = std::allocate_shared<PooledBytes>(PoolAllocator<PooledBytes>(), bytes);
+        uint8_t* out = blob->data();
+        for (const auto& frame : frames) {
+            std::memcpy(out, frame->data(), frame->size());
+            out += frame->size();
+        }
+        return blob;
+    }
+
+private:
+    // The rest is called with mutex_ held
+    template<typename Encode>
+    bool seedLocked(size_t count, Encode& encode) {
+        if (seeded_) {
+            return false;
+        }
+        size_t older = count - caught(count, encode);
+        size_t kept = std::min(older, capacity_ - frames_.size());
+        // Right below the lines appended meanwhile, or the next ones if none were
+        HistoryId first_id = frames_.empty() ? version_ + 1 : version_ - frames_.size() + 1 - kept;
+        if (frames_.empty()) {
+            version_ += kept;
+        }
+        std::vector<SharedFrame> fetched;
+        fetched.reserve(kept);
+        for (size_t i = older - kept; i < older; ++i) {
+            fetched.push_back(encode(i, first_id + fetched.size()));
+            bytes_ += fetched.back()->size();
+        }
+        frames_.insert(frames_.begin(), fetched.begin(), fetched.end());
+        seed_last_ = first_id + kept - 1;
+        blob_.reset();
+        compressed_blob_.reset();
+        seeded_ = true;
+        return true;
+    }
+
+    // How many of the newest of the `count` fetched lines are the oldest
+    // ones appended meanwhile
+    template<typename Encode>
+    size_t caught(size_t count, Encode& encode) {
+        auto same = [](const SharedFrame& a, const SharedFrame& b) {
+            auto line_a = viewPacket<ChatMessagePacketView>(std::span<const uint8_t>(*a).subspan(sizeof(uint32_t)));
+            auto line_b = viewPacket<ChatMessagePacketView>(std::span<const uint8_t>(*b).subspan(sizeof(uint32_t)));
+            return line_a && line_b && line_a->getSender() == line_b->getSender() &&
+                   line_a->getMessage() == line_b->getMessage();
+        };
+        size_t most = std::min(count, frames_.size());
+        if (most == 0) {
+            return 0;
+        }
+        std::vector<SharedFrame> newest;
+        newest.reserve(most);
+        for (size_t i = count - most; i < count; ++i) {
+            newest.push_back(encode(i, 0));
+        }
+        for (size_t n = most; n > 0; --n) {
+            if (std::equal(newest.end() - n, newest.end(), frames_.begin(), same)) {
+                return n;
+            }
+        }
+        return 0;
+    }
+
+    // The kept lines up to id `through`
+    template<typename Compress, typename Deliver>
+    void replayThroughLocked(HistoryId through, bool compressed, Compress& compress, Deliver& deliver) {
+        HistoryId first_id = version_ - frames_.size() + 1;
+        if (through >= version_) {
+            deliver(compressed ? currentCompressedBlob(compress) : currentBlob(), first_id - 1, version_);
+            return;
+        }
+        size_t count = through < first_id ? 0 : through - first_id + 1;
+        deliver(joinLocked(0, count, compressed, compress), first_id - 1, std::max(through, first_id - 1));
+    }
+
+    template<typename Compress, typename Deliver>
+    void replayLocked(HistoryId last_seen, bool compressed, Compress& compress, Deliver& deliver) {
+        HistoryId first_id = version_ - frames_.size() + 1;
+        size_t skipped = last_seen < first_id ? 0 : std::min<size_t>(last_seen - first_id + 1, frames_.size());
+        if (skipped == 0) {
+            deliver(compressed ? currentCompressedBlob(compress) : currentBlob(), first_id - 1, version_);
+            return;
+        }
+        deliver(joinLocked(skipped, frames_.size(), compressed, compress), first_id - 1 + skipped, version_);
+    }
+
+    // Frames [begin, end) as one blob, compressed when asked and that pays
+    template<typename Compress>
+    SharedFrame joinLocked(size_t begin, size_t end, bool compressed, Compress& compress) {
+        auto range = std::ranges::subrange(frames_.begin() + begin, frames_.begin() + end);
+        size_t bytes = 0;
+        for (const auto& frame : range) {
+            bytes += frame->size();
+        }
+        SharedFrame blob = join(range, bytes);
+        if (compressed && bytes > 0) {
+            if (SharedFrame deflated = compress(*blob)) {
+                blob = std::move(deflated);
+            }
+        }
+        return blob;
+    }
+
+    // Once seeded
+    SharedFrame currentBlob() {
+        if (!blob_) {
+            blob_ = join(frames_, bytes_);
+        }
+        return blob_;
+    }
+
+    template<typename Compress>
+    SharedFrame currentCompressedBlob(Compress& compress) {
+        if (!compressed_blob_) {
+            compressed_blob_ = compress(*currentBlob());
+            if (!compressed_blob_) {
+                compressed_blob_ = blob_;
+            }
+        }
+        return compressed_blob_;
+    }
+
+    mutable std::mutex mutex_;
+    size_t capacity_;
+    std::deque<SharedFrame> frames_;
+    size_t bytes_ = 0;
+    SharedFrame blob_;
+    SharedFrame compressed_blob_;
+    uint64_t version_ = 0;
+    // The newest id a fetched line got
+    HistoryId seed_last_ = 0;
+    bool seeded_ = false;
+};
@@ -0,0 +1,189 @@
+// log.hh
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Asynchronous logging. A log call formats into a thread-local string and
+// copies the line into a lock-free ring owned by the calling thread; a
+// background thread drains every ring and does the actual writing. Nothing
+// on the calling side locks, allocates in steady state or touches a file.
+//
+// Levels below CHAT_LOG_LEVEL are compiled out entirely, the ones above are
+// filtered at run time with a single relaxed load:
+//
+//   logDebug("[SERVER] Session {} joined room {}", id, room);
+//
+// The format string is checked at compile time: every {} needs an argument
+// and every argument a {}. A full ring drops the line rather than block the
+// caller, Log::dropped() counts those.
+enum class LogLevel : uint8_t {
+    Trace,
+    Debug,
+    Info,
+    Warn,
+    Error,
+    Off
+};
+
+#ifndef CHAT_LOG_LEVEL
+#define CHAT_LOG_LEVEL 1  // Debug, trace lines are compiled out
+#endif
+
+constexpr LogLevel kCompiledLogLevel = static_cast<LogLevel>(CHAT_LOG_LEVEL);
+
+// Format string parsed at compile time. Holds the position of each {} so the
+// formatter only copies the text between them.
+template<typename... Args>
+class LogFormat {
+public:
+    template<size_t N>
+    consteval LogFormat(const char (&fmt)[N]) : fmt_(fmt, N - 1) {
+        size_t count = 0;
+        for (size_t i = 0; i + 1 < fmt_.size(); ++i) {
+            if (fmt_[i] == '{' && fmt_[i + 1] == '}') {
+                if (count == sizeof...(Args)) {
+                    tooFewArguments();
+                }
+                holes_[count++] = i;
+                ++i;
+            }
+        }
+        if (count != sizeof...(Args)) {
+            tooManyArguments();
+        }
+    }
+
+    std::string_view text() const { return fmt_; }
+    const std::array<size_t, sizeof...(Args)>& holes() const { return holes_; }
+
+private:
+    // Not constexpr, so calling them makes the format string a compile error
+    static void tooFewArguments() {}
+    static void tooManyArguments() {}
+
+    std::string_view fmt_;
+    std::array<size_t, sizeof...(Args)> holes_{};
+};
+
+namespace log_detail {
+
+inline void append(std::string& out, std::string_view value) { out.append(value); }
+inline void append(std::string& out, const char* value) { out.append(value ? value : "(null)"); }
+inline void append(std::string& out, char value) { out.push_back(value); }
+inline void append(std::string& out, bool value) { out.append(value ? "true" : "false"); }
+
+template<typename T>
+    requires (std::is_arithmetic_v<T> && !std::is_same_v<T, bool> && !std::is_same_v<T, char>)
+void append(std::string& out, T value) {
+    char buffer[64];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr);
+}
+
+template<typename T>
+    requires std::is_enum_v<T>
+void append(std::string& out, T value) {
+    append(out, static_cast<std::underlying_type_t<T>>(value));
+}
+
+// Anything else that can be streamed pays for an ostringstream
+template<typename T>
+    requires (!std::is_arithmetic_v<T> && !std::is_enum_v<T> && !std::is_convertible_v<const T&, std::string_view> &&
+              requires(std::ostream& os, const T& t) { os << t; })
+void append(std::string& out, const T& value) {
+    std::ostringstream oss;
+    oss << value;
+    out.append(oss.str());
+}
+
+template<typename T>
+    requires (std::is_convertible_v<const T&, std::string_view> && !std::is_same_v<T, const char*> &&
+              !std::is_same_v<T, char*>)
+void append(std::string& out, const T& value) {
+    out.append(std::string_view(value));
+}
+
+template<typename... Args, size_t... I>
+void format(std::string& out, const LogFormat<Args...>& fmt, std::index_sequence<I...>, const Args&... args) {
+    std::string_view text = fmt.text();
+    if constexpr (sizeof...(Args) == 0) {
+        out.append(text);
+    } else {
+        size_t position = 0;
+        auto next = [&](size_t hole, const auto& value) {
+            out.append(text.substr(position, hole - position));
+            append(out, value);
+            position = hole + 2;
+        };
+        (next(fmt.holes()[I], args), ...);
+        out.append(text.substr(position));
+    }
+}
+
+}
+
+// Formats into `out`, appending. Exposed for tests and for callers that want
+// the text without logging it.
+template<typename... Args>
+void logFormat(std::string& out, LogFormat<std::type_identity_t<Args>...> fmt, const Args&... args) {
+    log_detail::format(out, fmt, std::index_sequence_for<Args...>{}, args...);
+}
+
+class Log {
+public:
+    // Bytes of log lines each thread can have waiting for the writer
+    static constexpr size_t kRingCapacity = 256 * 1024;
+
+    static LogLevel level() { return level_.load(std::memory_order_relaxed); }
+    static void setLevel(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+
+    // Where the writer thread puts lines, stdout by default. Flushes first so
+    // nothing queued ends up in the new output.
+    static void setOutput(FILE* output);
+
+    // Queues a finished line from the calling thread
+    static void write(LogLevel level, std::string_view line);
+
+    // Blocks until every line queued so far has been written and flushed
+    static void flush();
+
+    // Lines dropped because their thread's ring was full
+    static uint64_t dropped();
+
+private:
+    static inline std::atomic<LogLevel> level_{LogLevel::Info};
+};
+
+template<LogLevel Level, typename... Args>
+void logAt(LogFormat<std::type_identity_t<Args>...> fmt, const Args&... args) {
+    if constexpr (Level >= kCompiledLogLevel && Level != LogLevel::Off) {
+        if (Level >= Log::level()) {
+            // Reused line buffer, no allocation once it has grown
+            thread_local std::string line;
+            line.clear();
+            log_detail::format(line, fmt, std::index_sequence_for<Args...>{}, args...);
+            Log::write(Level, line);
+        }
+    }
+}
+
+template<typename... Args>
+void logTrace(LogFormat<std::type_identity_t<Args>...> fmt, const Args&... args) { logAt<LogLevel::Trace, Args...>(fmt, args...); }
+template<typename... Args>
+void logDebug(LogFormat<std::type_identity_t<Args>...> fmt, const Args&... args) { logAt<LogLevel::Debug, Args...>(fmt, args...); }
+template<typename... Args>
+void logInfo(LogFormat<std::type_identity_t<Args>...> fmt, const Args&... args) { logAt<LogLevel::Info, Args...>(fmt, args...); }
+template<typename... Args>
+void logWarn(LogFormat<std::type_identity_t<Args>...> fmt, const Args&... args) { logAt<LogLevel::Warn, Args...>(fmt, args...); }
+template<typename... Args>
+void logError(LogFormat<std::type_identity_t<Args>...> fmt, const Args&... args) { logAt<LogLevel::Error, Args...>(fmt, args...); }
@@ -0,0 +1,97 @@
+// loginlimiter.hh
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct LoginLimits {
+    // Login and account creation attempts per address and window
+    uint32_t max_attempts_per_address = 100;
+    // Failed logins per username and window
+    uint32_t max_failures_per_user = 5;
+    std::chrono::seconds window{60};
+    // Bounds the memory spent on tracking. Once this many keys are live,
+    // new ones are refused until their windows expire.
+    size_t max_tracked_keys = 100000;
+};
+
+// Fixed-window limiter for credential checks, so brute force and login
+// storms are turned away before they cost a password hash. Safe to use from
+// any thread.
+class LoginLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit LoginLimiter(LoginLimits limits = {}) : limits_(limits) {}
+
+    // Counts an attempt from `address`, optionally for `username`, and tells
+    // whether it may go ahead
+    bool allow(const std::string& address, const std::string& username = {},
+               Clock::time_point now = Clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Window* by_address = find(addresses_, address, now);
+        if (!by_address || by_address->count >= limits_.max_attempts_per_address) {
+            return false;
+        }
+        if (!username.empty()) {
+            auto it = failures_.find(username);
+            if (it != failures_.end() && !expired(it->second, now) &&
+                it->second.count >= limits_.max_failures_per_user) {
+                return false;
+            }
+        }
+        ++by_address->count;
+        return true;
+    }
+
+    // A login for `username` failed
+    void fail(const std::string& username, Clock::time_point now = Clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (Window* window = find(failures_, username, now)) {
+            ++window->count;
+        }
+    }
+
+    // A login for `username` succeeded, forget its failures
+    void succeed(const std::string& username) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        failures_.erase(username);
+    }
+
+private:
+    struct Window {
+        Clock::time_point start;
+        uint32_t count = 0;
+    };
+    using Windows = std::unordered_map<std::string, Window>;
+
+    bool expired(const Window& window, Clock::time_point now) const {
+        return now - window.start >= limits_.window;
+    }
+
+    // The current window of `key`, restarted if it has expired, or null if
+    // the key is new and there is no room to track it
+    Window* find(Windows& windows, const std::string& key, Clock::time_point now) {
+        auto it = windows.find(key);
+        if (it == windows.end()) {
+            if (windows.size() >= limits_.max_tracked_keys) {
+                std::erase_if(windows, [&](const auto& entry) { return expired(entry.second, now); });
+                if (windows.size() >= limits_.max_tracked_keys) {
+                    return nullptr;
+                }
+            }
+            it = windows.emplace(key, Window{now, 0}).first;
+        } else if (expired(it->second, now)) {
+            it->second = Window{now, 0};
+        }
+        return &it->second;
+    }
+
+    LoginLimits limits_;
+    std::mutex mutex_;
+    Windows addresses_;
+    Windows failures_;
+};
@@ -0,0 +1,326 @@
+// metrics.hh
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Cheap, thread-safe metrics for the hot path. Updating a metric is one or
+// two relaxed atomic operations and never locks; only registering a metric
+// and rendering the registry take the registry mutex. Callers register once
+// and keep the returned reference, which stays valid as long as the registry.
+
+namespace metrics_detail {
+
+constexpr size_t kShards = 16;
+
+// Spreads the threads over the counter shards, so threads bumping the same
+// counter do not fight over one cache line
+inline size_t shardIndex() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return index;
+}
+
+inline void appendNumber(std::string& out, double value) {
+    char buffer[64];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr);
+}
+
+inline void appendNumber(std::string& out, uint64_t value) {
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr);
+}
+
+}
+
+// Monotonic counter, sharded per thread
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        shards_[metrics_detail::shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const auto& shard : shards_) {
+            total += shard.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Shard, metrics_detail::kShards> shards_;
+};
+
+// Value that goes up and down, such as a queue depth
+class Gauge {
+public:
+    void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+    void add(int64_t delta) { value_.fetch_add(delta, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Log-linear histogram in the spirit of HDR histograms: every power of two
+// is split into 8 buckets, so a recorded value is known to within 12.5%
+// over the whole uint64_t range with a fixed 496 buckets. Values are
+// nanoseconds by convention and exported in seconds.
+class Histogram {
+public:
+    static constexpr unsigned kSubBucketBits = 3;
+    static constexpr uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits;
+    static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+    void record(uint64_t value) {
+        buckets_[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t bucket(size_t index) const { return buckets_[index].load(std::memory_order_relaxed); }
+
+    static constexpr size_t bucketOf(uint64_t value) {
+        if (value < kSubBuckets) {
+            return static_cast<size_t>(value);
+        }
+        unsigned exponent = static_cast<unsigned>(std::bit_width(value)) - 1;
+        uint64_t mantissa = (value >> (exponent - kSubBucketBits)) - kSubBuckets;
+        return static_cast<size_t>((exponent - kSubBucketBits + 1) * kSubBuckets + mantissa);
+    }
+
+    // Smallest value that no longer falls into `index`
+    static constexpr uint64_t bucketLimit(size_t index) {
+        if (index < kSubBuckets) {
+            return index + 1;
+        }
+        unsigned exponent = static_cast<unsigned>(index / kSubBuckets) + kSubBucketBits - 1;
+        uint64_t mantissa = index % kSubBuckets;
+        uint64_t limit = (kSubBuckets + mantissa + 1) << (exponent - kSubBucketBits);
+        return limit == 0 ? UINT64_MAX : limit;  // the last bucket ends at the top of the range
+    }
+
+    // Upper bound of the bucket holding the q-th quantile, 0 when empty
+    uint64_t quantile(double q) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += bucket(i);
+            if (seen >= rank) {
+                return bucketLimit(i);
+            }
+        }
+        return UINT64_MAX;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+};
+
+enum class MetricType {
+    Counter,
+    Gauge,
+    Histogram
+};
+
+// Named metrics, rendered in the Prometheus text exposition format. Labels
+// are passed preformatted, e.g. `type="Login"`.
+class MetricsRegistry {
+public:
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = {}) {
+        return *add(name, help, MetricType::Counter, labels).counter;
+    }
+
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = {}) {
+        return *add(name, help, MetricType::Gauge, labels).gauge;
+    }
+
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = {}) {
+        return *add(name, help, MetricType::Histogram, labels).histogram;
+    }
+
+    // A metric kept elsewhere, read when the registry is rendered
+    void callback(const std::string& name, const std::string& help, MetricType type,
+                  std::function<double()> read, const std::string& labels = {}) {
+        add(name, help, type, labels, std::move(read));
+    }
+
+    std::string renderPrometheus() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string out;
+        for (const auto& [name, family] : families_) {
+            out += "# HELP " + name + " " + family.help + "\n";
+            out += "# TYPE " + name + " " + typeName(family.type) + "\n";
+            for (const auto& metric : family.metrics) {
+                render(out, name, family.type, *metric);
+            }
+        }
+        return out;
+    }
+
+private:
+    // Holds whichever of these the family's type calls for
+    struct Metric {
+        std::string labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::function<double()> read;
+    };
+
+    struct Family {
+        std::string help;
+        MetricType type;
+        std::vector<std::unique_ptr<Metric>> metrics;
+    };
+
+    // Returns the existing metric when name and labels were registered before
+    Metric& add(const std::string& name, const std::string& help, MetricType type, const std::string& labels,
+                std::function<double()> read = {}) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& family = families_[name];
+        if (family.metrics.empty()) {
+            family.help = help;
+            family.type = type;
+        }
+        for (auto& metric : family.metrics) {
+            if (metric->labels == labels) {
+                return *metric;
+            }
+        }
+        auto metric = std::make_unique<Metric>();
+        metric->labels = labels;
+        if (read) {
+            metric->read = std::move(read);
+        } else if (type == MetricType::Counter) {
+            metric->counter = std::make_unique<Counter>();
+        } else if (type == MetricType::Gauge) {
+            metric->gauge = std::make_unique<Gauge>();
+        } else {
+            metric->histogram = std::make_unique<Histogram>();
+        }
+        family.metrics.push_back(std::move(metric));
+        return *family.metrics.back();
+    }
+
+    static const char* typeName(MetricType type) {
+        switch (type) {
+        case MetricType::Counter: return "counter";
+        case MetricType::Gauge: return "gauge";
+        case MetricType::Histogram: return "histogram";
+        }
+        return "untyped";
+    }
+
+    static std::string withLabels(const std::string& labels, const std::string& extra = {}) {
+        if (labels.empty() && extra.empty()) {
+            return {};
+        }
+        return "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+    }
+
+    static void render(std::string& out, const std::string& name, MetricType type, const Metric& metric) {
+        if (metric.read) {
+            out += name + withLabels(metric.labels) + " ";
+            metrics_detail::appendNumber(out, metric.read());
+            out += "\n";
+            return;
+        }
+        switch (type) {
+        case MetricType::Counter:
+            out += name + withLabels(metric.labels) + " ";
+            metrics_detail::appendNumber(out, metric.counter->value());
+            out += "\n";
+            break;
+        case MetricType::Gauge:
+            out += name + withLabels(metric.labels) + " ";
+            metrics_detail::appendNumber(out, static_cast<double>(metric.gauge->value()));
+            out += "\n";
+            break;
+        case MetricType::Histogram:
+            renderHistogram(out, name, metric);
+            break;
+        }
+    }
+
+    // Buckets are exported at every power of two between 1 us and 34 s, the
+    // finer internal buckets are folded into them
+    static void renderHistogram(std::string& out, const std::string& name, const Metric& metric) {
+        constexpr unsigned kFirstExponent = 10;
+        constexpr unsigned kLastExponent = 35;
+        const Histogram& histogram = *metric.histogram;
+        uint64_t cumulative = 0;
+        size_t index = 0;
+        for (unsigned exponent = kFirstExponent; exponent <= kLastExponent; ++exponent) {
+            uint64_t bound = uint64_t(1) << exponent;
+            while (index < Histogram::kBuckets && Histogram::bucketLimit(index) <= bound) {
+                cumulative += histogram.bucket(index++);
+            }
+            std::string le = "le=\"";
+            metrics_detail::appendNumber(le, static_cast<double>(bound) / 1e9);
+            le += "\"";
+            out += name + "_bucket" + withLabels(metric.labels, le) + " ";
+            metrics_detail::appendNumber(out, cumulative);
+            out += "\n";
+        }
+        // Bucket counts and the total are read separately, keep +Inf consistent
+        uint64_t count = cumulative;
+        while (index < Histogram::kBuckets) {
+            count += histogram.bucket(index++);
+        }
+        out += name + "_bucket" + withLabels(metric.labels, "le=\"+Inf\"") + " ";
+        metrics_detail::appendNumber(out, count);
+        out += "\n" + name + "_sum" + withLabels(metric.labels) + " ";
+        metrics_detail::appendNumber(out, static_cast<double>(histogram.sum()) / 1e9);
+        out += "\n" + name + "_count" + withLabels(metric.labels) + " ";
+        metrics_detail::appendNumber(out, count);
+        out += "\n";
+    }
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Family> families_;
+};
+
+// Records the nanoseconds from construction to destruction
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTimer() {
+        histogram_.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count()));
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Histogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
@@ -0,0 +1,35 @@
+// metricsserver.h
+#pragma once
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+
+#include "metrics.hh"
+
+// Serves a MetricsRegistry to Prometheus on its own port. Speaks just enough
+// HTTP/1.0 for a scraper: one GET per connection, /metrics gets the text
+// exposition format, anything else a 404. Runs on the io_context it is given,
+// the listener on a strand and each connection on its own. A connection that
+// has not been answered within `request_timeout` is closed.
+class MetricsServer {
+public:
+    MetricsServer(boost::asio::io_context& io_context, unsigned short port, const MetricsRegistry& registry,
+                  std::chrono::milliseconds request_timeout = std::chrono::seconds(5));
+
+    // Safe from any thread, the listener is closed on its strand
+    void stop();
+    unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
+private:
+    void do_accept();
+
+    boost::asio::io_context& io_context_;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    // Waits out a failed accept
+    boost::asio::steady_timer accept_timer_;
+    const MetricsRegistry& registry_;
+    std::chrono::milliseconds request_timeout_;
+    std::atomic<bool> stopped_{false};
+};
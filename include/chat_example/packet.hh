@@ -1,11 +1,21 @@
 // packet.hh
 #pragma once
 
+#include <array>
+#include <concepts>
 #include <cstdint>
 #include <vector>
 #include <string>
 #include <cstring>
 #include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "bufferpool.hh"
 
 enum class PacketType : uint8_t {
     Login,
@@ -14,23 +24,266 @@ enum class PacketType : uint8_t {
     LoginSuccess,
     LoginFailed,
     AccountCreated,
-    AccountExists
+    AccountExists,
+    JoinRoom,
+    LeaveRoom,
+    Compressed,
+    ChatMessageBatch,
+    // Between ChatServer nodes only, see clusterbus.h
+    ClusterHello,
+    ClusterForward,
+    // Keepalive, either way
+    Ping,
+    Pong,
+    // Login with the token from an earlier LoginSuccess
+    Resume,
+    // A CreateUser or Login turned away before it was looked at, by the
+    // login limiter or because the server is too busy hashing passwords
+    RateLimited
+};
+
+inline const char* packetTypeName(PacketType type) {
+    switch (type) {
+    case PacketType::Login:          return "Login";
+    case PacketType::CreateUser:     return "CreateUser";
+    case PacketType::ChatMessage:    return "ChatMessage";
+    case PacketType::LoginSuccess:   return "LoginSuccess";
+    case PacketType::LoginFailed:    return "LoginFailed";
+    case PacketType::AccountCreated: return "AccountCreated";
+    case PacketType::AccountExists:  return "AccountExists";
+    case PacketType::JoinRoom:       return "JoinRoom";
+    case PacketType::LeaveRoom:      return "LeaveRoom";
+    case PacketType::Compressed:     return "Compressed";
+    case PacketType::ChatMessageBatch: return "ChatMessageBatch";
+    case PacketType::ClusterHello:   return "ClusterHello";
+    case PacketType::ClusterForward: return "ClusterForward";
+    case PacketType::Ping:           return "Ping";
+    case PacketType::Pong:           return "Pong";
+    case PacketType::Resume:         return "Resume";
+    case PacketType::RateLimited:    return "RateLimited";
+    }
+    return "Unknown";
+}
+
+// Optional protocol features. The client offers them in its login, the
+// server's login reply carries the subset it agreed to. Bits of a uint32_t
+// mask.
+// Compressed frames with the version 1 shared dictionary, see compression.hh
+constexpr uint32_t kCapCompressedFrames = 1 << 0;
+// ChatMessageBatch packets for busy rooms
+constexpr uint32_t kCapMessageBatches = 1 << 1;
+// Answers the server's Ping with a Pong, so it is pinged when idle instead
+// of being closed
+constexpr uint32_t kCapKeepalive = 1 << 2;
+
+// Chat messages are addressed to a room. Every connection is in the lobby,
+// other rooms have to be joined.
+using RoomId = uint32_t;
+constexpr RoomId kLobbyRoom = 0;
+
+// Position of a lobby line in the server's history, counting up from 1 for
+// as long as the server runs. 0 on lines that are not part of the history.
+using HistoryId = uint64_t;
+
+// An encoded frame (length prefix included) that is never modified after
+// creation. Write queues hold references to it, so one encode can be shared by
+// every recipient of a broadcast. Bytes and control block come from the
+// BufferPool.
+using SharedFrame = std::shared_ptr<const PooledBytes>;
+
+// Bounds-checked cursor over a received packet body. Nothing is copied,
+// strings come back as views into the buffer.
+class PacketReader {
+public:
+    explicit PacketReader(std::span<const uint8_t> data) : data_(data) {}
+
+    template<typename T>
+    bool read(T& value) {
+        if (data_.size() - offset_ < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, data_.data() + offset_, sizeof(T));
+        offset_ += sizeof(T);
+        return true;
+    }
+
+    bool readString(std::string_view& str) {
+        uint32_t length;
+        if (!read(length) || data_.size() - offset_ < length) {
+            return false;
+        }
+        str = std::string_view(reinterpret_cast<const char*>(data_.data() + offset_), length);
+        offset_ += length;
+        return true;
+    }
+
+    bool atEnd() const { return offset_ == data_.size(); }
+
+private:
+    std::span<const uint8_t> data_;
+    size_t offset_ = 0;
+};
+
+// Wire encoding of a single field. Trivially copyable values are written
+// as-is, strings as a uint32_t length followed by the bytes.
+template<typename T>
+struct FieldCodec {
+    static_assert(std::is_trivially_copyable_v<T>, "Field type needs a FieldCodec specialization");
+    using View = T;
+
+    static constexpr size_t size(const T&) { return sizeof(T); }
+
+    static uint8_t* write(uint8_t* out, const T& value) {
+        std::memcpy(out, &value, sizeof(T));
+        return out + sizeof(T);
+    }
+
+    static bool read(PacketReader& reader, T& value) { return reader.read(value); }
+};
+
+template<>
+struct FieldCodec<std::string> {
+    using View = std::string_view;
+
+    static size_t size(std::string_view str) { return sizeof(uint32_t) + str.size(); }
+
+    static uint8_t* write(uint8_t* out, std::string_view str) {
+        uint32_t length = static_cast<uint32_t>(str.size());
+        std::memcpy(out, &length, sizeof(uint32_t));
+        std::memcpy(out + sizeof(uint32_t), str.data(), str.size());
+        return out + sizeof(uint32_t) + str.size();
+    }
+
+    static bool read(PacketReader& reader, std::string_view& str) { return reader.readString(str); }
 };
 
+// Compile-time description of a packet: its type tag and the ordered list of
+// field types. Everything else (exact encoded size, one-pass encoder,
+// bounds-checked decoder) is generated from it. `encode` and `encodedSize`
+// accept the owning tuple as well as the view tuple.
+template<PacketType Type, typename... Fields>
+struct PacketSchema {
+    static constexpr PacketType type = Type;
+    using Values = std::tuple<Fields...>;
+    using Views = std::tuple<typename FieldCodec<Fields>::View...>;
+
+    // Body size, type byte included
+    template<typename Tuple>
+    static size_t encodedSize(const Tuple& values) {
+        return sizeOf(values, std::index_sequence_for<Fields...>{});
+    }
+
+    // Writes the body to `out`, which must hold encodedSize() bytes
+    template<typename Tuple>
+    static uint8_t* encode(uint8_t* out, const Tuple& values) {
+        out = FieldCodec<PacketType>::write(out, type);
+        return encodeFields(out, values, std::index_sequence_for<Fields...>{});
+    }
+
+    // Length prefix plus body in a single exactly sized allocation
+    template<typename Buffer = std::vector<uint8_t>, typename Tuple>
+    static Buffer encodeFrame(const Tuple& values) {
+        uint32_t size = static_cast<uint32_t>(encodedSize(values));
+        Buffer frame(sizeof(uint32_t) + size);
+        std::memcpy(frame.data(), &size, sizeof(uint32_t));
+        encode(frame.data() + sizeof(uint32_t), values);
+        return frame;
+    }
+
+    // Reads the fields following the type byte
+    static bool decode(PacketReader& reader, Views& views) {
+        return decodeFields(reader, views, std::index_sequence_for<Fields...>{});
+    }
+
+private:
+    template<typename Tuple, size_t... I>
+    static size_t sizeOf(const Tuple& values, std::index_sequence<I...>) {
+        return (sizeof(PacketType) + ... + FieldCodec<Fields>::size(std::get<I>(values)));
+    }
+
+    template<typename Tuple, size_t... I>
+    static uint8_t* encodeFields(uint8_t* out, const Tuple& values, std::index_sequence<I...>) {
+        ((out = FieldCodec<Fields>::write(out, std::get<I>(values))), ...);
+        return out;
+    }
+
+    template<size_t... I>
+    static bool decodeFields(PacketReader& reader, Views& views, std::index_sequence<I...>) {
+        return (FieldCodec<Fields>::read(reader, std::get<I>(views)) && ...);
+    }
+};
+
+using LoginPacketSchema          = PacketSchema<PacketType::Login, std::string, std::string, uint32_t>;
+using CreateUserPacketSchema     = PacketSchema<PacketType::CreateUser, std::string, std::string>;
+using ChatMessagePacketSchema    = PacketSchema<PacketType::ChatMessage, std::string, std::string, RoomId, HistoryId>;
+// Capabilities, a resume token and the id of the line the history replayed
+// next follows
+using LoginSuccessPacketSchema   = PacketSchema<PacketType::LoginSuccess, uint32_t, std::string, HistoryId>;
+using LoginFailedPacketSchema    = PacketSchema<PacketType::LoginFailed>;
+using AccountCreatedPacketSchema = PacketSchema<PacketType::AccountCreated>;
+using AccountExistsPacketSchema  = PacketSchema<PacketType::AccountExists>;
+using RateLimitedPacketSchema    = PacketSchema<PacketType::RateLimited>;
+using JoinRoomPacketSchema       = PacketSchema<PacketType::JoinRoom, RoomId>;
+using LeaveRoomPacketSchema      = PacketSchema<PacketType::LeaveRoom, RoomId>;
+// Inflated size, then the deflated bytes of one or more complete frames
+using CompressedPacketSchema     = PacketSchema<PacketType::Compressed, uint32_t, std::string>;
+// The room, then sender and message strings back to back, one pair per line,
+// then the history id of the newest line
+using ChatMessageBatchPacketSchema = PacketSchema<PacketType::ChatMessageBatch, RoomId, std::string, HistoryId>;
+
+// Either side may ping, the other answers with a Pong carrying the same nonce
+using PingPacketSchema           = PacketSchema<PacketType::Ping, uint32_t>;
+using PongPacketSchema           = PacketSchema<PacketType::Pong, uint32_t>;
+
+// Token, the newest history id the client has and the capabilities it offers
+using ResumePacketSchema         = PacketSchema<PacketType::Resume, std::string, HistoryId, uint32_t>;
+
+// What a forwarded frame is, so the receiving node knows whether it belongs
+// in the history and may be batched
+enum class ClusterFrameKind : uint8_t {
+    Announcement,
+    ChatLine
+};
+
+// The sending node's id
+using ClusterHelloPacketSchema   = PacketSchema<PacketType::ClusterHello, uint32_t>;
+// Room and kind, then a complete frame as the origin node encoded it
+using ClusterForwardPacketSchema = PacketSchema<PacketType::ClusterForward, RoomId, ClusterFrameKind, std::string>;
+
+// Why an inbound packet was rejected
+enum class DecodeResult : uint8_t {
+    Ok,
+    Empty,
+    UnknownType,
+    Truncated,      // a field runs past the end of the frame
+    TrailingData,   // bytes left over after the last field
+    TooLarge,       // the frame exceeds the limit for its packet type
+    Corrupt         // compressed data that does not inflate to its stated size,
+                    // or a forwarded frame that is not one
+};
+
+// Absolute cap on any frame body, before the packet type is known
+constexpr uint32_t kMaxFrameSize = 1024 * 1024;
+
+// Length prefix plus the type byte, enough to validate a frame before its body arrives
+constexpr size_t kFrameHeaderSize = sizeof(uint32_t) + sizeof(PacketType);
+
 class Packet {
 public:
     virtual ~Packet() = default;
 
     virtual PacketType getType() const = 0;
+    virtual size_t encodedSize() const = 0;
     virtual size_t serialize(std::vector<uint8_t>& buffer) const = 0;
-    virtual void deserialize(const std::vector<uint8_t>& data) = 0;
+    virtual bool deserialize(std::span<const uint8_t> data) = 0;
 
+    // Type-erased path, used when only a Packet& is at hand
     static inline std::vector<uint8_t> preparePacketForSending(const Packet& packet) {
         std::vector<uint8_t> result;
-        result.reserve(1024);  // Reserve some space to avoid frequent reallocations
+        result.reserve(sizeof(uint32_t) + packet.encodedSize());
 
         // Placeholder for packet size
-        writeToBuffer(result, static_cast<uint32_t>(0));
+        result.resize(sizeof(uint32_t));
 
         // Serialize the packet
         size_t packetSize = packet.serialize(result);
@@ -42,230 +295,589 @@ public:
         return result;
     }
 
-protected:
-    template<typename T>
-    static void writeToBuffer(std::vector<uint8_t>& buffer, const T& value) {
-        size_t size = sizeof(T);
-        size_t currentSize = buffer.size();
-        buffer.resize(currentSize + size);
-        std::memcpy(buffer.data() + currentSize, &value, size);
-    }
-
-    template<typename T>
-    static T readFromBuffer(const std::vector<uint8_t>& buffer, size_t& offset) {
-        T value;
-        std::memcpy(&value, buffer.data() + offset, sizeof(T));
-        offset += sizeof(T);
-        return value;
-    }
-
-    static void writeString(std::vector<uint8_t>& buffer, const std::string& str) {
-        uint32_t length = static_cast<uint32_t>(str.length());
-        writeToBuffer(buffer, length);
-        buffer.insert(buffer.end(), str.begin(), str.end());
+    // Statically typed path, encodes straight from the schema without a
+    // virtual call
+    template<typename P>
+        requires (std::derived_from<P, Packet> && !std::is_same_v<P, Packet>)
+    static inline std::vector<uint8_t> preparePacketForSending(const P& packet) {
+        return P::Schema::encodeFrame(packet.fields());
     }
 
-    static std::string readString(const std::vector<uint8_t>& buffer, size_t& offset) {
-        uint32_t length = readFromBuffer<uint32_t>(buffer, offset);
-        std::string str(reinterpret_cast<const char*>(buffer.data() + offset), length);
-        offset += length;
-        return str;
+    template<std::derived_from<Packet> P>
+    static inline SharedFrame prepareSharedPacket(const P& packet) {
+        return std::allocate_shared<const PooledBytes>(PoolAllocator<PooledBytes>(),
+                                                       P::Schema::template encodeFrame<PooledBytes>(packet.fields()));
     }
 };
 
-class LoginPacket : public Packet {
+// Owning packet generated from a schema. Concrete packets derive from it
+// and only add a constructor and named accessors.
+template<typename SchemaT>
+class BasicPacket : public Packet {
 public:
-    LoginPacket() = default;
-    LoginPacket(const std::string& username, const std::string& password)
-        : username_(username), password_(password) {}
+    using Schema = SchemaT;
+
+    BasicPacket() = default;
+    explicit BasicPacket(typename Schema::Values fields) : fields_(std::move(fields)) {}
+
+    PacketType getType() const override { return Schema::type; }
 
-    PacketType getType() const override { return PacketType::Login; }
+    size_t encodedSize() const override { return Schema::encodedSize(fields_); }
 
     size_t serialize(std::vector<uint8_t>& buffer) const override {
-        size_t initialSize = buffer.size();
-        writeToBuffer(buffer, getType());
-        writeString(buffer, username_);
-        writeString(buffer, password_);
-        return buffer.size() - initialSize;
+        size_t size = encodedSize();
+        size_t offset = buffer.size();
+        buffer.resize(offset + size);
+        Schema::encode(buffer.data() + offset, fields_);
+        return size;
     }
 
-    void deserialize(const std::vector<uint8_t>& data) override {
-        size_t offset = 1; // Skip the packet type
-        username_ = readString(data, offset);
-        password_ = readString(data, offset);
+    bool deserialize(std::span<const uint8_t> data) override {
+        PacketReader reader(data);
+        PacketType type;
+        typename Schema::Views views;
+        if (!reader.read(type) || type != Schema::type || !Schema::decode(reader, views) || !reader.atEnd()) {
+            return false;
+        }
+        fields_ = typename Schema::Values(views);
+        return true;
     }
 
-    const std::string& getUsername() const { return username_; }
-    const std::string& getPassword() const { return password_; }
+    const typename Schema::Values& fields() const { return fields_; }
+
+protected:
+    template<size_t I>
+    const auto& field() const { return std::get<I>(fields_); }
 
 private:
-    std::string username_;
-    std::string password_;
+    typename Schema::Values fields_;
 };
 
-class CreateUserPacket : public Packet {
+class LoginPacket : public BasicPacket<LoginPacketSchema> {
+public:
+    LoginPacket() = default;
+    LoginPacket(const std::string& username, const std::string& password, uint32_t capabilities = 0)
+        : BasicPacket({username, password, capabilities}) {}
+
+    const std::string& getUsername() const { return field<0>(); }
+    const std::string& getPassword() const { return field<1>(); }
+    uint32_t getCapabilities() const { return field<2>(); }
+};
+
+class CreateUserPacket : public BasicPacket<CreateUserPacketSchema> {
 public:
     CreateUserPacket() = default;
     CreateUserPacket(const std::string& username, const std::string& password)
-        : username_(username), password_(password) {}
+        : BasicPacket({username, password}) {}
 
-    PacketType getType() const override { return PacketType::CreateUser; }
+    const std::string& getUsername() const { return field<0>(); }
+    const std::string& getPassword() const { return field<1>(); }
+};
 
-    size_t serialize(std::vector<uint8_t>& buffer) const override {
-        size_t initialSize = buffer.size();
-        writeToBuffer(buffer, getType());
-        writeString(buffer, username_);
-        writeString(buffer, password_);
-        return buffer.size() - initialSize;
-    }
+class ChatMessagePacket : public BasicPacket<ChatMessagePacketSchema> {
+public:
+    ChatMessagePacket() = default;
+    ChatMessagePacket(const std::string& sender, const std::string& message, RoomId room = kLobbyRoom,
+                      HistoryId history_id = 0)
+        : BasicPacket({sender, message, room, history_id}) {}
+
+    const std::string& getSender() const { return field<0>(); }
+    const std::string& getMessage() const { return field<1>(); }
+    RoomId getRoom() const { return field<2>(); }
+    HistoryId getHistoryId() const { return field<3>(); }
+};
 
-    void deserialize(const std::vector<uint8_t>& data) override {
-        size_t offset = 1; // Skip the packet type
-        username_ = readString(data, offset);
-        password_ = readString(data, offset);
-    }
+class LoginSuccessPacket : public BasicPacket<LoginSuccessPacketSchema> {
+public:
+    explicit LoginSuccessPacket(uint32_t capabilities = 0, const std::string& resume_token = {},
+                                HistoryId replay_after = 0)
+        : BasicPacket({capabilities, resume_token, replay_after}) {}
 
-    const std::string& getUsername() const { return username_; }
-    const std::string& getPassword() const { return password_; }
+    uint32_t getCapabilities() const { return field<0>(); }
+    const std::string& getResumeToken() const { return field<1>(); }
+    HistoryId getReplayAfter() const { return field<2>(); }
+};
 
-private:
-    std::string username_;
-    std::string password_;
+class LoginFailedPacket : public BasicPacket<LoginFailedPacketSchema> {};
+class AccountCreatedPacket : public BasicPacket<AccountCreatedPacketSchema> {};
+class AccountExistsPacket : public BasicPacket<AccountExistsPacketSchema> {};
+class RateLimitedPacket : public BasicPacket<RateLimitedPacketSchema> {};
+
+class JoinRoomPacket : public BasicPacket<JoinRoomPacketSchema> {
+public:
+    JoinRoomPacket() = default;
+    explicit JoinRoomPacket(RoomId room) : BasicPacket(Schema::Values{room}) {}
+
+    RoomId getRoom() const { return field<0>(); }
 };
 
-class ChatMessagePacket : public Packet {
+class LeaveRoomPacket : public BasicPacket<LeaveRoomPacketSchema> {
 public:
-    ChatMessagePacket() = default;
-    ChatMessagePacket(const std::string& sender, const std::string& message)
-        : sender_(sender), message_(message) {}
+    LeaveRoomPacket() = default;
+    explicit LeaveRoomPacket(RoomId room) : BasicPacket(Schema::Values{room}) {}
 
-    PacketType getType() const override { return PacketType::ChatMessage; }
+    RoomId getRoom() const { return field<0>(); }
+};
 
-    size_t serialize(std::vector<uint8_t>& buffer) const override {
-        size_t initialSize = buffer.size();
-        writeToBuffer(buffer, getType());
-        writeString(buffer, sender_);
-        writeString(buffer, message_);
-        return buffer.size() - initialSize;
+namespace packet_detail {
+
+// Calls `f` with the sender and message of each line of a ChatMessageBatch,
+// false if the lines do not parse
+template<typename F>
+bool forEachBatchLine(std::string_view lines, F&& f) {
+    PacketReader reader(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(lines.data()), lines.size()));
+    while (!reader.atEnd()) {
+        std::string_view sender;
+        std::string_view message;
+        if (!reader.readString(sender) || !reader.readString(message)) {
+            return false;
+        }
+        f(sender, message);
+    }
+    return true;
+}
+
+} // namespace packet_detail
+
+// Several chat lines to the same room in one frame. Lines are appended to
+// a string with appendLine() and the packet is built from that.
+class ChatMessageBatchPacket : public BasicPacket<ChatMessageBatchPacketSchema> {
+public:
+    ChatMessageBatchPacket() = default;
+    ChatMessageBatchPacket(RoomId room, const std::string& lines, HistoryId last_history_id = 0)
+        : BasicPacket({room, lines, last_history_id}) {}
+
+    static void appendLine(std::string& lines, std::string_view sender, std::string_view message) {
+        size_t offset = lines.size();
+        lines.resize(offset + FieldCodec<std::string>::size(sender) + FieldCodec<std::string>::size(message));
+        auto* out = reinterpret_cast<uint8_t*>(lines.data() + offset);
+        out = FieldCodec<std::string>::write(out, sender);
+        FieldCodec<std::string>::write(out, message);
     }
 
-    void deserialize(const std::vector<uint8_t>& data) override {
-        size_t offset = 1; // Skip the packet type
-        sender_ = readString(data, offset);
-        message_ = readString(data, offset);
+    // Malformed lines fail the whole packet, as they do the view
+    bool deserialize(std::span<const uint8_t> data) override {
+        return BasicPacket::deserialize(data) &&
+               packet_detail::forEachBatchLine(getLines(), [](std::string_view, std::string_view) {});
     }
 
-    const std::string& getSender() const { return sender_; }
-    const std::string& getMessage() const { return message_; }
+    RoomId getRoom() const { return field<0>(); }
+    const std::string& getLines() const { return field<1>(); }
+    HistoryId getLastHistoryId() const { return field<2>(); }
+    // Sender and message of every line, empty if the lines are malformed
+    std::vector<std::pair<std::string, std::string>> getMessages() const {
+        std::vector<std::pair<std::string, std::string>> messages;
+        if (!packet_detail::forEachBatchLine(getLines(), [&](std::string_view sender, std::string_view message) {
+                messages.emplace_back(sender, message);
+            })) {
+            messages.clear();
+        }
+        return messages;
+    }
+};
+
+class PingPacket : public BasicPacket<PingPacketSchema> {
+public:
+    PingPacket() = default;
+    explicit PingPacket(uint32_t nonce) : BasicPacket(Schema::Values{nonce}) {}
+
+    uint32_t getNonce() const { return field<0>(); }
+};
+
+class PongPacket : public BasicPacket<PongPacketSchema> {
+public:
+    PongPacket() = default;
+    explicit PongPacket(uint32_t nonce) : BasicPacket(Schema::Values{nonce}) {}
+
+    uint32_t getNonce() const { return field<0>(); }
+};
+
+class ResumePacket : public BasicPacket<ResumePacketSchema> {
+public:
+    ResumePacket() = default;
+    ResumePacket(const std::string& token, HistoryId last_seen, uint32_t capabilities = 0)
+        : BasicPacket({token, last_seen, capabilities}) {}
+
+    const std::string& getToken() const { return field<0>(); }
+    HistoryId getLastSeen() const { return field<1>(); }
+    uint32_t getCapabilities() const { return field<2>(); }
+};
+
+class ClusterHelloPacket : public BasicPacket<ClusterHelloPacketSchema> {
+public:
+    ClusterHelloPacket() = default;
+    explicit ClusterHelloPacket(uint32_t node_id) : BasicPacket(Schema::Values{node_id}) {}
+
+    uint32_t getNodeId() const { return field<0>(); }
+};
+
+// The bus itself writes the header and the shared frame back to back
+// rather than copying the frame into one of these, see clusterbus.cc
+class ClusterForwardPacket : public BasicPacket<ClusterForwardPacketSchema> {
+public:
+    ClusterForwardPacket() = default;
+    ClusterForwardPacket(RoomId room, ClusterFrameKind kind, const std::string& frame)
+        : BasicPacket({room, kind, frame}) {}
+
+    RoomId getRoom() const { return field<0>(); }
+    ClusterFrameKind getKind() const { return field<1>(); }
+    const std::string& getFrame() const { return field<2>(); }
+};
+
+// Built by compressFrames() rather than from fields, see compression.hh
+class CompressedPacket : public BasicPacket<CompressedPacketSchema> {
+public:
+    CompressedPacket() = default;
+    CompressedPacket(uint32_t inflated_size, const std::string& data)
+        : BasicPacket({inflated_size, data}) {}
+
+    uint32_t getInflatedSize() const { return field<0>(); }
+    const std::string& getData() const { return field<1>(); }
+};
+
+// Non-owning views of inbound packets. They borrow the receive buffer, so
+// they are only valid until the buffer is reused for the next frame. The
+// owning classes above are still used to build outbound packets.
+template<typename SchemaT>
+class BasicPacketView {
+public:
+    using Schema = SchemaT;
+    static constexpr PacketType type = Schema::type;
+
+    bool parse(PacketReader& reader) { return Schema::decode(reader, fields_); }
+
+    const typename Schema::Views& fields() const { return fields_; }
+
+protected:
+    template<size_t I>
+    auto field() const { return std::get<I>(fields_); }
 
 private:
-    std::string sender_;
-    std::string message_;
+    typename Schema::Views fields_;
 };
 
-class LoginSuccessPacket : public Packet {
+class LoginPacketView : public BasicPacketView<LoginPacketSchema> {
 public:
-    LoginSuccessPacket() = default;
+    std::string_view getUsername() const { return field<0>(); }
+    std::string_view getPassword() const { return field<1>(); }
+    uint32_t getCapabilities() const { return field<2>(); }
+};
 
-    PacketType getType() const override { return PacketType::LoginSuccess; }
+class CreateUserPacketView : public BasicPacketView<CreateUserPacketSchema> {
+public:
+    std::string_view getUsername() const { return field<0>(); }
+    std::string_view getPassword() const { return field<1>(); }
+};
 
-    size_t serialize(std::vector<uint8_t>& buffer) const override {
-        size_t initialSize = buffer.size();
-        writeToBuffer(buffer, getType());
-        return buffer.size() - initialSize;
-    }
+class ChatMessagePacketView : public BasicPacketView<ChatMessagePacketSchema> {
+public:
+    std::string_view getSender() const { return field<0>(); }
+    std::string_view getMessage() const { return field<1>(); }
+    RoomId getRoom() const { return field<2>(); }
+    HistoryId getHistoryId() const { return field<3>(); }
+};
 
-    void deserialize(const std::vector<uint8_t>& data) override {
-        // No additional data to deserialize
-    }
+class LoginSuccessPacketView : public BasicPacketView<LoginSuccessPacketSchema> {
+public:
+    uint32_t getCapabilities() const { return field<0>(); }
+    std::string_view getResumeToken() const { return field<1>(); }
+    HistoryId getReplayAfter() const { return field<2>(); }
 };
 
-class LoginFailedPacket : public Packet {
+class LoginFailedPacketView : public BasicPacketView<LoginFailedPacketSchema> {};
+class AccountCreatedPacketView : public BasicPacketView<AccountCreatedPacketSchema> {};
+class AccountExistsPacketView : public BasicPacketView<AccountExistsPacketSchema> {};
+class RateLimitedPacketView : public BasicPacketView<RateLimitedPacketSchema> {};
+
+class JoinRoomPacketView : public BasicPacketView<JoinRoomPacketSchema> {
 public:
-    LoginFailedPacket() = default;
+    RoomId getRoom() const { return field<0>(); }
+};
 
-    PacketType getType() const override { return PacketType::LoginFailed; }
+class LeaveRoomPacketView : public BasicPacketView<LeaveRoomPacketSchema> {
+public:
+    RoomId getRoom() const { return field<0>(); }
+};
 
-    size_t serialize(std::vector<uint8_t>& buffer) const override {
-        size_t initialSize = buffer.size();
-        writeToBuffer(buffer, getType());
-        return buffer.size() - initialSize;
+class ChatMessageBatchPacketView : public BasicPacketView<ChatMessageBatchPacketSchema> {
+public:
+    // Every line is checked here, so forEachLine() cannot run off the end
+    bool parse(PacketReader& reader) {
+        return BasicPacketView::parse(reader) && forEachLine([](std::string_view, std::string_view) {});
     }
 
-    void deserialize(const std::vector<uint8_t>& data) override {
-        // No additional data to deserialize
-    }
+    RoomId getRoom() const { return field<0>(); }
+    HistoryId getLastHistoryId() const { return field<2>(); }
+
+    // Calls `f` with the sender and message of each line, in order. False
+    // if the lines do not parse.
+    template<typename F>
+    bool forEachLine(F&& f) const { return packet_detail::forEachBatchLine(field<1>(), std::forward<F>(f)); }
 };
 
-class AccountCreatedPacket : public Packet {
+class PingPacketView : public BasicPacketView<PingPacketSchema> {
 public:
-    AccountCreatedPacket() = default;
+    uint32_t getNonce() const { return field<0>(); }
+};
 
-    PacketType getType() const override { return PacketType::AccountCreated; }
+class PongPacketView : public BasicPacketView<PongPacketSchema> {
+public:
+    uint32_t getNonce() const { return field<0>(); }
+};
 
-    size_t serialize(std::vector<uint8_t>& buffer) const override {
-        size_t initialSize = buffer.size();
-        writeToBuffer(buffer, getType());
-        return buffer.size() - initialSize;
-    }
+class ResumePacketView : public BasicPacketView<ResumePacketSchema> {
+public:
+    std::string_view getToken() const { return field<0>(); }
+    HistoryId getLastSeen() const { return field<1>(); }
+    uint32_t getCapabilities() const { return field<2>(); }
+};
 
-    void deserialize(const std::vector<uint8_t>& data) override {
-        // No additional data to deserialize
-    }
+class ClusterHelloPacketView : public BasicPacketView<ClusterHelloPacketSchema> {
+public:
+    uint32_t getNodeId() const { return field<0>(); }
 };
 
-class AccountExistsPacket : public Packet {
+class ClusterForwardPacketView : public BasicPacketView<ClusterForwardPacketSchema> {
 public:
-    AccountExistsPacket() = default;
+    RoomId getRoom() const { return field<0>(); }
+    ClusterFrameKind getKind() const { return field<1>(); }
+    // Length prefix included
+    std::string_view getFrame() const { return field<2>(); }
+};
 
-    PacketType getType() const override { return PacketType::AccountExists; }
+class CompressedPacketView : public BasicPacketView<CompressedPacketSchema> {
+public:
+    uint32_t getInflatedSize() const { return field<0>(); }
+    std::string_view getData() const { return field<1>(); }
+};
 
-    size_t serialize(std::vector<uint8_t>& buffer) const override {
-        size_t initialSize = buffer.size();
-        writeToBuffer(buffer, getType());
-        return buffer.size() - initialSize;
+template<typename... Ts>
+struct PacketList {
+    static constexpr size_t size = sizeof...(Ts);
+};
+
+// Every packet, in PacketType order: the position in the list is the type
+// byte, which lets the dispatch tables below be indexed directly by it
+using OwningPackets = PacketList<LoginPacket, CreateUserPacket, ChatMessagePacket,
+                                 LoginSuccessPacket, LoginFailedPacket,
+                                 AccountCreatedPacket, AccountExistsPacket,
+                                 JoinRoomPacket, LeaveRoomPacket, CompressedPacket,
+                                 ChatMessageBatchPacket, ClusterHelloPacket, ClusterForwardPacket,
+                                 PingPacket, PongPacket, ResumePacket, RateLimitedPacket>;
+using PacketViews = PacketList<LoginPacketView, CreateUserPacketView, ChatMessagePacketView,
+                               LoginSuccessPacketView, LoginFailedPacketView,
+                               AccountCreatedPacketView, AccountExistsPacketView,
+                               JoinRoomPacketView, LeaveRoomPacketView, CompressedPacketView,
+                               ChatMessageBatchPacketView, ClusterHelloPacketView, ClusterForwardPacketView,
+                               PingPacketView, PongPacketView, ResumePacketView, RateLimitedPacketView>;
+
+namespace packet_detail {
+
+template<typename... Ts>
+constexpr bool inTypeOrder(PacketList<Ts...>) {
+    size_t index = 0;
+    return ((static_cast<size_t>(Ts::Schema::type) == index++) && ...);
+}
+
+template<typename P>
+std::unique_ptr<Packet> makePacket() {
+    return std::make_unique<P>();
+}
+
+template<typename... Ts>
+constexpr auto makeFactoryTable(PacketList<Ts...>) {
+    return std::array<std::unique_ptr<Packet> (*)(), sizeof...(Ts)>{&makePacket<Ts>...};
+}
+
+} // namespace packet_detail
+
+static_assert(packet_detail::inTypeOrder(OwningPackets{}), "OwningPackets must follow PacketType order");
+static_assert(packet_detail::inTypeOrder(PacketViews{}), "PacketViews must follow PacketType order");
+
+inline std::optional<PacketType> peekPacketType(std::span<const uint8_t> data) {
+    if (data.empty()) {
+        return std::nullopt;
+    }
+    return static_cast<PacketType>(data[0]);
+}
+
+// Parse `data` as a View. Every length is checked against the buffer, a
+// frame is only accepted when its fields cover it exactly.
+template<typename View>
+DecodeResult decodePacket(std::span<const uint8_t> data, View& view) {
+    PacketReader reader(data);
+    PacketType type;
+    if (!reader.read(type)) {
+        return DecodeResult::Empty;
+    }
+    if (type != View::type) {
+        return DecodeResult::UnknownType;
+    }
+    if (!view.parse(reader)) {
+        return DecodeResult::Truncated;
+    }
+    if (!reader.atEnd()) {
+        return DecodeResult::TrailingData;
+    }
+    return DecodeResult::Ok;
+}
+
+template<typename View>
+std::optional<View> viewPacket(std::span<const uint8_t> data) {
+    View view;
+    if (decodePacket(data, view) != DecodeResult::Ok) {
+        return std::nullopt;
+    }
+    return view;
+}
+
+// Largest accepted body for each packet type. Checked against the length
+// prefix as soon as the type byte is known, so an oversized frame is
+// rejected before any buffer is grown for it.
+struct PacketLimits {
+    std::array<uint32_t, PacketViews::size> max_body_size{};
+
+    uint32_t maxBodySize(PacketType type) const {
+        auto index = static_cast<size_t>(type);
+        return index < max_body_size.size() ? max_body_size[index] : 0;
+    }
+
+    // Limits for what a client may send: names and passwords up to
+    // max_name_length bytes, chat lines up to max_message_length bytes.
+    // Server-to-client types only need their type byte.
+    static PacketLimits forClients(uint32_t max_name_length = 64, uint32_t max_message_length = 4096) {
+        const uint32_t string_header = sizeof(uint32_t);
+        const uint32_t credentials = sizeof(PacketType) + 2 * (string_header + max_name_length);
+        const uint32_t chat_message = sizeof(PacketType) + string_header + max_name_length + string_header +
+                                      max_message_length + sizeof(RoomId) + sizeof(HistoryId);
+        // A resume token is the name and under 64 bytes of header and
+        // signature, see resumetoken.hh
+        const uint32_t resume =
+            sizeof(PacketType) + string_header + max_name_length + 64 + sizeof(HistoryId) + sizeof(uint32_t);
+
+        PacketLimits limits;
+        limits.max_body_size.fill(sizeof(PacketType));
+        limits.max_body_size[static_cast<size_t>(PacketType::Login)] = credentials + sizeof(uint32_t);
+        limits.max_body_size[static_cast<size_t>(PacketType::CreateUser)] = credentials;
+        limits.max_body_size[static_cast<size_t>(PacketType::ChatMessage)] = chat_message;
+        limits.max_body_size[static_cast<size_t>(PacketType::JoinRoom)] = sizeof(PacketType) + sizeof(RoomId);
+        limits.max_body_size[static_cast<size_t>(PacketType::LeaveRoom)] = sizeof(PacketType) + sizeof(RoomId);
+        limits.max_body_size[static_cast<size_t>(PacketType::Ping)] = sizeof(PacketType) + sizeof(uint32_t);
+        limits.max_body_size[static_cast<size_t>(PacketType::Pong)] = sizeof(PacketType) + sizeof(uint32_t);
+        limits.max_body_size[static_cast<size_t>(PacketType::Resume)] = resume;
+        // A frame is only sent compressed when that makes it smaller
+        limits.max_body_size[static_cast<size_t>(PacketType::Compressed)] =
+            sizeof(PacketType) + sizeof(uint32_t) + string_header + sizeof(uint32_t) + chat_message;
+        return limits;
+    }
+
+    // What one node's bus may send another: its hello, then forwarded frames
+    static PacketLimits forCluster() {
+        PacketLimits limits;
+        limits.max_body_size.fill(sizeof(PacketType));
+        limits.max_body_size[static_cast<size_t>(PacketType::ClusterHello)] = sizeof(PacketType) + sizeof(uint32_t);
+        limits.max_body_size[static_cast<size_t>(PacketType::ClusterForward)] = kMaxFrameSize;
+        return limits;
     }
 
-    void deserialize(const std::vector<uint8_t>& data) override {
-        // No additional data to deserialize
+    // Anything up to kMaxFrameSize, for trusted peers
+    static PacketLimits unbounded() {
+        PacketLimits limits;
+        limits.max_body_size.fill(kMaxFrameSize);
+        return limits;
     }
 };
 
-// Helper function to create a packet from raw data
-inline std::unique_ptr<Packet> createPacketFromData(const std::vector<uint8_t>& data) {
-    if (data.empty()) {
-        return nullptr;
+// Validates a frame header: the length prefix and the type byte that follows
+// it. `body_size` includes the type byte.
+inline DecodeResult checkFrameHeader(uint32_t body_size, uint8_t type, const PacketLimits& limits) {
+    if (body_size == 0) {
+        return DecodeResult::Empty;
+    }
+    if (type >= PacketViews::size) {
+        return DecodeResult::UnknownType;
     }
+    if (body_size > limits.maxBodySize(static_cast<PacketType>(type))) {
+        return DecodeResult::TooLarge;
+    }
+    return DecodeResult::Ok;
+}
+
+// Calls `handler` with the body of every frame in `frames`, which must hold
+// whole frames and nothing else, such as the inflated payload of a
+// Compressed packet. Stops at the first frame that is rejected.
+template<typename Handler>
+DecodeResult consumeFrames(std::span<const uint8_t> frames, const PacketLimits& limits, Handler&& handler) {
+    while (!frames.empty()) {
+        if (frames.size() < kFrameHeaderSize) {
+            return DecodeResult::Truncated;
+        }
+        uint32_t size;
+        std::memcpy(&size, frames.data(), sizeof(uint32_t));
+        DecodeResult result = checkFrameHeader(size, frames[sizeof(uint32_t)], limits);
+        if (result != DecodeResult::Ok) {
+            return result;
+        }
+        if (frames.size() - sizeof(uint32_t) < size) {
+            return DecodeResult::Truncated;
+        }
+        result = handler(frames.subspan(sizeof(uint32_t), size));
+        if (result != DecodeResult::Ok) {
+            return result;
+        }
+        frames = frames.subspan(sizeof(uint32_t) + size);
+    }
+    return DecodeResult::Ok;
+}
 
-    PacketType type = static_cast<PacketType>(data[0]);
-    std::unique_ptr<Packet> packet;
+namespace packet_detail {
 
-    switch (type) {
-    case PacketType::Login:
-        packet = std::make_unique<LoginPacket>();
-        break;
-    case PacketType::CreateUser:
-        packet = std::make_unique<CreateUserPacket>();
-        break;
-    case PacketType::ChatMessage:
-        packet = std::make_unique<ChatMessagePacket>();
-        break;
-    case PacketType::LoginSuccess:
-        packet = std::make_unique<LoginSuccessPacket>();
-        break;
-    case PacketType::LoginFailed:
-        packet = std::make_unique<LoginFailedPacket>();
-        break;
-    case PacketType::AccountCreated:
-        packet = std::make_unique<AccountCreatedPacket>();
-        break;
-    case PacketType::AccountExists:
-        packet = std::make_unique<AccountExistsPacket>();
-        break;
-    default:
+template<typename View, typename Handler>
+DecodeResult dispatchAs(std::span<const uint8_t> data, Handler& handler) {
+    View view;
+    DecodeResult result = decodePacket(data, view);
+    if (result == DecodeResult::Ok) {
+        handler(view);
+    }
+    return result;
+}
+
+template<typename Handler, typename... Views>
+constexpr auto makeDispatchTable(PacketList<Views...>) {
+    return std::array<DecodeResult (*)(std::span<const uint8_t>, Handler&), sizeof...(Views)>{
+        &dispatchAs<Views, Handler>...};
+}
+
+} // namespace packet_detail
+
+// Parses `data` in place and calls `handler` with the matching view. The jump
+// table is built at compile time from PacketViews, so there is no allocation,
+// no virtual call and no switch. `handler` is only called when the whole
+// packet validates.
+template<typename Handler>
+DecodeResult dispatchPacket(std::span<const uint8_t> data, Handler&& handler) {
+    static constexpr auto table = packet_detail::makeDispatchTable<std::remove_reference_t<Handler>>(PacketViews{});
+    auto type = peekPacketType(data);
+    if (!type) {
+        return DecodeResult::Empty;
+    }
+    if (static_cast<size_t>(*type) >= table.size()) {
+        return DecodeResult::UnknownType;
+    }
+    return table[static_cast<size_t>(*type)](data, handler);
+}
+
+// Helper function to create a packet from raw data
+inline std::unique_ptr<Packet> createPacketFromData(std::span<const uint8_t> data) {
+    static constexpr auto factories = packet_detail::makeFactoryTable(OwningPackets{});
+    auto type = peekPacketType(data);
+    if (!type || static_cast<size_t>(*type) >= factories.size()) {
         return nullptr;
     }
 
-    packet->deserialize(data);
+    std::unique_ptr<Packet> packet = factories[static_cast<size_t>(*type)]();
+    if (!packet->deserialize(data)) {
+        return nullptr;
+    }
     return packet;
 }
@@ -0,0 +1,95 @@
+// receivebuffer.hh
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "packet.hh"
+
+// Reusable receive buffer for a stream of length-prefixed frames. The socket
+// reads as much as is available into it with async_read_some, then consume()
+// hands every complete frame to the caller in one go, so a pipelined burst
+// of frames costs one read instead of two per frame.
+//
+// Buffered bytes are compacted to the front instead of wrapping around, so
+// each frame stays contiguous and can be parsed in place by the packet views.
+// The storage comes from the BufferPool, a closed connection's buffer is
+// reused by the next one.
+class ReceiveBuffer {
+public:
+    explicit ReceiveBuffer(size_t capacity = 16 * 1024)
+        : storage_(capacity), capacity_(capacity) {}
+
+    // Free space for the next read. Makes room for the whole of a partially
+    // received frame, growing past the initial capacity only for frames whose
+    // header consume() has already validated. Also compacts whenever that frees
+    // more space than is left at the end, so reads do not shrink to a trickle
+    // as consumed frames pile up at the front.
+    boost::asio::mutable_buffer prepare() {
+        size_t buffered = end_ - begin_;
+        size_t needed = kFrameHeaderSize;
+        if (buffered >= kFrameHeaderSize) {
+            uint32_t size;
+            std::memcpy(&size, storage_.data() + begin_, sizeof(uint32_t));
+            needed = sizeof(uint32_t) + size;
+        }
+
+        if (storage_.size() - end_ < begin_ || storage_.size() - begin_ < needed) {
+            std::memmove(storage_.data(), storage_.data() + begin_, buffered);
+            begin_ = 0;
+            end_ = buffered;
+        }
+        if (storage_.size() < needed) {
+            storage_.resize(needed);
+        }
+        return boost::asio::buffer(storage_.data() + end_, storage_.size() - end_);
+    }
+
+    void commit(size_t bytes) { end_ += bytes; }
+
+    // Calls `handler` with the body of every complete frame, in order, and
+    // stops at the first header that breaks `limits` or the first frame the
+    // handler rejects. The span is only valid for the duration of the call.
+    template<typename Handler>
+    DecodeResult consume(const PacketLimits& limits, Handler&& handler) {
+        while (end_ - begin_ >= kFrameHeaderSize) {
+            const uint8_t* frame = storage_.data() + begin_;
+            uint32_t size;
+            std::memcpy(&size, frame, sizeof(uint32_t));
+            DecodeResult result = checkFrameHeader(size, frame[sizeof(uint32_t)], limits);
+            if (result != DecodeResult::Ok) {
+                return result;
+            }
+            if (end_ - begin_ < sizeof(uint32_t) + size) {
+                break;
+            }
+            begin_ += sizeof(uint32_t) + size;
+            result = handler(std::span<const uint8_t>(frame + sizeof(uint32_t), size));
+            if (result != DecodeResult::Ok) {
+                return result;
+            }
+        }
+
+        if (begin_ == end_) {
+            begin_ = end_ = 0;
+            // Give back what a one-off large frame made us grow by
+            if (storage_.size() > capacity_) {
+                storage_.resize(capacity_);
+                storage_.shrink_to_fit();
+            }
+        }
+        return DecodeResult::Ok;
+    }
+
+    size_t buffered() const { return end_ - begin_; }
+
+private:
+    PooledBytes storage_;
+    size_t capacity_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
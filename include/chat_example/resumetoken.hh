@@ -0,0 +1,41 @@
+// resumetoken.hh
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+struct ResumeConfig {
+    // Signs the tokens. Nodes and releases given the same key accept each
+    // other's tokens. Left empty, a random key is made up at startup and the
+    // tokens die with the process.
+    std::string key;
+    std::chrono::seconds lifetime{24 * 60 * 60};
+};
+
+// What a valid token vouches for
+struct ResumeClaims {
+    std::string username;
+    // Of the server the history ids a client saw came from
+    uint64_t epoch = 0;
+};
+
+// Self-contained proof of an earlier login, so a client that reconnects is
+// let back in without a password hash or a database lookup. A token is the
+// claims and their expiry in the clear, followed by a truncated
+// HMAC-SHA256 over them. Nothing is kept per token, a token cannot be
+// revoked before it expires short of changing the key.
+class ResumeTokens {
+public:
+    explicit ResumeTokens(const ResumeConfig& config);
+
+    std::string issue(std::string_view username, uint64_t epoch) const;
+    // Null unless the token is ours, intact and not expired
+    std::optional<ResumeClaims> verify(std::string_view token) const;
+
+private:
+    std::string key_;
+    std::chrono::seconds lifetime_;
+};
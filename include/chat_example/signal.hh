@@ -2,62 +2,175 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <atomic>
+#include <concepts>
 #include <functional>
-#include <optional>
+#include <memory>
 #include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+// Single-slot signal. emit() takes no lock and allocates nothing: it loads
+// the slot with one atomic read between two updates of an emit counter and
+// makes one virtual call, which either runs the slot or posts it, with the
+// arguments moved into the posted handler. The callable is stored inline in
+// the slot node allocated by connect(), there is no std::function in
+// between.
+//
+// Replaced slots are retired rather than freed, so an emit racing a
+// connect() or disconnect() still calls a live slot. The next connect() or
+// disconnect() that finds no emit in progress frees them; at most the ones
+// replaced while emits kept overlapping are waiting at any time. Direct
+// slots are called on the emitting thread and run concurrently when several
+// threads emit; connect to a strand to have them serialized.
 template <typename... Args>
 class Signal {
 public:
     using SlotType = std::function<void(Args...)>;
 
-    void connect(const SlotType& slot, boost::asio::io_service* io_service = nullptr) {
-        std::lock_guard<std::mutex> lock(m_mutex);
+    template<typename F>
+        requires std::invocable<F&, Args...>
+    void connect(F&& slot, boost::asio::io_service* io_service = nullptr) {
         if (io_service) {
-            m_slot = [io_service, slot](Args... args) {
-                io_service->post([slot, args...]() {
-                    slot(args...);
-                });
-            };
+            publish(std::make_shared<PostedSlot<std::decay_t<F>, IoServicePoster>>(std::forward<F>(slot),
+                                                                                  IoServicePoster{io_service}));
         } else {
-            m_slot = slot;
+            publish(std::make_shared<DirectSlot<std::decay_t<F>>>(std::forward<F>(slot)));
         }
     }
 
-    void connect(const SlotType& slot, std::shared_ptr<boost::asio::io_service> io_service) {
-        std::lock_guard<std::mutex> lock(m_mutex);
+    template<typename F>
+        requires std::invocable<F&, Args...>
+    void connect(F&& slot, std::shared_ptr<boost::asio::io_service> io_service) {
         if (io_service) {
-            std::weak_ptr<boost::asio::io_service> weak_io_service = io_service;
-            m_slot = [weak_io_service, slot](Args... args) {
-                if (auto io_service = weak_io_service.lock()) {
-                    io_service->post([slot, args...]() {
-                        slot(args...);
-                    });
-                }
-            };
+            publish(std::make_shared<PostedSlot<std::decay_t<F>, WeakIoServicePoster>>(std::forward<F>(slot),
+                                                                                      WeakIoServicePoster{io_service}));
         } else {
-            m_slot = slot;
+            publish(std::make_shared<DirectSlot<std::decay_t<F>>>(std::forward<F>(slot)));
         }
     }
 
+    // Runs the slot on `executor`, a strand for instance, so slots posted
+    // from any thread never run concurrently
+    template<typename F, typename Executor>
+        requires (std::invocable<F&, Args...> &&
+                  (boost::asio::execution::is_executor<Executor>::value || boost::asio::is_executor<Executor>::value))
+    void connect(F&& slot, const Executor& executor) {
+        publish(std::make_shared<PostedSlot<std::decay_t<F>, ExecutorPoster<Executor>>>(std::forward<F>(slot),
+                                                                                       ExecutorPoster<Executor>{executor}));
+    }
+
     void emit(Args... args) {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        if (m_slot) {
-            (*m_slot)(args...);
+        EmitGuard guard(m_emitting);
+        if (const Slot* slot = m_slot.load()) {
+            slot->call(std::forward<Args>(args)...);
         }
     }
 
     void disconnect() {
         std::lock_guard<std::mutex> lock(m_mutex);
-        m_slot.reset();
+        m_slot.store(nullptr);
+        reclaim();
     }
 
     bool connected() const {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        return m_slot.has_value();
+        return m_slot.load(std::memory_order_acquire) != nullptr;
     }
 
 private:
-    std::optional<SlotType> m_slot;
-    mutable std::mutex m_mutex;
+    struct Slot : std::enable_shared_from_this<Slot> {
+        virtual ~Slot() = default;
+        virtual void call(Args... args) const = 0;
+    };
+
+    template<typename F>
+    struct DirectSlot final : Slot {
+        template<typename G>
+        explicit DirectSlot(G&& g) : f(std::forward<G>(g)) {}
+
+        void call(Args... args) const override { f(std::forward<Args>(args)...); }
+
+        mutable F f;
+    };
+
+    // Copies of the arguments travel with the posted handler, references
+    // into the emitter's buffers would be dangling by the time it runs
+    template<typename F, typename Poster>
+    struct PostedSlot final : Slot {
+        template<typename G>
+        PostedSlot(G&& g, Poster p) : f(std::forward<G>(g)), poster(std::move(p)) {}
+
+        void call(Args... args) const override {
+            // The handler holds a reference to the node, so the slot outlives
+            // a Signal destroyed in the meantime
+            auto self = std::static_pointer_cast<const PostedSlot>(this->shared_from_this());
+            poster.post([self = std::move(self), values = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)]() mutable {
+                std::apply([&self](auto&... value) { self->f(std::forward<Args>(value)...); }, values);
+            });
+        }
+
+        mutable F f;
+        Poster poster;
+    };
+
+    struct IoServicePoster {
+        boost::asio::io_service* io_service;
+
+        template<typename Handler>
+        void post(Handler&& handler) const { boost::asio::post(*io_service, std::forward<Handler>(handler)); }
+    };
+
+    struct WeakIoServicePoster {
+        std::weak_ptr<boost::asio::io_service> io_service;
+
+        template<typename Handler>
+        void post(Handler&& handler) const {
+            if (auto locked = io_service.lock()) {
+                boost::asio::post(*locked, std::forward<Handler>(handler));
+            }
+        }
+    };
+
+    template<typename Executor>
+    struct ExecutorPoster {
+        Executor executor;
+
+        template<typename Handler>
+        void post(Handler&& handler) const { boost::asio::post(executor, std::forward<Handler>(handler)); }
+    };
+
+    // Counts the emit in progress, even when the slot throws
+    struct EmitGuard {
+        explicit EmitGuard(std::atomic<size_t>& count) : count(count) { count.fetch_add(1); }
+        ~EmitGuard() { count.fetch_sub(1, std::memory_order_release); }
+        std::atomic<size_t>& count;
+    };
+
+    void publish(std::shared_ptr<const Slot> slot) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_slot.store(slot.get());
+        m_slots.push_back(std::move(slot));
+        reclaim();
+    }
+
+    // Called with m_mutex held, after the current slot was stored. Both that
+    // store and the counter are sequentially consistent: with no emit in
+    // progress, every emit from here on loads the current slot, and the
+    // ones that finished are done with the retired ones.
+    void reclaim() {
+        if (m_emitting.load() != 0) {
+            return;
+        }
+        const Slot* current = m_slot.load();
+        std::erase_if(m_slots, [current](const auto& slot) { return slot.get() != current; });
+    }
+
+    std::atomic<const Slot*> m_slot{nullptr};
+    std::atomic<size_t> m_emitting{0};
+    // The current slot and those retired but maybe still being called,
+    // guarded by m_mutex. Only connect() and disconnect() take it.
+    std::vector<std::shared_ptr<const Slot>> m_slots;
+    std::mutex m_mutex;
 };
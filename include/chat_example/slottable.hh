@@ -0,0 +1,103 @@
+// slottable.hh
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Stable reference to an entry of a SlotTable. The generation tells a live
+// entry from a later one that reused the same slot, so a stale handle is
+// harmless: lookups and erases with it simply fail.
+struct SlotHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool valid() const { return index != UINT32_MAX; }
+    bool operator==(const SlotHandle&) const = default;
+};
+
+// Dense table of values addressed by SlotHandle. The values themselves live
+// in one contiguous vector, so iterating them touches memory in order
+// instead of chasing tree nodes, and erase is O(1) by moving the last value
+// into the hole. The slot array only maps handles to positions.
+template<typename T>
+class SlotTable {
+public:
+    SlotHandle insert(T value) {
+        uint32_t index;
+        if (free_head_ != kNoSlot) {
+            index = free_head_;
+            free_head_ = slots_[index].position;
+        } else {
+            index = static_cast<uint32_t>(slots_.size());
+            slots_.push_back({});
+        }
+        slots_[index].position = static_cast<uint32_t>(values_.size());
+        values_.push_back(std::move(value));
+        owners_.push_back(index);
+        return {index, slots_[index].generation};
+    }
+
+    bool erase(SlotHandle handle) {
+        if (!contains(handle)) {
+            return false;
+        }
+        Slot& slot = slots_[handle.index];
+        uint32_t position = slot.position;
+        uint32_t last = static_cast<uint32_t>(values_.size() - 1);
+        if (position != last) {
+            values_[position] = std::move(values_[last]);
+            owners_[position] = owners_[last];
+            slots_[owners_[position]].position = position;
+        }
+        values_.pop_back();
+        owners_.pop_back();
+
+        // Retire the slot, the bumped generation invalidates old handles
+        ++slot.generation;
+        slot.position = free_head_;
+        free_head_ = handle.index;
+        return true;
+    }
+
+    bool contains(SlotHandle handle) const {
+        // Erasing bumps the generation, so a free slot never matches
+        return handle.index < slots_.size() && slots_[handle.index].generation == handle.generation;
+    }
+
+    // Null for a stale handle
+    T* find(SlotHandle handle) {
+        return contains(handle) ? &values_[slots_[handle.index].position] : nullptr;
+    }
+
+    void clear() {
+        // Keeps the slots, with bumped generations, so outstanding handles
+        // stay invalid
+        for (uint32_t index : owners_) {
+            ++slots_[index].generation;
+            slots_[index].position = free_head_;
+            free_head_ = index;
+        }
+        values_.clear();
+        owners_.clear();
+    }
+
+    size_t size() const { return values_.size(); }
+    bool empty() const { return values_.empty(); }
+
+    // Every value, in no particular order
+    const std::vector<T>& values() const { return values_; }
+
+private:
+    static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+    struct Slot {
+        // Index into values_ while in use, next free slot otherwise
+        uint32_t position = kNoSlot;
+        uint32_t generation = 0;
+    };
+
+    std::vector<T> values_;
+    std::vector<uint32_t> owners_;  // slot of each value
+    std::vector<Slot> slots_;
+    uint32_t free_head_ = kNoSlot;
+};
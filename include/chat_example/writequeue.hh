@@ -0,0 +1,126 @@
+// writequeue.hh
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "packet.hh"
+
+// Bounds for a single gathered write. The buffer cap keeps us below IOV_MAX
+// (1024 on Linux), the byte cap keeps one slow write from holding the whole
+// queue hostage.
+struct WriteBatchLimits {
+    size_t max_bytes = 256 * 1024;
+    size_t max_buffers = 64;
+};
+
+inline boost::asio::const_buffer frameBuffer(const std::vector<uint8_t>& frame) {
+    return boost::asio::buffer(frame);
+}
+
+inline boost::asio::const_buffer frameBuffer(const SharedFrame& frame) {
+    return boost::asio::buffer(*frame);
+}
+
+// Fills `buffers` with the frames at the front of `queue` that fit in one
+// gathered write and returns how many were taken. The first frame is always
+// taken, even when it is larger than max_bytes on its own.
+template <typename Queue>
+size_t gatherFrames(const Queue& queue,
+                    const WriteBatchLimits& limits,
+                    std::vector<boost::asio::const_buffer>& buffers) {
+    buffers.clear();
+    size_t bytes = 0;
+    for (const auto& frame : queue) {
+        auto buffer = frameBuffer(frame);
+        if (!buffers.empty() &&
+            (buffers.size() >= limits.max_buffers || bytes + buffer.size() > limits.max_bytes)) {
+            break;
+        }
+        bytes += buffer.size();
+        buffers.push_back(buffer);
+    }
+    return buffers.size();
+}
+
+// What a session does once its outbound queue crosses the high watermark
+enum class SlowConsumerPolicy {
+    DropOldest,  // discard the oldest queued chat messages down to the low watermark
+    PauseReads,  // stop reading from the client until the queue drains to the low watermark
+    Disconnect   // drop the connection
+};
+
+struct BackpressureConfig {
+    size_t high_watermark_bytes = 1024 * 1024;
+    size_t high_watermark_frames = 1024;
+    size_t low_watermark_bytes = 256 * 1024;
+    size_t low_watermark_frames = 256;
+    // Hard cap, exceeding it disconnects whatever the policy. Keeps memory
+    // bounded even when nothing in the queue may be dropped.
+    size_t max_bytes = 8 * 1024 * 1024;
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DropOldest;
+};
+
+// Outbound frame queue of one connection. Tracks its size in bytes and which
+// frames are part of the write currently in flight; those are never dropped
+// since the socket may still be reading from them.
+class FrameQueue {
+public:
+    void push(SharedFrame frame) {
+        bytes_ += frame->size();
+        frames_.push_back(std::move(frame));
+    }
+
+    bool empty() const { return frames_.empty(); }
+    bool writing() const { return in_flight_ > 0; }
+    size_t frames() const { return frames_.size(); }
+    size_t bytes() const { return bytes_; }
+
+    bool above(size_t max_bytes, size_t max_frames) const {
+        return bytes_ > max_bytes || frames_.size() > max_frames;
+    }
+
+    // Starts a gathered write of the frames at the front
+    void gather(const WriteBatchLimits& limits, std::vector<boost::asio::const_buffer>& buffers) {
+        in_flight_ = gatherFrames(frames_, limits, buffers);
+    }
+
+    // The write started by gather() has finished
+    void complete() {
+        for (size_t i = 0; i < in_flight_; ++i) {
+            bytes_ -= frames_[i]->size();
+        }
+        frames_.erase(frames_.begin(), frames_.begin() + in_flight_);
+        in_flight_ = 0;
+    }
+
+    // Drops the oldest frames accepted by `droppable` until the queue is at
+    // or below the given size, and returns how many were dropped
+    template<typename Predicate>
+    size_t dropOldest(size_t target_bytes, size_t target_frames, Predicate droppable) {
+        Frames kept;
+        size_t dropped = 0;
+        for (size_t i = 0; i < frames_.size(); ++i) {
+            auto& frame = frames_[i];
+            bool over = bytes_ > target_bytes || frames_.size() - dropped > target_frames;
+            if (i >= in_flight_ && over && droppable(*frame)) {
+                bytes_ -= frame->size();
+                ++dropped;
+                continue;
+            }
+            kept.push_back(std::move(frame));
+        }
+        frames_ = std::move(kept);
+        return dropped;
+    }
+
+private:
+    using Frames = std::deque<SharedFrame, PoolAllocator<SharedFrame>>;
+
+    Frames frames_;
+    size_t bytes_ = 0;
+    size_t in_flight_ = 0;
+};
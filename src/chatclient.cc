@@ -1,212 +1,392 @@
 #include "chatclient.h"
 #include "packet.hh"
 #include "format.hh"
+#include <concepts>
 #include <thread>
 #include <boost/asio.hpp>
 
-ChatClient::ChatClient(const std::string& name)
-    : name_(name), io_context_(), work_guard_(boost::asio::make_work_guard(io_context_)),
-    socket_(io_context_), closed_(false), logged_in_(false) {
-    //dbgln("[CLIENT {}] Initializing", name_);
+ChatClient::ChatClient(const std::string& name, WriteBatchLimits write_limits)
+    : ChatClient(std::make_unique<boost::asio::io_context>(), nullptr, name, write_limits) {}
+
+ChatClient::ChatClient(boost::asio::io_context& io_context, const std::string& name, WriteBatchLimits write_limits)
+    : ChatClient(nullptr, &io_context, name, write_limits) {}
+
+ChatClient::ChatClient(std::unique_ptr<boost::asio::io_context> owned_io_context,
+                       boost::asio::io_context* shared_io_context,
+                       const std::string& name,
+                       WriteBatchLimits write_limits)
+    : owned_io_context_(std::move(owned_io_context)),
+    io_context_(shared_io_context ? *shared_io_context : *owned_io_context_),
+    strand_(boost::asio::make_strand(io_context_)),
+    resolver_(strand_),
+    socket_(strand_),
+    name_(name), write_wanted_(makeWakeup(strand_)), write_limits_(write_limits), closed_(false), logged_in_(false) {
+    logTrace("[CLIENT {}] Initializing", name_);
+    if (owned_io_context_) {
+        work_guard_.emplace(boost::asio::make_work_guard(io_context_));
+    }
 
     Connect.connect([this] (auto host, auto port)
     {
         connect(host, port);
-    }, &io_context_);
+    }, strand_);
 
     SendMessage.connect([this] (auto message)
     {
         send_message(message);
-    }, &io_context_);
+    }, strand_);
+    SendRoomMessage.connect([this] (auto room, auto message)
+    {
+        send_message(message, room);
+    }, strand_);
+    JoinRoom.connect([this] (auto room)
+    {
+        write(JoinRoomPacket(room));
+    }, strand_);
+    LeaveRoom.connect([this] (auto room)
+    {
+        write(LeaveRoomPacket(room));
+    }, strand_);
     CreateUser.connect([this] (auto username, auto password)
     {
         create_user(username, password);
-    }, &io_context_);
+    }, strand_);
     Close.connect([this]
     {
         close();
-    }, &io_context_);
+    }, strand_);
     Login.connect([this] (auto username, auto password)
     {
         login(username, password);
-    }, &io_context_);
+    }, strand_);
+    Resume.connect([this] (auto state)
+    {
+        resume(state);
+    }, strand_);
 }
 
 void ChatClient::start() {
+    if (!owned_io_context_) {
+        return;  // The owner of the shared io_context runs it
+    }
     io_thread_ = std::thread([this]() {
-        //dbgln("[CLIENT {}] IO thread started", name_);
+        logDebug("[CLIENT {}] IO thread started", name_);
         io_context_.run();
-        //dbgln("[CLIENT {}] IO thread ended", name_);
+        logDebug("[CLIENT {}] IO thread ended", name_);
     });
 }
 
 void ChatClient::stop() {
-    //dbgln("[CLIENT {}] Stopping client", name_);
-    Close.emit();
-    if (io_thread_.joinable()) {
-        io_context_.stop();
-        io_thread_.join();
+    logDebug("[CLIENT {}] Stopping client", name_);
+    if (owned_io_context_) {
+        Close.emit();
+        if (io_thread_.joinable()) {
+            io_context_.stop();
+            io_thread_.join();
+        }
+        return;
     }
-    //dbgln("[CLIENT {}] Client stopped", name_);
+
+    // The io_context keeps running for the other clients, so wait until the
+    // aborted reads and writes have been handled before we may go away
+    auto drained = std::make_shared<std::promise<void>>();
+    auto done = drained->get_future();
+    boost::asio::post(strand_, [this, drained] {
+        close();
+        if (outstanding_ == 0) {
+            drained->set_value();
+        } else {
+            drained_ = drained;
+        }
+    });
+    done.wait();
+    logDebug("[CLIENT {}] Client stopped", name_);
 }
 
-void ChatClient::connect(const std::string& host, const std::string& port) {
-    try {
-        boost::asio::ip::tcp::resolver resolver(io_context_);
-        auto endpoints = resolver.resolve(host, port);
+template<typename Handler>
+auto ChatClient::tracked(Handler handler) {
+    ++outstanding_;
+    // Constrained, so async_connect can still tell its overloads apart
+    return [this, handler = std::move(handler)]<typename... Args>(Args&&... args) mutable
+        requires std::invocable<Handler&, Args...> {
+        handler(std::forward<Args>(args)...);
+        if (--outstanding_ == 0 && drained_) {
+            // stop() may destroy us as soon as this is set
+            auto drained = std::move(drained_);
+            drained->set_value();
+        }
+    };
+}
 
+void ChatClient::connect(const std::string& host, const std::string& port) {
+    // Resolved asynchronously, a shared I/O thread must not block on DNS
+    resolver_.async_resolve(host, port, tracked([this](const boost::system::error_code& ec,
+                                                       const boost::asio::ip::tcp::resolver::results_type& endpoints) {
+        if (closed_) {
+            return;  // Cancelled by close(), which has already reported it
+        }
+        if (ec) {
+            logWarn("[CLIENT {}] Connection failed: {}", name_, ec.message());
+            on_disconnected.emit();
+            return;
+        }
         boost::asio::async_connect(socket_, endpoints,
-                                   [this](const boost::system::error_code& ec, const boost::asio::ip::tcp::endpoint&) {
+                                   tracked([this](const boost::system::error_code& ec, const boost::asio::ip::tcp::endpoint&) {
                                        if (!ec) {
-                                           //dbgln("[CLIENT {}] Connected to server", name_);
+                                           logDebug("[CLIENT {}] Connected to server", name_);
                                            on_connected.emit();
-                                           do_read_header();
+                                           // Also sends whatever was written while connecting
+                                           boost::asio::co_spawn(strand_, read_loop(), tracked(rethrowEscaped));
+                                           boost::asio::co_spawn(strand_, write_loop(), tracked(rethrowEscaped));
                                        } else {
-                                           //dbgln("[CLIENT {}] Connection failed: {}", name_, ec.message());
+                                           logWarn("[CLIENT {}] Connection failed: {}", name_, ec.message());
                                            on_disconnected.emit();
                                        }
-                                   });
-    } catch (std::exception& e) {
-        //dbgln("[CLIENT {}] Connection failed: {}", name_, e.what());
-        on_disconnected.emit();
-        return;
-    }
+                                   }));
+    }));
 }
 
 void ChatClient::close() {
     if (!closed_) {
         closed_ = true;
         boost::system::error_code ec;
+        resolver_.cancel();
         socket_.close(ec);
-        //dbgln("[CLIENT {}] Closed connection. Error code: {}", name_, ec.value());
+        write_wanted_.cancel();
+        logDebug("[CLIENT {}] Closed connection. Error code: {}", name_, ec.value());
         on_disconnected.emit();
     }
 }
 
 void ChatClient::write(const Packet& packet) {
     auto prepared_packet = Packet::preparePacketForSending(packet);
-    //dbgln("[CLIENT {}] Sending packet of type: {}", name_, static_cast<int>(packet.getType()));
+    if ((capabilities_ & kCapCompressedFrames) && prepared_packet.size() >= compression_.threshold) {
+        if (auto compressed = compressFrames(prepared_packet, compression_.level)) {
+            prepared_packet = std::move(*compressed);
+        }
+    }
+    logTrace("[CLIENT {}] Sending packet of type: {}", name_, static_cast<int>(packet.getType()));
     bool write_in_progress = !write_msgs_.empty();
     write_msgs_.push_back(std::move(prepared_packet));
     if (!write_in_progress) {
-        do_write();
-    }
-}
-
-void ChatClient::do_read_header() {
-    boost::asio::async_read(socket_, boost::asio::buffer(&next_packet_size_, sizeof(uint32_t)),
-                            [this](boost::system::error_code ec, std::size_t /*length*/) {
-                                if (!ec) {
-                                    if (next_packet_size_ > 1024 * 1024) {  // Limit packet size to 1MB
-                                        //dbgln("[CLIENT {}] Received packet size too large: {}", name_, next_packet_size_);
-                                        close();
-                                        return;
-                                    }
-                                    read_msg_.resize(next_packet_size_);
-                                    do_read_body();
-                                } else if (ec != boost::asio::error::operation_aborted) {
-                                    //dbgln("[CLIENT {}] Read header error: {}", name_, ec.message());
-                                    close();
-                                }
-                            });
-}
-
-void ChatClient::do_read_body() {
-    boost::asio::async_read(socket_, boost::asio::buffer(read_msg_),
-                            [this](boost::system::error_code ec, std::size_t /*length*/) {
-                                if (!ec) {
-                                    handle_packet(read_msg_);
-                                    do_read_header();
-                                } else if (ec != boost::asio::error::operation_aborted) {
-                                    //dbgln("[CLIENT {}] Read body error: {}", name_, ec.message());
-                                    close();
-                                }
-                            });
-}
-
-void ChatClient::do_write() {
-    boost::asio::async_write(socket_,
-                             boost::asio::buffer(write_msgs_.front()),
-                             [this](boost::system::error_code ec, std::size_t /*length*/) {
-                                 if (!ec) {
-                                     write_msgs_.pop_front();
-                                     if (!write_msgs_.empty()) {
-                                         do_write();
-                                     }
-                                 } else {
-                                     //dbgln("[CLIENT {}] Write error: {}", name_, ec.message());
-                                     close();
-                                 }
-                             });
+        write_wanted_.cancel();
+    }
+}
+
+boost::asio::awaitable<void> ChatClient::read_loop() {
+    using boost::asio::redirect_error;
+    using boost::asio::use_awaitable;
+    // The server is trusted up to the global frame cap
+    static const PacketLimits limits = PacketLimits::unbounded();
+    for (;;) {
+        boost::system::error_code ec;
+        size_t length = co_await socket_.async_read_some(read_buffer_.prepare(), redirect_error(use_awaitable, ec));
+        if (ec) {
+            if (ec != boost::asio::error::operation_aborted) {
+                logWarn("[CLIENT {}] Read error: {}", name_, ec.message());
+                close();
+            }
+            co_return;
+        }
+        read_buffer_.commit(length);
+        DecodeResult result = read_buffer_.consume(
+            limits,
+            [this](std::span<const uint8_t> frame) {
+                return handle_packet(frame);
+            });
+        if (result != DecodeResult::Ok) {
+            logWarn("[CLIENT {}] Received invalid frame: {}", name_, static_cast<int>(result));
+            close();
+            co_return;
+        }
+    }
+}
+
+boost::asio::awaitable<void> ChatClient::write_loop() {
+    using boost::asio::redirect_error;
+    using boost::asio::use_awaitable;
+    while (!closed_) {
+        boost::system::error_code ec;
+        if (write_msgs_.empty()) {
+            co_await write_wanted_.async_wait(redirect_error(use_awaitable, ec));
+            continue;
+        }
+        size_t batch = gatherFrames(write_msgs_, write_limits_, write_buffers_);
+        co_await boost::asio::async_write(socket_, write_buffers_, redirect_error(use_awaitable, ec));
+        if (ec) {
+            // Closed under us, close() has already reported it
+            if (!closed_) {
+                logWarn("[CLIENT {}] Write error: {}", name_, ec.message());
+                close();
+            }
+            co_return;
+        }
+        write_msgs_.erase(write_msgs_.begin(), write_msgs_.begin() + batch);
+    }
 }
 
 void ChatClient::login(const std::string& username, const std::string& password) {
-    //dbgln("[CLIENT {}] Attempting login for user: {}", name_, username);
-    write(LoginPacket(username, password));
+    logDebug("[CLIENT {}] Attempting login for user: {}", name_, username);
+    pending_requests_.push_back(PacketType::Login);
+    write(LoginPacket(username, password, kCapCompressedFrames | kCapMessageBatches | kCapKeepalive));
+}
+
+void ChatClient::resume(const ResumeState& state) {
+    logDebug("[CLIENT {}] Resuming an earlier login", name_);
+    {
+        std::lock_guard<std::mutex> lock(resume_mutex_);
+        resume_state_ = state;
+    }
+    pending_requests_.push_back(PacketType::Resume);
+    write(ResumePacket(state.token, state.last_seen, kCapCompressedFrames | kCapMessageBatches | kCapKeepalive));
+}
+
+ResumeState ChatClient::resume_state() const {
+    std::lock_guard<std::mutex> lock(resume_mutex_);
+    return resume_state_;
+}
+
+void ChatClient::saw_history(HistoryId id) {
+    std::lock_guard<std::mutex> lock(resume_mutex_);
+    resume_state_.last_seen = std::max(resume_state_.last_seen, id);
 }
 
 void ChatClient::create_user(const std::string& username, const std::string& password) {
-    //dbgln("[CLIENT {}] Attempting to create user: {}", name_, username);
+    logDebug("[CLIENT {}] Attempting to create user: {}", name_, username);
+    pending_requests_.push_back(PacketType::CreateUser);
     write(CreateUserPacket(username, password));
 }
 
-void ChatClient::send_message(const std::string& message) {
+std::optional<PacketType> ChatClient::answered() {
+    if (pending_requests_.empty()) {
+        return std::nullopt;
+    }
+    PacketType request = pending_requests_.front();
+    pending_requests_.pop_front();
+    return request;
+}
+
+void ChatClient::send_message(const std::string& message, RoomId room) {
     if (logged_in_) {
-        write(ChatMessagePacket(name_, message));
-        //dbgln("[CLIENT {}] Sent message: {}", name_, message);
+        write(ChatMessagePacket(name_, message, room));
+        logTrace("[CLIENT {}] Sent message: {}", name_, message);
     } else {
-        //dbgln("[CLIENT {}] Cannot send message: not logged in", name_);
+        logWarn("[CLIENT {}] Cannot send message: not logged in", name_);
     }
 }
 
-void ChatClient::handle_packet(const std::vector<uint8_t>& packet_data) {
-    //dbgln("[CLIENT {}] Handling packet of size: {}", name_, packet_data.size());
-    auto packet = createPacketFromData(packet_data);
-    if (!packet) {
-        //dbgln("[CLIENT {}] Received invalid packet from server", name_);
-        return;
+DecodeResult ChatClient::handle_packet(std::span<const uint8_t> packet_data) {
+    logTrace("[CLIENT {}] Handling packet of size: {}", name_, packet_data.size());
+    DecodeResult handled = DecodeResult::Ok;
+    DecodeResult result = dispatchPacket(packet_data, [this, &handled](const auto& packet) {
+        logTrace("[CLIENT {}] Received packet of type: {}", name_, static_cast<int>(packet.type));
+        if constexpr (std::is_same_v<std::decay_t<decltype(packet)>, CompressedPacketView>) {
+            handled = on_compressed(packet);
+        } else {
+            on_packet(packet);
+        }
+    });
+    if (result == DecodeResult::Ok) {
+        result = handled;
     }
-
-    //dbgln("[CLIENT {}] Received packet of type: {}", name_, static_cast<int>(packet->getType()));
-
-    switch (packet->getType()) {
-    case PacketType::LoginSuccess: {
-        //dbgln("[CLIENT {}] Login successful", name_);
-        logged_in_ = true;
-        on_login_response.emit(true);
-        break;
+    if (result != DecodeResult::Ok) {
+        logWarn("[CLIENT {}] Received invalid packet from server: {}", name_, static_cast<int>(result));
     }
-    case PacketType::LoginFailed: {
-        //dbgln("[CLIENT {}] Login failed", name_);
-        logged_in_ = false;
-        on_login_response.emit(false);
-        break;
+    return result;
+}
+
+DecodeResult ChatClient::on_compressed(const CompressedPacketView& packet) {
+    // The server is trusted up to the global frame cap
+    static const PacketLimits limits = PacketLimits::unbounded();
+    if (!inflateFrames(packet, kMaxFrameSize, inflated_)) {
+        return DecodeResult::Corrupt;
     }
-    case PacketType::AccountCreated: {
-        //dbgln("[CLIENT {}] Account created successfully", name_);
-        account_created_ = true;
-        on_create_account_response.emit(true);
-        break;
+    // Views into inflated_ only live until the next compressed frame
+    return consumeFrames(inflated_, limits, [this](std::span<const uint8_t> frame) {
+        if (peekPacketType(frame) == PacketType::Compressed) {
+            return DecodeResult::UnknownType;
+        }
+        return handle_packet(frame);
+    });
+}
+
+void ChatClient::on_packet(const LoginSuccessPacketView& login_success) {
+    logDebug("[CLIENT {}] Login successful", name_);
+    answered();
+    capabilities_ = login_success.getCapabilities();
+    {
+        std::lock_guard<std::mutex> lock(resume_mutex_);
+        resume_state_.token = std::string(login_success.getResumeToken());
+        // Where the replay that follows starts, the ids from an earlier
+        // server may not go on from there. Only the lines handled move it.
+        resume_state_.last_seen = login_success.getReplayAfter();
     }
-    case PacketType::AccountExists: {
-        //dbgln("[CLIENT {}] Account creation failed: username already exists", name_);
+    logged_in_ = true;
+    on_login_response.emit(true);
+}
+
+void ChatClient::on_packet(const LoginFailedPacketView&) {
+    logDebug("[CLIENT {}] Login failed", name_);
+    answered();
+    capabilities_ = 0;
+    logged_in_ = false;
+    on_login_response.emit(false);
+}
+
+void ChatClient::on_packet(const AccountCreatedPacketView&) {
+    logDebug("[CLIENT {}] Account created successfully", name_);
+    answered();
+    account_created_ = true;
+    on_create_account_response.emit(true);
+}
+
+void ChatClient::on_packet(const PingPacketView& ping) {
+    write(PongPacket(ping.getNonce()));
+}
+
+void ChatClient::on_packet(const AccountExistsPacketView&) {
+    logDebug("[CLIENT {}] Account creation failed: username already exists", name_);
+    answered();
+    account_created_ = false;
+    on_create_account_response.emit(false);
+}
+
+void ChatClient::on_packet(const RateLimitedPacketView&) {
+    if (answered() == PacketType::CreateUser) {
+        logDebug("[CLIENT {}] Account creation refused: too many attempts", name_);
         account_created_ = false;
         on_create_account_response.emit(false);
-        break;
+        return;
     }
-    case PacketType::ChatMessage: {
-        auto chat_message = static_cast<ChatMessagePacket*>(packet.get());
-        //dbgln("[CLIENT {}] Received message from {}: {}", name_, chat_message->getSender(), chat_message->getMessage());
-        on_message_received.emit(chat_message->getSender(), chat_message->getMessage());
-        break;
+    logDebug("[CLIENT {}] Login refused: the server is busy", name_);
+    capabilities_ = 0;
+    logged_in_ = false;
+    on_login_response.emit(false);
+}
+
+void ChatClient::on_packet(const ChatMessagePacketView& chat_message) {
+    if (chat_message.getRoom() == kLobbyRoom) {
+        saw_history(chat_message.getHistoryId());
     }
-    case PacketType::Login:
-    case PacketType::CreateUser:
-        //dbgln("[CLIENT {}] Received unexpected packet type from server: {}", name_, static_cast<int>(packet->getType()));
-        break;
-    default:
-        //dbgln("[CLIENT {}] Received unknown packet type from server: {}", name_, static_cast<int>(packet->getType()));
-        break;
+    on_chat_line(chat_message.getRoom(), chat_message.getSender(), chat_message.getMessage());
+}
+
+void ChatClient::on_packet(const ChatMessageBatchPacketView& batch) {
+    // Already checked when the view was parsed
+    batch.forEachLine([&](std::string_view sender, std::string_view message) {
+        on_chat_line(batch.getRoom(), sender, message);
+    });
+    if (batch.getRoom() == kLobbyRoom) {
+        saw_history(batch.getLastHistoryId());
     }
 }
 
+void ChatClient::on_chat_line(RoomId room, std::string_view sender, std::string_view message) {
+    logTrace("[CLIENT {}] Received message from {}: {}", name_, sender, message);
+    // The signal hands out std::string so slots can outlive the receive buffer
+    if (room == kLobbyRoom) {
+        on_message_received.emit(std::string(sender), std::string(message));
+    } else {
+        on_room_message_received.emit(room, std::string(sender), std::string(message));
+    }
+}
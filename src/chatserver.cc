@@ -2,245 +2,1276 @@
 #include "packet.hh"
 #include "format.hh"
 
+#include <algorithm>
+#include <boost/version.hpp>
+#include <netinet/tcp.h>
+#include <random>
+
+// Older Asio has no io_uring backend and would quietly stay on epoll
+#if defined(BOOST_ASIO_HAS_IO_URING) && BOOST_VERSION < 107800
+#error "CHAT_EXAMPLE_IO_URING needs Boost 1.78 or newer"
+#endif
+
+namespace {
+
+// DatabaseAdapter completes on whichever thread is running the io_context.
+// Hop back onto the session's strand before the handler touches the session.
+template <typename Handler>
+auto on_session_strand(const std::shared_ptr<ChatSession>& session, Handler handler) {
+    return [session, handler = std::move(handler)](const auto&... args) {
+        boost::asio::dispatch(session->get_executor(), [handler, args...] {
+            handler(args...);
+        });
+    };
+}
+
+uint64_t nanosecondsSince(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+// A frame for many recipients and, made the first time a recipient that
+// negotiated it comes up, its compressed version
+class FanOutFrame {
+public:
+    FanOutFrame(SharedFrame frame, size_t threshold)
+        : frame_(std::move(frame)), compressible_(frame_->size() >= threshold) {}
+
+    template <typename Compress>
+    const SharedFrame& frame_for(const ChatSession& participant, Compress&& compress) {
+        if (!compressible_ || !participant.compresses()) {
+            return frame_;
+        }
+        if (!compressed_) {
+            compressed_ = compress(*frame_);
+            // Did not shrink, so everyone gets the original
+            compressible_ = compressed_ != nullptr;
+        }
+        return compressible_ ? compressed_ : frame_;
+    }
+
+private:
+    SharedFrame frame_;
+    SharedFrame compressed_;
+    bool compressible_;
+};
+
+// Records how long the database took to call back
+template <typename Callback>
+auto timed(Histogram& histogram, Callback callback) {
+    return [&histogram, start = std::chrono::steady_clock::now(), callback = std::move(callback)](const auto&... args) {
+        histogram.record(nanosecondsSince(start));
+        callback(args...);
+    };
+}
+
+}
+
+ServerMetrics::ServerMetrics(MetricsRegistry& registry)
+    : packets_rejected(registry.counter("chat_packets_rejected_total", "Frames that failed to decode or broke the limits")),
+    packet_handling(registry.histogram("chat_packet_handling_seconds", "Time to handle one received packet")),
+    bytes_received(registry.counter("chat_received_bytes_total", "Bytes read from client sockets")),
+    bytes_sent(registry.counter("chat_sent_bytes_total", "Bytes written to client sockets")),
+    reads(registry.counter("chat_socket_reads_total", "Completed socket reads")),
+    writes(registry.counter("chat_socket_writes_total", "Completed gathered socket writes")),
+    frames_sent(registry.counter("chat_sent_frames_total", "Frames written to client sockets")),
+    sessions(registry.gauge("chat_sessions", "Connected sessions")),
+    write_queue_bytes(registry.gauge("chat_write_queue_bytes", "Bytes waiting in session write queues")),
+    write_queue_frames(registry.gauge("chat_write_queue_frames", "Frames waiting in session write queues")),
+    broadcasts(registry.counter("chat_broadcasts_total", "Broadcasts to a room or the lobby")),
+    broadcast_deliveries(registry.counter("chat_broadcast_deliveries_total", "Frames queued by broadcasts, the fan-out")),
+    broadcast_duration(registry.histogram("chat_broadcast_seconds", "Time to queue one broadcast to every recipient")),
+    frames_compressed(registry.counter("chat_compressed_frames_total", "Frames compressed for sessions that negotiated it")),
+    compression_saved_bytes(registry.counter("chat_compression_saved_bytes_total", "Bytes saved by compression, per compressed frame")),
+    batches(registry.counter("chat_message_batches_total", "ChatMessageBatch frames built at the end of a busy tick")),
+    batched_lines(registry.counter("chat_batched_lines_total", "Chat lines held back for a ChatMessageBatch")),
+    cluster_published(registry.counter("chat_cluster_frames_published_total", "Broadcasts published to the other nodes")),
+    cluster_received(registry.counter("chat_cluster_frames_received_total", "Broadcasts forwarded by other nodes")),
+    login_timeouts(registry.counter("chat_session_timeouts_total", "Sessions closed for missing a deadline", "reason=\"login\"")),
+    frame_timeouts(registry.counter("chat_session_timeouts_total", "Sessions closed for missing a deadline", "reason=\"frame\"")),
+    idle_timeouts(registry.counter("chat_session_timeouts_total", "Sessions closed for missing a deadline", "reason=\"idle\"")),
+    pings_sent(registry.counter("chat_pings_sent_total", "Keepalive pings sent to quiet sessions")),
+    accept_backoffs(registry.counter("chat_accept_backoffs_total", "Times accepting paused for the connection limits or an accept error")),
+    resumes(registry.counter("chat_resumes_total", "Logins with a resume token", "result=\"ok\"")),
+    resumes_rejected(registry.counter("chat_resumes_total", "Logins with a resume token", "result=\"rejected\"")),
+    db_store(registry.histogram("chat_db_callback_seconds", "Database request to callback latency", "op=\"store_message\"")),
+    db_authenticate(registry.histogram("chat_db_callback_seconds", "", "op=\"authenticate_user\"")),
+    db_create_user(registry.histogram("chat_db_callback_seconds", "", "op=\"create_user\"")),
+    db_recent_messages(registry.histogram("chat_db_callback_seconds", "", "op=\"recent_messages\"")) {
+    for (size_t i = 0; i < packets_received.size(); ++i) {
+        const char* name = packetTypeName(static_cast<PacketType>(i));
+        packets_received[i] = &registry.counter("chat_packets_received_total", "Packets received by type",
+                                                std::string("type=\"") + name + "\"");
+    }
+}
+
 ChatServer::ChatServer(boost::asio::io_context& io_context,
                        short port,
-                       std::shared_ptr<DatabaseAdapter> db_adapter)
+                       std::shared_ptr<DatabaseAdapter> db_adapter,
+                       ChatServerConfig config)
     : io_context_(io_context),
-    acceptor_(io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+    accept_strand_(boost::asio::make_strand(io_context)),
+    acceptor_(accept_strand_),
+    accept_timer_(accept_strand_),
+    accept_tokens_(config.accept.max_per_second),
+    accept_refilled_(std::chrono::steady_clock::now()),
     stop_flag_(false),
-    db_adapter_(std::move(db_adapter)) {
-    //dbgln("[SERVER] ChatServer constructor");
+    db_adapter_(std::move(db_adapter)),
+    config_(config),
+    history_(config_.history_size),
+    epoch_((static_cast<uint64_t>(std::random_device{}()) << 32) | std::random_device{}()),
+    resume_tokens_(config_.resume),
+    login_limiter_(config_.login_limits),
+    metrics_(metrics_registry_) {
+    auto& counters = backpressure_counters_;
+    metrics_registry_.callback("chat_backpressure_drop_events_total", "Times a slow consumer had chat lines dropped",
+                               MetricType::Counter, [&counters] { return static_cast<double>(counters.drop_events.load()); });
+    metrics_registry_.callback("chat_backpressure_dropped_frames_total", "Chat lines dropped for slow consumers",
+                               MetricType::Counter, [&counters] { return static_cast<double>(counters.frames_dropped.load()); });
+    metrics_registry_.callback("chat_backpressure_read_pauses_total", "Times reads were paused for a slow consumer",
+                               MetricType::Counter, [&counters] { return static_cast<double>(counters.read_pauses.load()); });
+    metrics_registry_.callback("chat_backpressure_disconnects_total", "Slow consumers disconnected",
+                               MetricType::Counter, [&counters] { return static_cast<double>(counters.disconnects.load()); });
+    metrics_registry_.callback("chat_log_dropped_lines_total", "Log lines dropped because a log ring was full",
+                               MetricType::Counter, [] { return static_cast<double>(Log::dropped()); });
+    if (config_.cluster.port != 0 || !config_.cluster.peers.empty()) {
+        cluster_ = std::make_unique<ClusterBus>(io_context_, config_.cluster,
+                                                [this](RoomId room, ClusterFrameKind kind, SharedFrame frame) {
+                                                    on_cluster_frame(room, kind, std::move(frame));
+                                                });
+        ClusterBus& cluster = *cluster_;
+        metrics_registry_.callback("chat_cluster_peers", "Other nodes this one has a link to",
+                                   MetricType::Gauge, [&cluster] { return static_cast<double>(cluster.connected_peers()); });
+        metrics_registry_.callback("chat_cluster_overflows_total", "Links to other nodes dropped for falling behind",
+                                   MetricType::Counter, [&cluster] { return static_cast<double>(cluster.overflows()); });
+    }
+    if (config_.metrics_port != 0) {
+        metrics_server_ = std::make_unique<MetricsServer>(io_context_, config_.metrics_port, metrics_registry_);
+    }
+    open_listener(port);
     do_accept();
-    //dbgln("[SERVER] Server started on port {}", port);
+    logInfo("[SERVER] Server started on port {}", acceptor_.local_endpoint().port());
 }
 
-void ChatServer::stop() {
-    //dbgln("[SERVER] Stopping server...");
+void ChatServer::open_listener(unsigned short port) {
+    using boost::asio::ip::tcp;
+    const SocketTuning& tuning = config_.socket_tuning;
+    if (config_.listen_fd >= 0) {
+        // Still listening, the previous release bound it the same way
+        acceptor_.assign(tcp::v4(), config_.listen_fd);
+    } else {
+        tcp::endpoint endpoint(tcp::v4(), port);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        if (config_.reuse_port) {
+            acceptor_.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+        }
+        acceptor_.bind(endpoint);
+    }
+    // Before listen(), the window scale a connection gets is settled by the
+    // time accept() returns it
+    if (tuning.send_buffer > 0) {
+        acceptor_.set_option(tcp::socket::send_buffer_size(tuning.send_buffer));
+    }
+    if (tuning.receive_buffer > 0) {
+        acceptor_.set_option(tcp::socket::receive_buffer_size(tuning.receive_buffer));
+    }
+    if (config_.listen_fd < 0) {
+        acceptor_.listen();
+    }
+    // So accept_backlog() finds out the backlog is empty instead of blocking
+    acceptor_.non_blocking(true);
+}
+
+void ChatServer::close_listener() {
     stop_flag_ = true;
-    acceptor_.close();
-    //dbgln("[SERVER] Acceptor closed");
+    // Not while accept_backlog() is using it
+    boost::asio::dispatch(accept_strand_, [this] {
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+        accept_timer_.cancel();
+        logDebug("[SERVER] Acceptor closed");
+    });
+}
 
-    // Move this to protect us from lifetime problems
-    std::set<std::shared_ptr<ChatSession>> participants = std::move(participants_);
-    participants_.clear();
+void ChatServer::stop() {
+    logInfo("[SERVER] Stopping server...");
+    close_listener();
+    if (metrics_server_) {
+        metrics_server_->stop();
+    }
+    if (cluster_) {
+        cluster_->stop();
+    }
 
-    //dbgln("[SERVER] Stopping participant sessions");
+    std::vector<std::shared_ptr<ChatSession>> participants;
+    {
+        std::lock_guard<std::mutex> lock(participants_mutex_);
+        participants = participants_.values();
+        participants_.clear();
+        participants_snapshot_.reset();
+        rooms_.clear();
+        drained_ = nullptr;
+        metrics_.sessions.set(0);
+    }
+    // Each session closes on its own strand and is gone once its last
+    // handler has run
     for (auto& participant : participants) {
-        boost::asio::post(io_context_, [&participant] {
-            //dbgln("[SERVER] Stopping participant {}", participant->get_username());
-            participant->stop();
-        });
+        participant->stop();
     }
+    logInfo("[SERVER] Server stop completed");
+}
 
-    io_context_.run();
+void ChatServer::drain(std::function<void()> done) {
+    if (draining_.exchange(true)) {
+        return;
+    }
+    close_listener();
+    std::vector<std::shared_ptr<ChatSession>> participants;
+    {
+        std::lock_guard<std::mutex> lock(participants_mutex_);
+        participants = participants_.values();
+        if (!participants.empty()) {
+            drained_ = done ? std::move(done) : [] {};
+        }
+    }
+    logInfo("[SERVER] Draining {} sessions over {} ms", participants.size(), config_.drain.spread.count());
+    if (participants.empty()) {
+        finish_drain(std::move(done));
+        return;
+    }
+    // The metrics endpoint and the cluster stay up meanwhile, the sessions
+    // still open keep getting what the rest of the cluster says
+    auto now = std::chrono::steady_clock::now();
+    size_t count = participants.size();
+    for (size_t i = 0; i < count; ++i) {
+        participants[i]->close_at(now + config_.drain.spread * i / count);
+    }
+}
 
-    //dbgln("[SERVER] All participant sessions stopped");
-    participants.clear();
-    //dbgln("[SERVER] Participants cleared");
-    //dbgln("[SERVER] Server stop completed");
+void ChatServer::finish_drain(std::function<void()> done) {
+    if (metrics_server_) {
+        metrics_server_->stop();
+    }
+    if (cluster_) {
+        cluster_->stop();
+    }
+    logInfo("[SERVER] Drain completed");
+    if (done) {
+        done();
+    }
 }
 
 void ChatServer::do_accept() {
+    auto delay = accept_delay();
+    if (delay.count() > 0) {
+        accept_after(delay);
+        return;
+    }
+    // Each accepted socket gets its own strand
     acceptor_.async_accept(
+        boost::asio::make_strand(io_context_),
         [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
-            if (!ec && !stop_flag_) {
-                //dbgln("[SERVER] New connection accepted");
-                auto session = std::make_shared<ChatSession>(std::move(socket), *this);
-                participants_.insert(session);
-                session->start();
+            if (stop_flag_) {
+                return;
+            }
+            if (ec) {
+                // Out of descriptors, say. Give the sessions a moment to close some.
+                logWarn("[SERVER] Accept error: {}", ec.message());
+                accept_after(config_.accept.backoff);
+                return;
+            }
+            if (!start_session(std::move(socket))) {
+                return;
+            }
+            accept_backlog();
+            if (!stop_flag_) {
                 do_accept();
-            } else if (ec) {
-                //dbgln("[SERVER] Accept error: {}", ec.message());
             }
         });
 }
 
-void ChatServer::handle_packet(std::shared_ptr<ChatSession> sender, const std::vector<uint8_t>& packet_data) {
-    //dbgln("[SERVER] Handling packet of size: {}", packet_data.size());
-    auto packet = createPacketFromData(packet_data);
-    if (!packet) {
-        //dbgln("[SERVER] Received invalid packet from client");
-        return;
+void ChatServer::accept_backlog() {
+    for (size_t i = 1; i < config_.accept.batch && !stop_flag_ && acceptor_.is_open(); ++i) {
+        if (accept_delay().count() > 0) {
+            // do_accept() waits it out
+            return;
+        }
+        boost::asio::ip::tcp::socket socket(boost::asio::make_strand(io_context_));
+        boost::system::error_code ec;
+        acceptor_.accept(socket, ec);
+        if (ec) {
+            // Nobody waiting, or an error the next async_accept runs into.
+            // No connection came of the rate limit's token.
+            if (config_.accept.max_per_second != 0) {
+                accept_tokens_ += 1;
+            }
+            return;
+        }
+        if (!start_session(std::move(socket))) {
+            return;
+        }
+    }
+}
+
+bool ChatServer::start_session(boost::asio::ip::tcp::socket socket) {
+    using boost::asio::ip::tcp;
+    logDebug("[SERVER] New connection accepted");
+    const SocketTuning& tuning = config_.socket_tuning;
+    // A connection reset already fails here and is left for the session
+    // to find out about
+    boost::system::error_code ec;
+    if (tuning.no_delay) {
+        socket.set_option(tcp::no_delay(true), ec);
     }
+    if (tuning.notsent_lowat > 0) {
+        socket.set_option(boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT>(tuning.notsent_lowat), ec);
+    }
+    // Session and control block share one pooled block, which the next
+    // connection reuses once this one is gone
+    auto session = std::allocate_shared<ChatSession>(PoolAllocator<ChatSession>(), std::move(socket), *this);
+    join(session);
+    session->start();
+    // Accepted as stop() or drain() took their list of sessions, which this
+    // one may have missed
+    if (stop_flag_) {
+        session->stop();
+        return false;
+    }
+    return true;
+}
+
+std::chrono::steady_clock::duration ChatServer::accept_delay() {
+    const AcceptLimits& limits = config_.accept;
+    if (limits.max_connections != 0) {
+        std::lock_guard<std::mutex> lock(participants_mutex_);
+        if (participants_.size() >= limits.max_connections) {
+            return limits.backoff;
+        }
+    }
+    if (limits.max_per_second != 0) {
+        // Token bucket, refilled at max_per_second and holding a second's worth
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - accept_refilled_).count();
+        double rate = limits.max_per_second;
+        accept_tokens_ = std::min(rate, accept_tokens_ + elapsed * rate);
+        accept_refilled_ = now;
+        if (accept_tokens_ < 1) {
+            return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>((1 - accept_tokens_) / rate));
+        }
+        accept_tokens_ -= 1;
+    }
+    return std::chrono::steady_clock::duration::zero();
+}
 
-    //dbgln("[SERVER] Received packet of type: {}", static_cast<int>(packet->getType()));
+void ChatServer::accept_after(std::chrono::steady_clock::duration delay) {
+    metrics_.accept_backoffs.add();
+    accept_timer_.expires_after(delay);
+    accept_timer_.async_wait([this](boost::system::error_code ec) {
+        if (!ec && !stop_flag_) {
+            do_accept();
+        }
+    });
+}
+
+DecodeResult ChatServer::handle_packet(std::shared_ptr<ChatSession> sender, std::span<const uint8_t> packet_data) {
+    // Once per packet read, a compressed one along with the frames inside
+    ScopedTimer timer(metrics_.packet_handling);
+    return handle_frame(sender, packet_data);
+}
 
-    switch (packet->getType()) {
-    case PacketType::Login: {
-        auto login_packet = static_cast<LoginPacket*>(packet.get());
+DecodeResult ChatServer::handle_frame(const std::shared_ptr<ChatSession>& sender, std::span<const uint8_t> packet_data) {
+    logTrace("[SERVER] Handling packet of size: {}", packet_data.size());
+    DecodeResult handled = DecodeResult::Ok;
+    DecodeResult result = dispatchPacket(packet_data, [this, &sender, &handled](const auto& packet) {
+        logTrace("[SERVER] Received packet of type: {}", static_cast<int>(packet.type));
+        metrics_.packets_received[static_cast<size_t>(packet.type)]->add();
+        if constexpr (std::is_same_v<std::decay_t<decltype(packet)>, CompressedPacketView>) {
+            handled = on_compressed(sender, packet);
+        } else {
+            on_packet(sender, packet);
+        }
+    });
+    if (result == DecodeResult::Ok) {
+        result = handled;
+    }
+    if (result != DecodeResult::Ok) {
+        metrics_.packets_rejected.add();
+        logWarn("[SERVER] Received invalid packet from client: {}", static_cast<int>(result));
+    }
+    return result;
+}
+
+void ChatServer::on_packet(const std::shared_ptr<ChatSession>& sender, const LoginPacketView& login_packet) {
+    std::string username(login_packet.getUsername());
+    std::string password(login_packet.getPassword());
+    uint32_t capabilities = negotiate(login_packet.getCapabilities());
+    sender->queue_credential_check([this, sender, username, password, capabilities](std::function<void()> done) {
+        // Turned away before it costs a password hash
+        if (!login_limiter_.allow(sender->get_address(), username)) {
+            sender->deliver(LoginFailedPacket());
+            done();
+            return;
+        }
         authenticate_user(
-            login_packet->getUsername(),
-            login_packet->getPassword(),
-            [this, sender, username = login_packet->getUsername()](bool success) {
-                if (success) {
-                    sender->set_username(username);
-                    sender->deliver(LoginSuccessPacket());
-
-                    // Send recent messages to newly logged-in user
-                    load_recent_messages(sender);
-
-                    // Notify others
-                    ChatMessagePacket system_msg("System", username + " has joined the chat.");
-                    broadcast(system_msg, sender);
-                } else {
+            username,
+            password,
+            on_session_strand(sender, [this, sender, username, capabilities, done](AuthResult result) {
+                switch (result) {
+                case AuthResult::Ok:
+                    login_limiter_.succeed(username);
+                    admit(sender, username, capabilities, 0);
+                    break;
+                case AuthResult::Rejected:
+                    login_limiter_.fail(username);
                     sender->deliver(LoginFailedPacket());
+                    break;
+                case AuthResult::Busy:
+                    // Our overload, not a wrong guess, so it is no strike
+                    sender->deliver(RateLimitedPacket());
+                    break;
                 }
-            });
-        break;
+                done();
+            }));
+    });
+}
+
+// Checked on the spot, but queued behind any password check still running
+// so the replies keep their order
+void ChatServer::on_packet(const std::shared_ptr<ChatSession>& sender, const ResumePacketView& resume_packet) {
+    auto claims = resume_tokens_.verify(resume_packet.getToken());
+    HistoryId last_seen = resume_packet.getLastSeen();
+    uint32_t capabilities = negotiate(resume_packet.getCapabilities());
+    sender->queue_credential_check([this, sender, claims, last_seen, capabilities](std::function<void()> done) {
+        if (!claims) {
+            metrics_.resumes_rejected.add();
+            sender->deliver(LoginFailedPacket());
+        } else {
+            metrics_.resumes.add();
+            // Ids from before a restart, or from another node, say nothing
+            // about what the client has
+            admit(sender, claims->username, capabilities, claims->epoch == epoch_ ? last_seen : 0);
+        }
+        done();
+    });
+}
+
+uint32_t ChatServer::negotiate(uint32_t offered) const {
+    uint32_t supported = (config_.compression.enabled ? kCapCompressedFrames : 0) |
+                         (config_.batch_interval.count() > 0 ? kCapMessageBatches : 0) |
+                         (config_.timeouts.ping_interval.count() > 0 ? kCapKeepalive : 0);
+    return offered & supported;
+}
+
+void ChatServer::admit(const std::shared_ptr<ChatSession>& session, const std::string& username, uint32_t capabilities,
+                       HistoryId last_seen) {
+    session->set_username(username);
+    session->set_capabilities(capabilities);
+    std::string token = resume_tokens_.issue(username, epoch_);
+
+    // Send recent messages to newly logged-in user, or what they missed.
+    // The reply names the id they follow, so a client cut off before they
+    // arrive asks for them again.
+    bool seeded = true;
+    HistoryId admitted = 0;
+    history_.replay(last_seen, session->compresses(), [this](const PooledBytes& frames) { return compress(frames); },
+                    [&](SharedFrame missed, HistoryId after, HistoryId last) {
+                        session->deliver(LoginSuccessPacket(capabilities, token, after));
+                        seeded = missed != nullptr;
+                        if (seeded && !missed->empty()) {
+                            session->deliver(std::move(missed));
+                        }
+                        session->set_replayed_through(last);
+                        admitted = last;
+                    });
+    if (!seeded) {
+        load_recent_messages(session, admitted);
     }
-    case PacketType::CreateUser: {
-        auto create_user_packet = static_cast<CreateUserPacket*>(packet.get());
+
+    // Notify others
+    ChatMessagePacket system_msg("System", username + " has joined the chat.");
+    broadcast(system_msg, session);
+}
+
+void ChatServer::on_packet(const std::shared_ptr<ChatSession>& sender, const CreateUserPacketView& create_user_packet) {
+    std::string username(create_user_packet.getUsername());
+    std::string password(create_user_packet.getPassword());
+    sender->queue_credential_check([this, sender, username, password](std::function<void()> done) {
+        if (!login_limiter_.allow(sender->get_address())) {
+            // Says nothing about whether the name is taken
+            sender->deliver(RateLimitedPacket());
+            done();
+            return;
+        }
         create_user(
-            create_user_packet->getUsername(),
-            create_user_packet->getPassword(),
-            [this, sender](bool success) {
-                if (success) {
+            username,
+            password,
+            on_session_strand(sender, [sender, done](AuthResult result) {
+                switch (result) {
+                case AuthResult::Ok:
                     sender->deliver(AccountCreatedPacket());
-                } else {
+                    break;
+                case AuthResult::Rejected:
                     sender->deliver(AccountExistsPacket());
+                    break;
+                case AuthResult::Busy:
+                    sender->deliver(RateLimitedPacket());
+                    break;
                 }
-            });
-        break;
+                done();
+            }));
+    });
+}
+
+void ChatServer::on_packet(const std::shared_ptr<ChatSession>& sender, const ChatMessagePacketView& chat_message_packet) {
+    const std::string& sender_name = sender->get_username();
+
+    if (sender_name.empty()) {
+        sender->deliver(LoginFailedPacket());
+        return;
     }
-    case PacketType::ChatMessage: {
-        auto chat_message_packet = static_cast<ChatMessagePacket*>(packet.get());
-        std::string sender_name = sender->get_username();
 
-        if (sender_name.empty()) {
-            sender->deliver(LoginFailedPacket());
-            return;
+    RoomId room = chat_message_packet.getRoom();
+    if (room != kLobbyRoom && !sender->in_room(room)) {
+        return;
+    }
+
+    // Store message in database
+    ChatMessage msg(sender_name, std::string(chat_message_packet.getMessage()));
+    msg.room = room;
+    db_adapter_->storeMessage(msg, timed(metrics_.db_store, [this, sender, msg](bool success) {
+        if (success) {
+            // Create a new packet with the sender's name and message from msg,
+            // the same bytes go to everyone in the room and, for the lobby,
+            // into the login history
+            HistoryId history_id = 0;
+            auto encode = [&msg, &history_id](HistoryId id) {
+                history_id = id;
+                return Packet::prepareSharedPacket(ChatMessagePacket(msg.sender, msg.content, msg.room, id));
+            };
+            auto frame = msg.room == kLobbyRoom ? history_.append(encode) : encode(0);
+            broadcast_message(msg, history_id, std::move(frame), sender);
         }
+    }));
+}
 
-        // Store message in database
-        ChatMessage msg(sender_name, chat_message_packet->getMessage());
-        db_adapter_->storeMessage(msg, [this, sender, msg](bool success) {
-            if (success) {
-                // Create a new packet with the sender's name and message from msg
-                ChatMessagePacket broadcast_packet(msg.sender, msg.content);
-                broadcast(broadcast_packet, sender);
+void ChatServer::on_packet(const std::shared_ptr<ChatSession>& sender, const JoinRoomPacketView& join_room_packet) {
+    RoomId room = join_room_packet.getRoom();
+    if (sender->get_username().empty() || room == kLobbyRoom || sender->in_room(room) ||
+        sender->get_rooms().size() >= config_.max_rooms_per_session) {
+        return;
+    }
+    join_room(sender, room);
+    ChatMessagePacket system_msg("System", sender->get_username() + " has joined the room.", room);
+    broadcast(system_msg, sender, room);
+}
+
+void ChatServer::on_packet(const std::shared_ptr<ChatSession>& sender, const LeaveRoomPacketView& leave_room_packet) {
+    RoomId room = leave_room_packet.getRoom();
+    if (!sender->in_room(room)) {
+        return;
+    }
+    leave_room(room, sender->remove_room(room));
+    ChatMessagePacket system_msg("System", sender->get_username() + " has left the room.", room);
+    broadcast(system_msg, sender, room);
+}
+
+void ChatServer::on_packet(const std::shared_ptr<ChatSession>& sender, const PingPacketView& ping) {
+    sender->deliver(PongPacket(ping.getNonce()));
+}
+
+DecodeResult ChatServer::on_compressed(const std::shared_ptr<ChatSession>& sender, const CompressedPacketView& packet) {
+    if (!sender->compresses()) {
+        return DecodeResult::UnknownType;
+    }
+    // Sessions of one thread take turns, and nothing inside may be compressed again
+    thread_local std::vector<uint8_t> inflated;
+    if (!inflateFrames(packet, config_.compression.max_inflated_size, inflated)) {
+        return DecodeResult::Corrupt;
+    }
+    return consumeFrames(inflated, config_.packet_limits, [this, &sender](std::span<const uint8_t> frame) {
+        if (peekPacketType(frame) == PacketType::Compressed) {
+            return DecodeResult::UnknownType;
+        }
+        return handle_frame(sender, frame);
+    });
+}
+
+void ChatServer::broadcast(SharedFrame frame, std::shared_ptr<ChatSession> sender, RoomId room) {
+    publish(room, ClusterFrameKind::Announcement, frame);
+    fan_out(frame, sender, room, [](const ChatSession&) { return true; });
+}
+
+void ChatServer::publish(RoomId room, ClusterFrameKind kind, const SharedFrame& frame) {
+    if (cluster_) {
+        cluster_->publish(room, kind, frame);
+        metrics_.cluster_published.add();
+    }
+}
+
+// The origin node stored the line, so the nodes are expected to share the
+// database they keep users and messages in. Here it only goes into the
+// history and out to the local sessions. A lobby line is encoded again for
+// that, with the id it has in this node's history.
+void ChatServer::on_cluster_frame(RoomId room, ClusterFrameKind kind, SharedFrame frame) {
+    metrics_.cluster_received.add();
+    if (kind == ClusterFrameKind::ChatLine) {
+        auto line = viewPacket<ChatMessagePacketView>(std::span<const uint8_t>(*frame).subspan(sizeof(uint32_t)));
+        if (line) {
+            ChatMessage msg(std::string(line->getSender()), std::string(line->getMessage()));
+            msg.room = room;
+            HistoryId history_id = 0;
+            if (room == kLobbyRoom) {
+                frame = history_.append([&msg, &history_id](HistoryId id) {
+                    history_id = id;
+                    return Packet::prepareSharedPacket(ChatMessagePacket(msg.sender, msg.content, kLobbyRoom, id));
+                });
             }
+            deliver_message(msg, history_id, std::move(frame), nullptr);
+            return;
+        }
+    }
+    fan_out(frame, nullptr, room, [](const ChatSession&) { return true; });
+}
+
+// Queues `frame` for everyone in the room but the sender that `filter` accepts
+template<typename Filter>
+void ChatServer::fan_out(const SharedFrame& frame, const std::shared_ptr<ChatSession>& sender, RoomId room, Filter&& filter) {
+    auto start = std::chrono::steady_clock::now();
+    auto participants = room == kLobbyRoom ? participants_snapshot() : room_snapshot(room);
+    uint64_t deliveries = 0;
+    FanOutFrame out(frame, config_.compression.threshold);
+    auto compress_frame = [this](const PooledBytes& bytes) { return compress(bytes); };
+    for (auto& participant : *participants) {
+        if (participant != sender && filter(*participant)) {
+            participant->deliver(out.frame_for(*participant, compress_frame));
+            ++deliveries;
+        }
+    }
+    metrics_.broadcasts.add();
+    metrics_.broadcast_deliveries.add(deliveries);
+    metrics_.broadcast_duration.record(nanosecondsSince(start));
+}
+
+void ChatServer::broadcast_message(const ChatMessage& msg, HistoryId history_id, SharedFrame frame,
+                                   std::shared_ptr<ChatSession> sender) {
+    publish(msg.room, ClusterFrameKind::ChatLine, frame);
+    deliver_message(msg, history_id, std::move(frame), std::move(sender));
+}
+
+// The first line in a quiet room goes out at once and starts a tick. Lines
+// arriving before the tick ends are held back for the sessions that take
+// batches and go out together when it does. Everyone else gets every line
+// as it comes, as do all sessions once a tick passes without lines.
+void ChatServer::deliver_message(const ChatMessage& msg, HistoryId history_id, SharedFrame frame,
+                                 std::shared_ptr<ChatSession> sender) {
+    if (config_.batch_interval.count() == 0) {
+        fan_out(frame, sender, msg.room, [history_id](const ChatSession& participant) {
+            return participant.wants_line(history_id);
         });
-        break;
+        return;
     }
-    case PacketType::LoginSuccess:
-    case PacketType::LoginFailed:
-    case PacketType::AccountCreated:
-    case PacketType::AccountExists:
-        //dbgln("[SERVER] Received unexpected packet type from client: {}", static_cast<int>(packet->getType()));
-        break;
-    default:
-        //dbgln("[SERVER] Received unknown packet type from client: {}", static_cast<int>(packet->getType()));
-        break;
+    bool held_back = false;
+    {
+        std::lock_guard<std::mutex> lock(batches_mutex_);
+        auto [it, quiet] = batches_.try_emplace(msg.room, io_context_);
+        if (quiet) {
+            arm_batch(msg.room, it->second);
+        } else {
+            it->second.lines.push_back({sender, msg.sender, msg.content, history_id});
+            held_back = true;
+        }
+    }
+    if (held_back) {
+        metrics_.batched_lines.add();
     }
+    fan_out(frame, sender, msg.room, [held_back, history_id](const ChatSession& participant) {
+        return (!held_back || !participant.batches()) && participant.wants_line(history_id);
+    });
 }
 
-void ChatServer::broadcast(const Packet& packet, std::shared_ptr<ChatSession> sender) {
-    for (auto& participant : participants_) {
-        if (participant != sender) {
-            participant->deliver(packet);
+// Called with batches_mutex_ held
+void ChatServer::arm_batch(RoomId room, RoomBatch& batch) {
+    batch.timer.expires_after(config_.batch_interval);
+    batch.timer.async_wait([this, room](boost::system::error_code ec) {
+        // Cancelled when the server goes away
+        if (!ec) {
+            flush_batch(room);
+        }
+    });
+}
+
+void ChatServer::flush_batch(RoomId room) {
+    std::vector<BatchedLine> lines;
+    {
+        std::lock_guard<std::mutex> lock(batches_mutex_);
+        auto it = batches_.find(room);
+        if (it == batches_.end()) {
+            return;
+        }
+        lines.swap(it->second.lines);
+        if (lines.empty() || stop_flag_) {
+            batches_.erase(it);
+        } else {
+            arm_batch(room, it->second);
+        }
+    }
+    if (lines.empty()) {
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    // The senders do not get their own lines, but they have seen them
+    HistoryId first_history_id = std::numeric_limits<HistoryId>::max();
+    HistoryId last_history_id = 0;
+    for (const auto& line : lines) {
+        if (line.history_id != 0) {
+            first_history_id = std::min(first_history_id, line.history_id);
+            last_history_id = std::max(last_history_id, line.history_id);
+        }
+    }
+    // Leaving out the lines of `without`, and those up to `replayed` that a
+    // session got with its replay
+    auto encode = [room, &lines, last_history_id, this](const ChatSession* without,
+                                                        HistoryId replayed = 0) -> std::optional<FanOutFrame> {
+        std::string text;
+        for (const auto& line : lines) {
+            if (line.from.get() != without && (line.history_id == 0 || line.history_id > replayed)) {
+                ChatMessageBatchPacket::appendLine(text, line.sender, line.message);
+            }
+        }
+        if (text.empty()) {
+            return std::nullopt;
+        }
+        return FanOutFrame(Packet::prepareSharedPacket(ChatMessageBatchPacket(room, text, last_history_id)),
+                           config_.compression.threshold);
+    };
+    // Everyone gets the same batch, except the senders, who get it without
+    // their own lines
+    FanOutFrame everything = *encode(nullptr);
+    std::vector<std::pair<const ChatSession*, std::optional<FanOutFrame>>> without_own;
+    for (const auto& line : lines) {
+        // Lines from other nodes have no local sender
+        if (line.from && std::none_of(without_own.begin(), without_own.end(), [&](const auto& entry) { return entry.first == line.from.get(); })) {
+            without_own.emplace_back(line.from.get(), encode(line.from.get()));
         }
     }
+
+    auto compress_frame = [this](const PooledBytes& bytes) { return compress(bytes); };
+    auto participants = room == kLobbyRoom ? participants_snapshot() : room_snapshot(room);
+    uint64_t deliveries = 0;
+    for (auto& participant : *participants) {
+        if (!participant->batches()) {
+            continue;
+        }
+        FanOutFrame* out = &everything;
+        auto own = std::find_if(without_own.begin(), without_own.end(), [&](const auto& entry) {
+            return entry.first == participant.get();
+        });
+        // Logged in during the tick, rare enough to encode for on its own
+        HistoryId replayed = participant->replayed_through();
+        std::optional<FanOutFrame> late;
+        if (replayed >= first_history_id) {
+            late = encode(participant.get(), replayed);
+            if (!late) {
+                continue;
+            }
+            out = &*late;
+        } else if (own != without_own.end()) {
+            if (!own->second) {
+                continue;  // Nothing but their own lines
+            }
+            out = &*own->second;
+        }
+        participant->deliver(out->frame_for(*participant, compress_frame));
+        ++deliveries;
+    }
+    metrics_.batches.add();
+    metrics_.broadcast_deliveries.add(deliveries);
+    metrics_.broadcast_duration.record(nanosecondsSince(start));
 }
 
 void ChatServer::authenticate_user(const std::string& username,
                                    const std::string& password,
-                                   std::function<void(bool)> callback) {
-    db_adapter_->authenticateUser(username, password, callback);
+                                   AuthCallback callback) {
+    db_adapter_->authenticateUser(username, password, timed(metrics_.db_authenticate, std::move(callback)));
 }
 
 void ChatServer::create_user(const std::string& username,
                              const std::string& password,
-                             std::function<void(bool)> callback) {
-    db_adapter_->createUser(username, password, callback);
+                             AuthCallback callback) {
+    db_adapter_->createUser(username, password, timed(metrics_.db_create_user, std::move(callback)));
 }
 
-void ChatServer::load_recent_messages(std::shared_ptr<ChatSession> session) {
-    db_adapter_->getRecentMessages(50, [this, session](const std::vector<ChatMessage>& messages) {
-        for (const auto& msg : messages) {
-            ChatMessagePacket packet(msg.sender, msg.content);
-            session->deliver(packet);
+SharedFrame ChatServer::compress(const PooledBytes& frame) {
+    SharedFrame compressed = compressSharedFrame(frame, config_.compression.level);
+    if (compressed) {
+        metrics_.frames_compressed.add();
+        metrics_.compression_saved_bytes.add(frame.size() - compressed->size());
+    }
+    return compressed;
+}
+
+// First logins after startup, fetch the history and seed the cache with it.
+// The session had the lines newer than `admitted` live already.
+void ChatServer::load_recent_messages(std::shared_ptr<ChatSession> session, HistoryId admitted) {
+    db_adapter_->getRecentMessages(config_.history_size, timed(metrics_.db_recent_messages, [this, session, admitted](MessageSnapshot messages) {
+        // Only the lobby is replayed on login
+        std::vector<const ChatMessage*> lines;
+        lines.reserve(messages->size());
+        for (const auto& msg : *messages) {
+            if (msg.room == kLobbyRoom) {
+                lines.push_back(&msg);
+            }
         }
-    });
+        auto encode = [&lines](size_t i, HistoryId id) {
+            return Packet::prepareSharedPacket(ChatMessagePacket(lines[i]->sender, lines[i]->content, kLobbyRoom, id));
+        };
+        // Whether this fetch or an earlier one seeded, the session gets what
+        // it did not have live
+        auto compress_frames = [this](const PooledBytes& frames) { return compress(frames); };
+        history_.seed(lines.size(), encode, admitted, session->compresses(), compress_frames,
+                      [&session](SharedFrame frames, HistoryId, HistoryId last) {
+                          if (!frames->empty()) {
+                              session->deliver(std::move(frames));
+                          }
+                          session->set_replayed_through(last);
+                      });
+    }));
+}
+
+void ChatServer::join(std::shared_ptr<ChatSession> participant) {
+    std::lock_guard<std::mutex> lock(participants_mutex_);
+    // Before start(), so the session's strand always sees its handle
+    participant->set_handle(participants_.insert(participant));
+    participants_snapshot_.reset();
+    metrics_.sessions.add(1);
+}
+
+std::shared_ptr<const std::vector<std::shared_ptr<ChatSession>>> ChatServer::participants_snapshot() {
+    std::lock_guard<std::mutex> lock(participants_mutex_);
+    if (!participants_snapshot_) {
+        participants_snapshot_ = std::make_shared<const std::vector<std::shared_ptr<ChatSession>>>(
+            participants_.values());
+    }
+    return participants_snapshot_;
+}
+
+// Returns an empty snapshot for a room nobody is in
+std::shared_ptr<const std::vector<std::shared_ptr<ChatSession>>> ChatServer::room_snapshot(RoomId room) {
+    static const auto empty = std::make_shared<const std::vector<std::shared_ptr<ChatSession>>>();
+    std::lock_guard<std::mutex> lock(participants_mutex_);
+    auto it = rooms_.find(room);
+    if (it == rooms_.end()) {
+        return empty;
+    }
+    if (!it->second.snapshot) {
+        it->second.snapshot = std::make_shared<const std::vector<std::shared_ptr<ChatSession>>>(
+            it->second.members.values());
+    }
+    return it->second.snapshot;
+}
+
+// Called on the participant's strand
+void ChatServer::join_room(const std::shared_ptr<ChatSession>& participant, RoomId room) {
+    SlotHandle handle;
+    {
+        std::lock_guard<std::mutex> lock(participants_mutex_);
+        auto& members = rooms_[room];
+        handle = members.members.insert(participant);
+        members.snapshot.reset();
+    }
+    participant->add_room(room, handle);
+}
+
+// Called on the participant's strand, after it dropped its membership
+void ChatServer::leave_room(RoomId room, SlotHandle handle) {
+    std::lock_guard<std::mutex> lock(participants_mutex_);
+    auto it = rooms_.find(room);
+    if (it == rooms_.end() || !it->second.members.erase(handle)) {
+        return;
+    }
+    if (it->second.members.empty()) {
+        rooms_.erase(it);
+    } else {
+        it->second.snapshot.reset();
+    }
 }
 
 void ChatServer::leave(std::shared_ptr<ChatSession> participant) {
-    participants_.erase(participant);
+    // Its deadline timer would keep a session that is merely forgotten open
+    participant->stop();
+    std::function<void()> done;
+    {
+        std::lock_guard<std::mutex> lock(participants_mutex_);
+        // A session may fail its read and its write, only announce it once
+        if (!participants_.erase(participant->get_handle())) {
+            return;
+        }
+        participants_snapshot_.reset();
+        metrics_.sessions.add(-1);
+        if (participants_.empty() && drained_) {
+            done = std::move(drained_);
+            drained_ = nullptr;
+        }
+    }
+    auto rooms = participant->get_rooms();
+    for (const auto& membership : rooms) {
+        participant->remove_room(membership.room);
+        leave_room(membership.room, membership.handle);
+    }
     std::string username = participant->get_username();
-    if (!username.empty()) {
+    // A drained client is only moving over to the next release
+    if (!username.empty() && !draining_) {
         ChatMessagePacket system_msg("System", username + " has left the chat.");
         broadcast(system_msg, participant);
     }
+    if (done) {
+        finish_drain(std::move(done));
+    }
 }
 
 ChatSession::ChatSession(boost::asio::ip::tcp::socket socket, ChatServer& server)
-    : socket_(std::move(socket)), server_(server) {
-    //dbgln("[SERVER] New chat session created");
+    : socket_(std::move(socket)), server_(server),
+    read_buffer_(server.config().receive_buffer_size),
+    reads_resumed_(makeWakeup(socket_.get_executor())),
+    write_wanted_(makeWakeup(socket_.get_executor())),
+    deadline_timer_(socket_.get_executor()),
+    accepted_at_(std::chrono::steady_clock::now()),
+    last_read_(accepted_at_) {
+    boost::system::error_code ec;
+    auto endpoint = socket_.remote_endpoint(ec);
+    if (!ec) {
+        address_ = endpoint.address().to_string();
+    }
+    logTrace("[SERVER] New chat session created");
+}
+
+void ChatSession::queue_credential_check(CredentialCheck check) {
+    credential_checks_.push_back(std::move(check));
+    if (credential_checks_.size() == 1) {
+        run_credential_check();
+    }
+}
+
+// Called on the strand
+void ChatSession::run_credential_check() {
+    credential_checks_.front()([this, self = shared_from_this()] {
+        credential_checks_.pop_front();
+        // The client was waiting for us, not idle. After a login this also
+        // starts the pings, if it asked for them.
+        last_read_ = std::chrono::steady_clock::now();
+        check_deadlines();
+        if (!socket_.is_open()) {
+            credential_checks_.clear();
+        } else if (!credential_checks_.empty()) {
+            run_credential_check();
+        }
+    });
+}
+
+bool ChatSession::in_room(RoomId room) const {
+    return std::any_of(rooms_.begin(), rooms_.end(), [room](const RoomMembership& membership) {
+        return membership.room == room;
+    });
+}
+
+SlotHandle ChatSession::remove_room(RoomId room) {
+    for (auto& membership : rooms_) {
+        if (membership.room == room) {
+            SlotHandle handle = membership.handle;
+            membership = rooms_.back();
+            rooms_.pop_back();
+            return handle;
+        }
+    }
+    return {};
 }
 
 void ChatSession::start() {
-    //dbgln("[SERVER] Starting chat session");
-    do_read_header();
+    logTrace("[SERVER] Starting chat session");
+    boost::asio::dispatch(socket_.get_executor(), [this, self = shared_from_this()] {
+        check_deadlines();
+        boost::asio::co_spawn(socket_.get_executor(), read_loop(self), rethrowEscaped);
+        boost::asio::co_spawn(socket_.get_executor(), write_loop(self), rethrowEscaped);
+    });
+}
+
+void ChatSession::check_deadlines() {
+    if (!socket_.is_open()) {
+        return;
+    }
+    const SessionTimeouts& timeouts = server_.config().timeouts;
+    ServerMetrics& metrics = server_.metrics();
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    // True once `deadline` has passed, otherwise it is a candidate for the next wake-up
+    auto passed = [&](std::chrono::steady_clock::time_point deadline) {
+        if (deadline <= now) {
+            return true;
+        }
+        next = std::min(next, deadline);
+        return false;
+    };
+
+    Counter* timed_out = nullptr;
+    if (timeouts.login.count() > 0 && username_.empty() && passed(accepted_at_ + timeouts.login)) {
+        timed_out = &metrics.login_timeouts;
+    } else if (timeouts.frame.count() > 0 && frame_started_ && !reads_paused_ && passed(*frame_started_ + timeouts.frame)) {
+        timed_out = &metrics.frame_timeouts;
+    } else if (timeouts.idle.count() > 0 && !reads_paused_ && credential_checks_.empty() &&
+               passed(last_read_ + timeouts.idle)) {
+        // Paused reads and slow password hashes are the server's doing, not
+        // the client's
+        timed_out = &metrics.idle_timeouts;
+    }
+    if (timed_out) {
+        logInfo("[SERVER] Closing session {} from {}, it missed a deadline", username_, address_);
+        timed_out->add();
+        stop();
+        return;
+    }
+    if (close_at_) {
+        if (!closing_ && passed(*close_at_)) {
+            begin_close();
+        }
+        if (closing_ && passed(*close_at_ + server_.config().drain.flush_timeout)) {
+            stop();
+            return;
+        }
+    }
+
+    if (keepalive() && timeouts.ping_interval.count() > 0 && !reads_paused_) {
+        // Once per interval for as long as the client stays quiet
+        auto ping_at = std::max(last_read_, last_ping_) + timeouts.ping_interval;
+        if (ping_at <= now) {
+            last_ping_ = now;
+            deliver(PingPacket(++pings_));
+            metrics.pings_sent.add();
+            ping_at = now + timeouts.ping_interval;
+        }
+        next = std::min(next, ping_at);
+    }
+    if (next != std::chrono::steady_clock::time_point::max()) {
+        arm_deadline(next);
+    }
+}
+
+// Deadlines only ever move closer through here. Activity that pushes them
+// back is picked up when the timer fires and check_deadlines() looks again.
+void ChatSession::arm_deadline(std::chrono::steady_clock::time_point when) {
+    if (deadline_armed_ && deadline_timer_.expiry() <= when) {
+        return;
+    }
+    deadline_armed_ = true;
+    deadline_timer_.expires_at(when);
+    deadline_timer_.async_wait([this, self = shared_from_this()](boost::system::error_code ec) {
+        // Also cancelled when moved closer, the newer wait takes over
+        if (ec) {
+            return;
+        }
+        deadline_armed_ = false;
+        check_deadlines();
+    });
 }
 
-void ChatSession::deliver(const Packet& packet) {
-    bool write_in_progress = !write_msgs_.empty();
-    write_msgs_.push_back(Packet::preparePacketForSending(packet));
-    if (!write_in_progress) {
-        do_write();
+void ChatSession::close_at(std::chrono::steady_clock::time_point when) {
+    boost::asio::dispatch(socket_.get_executor(), [this, self = shared_from_this(), when] {
+        close_at_ = when;
+        check_deadlines();
+    });
+}
+
+// Called on the strand
+void ChatSession::begin_close() {
+    closing_ = true;
+    if (!write_msgs_.empty()) {
+        // write_loop() comes back here once the queue is empty
+        return;
+    }
+    // The client reads everything sent so far, then its end of file, and
+    // hangs up. Its goodbye ends our read and the session with it.
+    send_shut_ = true;
+    boost::system::error_code ec;
+    socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+}
+
+void ChatSession::deliver(SharedFrame frame) {
+    boost::asio::dispatch(socket_.get_executor(), [this, self = shared_from_this(), frame = std::move(frame)]() mutable {
+        // Stopped, possibly by backpressure, and only waiting to be reaped.
+        // Or closing, and only sending what it had.
+        if (!socket_.is_open() || closing_) {
+            return;
+        }
+        write_msgs_.push(std::move(frame));
+        apply_backpressure();
+        update_queue_metrics();
+        if (!write_msgs_.writing()) {
+            write_wanted_.cancel();
+        }
+    });
+}
+
+void ChatSession::apply_backpressure() {
+    const BackpressureConfig& config = server_.config().backpressure;
+    BackpressureCounters& counters = server_.backpressure_counters();
+
+    if (write_msgs_.bytes() > config.max_bytes) {
+        counters.disconnects++;
+        stop();
+        return;
+    }
+    if (!write_msgs_.above(config.high_watermark_bytes, config.high_watermark_frames)) {
+        return;
+    }
+
+    switch (config.policy) {
+    case SlowConsumerPolicy::DropOldest: {
+        // Only chat lines are expendable, singly or batched, control packets
+        // always go out. Compressed frames only ever carry chat lines and
+        // batches of them.
+        size_t dropped = write_msgs_.dropOldest(
+            config.low_watermark_bytes, config.low_watermark_frames,
+            [](const PooledBytes& frame) {
+                uint8_t type = frame[sizeof(uint32_t)];
+                return type == static_cast<uint8_t>(PacketType::ChatMessage) ||
+                       type == static_cast<uint8_t>(PacketType::ChatMessageBatch) ||
+                       type == static_cast<uint8_t>(PacketType::Compressed);
+            });
+        if (dropped > 0) {
+            counters.drop_events++;
+            counters.frames_dropped += dropped;
+        }
+        break;
+    }
+    case SlowConsumerPolicy::PauseReads:
+        if (!reads_paused_) {
+            reads_paused_ = true;
+            counters.read_pauses++;
+        }
+        break;
+    case SlowConsumerPolicy::Disconnect:
+        counters.disconnects++;
+        stop();
+        break;
+    }
+}
+
+void ChatSession::resume_reads() {
+    const BackpressureConfig& config = server_.config().backpressure;
+    if (!reads_paused_ || write_msgs_.above(config.low_watermark_bytes, config.low_watermark_frames)) {
+        return;
+    }
+    reads_paused_ = false;
+    // The client was not quiet, we were not listening
+    last_read_ = std::chrono::steady_clock::now();
+    if (frame_started_) {
+        frame_started_ = last_read_;
+    }
+    if (read_stalled_) {
+        read_stalled_ = false;
+        reads_resumed_.cancel();
     }
 }
 
 void ChatSession::stop() {
-    socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both);
-    socket_.close();
-}
-
-void ChatSession::do_read_header() {
-    auto self(shared_from_this());
-    boost::asio::async_read(socket_, boost::asio::buffer(&next_packet_size_, sizeof(uint32_t)),
-                            [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-                                if (!ec) {
-                                    if (next_packet_size_ > 1024 * 1024) {  // Limit packet size to 1MB
-                                        //dbgln("[SERVER] Received packet size too large: {}", next_packet_size_);
-                                        server_.leave(self);
-                                        return;
-                                    }
-                                    read_msg_.resize(next_packet_size_);
-                                    do_read_body();
-                                } else {
-                                    server_.leave(self);
-                                }
-                            });
-}
-
-void ChatSession::do_read_body() {
-    auto self(shared_from_this());
-    boost::asio::async_read(socket_, boost::asio::buffer(read_msg_),
-                            [this, self](boost::system::error_code ec, std::size_t length) {
-                                if (!ec) {
-                                    //dbgln("[SERVER] Received packet body of size: {}", length);
-                                    server_.handle_packet(self, read_msg_);
-                                    do_read_header();
-                                } else {
-                                    server_.leave(self);
-                                }
-                            });
-}
-
-void ChatSession::do_write() {
-    auto self(shared_from_this());
-    boost::asio::async_write(socket_,
-                             boost::asio::buffer(write_msgs_.front()),
-                             [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-                                 if (!ec) {
-                                     write_msgs_.pop_front();
-                                     if (!write_msgs_.empty()) {
-                                         do_write();
-                                     }
-                                 } else {
-                                     server_.leave(self);
-                                 }
-                             });
+    boost::asio::dispatch(socket_.get_executor(), [this, self = shared_from_this()] {
+        boost::system::error_code ec;
+        socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        socket_.close(ec);
+        deadline_timer_.cancel();
+        // Lets both loops see the socket is gone
+        reads_resumed_.cancel();
+        write_wanted_.cancel();
+        update_queue_metrics();
+    });
+}
+
+// Called on the strand. A closed session's queue is never sent, so it no
+// longer counts.
+void ChatSession::update_queue_metrics() {
+    size_t bytes = socket_.is_open() ? write_msgs_.bytes() : 0;
+    size_t frames = socket_.is_open() ? write_msgs_.frames() : 0;
+    ServerMetrics& metrics = server_.metrics();
+    metrics.write_queue_bytes.add(static_cast<int64_t>(bytes) - static_cast<int64_t>(reported_queue_bytes_));
+    metrics.write_queue_frames.add(static_cast<int64_t>(frames) - static_cast<int64_t>(reported_queue_frames_));
+    reported_queue_bytes_ = bytes;
+    reported_queue_frames_ = frames;
+}
+
+boost::asio::awaitable<void> ChatSession::read_loop(std::shared_ptr<ChatSession> self) {
+    using boost::asio::redirect_error;
+    using boost::asio::use_awaitable;
+    for (;;) {
+        boost::system::error_code ec;
+        size_t length = co_await socket_.async_read_some(read_buffer_.prepare(), redirect_error(use_awaitable, ec));
+        if (ec) {
+            server_.leave(self);
+            co_return;
+        }
+        server_.metrics().reads.add();
+        server_.metrics().bytes_received.add(length);
+        last_read_ = std::chrono::steady_clock::now();
+        read_buffer_.commit(length);
+        // Handle every complete frame this read brought in
+        size_t frames = 0;
+        DecodeResult result = read_buffer_.consume(
+            server_.config().packet_limits,
+            [this, &self, &frames](std::span<const uint8_t> frame) {
+                ++frames;
+                return server_.handle_packet(self, frame);
+            });
+        if (result != DecodeResult::Ok) {
+            logWarn("[SERVER] Rejected frame: {}", static_cast<int>(result));
+            server_.leave(self);
+            co_return;
+        }
+        // A new partial frame starts its own clock
+        if (read_buffer_.buffered() == 0) {
+            frame_started_.reset();
+        } else if (frames > 0 || !frame_started_) {
+            frame_started_ = last_read_;
+            const auto& timeouts = server_.config().timeouts;
+            if (timeouts.frame.count() > 0) {
+                arm_deadline(last_read_ + timeouts.frame);
+            }
+        }
+        if (reads_paused_) {
+            // Woken by resume_reads() once the client catches up, or by stop()
+            read_stalled_ = true;
+            co_await reads_resumed_.async_wait(redirect_error(use_awaitable, ec));
+        }
+    }
+}
+
+boost::asio::awaitable<void> ChatSession::write_loop(std::shared_ptr<ChatSession> self) {
+    using boost::asio::redirect_error;
+    using boost::asio::use_awaitable;
+    while (socket_.is_open()) {
+        boost::system::error_code ec;
+        if (write_msgs_.empty()) {
+            co_await write_wanted_.async_wait(redirect_error(use_awaitable, ec));
+            continue;
+        }
+        // Drain as much of the queue as the limits allow in one gathered write
+        write_msgs_.gather(server_.config().write_batch, write_buffers_);
+        size_t length = co_await boost::asio::async_write(socket_, write_buffers_, redirect_error(use_awaitable, ec));
+        if (ec) {
+            server_.leave(self);
+            co_return;
+        }
+        ServerMetrics& metrics = server_.metrics();
+        metrics.writes.add();
+        metrics.bytes_sent.add(length);
+        metrics.frames_sent.add(write_buffers_.size());
+        write_msgs_.complete();
+        update_queue_metrics();
+        resume_reads();
+        if (write_msgs_.empty() && closing_ && !send_shut_) {
+            begin_close();
+        }
+    }
 }
 
 void ChatSession::set_username(const std::string& username) {
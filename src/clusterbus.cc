@@ -0,0 +1,366 @@
+#include "clusterbus.h"
+#include "log.hh"
+#include "receivebuffer.hh"
+#include "writequeue.hh"
+
+#include <cstring>
+
+namespace {
+
+// Wait before accepting again after a failed accept
+constexpr std::chrono::milliseconds kAcceptBackoff{100};
+
+// The bytes ClusterForwardPacket would put in front of a frame of
+// `frame_size` bytes
+SharedFrame forwardHeader(RoomId room, ClusterFrameKind kind, size_t frame_size) {
+    constexpr size_t size =
+        sizeof(uint32_t) + sizeof(PacketType) + sizeof(RoomId) + sizeof(ClusterFrameKind) + sizeof(uint32_t);
+    PooledBytes header(size);
+    uint32_t body_size = static_cast<uint32_t>(size - sizeof(uint32_t) + frame_size);
+    std::memcpy(header.data(), &body_size, sizeof(uint32_t));
+    uint8_t* out = FieldCodec<PacketType>::write(header.data() + sizeof(uint32_t), PacketType::ClusterForward);
+    out = FieldCodec<RoomId>::write(out, room);
+    out = FieldCodec<ClusterFrameKind>::write(out, kind);
+    FieldCodec<uint32_t>::write(out, static_cast<uint32_t>(frame_size));
+    return std::allocate_shared<const PooledBytes>(PoolAllocator<PooledBytes>(), std::move(header));
+}
+
+// True if `frame` is exactly one frame of a known type, length prefix included
+bool isWholeFrame(std::string_view frame) {
+    if (frame.size() < kFrameHeaderSize) {
+        return false;
+    }
+    uint32_t size;
+    std::memcpy(&size, frame.data(), sizeof(uint32_t));
+    return size == frame.size() - sizeof(uint32_t) &&
+           checkFrameHeader(size, static_cast<uint8_t>(frame[sizeof(uint32_t)]), PacketLimits::unbounded()) ==
+               DecodeResult::Ok;
+}
+
+}
+
+// Our side of the link to one peer: dials it, says hello and writes what we
+// publish. Everything runs on the link's strand. A connection that fails is
+// replaced after reconnect_interval, its queue goes with it.
+class ClusterBus::PeerLink : public std::enable_shared_from_this<PeerLink> {
+public:
+    PeerLink(ClusterBus& bus, std::string host, std::string port)
+        : bus_(bus),
+        strand_(boost::asio::make_strand(bus.io_context_)),
+        resolver_(strand_),
+        timer_(strand_),
+        host_(std::move(host)),
+        port_(std::move(port)) {}
+
+    void start() {
+        boost::asio::dispatch(strand_, [this, self = shared_from_this()] { connect(); });
+    }
+
+    void publish(SharedFrame header, SharedFrame frame) {
+        boost::asio::dispatch(strand_, [this, self = shared_from_this(), header = std::move(header), frame = std::move(frame)]() mutable {
+            if (!connection_) {
+                return;
+            }
+            auto& queue = connection_->queue;
+            queue.push(std::move(header));
+            queue.push(std::move(frame));
+            if (queue.bytes() > bus_.config_.max_queued_bytes) {
+                bus_.overflows_.fetch_add(1, std::memory_order_relaxed);
+                logWarn("[CLUSTER] Peer {}:{} fell behind, dropping the link", host_, port_);
+                drop();
+                return;
+            }
+            if (!queue.writing()) {
+                do_write(connection_);
+            }
+        });
+    }
+
+    void stop() {
+        boost::asio::dispatch(strand_, [this, self = shared_from_this()] {
+            stopped_ = true;
+            timer_.cancel();
+            resolver_.cancel();
+            if (pending_) {
+                boost::system::error_code ignored;
+                pending_->socket.close(ignored);
+            }
+            if (connection_) {
+                drop();
+            }
+        });
+    }
+
+private:
+    // Handlers hold on to the connection they were started for, so its
+    // buffers outlive a close, and ignore it once it was replaced
+    struct Connection {
+        explicit Connection(const boost::asio::strand<boost::asio::io_context::executor_type>& strand) : socket(strand) {}
+
+        boost::asio::ip::tcp::socket socket;
+        FrameQueue queue;
+        std::vector<boost::asio::const_buffer> buffers;
+        uint8_t byte = 0;
+    };
+
+    void connect() {
+        if (stopped_) {
+            return;
+        }
+        pending_ = std::make_shared<Connection>(strand_);
+        resolver_.async_resolve(host_, port_, [this, self = shared_from_this()](boost::system::error_code ec, auto endpoints) {
+            if (ec || stopped_) {
+                pending_.reset();
+                retry();
+                return;
+            }
+            boost::asio::async_connect(pending_->socket, endpoints,
+                                       [this, self, connection = pending_](boost::system::error_code ec, const auto&) {
+                                           pending_.reset();
+                                           if (ec || stopped_) {
+                                               retry();
+                                               return;
+                                           }
+                                           connection->socket.set_option(boost::asio::ip::tcp::no_delay(true));
+                                           connection_ = connection;
+                                           bus_.connected_peers_.fetch_add(1, std::memory_order_relaxed);
+                                           logInfo("[CLUSTER] Linked to peer {}:{}", host_, port_);
+                                           connection->queue.push(Packet::prepareSharedPacket(ClusterHelloPacket(bus_.config_.node_id)));
+                                           do_write(connection);
+                                           watch(connection);
+                                       });
+        });
+    }
+
+    void retry() {
+        if (stopped_) {
+            return;
+        }
+        timer_.expires_after(bus_.config_.reconnect_interval);
+        timer_.async_wait([this, self = shared_from_this()](boost::system::error_code ec) {
+            if (!ec) {
+                connect();
+            }
+        });
+    }
+
+    void drop() {
+        boost::system::error_code ignored;
+        connection_->socket.close(ignored);
+        connection_.reset();
+        bus_.connected_peers_.fetch_sub(1, std::memory_order_relaxed);
+        retry();
+    }
+
+    void do_write(const std::shared_ptr<Connection>& connection) {
+        connection->queue.gather(write_limits_, connection->buffers);
+        boost::asio::async_write(connection->socket, connection->buffers,
+                                 [this, self = shared_from_this(), connection](boost::system::error_code ec, std::size_t) {
+                                     if (connection != connection_) {
+                                         return;
+                                     }
+                                     if (ec) {
+                                         logWarn("[CLUSTER] Lost peer {}:{}: {}", host_, port_, ec.message());
+                                         drop();
+                                         return;
+                                     }
+                                     connection->queue.complete();
+                                     if (!connection->queue.empty()) {
+                                         do_write(connection);
+                                     }
+                                 });
+    }
+
+    // The peer never writes on this link, so a read only completes once it
+    // has gone away
+    void watch(const std::shared_ptr<Connection>& connection) {
+        connection->socket.async_read_some(boost::asio::buffer(&connection->byte, 1),
+                                           [this, self = shared_from_this(), connection](boost::system::error_code, std::size_t) {
+                                               if (connection == connection_) {
+                                                   logWarn("[CLUSTER] Peer {}:{} closed the link", host_, port_);
+                                                   drop();
+                                               }
+                                           });
+    }
+
+    ClusterBus& bus_;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    boost::asio::ip::tcp::resolver resolver_;
+    boost::asio::steady_timer timer_;
+    std::string host_;
+    std::string port_;
+    WriteBatchLimits write_limits_;
+    std::shared_ptr<Connection> pending_;
+    std::shared_ptr<Connection> connection_;
+    bool stopped_ = false;
+};
+
+// A link a peer dialled: its hello, then the frames it forwards
+class ClusterBus::InboundLink : public std::enable_shared_from_this<InboundLink> {
+public:
+    InboundLink(ClusterBus& bus, boost::asio::ip::tcp::socket socket)
+        : bus_(bus), socket_(std::move(socket)) {}
+
+    void start() { do_read(); }
+
+    void stop() {
+        boost::asio::dispatch(socket_.get_executor(), [this, self = shared_from_this()] {
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+        });
+    }
+
+private:
+    void do_read() {
+        socket_.async_read_some(read_buffer_.prepare(), [this, self = shared_from_this()](boost::system::error_code ec, std::size_t length) {
+            if (ec) {
+                if (node_id_) {
+                    logInfo("[CLUSTER] Node {} went away", *node_id_);
+                }
+                return;
+            }
+            read_buffer_.commit(length);
+            static const PacketLimits limits = PacketLimits::forCluster();
+            DecodeResult result = read_buffer_.consume(limits, [this](std::span<const uint8_t> frame) {
+                return handle_frame(frame);
+            });
+            if (result != DecodeResult::Ok) {
+                logWarn("[CLUSTER] Rejected frame from a peer: {}", static_cast<int>(result));
+                boost::system::error_code ignored;
+                socket_.close(ignored);
+                return;
+            }
+            do_read();
+        });
+    }
+
+    DecodeResult handle_frame(std::span<const uint8_t> frame) {
+        DecodeResult handled = DecodeResult::Ok;
+        DecodeResult result = dispatchPacket(frame, [this, &handled](const auto& packet) {
+            using View = std::decay_t<decltype(packet)>;
+            if constexpr (std::is_same_v<View, ClusterHelloPacketView>) {
+                handled = on_hello(packet);
+            } else if constexpr (std::is_same_v<View, ClusterForwardPacketView>) {
+                handled = on_forward(packet);
+            } else {
+                handled = DecodeResult::UnknownType;
+            }
+        });
+        return result == DecodeResult::Ok ? handled : result;
+    }
+
+    DecodeResult on_hello(const ClusterHelloPacketView& hello) {
+        // Our own id means the node is configured as its own peer
+        if (node_id_ || hello.getNodeId() == bus_.config_.node_id) {
+            return DecodeResult::Corrupt;
+        }
+        node_id_ = hello.getNodeId();
+        logInfo("[CLUSTER] Node {} linked to us", *node_id_);
+        return DecodeResult::Ok;
+    }
+
+    DecodeResult on_forward(const ClusterForwardPacketView& forward) {
+        auto frame = forward.getFrame();
+        if (!node_id_ || !isWholeFrame(frame)) {
+            return DecodeResult::Corrupt;
+        }
+        // The receive buffer is reused, the fan-out needs bytes of its own
+        auto bytes = reinterpret_cast<const uint8_t*>(frame.data());
+        bus_.handler_(forward.getRoom(), forward.getKind(),
+                      std::allocate_shared<const PooledBytes>(PoolAllocator<PooledBytes>(), bytes, bytes + frame.size()));
+        return DecodeResult::Ok;
+    }
+
+    ClusterBus& bus_;
+    boost::asio::ip::tcp::socket socket_;
+    ReceiveBuffer read_buffer_{64 * 1024};
+    std::optional<uint32_t> node_id_;
+};
+
+ClusterBus::ClusterBus(boost::asio::io_context& io_context, const ClusterConfig& config, FrameHandler handler)
+    : io_context_(io_context),
+    config_(config),
+    handler_(std::move(handler)),
+    accept_strand_(boost::asio::make_strand(io_context)),
+    accept_timer_(accept_strand_) {
+    if (config_.port != 0) {
+        acceptor_.emplace(accept_strand_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), config_.port));
+        do_accept();
+        logInfo("[CLUSTER] Node {} listening for peers on port {}", config_.node_id, port());
+    }
+    for (const auto& peer : config_.peers) {
+        auto colon = peer.rfind(':');
+        if (colon == std::string::npos) {
+            logWarn("[CLUSTER] Ignoring peer {}, expected host:port", peer);
+            continue;
+        }
+        peers_.push_back(std::make_shared<PeerLink>(*this, peer.substr(0, colon), peer.substr(colon + 1)));
+        peers_.back()->start();
+    }
+}
+
+void ClusterBus::publish(RoomId room, ClusterFrameKind kind, const SharedFrame& frame) {
+    if (peers_.empty()) {
+        return;
+    }
+    // One header for all peers, the frame itself is shared with the local fan-out
+    SharedFrame header = forwardHeader(room, kind, frame->size());
+    for (const auto& peer : peers_) {
+        peer->publish(header, frame);
+    }
+}
+
+void ClusterBus::stop() {
+    stopped_ = true;
+    boost::asio::dispatch(accept_strand_, [this] {
+        if (acceptor_) {
+            boost::system::error_code ignored;
+            acceptor_->close(ignored);
+        }
+        accept_timer_.cancel();
+    });
+    for (const auto& peer : peers_) {
+        peer->stop();
+    }
+    std::lock_guard<std::mutex> lock(inbound_mutex_);
+    for (const auto& weak : inbound_) {
+        if (auto link = weak.lock()) {
+            link->stop();
+        }
+    }
+    inbound_.clear();
+}
+
+unsigned short ClusterBus::port() const {
+    return acceptor_ ? acceptor_->local_endpoint().port() : 0;
+}
+
+void ClusterBus::do_accept() {
+    acceptor_->async_accept(
+        boost::asio::make_strand(io_context_),
+        [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+            if (stopped_ || ec == boost::asio::error::operation_aborted) {
+                return;
+            }
+            if (ec) {
+                // Out of descriptors, say. Until it passes, peers that dial
+                // us keep retrying their links.
+                logWarn("[CLUSTER] Node {} failed to accept a peer: {}", config_.node_id, ec.message());
+                accept_timer_.expires_after(kAcceptBackoff);
+                accept_timer_.async_wait([this](boost::system::error_code ec) {
+                    if (!ec && !stopped_) {
+                        do_accept();
+                    }
+                });
+                return;
+            }
+            auto link = std::make_shared<InboundLink>(*this, std::move(socket));
+            {
+                std::lock_guard<std::mutex> lock(inbound_mutex_);
+                std::erase_if(inbound_, [](const auto& weak) { return weak.expired(); });
+                inbound_.push_back(link);
+            }
+            link->start();
+            do_accept();
+        });
+}
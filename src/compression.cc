@@ -0,0 +1,116 @@
+#include "compression.hh"
+
+#include <iterator>
+#include <string>
+#include <zlib.h>
+
+namespace {
+
+// Version 1 of the shared dictionary. Deflate finds its matches in the
+// preceding 32 KiB, the dictionary stands in for the text a short message
+// never had, so even a single chat line finds words and frame headers to
+// refer back to. The most common strings come last, where the distances
+// to them are shortest. Changing a single byte breaks every peer that
+// negotiated kCapCompressedFrames.
+constexpr char kDictionaryText[] =
+    "http://https://www.youtube.com/watch?v=.com/.org/.png.jpg.gif.pdf"
+    "pull request merge branch commit deploy build release issue ticket review "
+    "meeting tomorrow tonight morning afternoon weekend yesterday today minutes "
+    "please thanks thank you sorry sure cool nice great awesome good morning "
+    "lol haha :) :D ;) :( :P <3 xD omg brb afk btw imo tbh idk np ty gg "
+    "could you would you can you do you know what do you think let me know "
+    "i think i don't know what's up how are you are you there "
+    "I'm not sure that's I'll we'll you're it's don't can't won't didn't "
+    "about after again all also and any are because been before but "
+    "can come could day did does done even every first for from get "
+    "going good got had has have here how into just know like look "
+    "make more much need new now only other our out over people really "
+    "right said see should some something still that the their them "
+    "then there these they thing think this time too up very want was "
+    "way well were what when where which who why will with work would "
+    "yeah yes you your ";
+
+// Frame headers of the packets that get compressed: a chat line's sender
+// string header and the server's own announcements
+constexpr unsigned char kDictionaryFrames[] = {
+    0x02, 0x06, 0x00, 0x00, 0x00, 'S', 'y', 's', 't', 'e', 'm',
+};
+
+constexpr char kDictionaryTail[] =
+    " has left the room. has joined the room. has left the chat. has joined the chat.";
+
+std::span<const Bytef> dictionary() {
+    static const std::string bytes = std::string(kDictionaryText) +
+        std::string(std::begin(kDictionaryFrames), std::end(kDictionaryFrames)) + kDictionaryTail;
+    return {reinterpret_cast<const Bytef*>(bytes.data()), bytes.size()};
+}
+
+// Setting up a zlib stream allocates a few hundred KiB, so each thread
+// keeps one of each and resets it between frames
+class Deflater {
+public:
+    Deflater() {
+        deflateInit2(&stream_, level_, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    }
+    ~Deflater() { deflateEnd(&stream_); }
+
+    size_t deflate(std::span<const uint8_t> raw, uint8_t* out, size_t capacity, int level) {
+        deflateReset(&stream_);
+        if (level != level_) {
+            deflateParams(&stream_, level, Z_DEFAULT_STRATEGY);
+            level_ = level;
+        }
+        auto dict = dictionary();
+        deflateSetDictionary(&stream_, dict.data(), static_cast<uInt>(dict.size()));
+        stream_.next_in = const_cast<Bytef*>(raw.data());
+        stream_.avail_in = static_cast<uInt>(raw.size());
+        stream_.next_out = out;
+        stream_.avail_out = static_cast<uInt>(capacity);
+        // Z_OK instead of Z_STREAM_END means the output ran out of room
+        if (::deflate(&stream_, Z_FINISH) != Z_STREAM_END) {
+            return 0;
+        }
+        return capacity - stream_.avail_out;
+    }
+
+private:
+    z_stream stream_{};
+    int level_ = Z_DEFAULT_COMPRESSION;
+};
+
+class Inflater {
+public:
+    Inflater() { inflateInit2(&stream_, -MAX_WBITS); }
+    ~Inflater() { inflateEnd(&stream_); }
+
+    bool inflate(std::span<const uint8_t> data, uint8_t* out, size_t size) {
+        inflateReset(&stream_);
+        auto dict = dictionary();
+        inflateSetDictionary(&stream_, dict.data(), static_cast<uInt>(dict.size()));
+        stream_.next_in = const_cast<Bytef*>(data.data());
+        stream_.avail_in = static_cast<uInt>(data.size());
+        stream_.next_out = out;
+        stream_.avail_out = static_cast<uInt>(size);
+        // Output beyond `size` ends in Z_BUF_ERROR, a bomb fills the buffer and stops
+        return ::inflate(&stream_, Z_FINISH) == Z_STREAM_END && stream_.avail_out == 0 && stream_.avail_in == 0;
+    }
+
+private:
+    z_stream stream_{};
+};
+
+}
+
+namespace compression_detail {
+
+size_t deflate(std::span<const uint8_t> raw, uint8_t* out, size_t capacity, int level) {
+    thread_local Deflater deflater;
+    return deflater.deflate(raw, out, capacity, level);
+}
+
+bool inflate(std::span<const uint8_t> data, uint8_t* out, size_t size) {
+    thread_local Inflater inflater;
+    return inflater.inflate(data, out, size);
+}
+
+}
@@ -0,0 +1,89 @@
+#include "credentialhasher.hh"
+
+#include <algorithm>
+#include <crypt.h>
+#include <cstring>
+#include <memory>
+
+namespace {
+
+// Compares every byte, so timing does not tell how much of a hash matched
+bool constantTimeEquals(const char* a, const std::string& b) {
+    size_t length = std::strlen(a);
+    unsigned char diff = length != b.size();
+    for (size_t i = 0; i < std::min(length, b.size()); ++i) {
+        diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+    }
+    return diff == 0;
+}
+
+}
+
+CredentialHasher::CredentialHasher(CredentialHasherConfig config)
+    : config_(config),
+    pool_(std::max<size_t>(1, config.threads)) {}
+
+CredentialHasher::~CredentialHasher() {
+    pool_.join();
+}
+
+bool CredentialHasher::reserve() {
+    if (++pending_ > config_.max_pending) {
+        --pending_;
+        return false;
+    }
+    return true;
+}
+
+bool CredentialHasher::hash(std::string password, HashCallback callback) {
+    if (!reserve()) {
+        return false;
+    }
+    boost::asio::post(pool_, [this, password = std::move(password), callback = std::move(callback)] {
+        std::string hash;
+        bool success = hashNow(password, config_.cost, hash);
+        --pending_;
+        callback(success, std::move(hash));
+    });
+    return true;
+}
+
+bool CredentialHasher::verify(std::string password, std::string hash, VerifyCallback callback) {
+    if (!reserve()) {
+        return false;
+    }
+    boost::asio::post(pool_, [this, password = std::move(password), hash = std::move(hash), callback = std::move(callback)] {
+        bool match = verifyNow(password, hash);
+        --pending_;
+        callback(match);
+    });
+    return true;
+}
+
+bool CredentialHasher::hashNow(const std::string& password, unsigned cost, std::string& hash) {
+    // crypt() would silently cut the password short
+    if (password.find('\0') != std::string::npos) {
+        return false;
+    }
+    char setting[CRYPT_GENSALT_OUTPUT_SIZE];
+    // A null random source makes libxcrypt draw the salt from the OS
+    if (!crypt_gensalt_rn("$2b$", cost, nullptr, 0, setting, sizeof(setting))) {
+        return false;
+    }
+    auto data = std::make_unique<crypt_data>();
+    const char* result = crypt_rn(password.c_str(), setting, data.get(), sizeof(crypt_data));
+    if (!result || result[0] == '*') {
+        return false;
+    }
+    hash = result;
+    return true;
+}
+
+bool CredentialHasher::verifyNow(const std::string& password, const std::string& hash) {
+    if (password.find('\0') != std::string::npos) {
+        return false;
+    }
+    auto data = std::make_unique<crypt_data>();
+    const char* result = crypt_rn(password.c_str(), hash.c_str(), data.get(), sizeof(crypt_data));
+    return result && result[0] != '*' && constantTimeEquals(result, hash);
+}
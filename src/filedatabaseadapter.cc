@@ -0,0 +1,417 @@
+#include "filedatabaseadapter.hh"
+#include "packet.hh"
+#include "format.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+
+// Each log record is a kind byte, the payload size and the payload. Strings
+// use the same length-prefixed encoding as the wire protocol.
+enum class RecordKind : uint8_t {
+    User = 'U',
+    Message = 'M',     // lobby message
+    RoomMessage = 'R'  // message with the room appended
+};
+
+constexpr size_t kRecordHeaderSize = sizeof(RecordKind) + sizeof(uint32_t);
+
+std::vector<uint8_t> makeRecord(RecordKind kind, std::string_view first, std::string_view second,
+                                const int64_t* timestamp = nullptr, const uint32_t* room = nullptr) {
+    uint32_t payload = static_cast<uint32_t>(FieldCodec<std::string>::size(first) +
+                                             FieldCodec<std::string>::size(second) +
+                                             (timestamp ? sizeof(int64_t) : 0) +
+                                             (room ? sizeof(uint32_t) : 0));
+    std::vector<uint8_t> record(kRecordHeaderSize + payload);
+    uint8_t* out = FieldCodec<RecordKind>::write(record.data(), kind);
+    out = FieldCodec<uint32_t>::write(out, payload);
+    out = FieldCodec<std::string>::write(out, first);
+    out = FieldCodec<std::string>::write(out, second);
+    if (timestamp) {
+        out = FieldCodec<int64_t>::write(out, *timestamp);
+    }
+    if (room) {
+        FieldCodec<uint32_t>::write(out, *room);
+    }
+    return record;
+}
+
+int64_t toTicks(std::chrono::system_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+std::chrono::system_clock::time_point fromTicks(int64_t ticks) {
+    return std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(ticks)));
+}
+
+// Message records in a block of the index
+constexpr size_t kBlockMessages = 1024;
+// Read at a time while replaying the log
+constexpr size_t kLoadChunk = 1 << 20;
+
+struct Record {
+    RecordKind kind;
+    std::string_view first;
+    std::string_view second;
+    int64_t ticks = 0;
+    uint32_t room = 0;
+};
+
+// Size of the record at the start of `data`, header included, 0 if it is
+// not all there
+size_t recordSize(std::span<const uint8_t> data) {
+    if (data.size() < kRecordHeaderSize) {
+        return 0;
+    }
+    PacketReader header(data);
+    RecordKind kind;
+    uint32_t payload;
+    header.read(kind);
+    header.read(payload);
+    return data.size() - kRecordHeaderSize < payload ? 0 : kRecordHeaderSize + payload;
+}
+
+// A complete record as recordSize() measured it, null if it is malformed
+std::optional<Record> parseRecord(std::span<const uint8_t> data) {
+    Record record;
+    PacketReader header(data);
+    uint32_t payload;
+    header.read(record.kind);
+    header.read(payload);
+    PacketReader reader(data.subspan(kRecordHeaderSize));
+    if (!reader.readString(record.first) || !reader.readString(record.second)) {
+        return std::nullopt;
+    }
+    switch (record.kind) {
+    case RecordKind::User:
+        return record;
+    case RecordKind::Message:
+        return reader.read(record.ticks) ? std::optional(record) : std::nullopt;
+    case RecordKind::RoomMessage:
+        return reader.read(record.ticks) && reader.read(record.room) ? std::optional(record) : std::nullopt;
+    }
+    return std::nullopt;
+}
+
+// Lobby messages keep the original record layout
+std::vector<uint8_t> makeMessageRecord(const ChatMessage& message) {
+    int64_t ticks = toTicks(message.timestamp);
+    if (message.room == 0) {
+        return makeRecord(RecordKind::Message, message.sender, message.content, &ticks);
+    }
+    return makeRecord(RecordKind::RoomMessage, message.sender, message.content, &ticks, &message.room);
+}
+
+ChatMessage toMessage(const Record& record) {
+    ChatMessage message(std::string(record.first), std::string(record.second), fromTicks(record.ticks));
+    message.room = record.room;
+    return message;
+}
+
+}
+
+FileDatabaseAdapter::FileDatabaseAdapter(boost::asio::io_context& io_context,
+                                         const std::filesystem::path& path,
+                                         size_t worker_threads,
+                                         bool sync_writes,
+                                         CredentialHasherConfig hasher,
+                                         size_t history_capacity)
+    : io_context_(io_context),
+    path_(path),
+    sync_writes_(sync_writes),
+    pool_(std::max<size_t>(1, worker_threads)),
+    write_strand_(boost::asio::make_strand(pool_.get_executor())),
+    hasher_(hasher),
+    recent_(history_capacity) {
+    load();
+    log_fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd_ < 0) {
+        throw std::runtime_error(format("Cannot open database log {}", path_.string()));
+    }
+}
+
+FileDatabaseAdapter::~FileDatabaseAdapter() {
+    // Let queued writes reach the log before it is closed. Hashes go first,
+    // a finished one still queues its write.
+    hasher_.join();
+    pool_.join();
+    if (log_fd_ >= 0) {
+        ::close(log_fd_);
+    }
+}
+
+void FileDatabaseAdapter::load() {
+    std::ifstream in(path_, std::ios::binary);
+    if (!in) {
+        return;  // First start, nothing to replay
+    }
+
+    // Streamed a chunk at a time, the records cut off by the end of a chunk
+    // are carried over to the next
+    std::vector<uint8_t> chunk;
+    uint64_t chunk_offset = 0;
+    size_t parsed = 0;
+    while (true) {
+        chunk.erase(chunk.begin(), chunk.begin() + parsed);
+        chunk_offset += parsed;
+        parsed = 0;
+        size_t kept = chunk.size();
+        chunk.resize(kept + kLoadChunk);
+        in.read(reinterpret_cast<char*>(chunk.data() + kept), kLoadChunk);
+        chunk.resize(kept + static_cast<size_t>(in.gcount()));
+        if (chunk.size() == kept) {
+            break;
+        }
+        std::span<const uint8_t> data(chunk);
+        while (size_t size = recordSize(data.subspan(parsed))) {
+            auto record = parseRecord(data.subspan(parsed, size));
+            if (!record) {
+                // Its length is intact, so the records after it still are
+                logWarn("[DB] Skipping malformed record of {} bytes at offset {}", size, chunk_offset + parsed);
+            } else if (record->kind == RecordKind::User) {
+                users_[std::string(record->first)] = std::string(record->second);
+            } else {
+                insert(toMessage(*record), chunk_offset + parsed, size);
+            }
+            parsed += size;
+        }
+    }
+    log_size_ = chunk_offset + parsed;
+
+    // A crash mid-append leaves a partial record at the tail, the only one
+    // that cannot be measured. Cut it off so new records are not appended
+    // after garbage.
+    auto file_size = std::filesystem::file_size(path_);
+    if (log_size_ != file_size) {
+        logWarn("[DB] Truncating {} bytes of incomplete log tail", file_size - log_size_);
+        in.close();
+        std::filesystem::resize_file(path_, log_size_);
+    }
+}
+
+// A record only counts once all of it is written, and synced if that is
+// asked for. Anything less is cut off again, so the next record does not
+// follow a partial one and a record reported as failed is not found on the
+// next start.
+bool FileDatabaseAdapter::append(const std::vector<uint8_t>& record) {
+    size_t written = 0;
+    while (written < record.size()) {
+        ssize_t result = ::write(log_fd_, record.data() + written, record.size() - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += static_cast<size_t>(result);
+    }
+    if (written == record.size() && (!sync_writes_ || ::fdatasync(log_fd_) == 0)) {
+        log_size_ += record.size();
+        return true;
+    }
+    // O_APPEND puts the next write at the new end
+    if (::ftruncate(log_fd_, static_cast<off_t>(log_size_)) != 0) {
+        logError("[DB] Cannot roll {} back to {} bytes after a failed append", path_.string(), log_size_);
+    }
+    return false;
+}
+
+void FileDatabaseAdapter::authenticateUser(const std::string& username,
+                                           const std::string& password,
+                                           AuthCallback callback) {
+    std::string hash;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto it = users_.find(username);
+        if (it == users_.end()) {
+            postCallback(io_context_, callback, AuthResult::Rejected);
+            return;
+        }
+        hash = it->second;
+    }
+    bool queued = hasher_.verify(password, std::move(hash), [this, callback](bool match) {
+        postCallback(io_context_, callback, match ? AuthResult::Ok : AuthResult::Rejected);
+    });
+    if (!queued) {
+        postCallback(io_context_, callback, AuthResult::Busy);
+    }
+}
+
+void FileDatabaseAdapter::createUser(const std::string& username,
+                                     const std::string& password,
+                                     AuthCallback callback) {
+    {
+        // Don't spend a hash on a name that is already taken
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        if (users_.count(username)) {
+            postCallback(io_context_, callback, AuthResult::Rejected);
+            return;
+        }
+    }
+    bool queued = hasher_.hash(password, [this, username, callback](bool hashed, std::string hash) {
+        if (!hashed) {
+            postCallback(io_context_, callback, AuthResult::Rejected);
+            return;
+        }
+        boost::asio::post(write_strand_, [this, username, hash = std::move(hash), callback] {
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex_);
+                if (users_.count(username)) {
+                    // Created by a request that was hashed at the same time
+                    postCallback(io_context_, callback, AuthResult::Rejected);
+                    return;
+                }
+            }
+            // Only the write strand mutates, so nobody can add this user meanwhile
+            bool success = append(makeRecord(RecordKind::User, username, hash));
+            if (success) {
+                std::unique_lock<std::shared_mutex> lock(mutex_);
+                users_[username] = hash;
+            }
+            postCallback(io_context_, callback, success ? AuthResult::Ok : AuthResult::Rejected);
+        });
+    });
+    if (!queued) {
+        postCallback(io_context_, callback, AuthResult::Busy);
+    }
+}
+
+void FileDatabaseAdapter::storeMessage(const ChatMessage& message,
+                                       StoreMessageCallback callback) {
+    boost::asio::post(write_strand_, [this, message, callback = std::move(callback)] {
+        uint64_t offset = log_size_;
+        auto record = makeMessageRecord(message);
+        bool success = append(record);
+        if (success) {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            insert(message, offset, record.size());
+        }
+        postCallback(io_context_, callback, success);
+    });
+}
+
+void FileDatabaseAdapter::storeMessages(std::vector<ChatMessage> messages,
+                                        StoreMessageCallback callback) {
+    boost::asio::post(write_strand_, [this, messages = std::move(messages), callback = std::move(callback)]() mutable {
+        uint64_t offset = log_size_;
+        std::vector<uint8_t> records;
+        std::vector<size_t> sizes;
+        sizes.reserve(messages.size());
+        for (const auto& message : messages) {
+            auto record = makeMessageRecord(message);
+            records.insert(records.end(), record.begin(), record.end());
+            sizes.push_back(record.size());
+        }
+        bool success = append(records);
+        if (success) {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            for (size_t i = 0; i < messages.size(); ++i) {
+                insert(std::move(messages[i]), offset, sizes[i]);
+                offset += sizes[i];
+            }
+        }
+        postCallback(io_context_, callback, success);
+    });
+}
+
+// Called with mutex_ held exclusively, or while loading
+void FileDatabaseAdapter::insert(ChatMessage message, uint64_t offset, size_t size) {
+    int64_t ticks = toTicks(message.timestamp);
+    if (blocks_.empty() || blocks_.back().messages == kBlockMessages) {
+        blocks_.push_back(LogBlock{offset, offset, ticks, ticks});
+    }
+    LogBlock& block = blocks_.back();
+    block.end = offset + size;
+    block.first_ticks = std::min(block.first_ticks, ticks);
+    block.last_ticks = std::max(block.last_ticks, ticks);
+    ++block.messages;
+
+    // A full ring overwrites its oldest message
+    if (recent_.size() == recent_.capacity()) {
+        evicted_until_ = std::max(evicted_until_, recent_[0].timestamp);
+    }
+    recent_.push(std::move(message));
+    std::lock_guard<std::mutex> lock(recent_mutex_);
+    recent_snapshot_.reset();
+}
+
+void FileDatabaseAdapter::getRecentMessages(size_t limit,
+                                            GetMessagesCallback callback) {
+    boost::asio::post(pool_, [this, limit, callback = std::move(callback)] {
+        MessageSnapshot recent;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            std::lock_guard<std::mutex> recent_lock(recent_mutex_);
+            // Every login asks for the same history, share it until the next store
+            if (!recent_snapshot_ || recent_snapshot_limit_ != limit) {
+                recent_snapshot_ = recent_.recent(limit);
+                recent_snapshot_limit_ = limit;
+            }
+            recent = recent_snapshot_;
+        }
+        postCallback(io_context_, callback, recent);
+    });
+}
+
+void FileDatabaseAdapter::getMessagesByTimeRange(std::chrono::system_clock::time_point start,
+                                                 std::chrono::system_clock::time_point end,
+                                                 GetMessagesCallback callback) {
+    boost::asio::post(pool_, [this, start, end, callback = std::move(callback)] {
+        MessageSnapshot filtered;
+        std::vector<LogBlock> blocks;
+        int64_t start_ticks = toTicks(start);
+        int64_t end_ticks = toTicks(end);
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            if (start > evicted_until_) {
+                filtered = recent_.range(start, end);
+            } else {
+                for (const auto& block : blocks_) {
+                    if (block.first_ticks <= end_ticks && block.last_ticks >= start_ticks) {
+                        blocks.push_back(block);
+                    }
+                }
+            }
+        }
+        if (!filtered) {
+            filtered = readRange(blocks, start_ticks, end_ticks);
+        }
+        postCallback(io_context_, callback, filtered);
+    });
+}
+
+MessageSnapshot FileDatabaseAdapter::readRange(const std::vector<LogBlock>& blocks, int64_t start, int64_t end) const {
+    auto messages = std::make_shared<std::vector<ChatMessage>>();
+    std::ifstream in(path_, std::ios::binary);
+    std::vector<uint8_t> data;
+    for (const auto& block : blocks) {
+        // Appended and flushed before the block was extended over it
+        data.resize(block.end - block.offset);
+        in.seekg(static_cast<std::streamoff>(block.offset));
+        in.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+        if (static_cast<size_t>(in.gcount()) != data.size()) {
+            logWarn("[DB] Log is shorter than its index, at {}", block.offset);
+            break;
+        }
+        std::span<const uint8_t> rest(data);
+        while (size_t size = recordSize(rest)) {
+            auto record = parseRecord(rest.first(size));
+            if (record && record->kind != RecordKind::User && record->ticks >= start && record->ticks <= end) {
+                messages->push_back(toMessage(*record));
+            }
+            rest = rest.subspan(size);
+        }
+    }
+    // Stores from several threads may have crossed on their way to the log
+    std::stable_sort(messages->begin(), messages->end(), [](const ChatMessage& a, const ChatMessage& b) {
+        return a.timestamp < b.timestamp;
+    });
+    return messages;
+}
@@ -0,0 +1,136 @@
+#include "groupcommitdatabaseadapter.hh"
+
+GroupCommitDatabaseAdapter::GroupCommitDatabaseAdapter(boost::asio::io_context& io_context,
+                                                       std::shared_ptr<DatabaseAdapter> inner,
+                                                       GroupCommitConfig config)
+    : inner_(std::move(inner)),
+    config_(config),
+    timer_(io_context) {
+    pending_.messages.reserve(config_.max_batch);
+    pending_.callbacks.reserve(config_.max_batch);
+}
+
+GroupCommitDatabaseAdapter::~GroupCommitDatabaseAdapter() {
+    // Nothing accepted may be lost, commit the tail directly
+    flush();
+}
+
+void GroupCommitDatabaseAdapter::authenticateUser(const std::string& username,
+                                                  const std::string& password,
+                                                  AuthCallback callback) {
+    inner_->authenticateUser(username, password, std::move(callback));
+}
+
+void GroupCommitDatabaseAdapter::createUser(const std::string& username,
+                                            const std::string& password,
+                                            AuthCallback callback) {
+    inner_->createUser(username, password, std::move(callback));
+}
+
+void GroupCommitDatabaseAdapter::storeMessage(const ChatMessage& message,
+                                              StoreMessageCallback callback) {
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.messages.push_back(message);
+        pending_.callbacks.push_back(std::move(callback));
+
+        if (pending_.messages.size() >= config_.max_batch) {
+            take_batch();
+            full = true;
+        } else if (pending_.messages.size() == 1) {
+            // First message of a new batch starts the clock
+            timer_.expires_after(config_.max_delay);
+            timer_.async_wait([weak_self = weak_from_this(), generation = generation_](boost::system::error_code ec) {
+                auto self = weak_self.lock();
+                if (ec || !self) {
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(self->mutex_);
+                    if (generation != self->generation_) {
+                        return;
+                    }
+                    self->take_batch();
+                }
+                self->commit_ready();
+            });
+        }
+    }
+    if (full) {
+        commit_ready();
+    }
+}
+
+void GroupCommitDatabaseAdapter::storeMessages(std::vector<ChatMessage> messages,
+                                               StoreMessageCallback callback) {
+    // Already a batch, keep it in order behind whatever is pending
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        take_batch();
+        Batch batch;
+        batch.messages = std::move(messages);
+        batch.callbacks.push_back(std::move(callback));
+        ready_.push_back(std::move(batch));
+    }
+    commit_ready();
+}
+
+void GroupCommitDatabaseAdapter::getRecentMessages(size_t limit,
+                                                   GetMessagesCallback callback) {
+    inner_->getRecentMessages(limit, std::move(callback));
+}
+
+void GroupCommitDatabaseAdapter::getMessagesByTimeRange(std::chrono::system_clock::time_point start,
+                                                        std::chrono::system_clock::time_point end,
+                                                        GetMessagesCallback callback) {
+    inner_->getMessagesByTimeRange(start, end, std::move(callback));
+}
+
+void GroupCommitDatabaseAdapter::flush() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        take_batch();
+    }
+    commit_ready();
+}
+
+// Called with mutex_ held, queues what is pending for commit_ready()
+void GroupCommitDatabaseAdapter::take_batch() {
+    ++generation_;
+    timer_.cancel();
+    if (pending_.messages.empty()) {
+        return;
+    }
+    ready_.push_back(std::move(pending_));
+    pending_ = Batch();
+    pending_.messages.reserve(config_.max_batch);
+    pending_.callbacks.reserve(config_.max_batch);
+}
+
+// A commit running on another thread, or further up this one from a
+// callback, hands over what was queued behind it before it returns
+void GroupCommitDatabaseAdapter::commit_ready() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (committing_) {
+        return;
+    }
+    committing_ = true;
+    while (!ready_.empty()) {
+        Batch batch = std::move(ready_.front());
+        ready_.pop_front();
+        lock.unlock();
+        commit(std::move(batch));
+        lock.lock();
+    }
+    committing_ = false;
+}
+
+void GroupCommitDatabaseAdapter::commit(Batch batch) {
+    inner_->storeMessages(std::move(batch.messages),
+                          [callbacks = std::move(batch.callbacks)](bool success) {
+                              for (const auto& callback : callbacks) {
+                                  callback(success);
+                              }
+                          });
+}
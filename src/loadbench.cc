@@ -0,0 +1,530 @@
+// Load generator and latency benchmark. Opens many connections on a handful
+// of io threads, drives a fixed total message rate through them and measures
+// end-to-end latency from the send timestamp embedded in every message.
+//
+// Without --host it benchmarks an in-process server. The result is a single
+// JSON object on stdout, progress goes to stderr.
+//
+//   chat-loadbench --clients 2000 --rooms 100 --rate 5000 --duration 30
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/asio.hpp>
+
+#include "chat_example/chatserver.h"
+#include "chat_example/compression.hh"
+#include "chat_example/format.hh"
+#include "chat_example/log.hh"
+#include "chat_example/packet.hh"
+#include "chat_example/receivebuffer.hh"
+#include "chat_example/writequeue.hh"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+    std::string host;  // empty to run the server in-process
+    unsigned short port = 12400;
+    size_t clients = 1000;
+    // Clients are spread evenly over this many rooms, 0 puts everyone in the lobby
+    size_t rooms = 0;
+    // Messages per second, summed over all clients
+    double rate = 1000;
+    size_t message_size = 64;
+    double duration = 10;
+    double warmup = 2;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned server_threads = std::max(1u, std::thread::hardware_concurrency());
+    // pid of an external server, to report its RSS
+    long server_pid = 0;
+    // Offer kCapCompressedFrames at login
+    bool compression = false;
+    // Tick of the embedded server's ChatMessageBatch, 0 turns batching off
+    unsigned batch_interval_us = 0;
+    // Embedded servers, meshed into a cluster when more than one. Node i
+    // takes chat connections on port + i and peers on port + nodes + i, and
+    // the clients are spread over the nodes in turn.
+    size_t nodes = 1;
+    // SocketTuning of the embedded servers, the buffer size for both
+    // directions
+    bool no_delay = true;
+    int socket_buffer = 0;
+    int notsent_lowat = 0;
+};
+
+[[noreturn]] void usage() {
+    std::cerr << "usage: chat-loadbench [--host H] [--port P] [--clients N] [--rooms R] [--rate MSGS_PER_SEC]\n"
+                 "                      [--message-size BYTES] [--duration SECS] [--warmup SECS]\n"
+                 "                      [--threads T] [--server-threads T] [--server-pid PID]\n"
+                 "                      [--compression 0|1] [--batch-interval-us US] [--nodes N]\n"
+                 "                      [--no-delay 0|1] [--socket-buffer BYTES] [--notsent-lowat BYTES]\n";
+    std::exit(2);
+}
+
+BenchConfig parse_args(int argc, char** argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--host") config.host = value;
+            else if (arg == "--port") config.port = static_cast<unsigned short>(std::stoul(value));
+            else if (arg == "--clients") config.clients = std::stoul(value);
+            else if (arg == "--rooms") config.rooms = std::stoul(value);
+            else if (arg == "--rate") config.rate = std::stod(value);
+            else if (arg == "--message-size") config.message_size = std::stoul(value);
+            else if (arg == "--duration") config.duration = std::stod(value);
+            else if (arg == "--warmup") config.warmup = std::stod(value);
+            else if (arg == "--threads") config.threads = static_cast<unsigned>(std::stoul(value));
+            else if (arg == "--server-threads") config.server_threads = static_cast<unsigned>(std::stoul(value));
+            else if (arg == "--server-pid") config.server_pid = std::stol(value);
+            else if (arg == "--compression") config.compression = std::stoi(value) != 0;
+            else if (arg == "--batch-interval-us") config.batch_interval_us = static_cast<unsigned>(std::stoul(value));
+            else if (arg == "--nodes") config.nodes = std::stoul(value);
+            else if (arg == "--no-delay") config.no_delay = std::stoi(value) != 0;
+            else if (arg == "--socket-buffer") config.socket_buffer = std::stoi(value);
+            else if (arg == "--notsent-lowat") config.notsent_lowat = std::stoi(value);
+            else usage();
+        } catch (const std::exception&) {
+            usage();
+        }
+    }
+    if (config.clients == 0 || config.rate <= 0 || config.threads == 0 || config.nodes == 0) {
+        usage();
+    }
+    return config;
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Resident set size in KiB from /proc, 0 if unavailable
+long rss_kb(const std::string& pid) {
+    std::ifstream status("/proc/" + pid + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmRSS:", 0) == 0) {
+            return std::strtol(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+// Thousands of sockets need more than the default 1024 descriptors
+void raise_fd_limit(size_t needed) {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= needed) {
+        return;
+    }
+    limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, needed);
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < needed) {
+        std::cerr << format("[BENCH] Descriptor limit {} is below the {} needed\n", limit.rlim_cur, needed);
+    }
+}
+
+struct BenchState {
+    BenchConfig config;
+    std::atomic<size_t> ready{0};
+    std::atomic<size_t> failed{0};
+    std::atomic<bool> sending{false};
+    std::atomic<int64_t> measure_from{INT64_MAX};
+    std::atomic<int64_t> measure_until{INT64_MAX};
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> received_bytes{0};
+};
+
+// Minimal client: one strand per connection and no thread of its own, so
+// thousands of them share the benchmark's io threads. Latencies are kept
+// per client and merged once the run is over.
+class BenchClient : public std::enable_shared_from_this<BenchClient> {
+public:
+    BenchClient(boost::asio::io_context& io_context, BenchState& state, size_t id)
+        : state_(state),
+        id_(id),
+        socket_(boost::asio::make_strand(io_context)),
+        timer_(socket_.get_executor()) {
+        if (state_.config.rooms > 0) {
+            room_ = static_cast<RoomId>(id % state_.config.rooms + 1);
+        }
+    }
+
+    void start(const boost::asio::ip::tcp::resolver::results_type& endpoints) {
+        boost::asio::async_connect(socket_, endpoints,
+                                   [this, self = shared_from_this()](boost::system::error_code ec, const auto&) {
+                                       if (ec) {
+                                           fail();
+                                           return;
+                                       }
+                                       socket_.set_option(boost::asio::ip::tcp::no_delay(true));
+                                       // Credential checks are answered in order, so both
+                                       // go out at once and AccountExists is fine on reruns
+                                       std::string name = format("bench{}", id_);
+                                       send(Packet::prepareSharedPacket(CreateUserPacket(name, "bench")));
+                                       uint32_t capabilities = (state_.config.compression ? kCapCompressedFrames : 0) |
+                                                               kCapMessageBatches | kCapKeepalive;
+                                       send(Packet::prepareSharedPacket(LoginPacket(name, "bench", capabilities)));
+                                       do_read();
+                                   });
+    }
+
+    // Starts the send loop at a random offset into the first interval
+    void start_sending(std::chrono::nanoseconds interval, std::chrono::nanoseconds offset) {
+        boost::asio::dispatch(socket_.get_executor(), [this, self = shared_from_this(), interval, offset] {
+            interval_ = interval;
+            next_send_ = Clock::now() + offset;
+            schedule();
+        });
+    }
+
+    void stop() {
+        boost::asio::dispatch(socket_.get_executor(), [this, self = shared_from_this()] {
+            boost::system::error_code ec;
+            timer_.cancel();
+            socket_.close(ec);
+        });
+    }
+
+    // Only read once the io threads have stopped
+    const std::vector<uint32_t>& latencies() const { return latencies_us_; }
+
+private:
+    void fail() {
+        if (!done_) {
+            done_ = true;
+            ++state_.failed;
+        }
+    }
+
+    void schedule() {
+        timer_.expires_at(next_send_);
+        timer_.async_wait([this, self = shared_from_this()](boost::system::error_code ec) {
+            if (ec || !state_.sending) {
+                return;
+            }
+            std::string content = std::to_string(now_ns());
+            if (content.size() < state_.config.message_size) {
+                content.resize(state_.config.message_size, ' ');
+            }
+            send(Packet::prepareSharedPacket(ChatMessagePacket("", content, room_)));
+            ++state_.sent;
+            // Fixed schedule, a late tick does not push the following ones back
+            next_send_ += interval_;
+            schedule();
+        });
+    }
+
+    void send(SharedFrame frame) {
+        queue_.push(std::move(frame));
+        if (!queue_.writing()) {
+            do_write();
+        }
+    }
+
+    void do_write() {
+        queue_.gather(WriteBatchLimits{}, write_buffers_);
+        boost::asio::async_write(socket_, write_buffers_,
+                                 [this, self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                                     queue_.complete();
+                                     if (ec) {
+                                         fail();
+                                         return;
+                                     }
+                                     if (!queue_.empty()) {
+                                         do_write();
+                                     }
+                                 });
+    }
+
+    void do_read() {
+        socket_.async_read_some(read_buffer_.prepare(),
+                                [this, self = shared_from_this()](boost::system::error_code ec, std::size_t length) {
+                                    if (ec) {
+                                        if (state_.sending) {
+                                            fail();
+                                        }
+                                        return;
+                                    }
+                                    state_.received_bytes += length;
+                                    read_buffer_.commit(length);
+                                    DecodeResult result = read_buffer_.consume(kLimits, [this](std::span<const uint8_t> frame) {
+                                        return handle(frame);
+                                    });
+                                    if (result != DecodeResult::Ok) {
+                                        fail();
+                                        return;
+                                    }
+                                    do_read();
+                                });
+    }
+
+    DecodeResult handle(std::span<const uint8_t> frame) {
+        DecodeResult handled = DecodeResult::Ok;
+        DecodeResult result = dispatchPacket(frame, [this, &handled](const auto& packet) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(packet)>, CompressedPacketView>) {
+                handled = on_compressed(packet);
+            } else {
+                on_packet(packet);
+            }
+        });
+        return result == DecodeResult::Ok ? handled : result;
+    }
+
+    DecodeResult on_compressed(const CompressedPacketView& packet) {
+        if (!inflateFrames(packet, kMaxFrameSize, inflated_)) {
+            return DecodeResult::Corrupt;
+        }
+        return consumeFrames(inflated_, kLimits, [this](std::span<const uint8_t> frame) {
+            if (peekPacketType(frame) == PacketType::Compressed) {
+                return DecodeResult::UnknownType;
+            }
+            return handle(frame);
+        });
+    }
+
+    void on_packet(const LoginSuccessPacketView&) {
+        if (room_ != kLobbyRoom) {
+            send(Packet::prepareSharedPacket(JoinRoomPacket(room_)));
+        }
+        ++state_.ready;
+    }
+
+    void on_packet(const LoginFailedPacketView&) { fail(); }
+
+    void on_packet(const PingPacketView& ping) { send(Packet::prepareSharedPacket(PongPacket(ping.getNonce()))); }
+
+    void on_packet(const ChatMessagePacketView& packet) {
+        on_line(packet.getRoom(), packet.getSender(), packet.getMessage());
+    }
+
+    void on_packet(const ChatMessageBatchPacketView& packet) {
+        packet.forEachLine([&](std::string_view sender, std::string_view message) {
+            on_line(packet.getRoom(), sender, message);
+        });
+    }
+
+    void on_line(RoomId room, std::string_view sender, std::string_view content) {
+        if (sender == "System" || room != room_) {
+            return;
+        }
+        int64_t sent_at = 0;
+        if (std::from_chars(content.data(), content.data() + content.size(), sent_at).ec != std::errc()) {
+            return;
+        }
+        // Only what was sent inside the measurement window counts
+        if (sent_at < state_.measure_from || sent_at >= state_.measure_until) {
+            return;
+        }
+        ++state_.received;
+        latencies_us_.push_back(static_cast<uint32_t>(std::max<int64_t>(0, now_ns() - sent_at) / 1000));
+    }
+
+    template<typename View>
+    void on_packet(const View&) {}
+
+    BenchState& state_;
+    size_t id_;
+    RoomId room_ = kLobbyRoom;
+    boost::asio::ip::tcp::socket socket_;
+    boost::asio::steady_timer timer_;
+    static inline const PacketLimits kLimits = PacketLimits::unbounded();
+
+    ReceiveBuffer read_buffer_{64 * 1024};
+    std::vector<uint8_t> inflated_;
+    FrameQueue queue_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    std::chrono::nanoseconds interval_{};
+    Clock::time_point next_send_;
+    std::vector<uint32_t> latencies_us_;
+    bool done_ = false;
+};
+
+uint32_t percentile(const std::vector<uint32_t>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void sleep_for_seconds(double seconds) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config = parse_args(argc, argv);
+    // stdout carries only the result line
+    Log::setOutput(stderr);
+    raise_fd_limit(config.clients * 2 + 64);
+
+    // In-process servers, tuned so thousands of logins from one address are
+    // neither rate-limited nor stuck behind a full-strength bcrypt. Each node
+    // gets its own io_context and a share of the threads, as if it were a
+    // process of its own, and they share the first node's database.
+    std::vector<std::unique_ptr<boost::asio::io_context>> server_contexts;
+    std::vector<std::unique_ptr<ChatServer>> servers;
+    std::vector<std::thread> server_threads;
+    bool embedded = config.host.empty();
+    if (embedded) {
+        for (size_t node = 0; node < config.nodes; ++node) {
+            server_contexts.push_back(std::make_unique<boost::asio::io_context>());
+        }
+        CredentialHasherConfig hasher;
+        hasher.cost = 4;
+        hasher.max_pending = config.clients * 2;
+        auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(*server_contexts[0], 10000, hasher);
+        ChatServerConfig server_config;
+        server_config.login_limits.max_attempts_per_address = UINT32_MAX;
+        server_config.login_limits.max_tracked_keys = config.clients * 2 + 16;
+        server_config.batch_interval = std::chrono::microseconds(config.batch_interval_us);
+        server_config.socket_tuning.no_delay = config.no_delay;
+        server_config.socket_tuning.send_buffer = config.socket_buffer;
+        server_config.socket_tuning.receive_buffer = config.socket_buffer;
+        server_config.socket_tuning.notsent_lowat = config.notsent_lowat;
+        for (size_t node = 0; node < config.nodes; ++node) {
+            if (config.nodes > 1) {
+                server_config.cluster.node_id = static_cast<uint32_t>(node);
+                server_config.cluster.port = static_cast<unsigned short>(config.port + config.nodes + node);
+                server_config.cluster.peers.clear();
+                for (size_t peer = 0; peer < config.nodes; ++peer) {
+                    if (peer != node) {
+                        server_config.cluster.peers.push_back(format("127.0.0.1:{}", config.port + config.nodes + peer));
+                    }
+                }
+            }
+            servers.push_back(std::make_unique<ChatServer>(*server_contexts[node], static_cast<short>(config.port + node),
+                                                           db_adapter, server_config));
+        }
+        unsigned threads_per_node = std::max<unsigned>(1, config.server_threads / static_cast<unsigned>(config.nodes));
+        for (auto& context : server_contexts) {
+            for (unsigned i = 0; i < threads_per_node; ++i) {
+                server_threads.emplace_back([&context] { context->run(); });
+            }
+        }
+        config.host = "127.0.0.1";
+    }
+
+    BenchState state;
+    state.config = config;
+    boost::asio::io_context io_context;
+    auto work_guard = boost::asio::make_work_guard(io_context);
+    std::vector<std::thread> io_threads;
+    for (unsigned i = 0; i < config.threads; ++i) {
+        io_threads.emplace_back([&io_context] { io_context.run(); });
+    }
+
+    boost::asio::ip::tcp::resolver resolver(io_context);
+    std::vector<boost::asio::ip::tcp::resolver::results_type> endpoints;
+    for (size_t node = 0; node < config.nodes; ++node) {
+        endpoints.push_back(resolver.resolve(config.host, std::to_string(config.port + node)));
+    }
+
+    std::cerr << format("[BENCH] Connecting {} clients to {} node(s) at {}:{}\n", config.clients, config.nodes, config.host, config.port);
+    std::vector<std::shared_ptr<BenchClient>> clients;
+    clients.reserve(config.clients);
+    auto connect_start = Clock::now();
+    for (size_t i = 0; i < config.clients; ++i) {
+        clients.push_back(std::make_shared<BenchClient>(io_context, state, i));
+        clients.back()->start(endpoints[i % endpoints.size()]);
+        // Pace the connects so the accept backlog does not overflow
+        if (i % 256 == 255) {
+            while (state.ready + state.failed + 128 < i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+    while (state.ready + state.failed < config.clients &&
+           Clock::now() - connect_start < std::chrono::seconds(120)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double connect_seconds = std::chrono::duration<double>(Clock::now() - connect_start).count();
+    std::cerr << format("[BENCH] {} clients ready, {} failed, in {}s\n", state.ready.load(), state.failed.load(), connect_seconds);
+    // Let the join announcements settle before measuring
+    sleep_for_seconds(0.5);
+
+    // Every client sends at the same rate, at random offsets so the load is even
+    auto interval = std::chrono::nanoseconds(static_cast<int64_t>(1e9 * static_cast<double>(config.clients) / config.rate));
+    std::mt19937_64 random(42);
+    std::uniform_int_distribution<int64_t> offset(0, std::max<int64_t>(1, interval.count()) - 1);
+    state.sending = true;
+    int64_t start = now_ns();
+    state.measure_from = start + static_cast<int64_t>(config.warmup * 1e9);
+    state.measure_until = state.measure_from + static_cast<int64_t>(config.duration * 1e9);
+    uint64_t sent_before = 0;
+    for (auto& client : clients) {
+        client->start_sending(interval, std::chrono::nanoseconds(offset(random)));
+    }
+
+    sleep_for_seconds(config.warmup);
+    sent_before = state.sent;
+    sleep_for_seconds(config.duration);
+    uint64_t sent_during = state.sent - sent_before;
+    state.sending = false;
+    // Give in-flight messages a moment to arrive
+    sleep_for_seconds(1.0);
+
+    long server_rss = 0;
+    if (embedded) {
+        server_rss = rss_kb("self");
+    } else if (config.server_pid > 0) {
+        server_rss = rss_kb(std::to_string(config.server_pid));
+    }
+
+    for (auto& client : clients) {
+        client->stop();
+    }
+    work_guard.reset();
+    for (auto& thread : io_threads) {
+        thread.join();
+    }
+    // The database lives on the first node, so that one goes last
+    for (size_t node = servers.size(); node-- > 0;) {
+        servers[node]->stop();
+        server_contexts[node]->stop();
+    }
+    for (auto& thread : server_threads) {
+        thread.join();
+    }
+
+    std::vector<uint32_t> latencies;
+    latencies.reserve(state.received);
+    for (const auto& client : clients) {
+        latencies.insert(latencies.end(), client->latencies().begin(), client->latencies().end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << format("{\"clients\":{},\"ready\":{},\"failed\":{},\"rooms\":{},\"target_rate\":{},\"duration_s\":{},"
+                        "\"connect_s\":{},\"sent\":{},\"delivered\":{},\"msgs_per_sec\":{},\"deliveries_per_sec\":{},"
+                        "\"latency_us\":{\"p50\":{},\"p99\":{},\"p999\":{},\"max\":{}},\"compression\":{},"
+                        "\"batch_interval_us\":{},\"nodes\":{},\"received_bytes\":{},\"server_rss_kb\":{}}",
+                        config.clients, state.ready.load(), state.failed.load(), config.rooms, config.rate, config.duration,
+                        connect_seconds, sent_during, latencies.size(),
+                        static_cast<double>(sent_during) / config.duration,
+                        static_cast<double>(latencies.size()) / config.duration,
+                        percentile(latencies, 0.50), percentile(latencies, 0.99), percentile(latencies, 0.999),
+                        latencies.empty() ? 0 : latencies.back(), config.compression, config.batch_interval_us, config.nodes,
+                        state.received_bytes.load(),
+                        server_rss)
+              << std::endl;
+    return state.failed == 0 ? 0 : 1;
+}
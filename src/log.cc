@@ -0,0 +1,263 @@
+#include "log.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::system_clock;
+
+// Single-producer single-consumer byte ring. The owning thread appends
+// records, the writer (or a flush, under the drain mutex) consumes them.
+// Each record is a RecordHeader followed by the text.
+struct RecordHeader {
+    uint32_t length;
+    LogLevel level;
+    int64_t timestamp;  // nanoseconds since the epoch
+};
+
+class LogRing {
+public:
+    LogRing() : data_(new uint8_t[Log::kRingCapacity]) {}
+
+    // Producer side, false if the record does not fit
+    bool push(LogLevel level, std::string_view text) {
+        RecordHeader header{static_cast<uint32_t>(text.size()), level,
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count()};
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        if (Log::kRingCapacity - (head - tail) < sizeof(header) + text.size()) {
+            return false;
+        }
+        copyIn(head, &header, sizeof(header));
+        copyIn(head + sizeof(header), text.data(), text.size());
+        head_.store(head + sizeof(header) + text.size(), std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, hands every waiting record to `formatter`
+    template<typename Formatter>
+    bool drain(Formatter&& formatter) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        if (tail == head) {
+            return false;
+        }
+        while (tail != head) {
+            RecordHeader header;
+            copyOut(tail, &header, sizeof(header));
+            std::string text(header.length, '\0');
+            copyOut(tail + sizeof(header), text.data(), header.length);
+            formatter(header, std::move(text));
+            tail += sizeof(header) + header.length;
+        }
+        tail_.store(tail, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    // Set once the owning thread has exited, the ring goes after its last drain
+    std::atomic<bool> orphaned{false};
+
+private:
+    void copyIn(size_t position, const void* source, size_t size) {
+        size_t offset = position % Log::kRingCapacity;
+        size_t first = std::min(size, Log::kRingCapacity - offset);
+        std::memcpy(data_.get() + offset, source, first);
+        std::memcpy(data_.get(), static_cast<const uint8_t*>(source) + first, size - first);
+    }
+
+    void copyOut(size_t position, void* destination, size_t size) const {
+        size_t offset = position % Log::kRingCapacity;
+        size_t first = std::min(size, Log::kRingCapacity - offset);
+        std::memcpy(destination, data_.get() + offset, first);
+        std::memcpy(static_cast<uint8_t*>(destination) + first, data_.get(), size - first);
+    }
+
+    std::unique_ptr<uint8_t[]> data_;
+    // Monotonic byte counters, the positions are taken modulo the capacity
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+const char* levelName(LogLevel level) {
+    switch (level) {
+    case LogLevel::Trace: return "TRACE";
+    case LogLevel::Debug: return "DEBUG";
+    case LogLevel::Info: return "INFO ";
+    case LogLevel::Warn: return "WARN ";
+    case LogLevel::Error: return "ERROR";
+    default: return "?    ";
+    }
+}
+
+class LogWriter {
+public:
+    LogWriter() : thread_([this] { run(); }) {}
+
+    ~LogWriter() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+        drainAll();
+    }
+
+    std::shared_ptr<LogRing> registerThread() {
+        auto ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.push_back(ring);
+        return ring;
+    }
+
+    void written() {
+        // Only the first line after an idle writer pays for the notify
+        if (!pending_.exchange(true, std::memory_order_acq_rel)) {
+            wake_.notify_one();
+        }
+    }
+
+    void dropped() { dropped_.fetch_add(1, std::memory_order_relaxed); }
+    uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+
+    void setOutput(FILE* output) {
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        drainLocked();
+        output_ = output;
+    }
+
+    void drainAll() {
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        drainLocked();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        while (!stopping_) {
+            // The timeout picks up lines whose notify raced the pending reset
+            wake_.wait_for(lock, std::chrono::milliseconds(50), [this] {
+                return stopping_ || pending_.load(std::memory_order_acquire);
+            });
+            pending_.store(false, std::memory_order_release);
+            lock.unlock();
+            drainAll();
+            lock.lock();
+        }
+    }
+
+    void drainLocked() {
+        std::vector<std::shared_ptr<LogRing>> rings;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings = rings_;
+        }
+
+        // Interleave the threads' lines back into time order
+        records_.clear();
+        for (const auto& ring : rings) {
+            ring->drain([this](const RecordHeader& header, std::string&& text) { records_.emplace_back(header, std::move(text)); });
+        }
+        std::stable_sort(records_.begin(), records_.end(), [](const auto& a, const auto& b) {
+            return a.first.timestamp < b.first.timestamp;
+        });
+        batch_.clear();
+        for (const auto& [header, text] : records_) {
+            appendLine(header, text);
+        }
+        if (!batch_.empty()) {
+            std::fwrite(batch_.data(), 1, batch_.size(), output_);
+            std::fflush(output_);
+        }
+
+        // Forget the rings of threads that are gone, now that they are empty
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        std::erase_if(rings_, [](const std::shared_ptr<LogRing>& ring) { return ring->orphaned && ring->empty(); });
+    }
+
+    void appendLine(const RecordHeader& header, const std::string& text) {
+        // localtime_r takes the time zone lock, only ask it once a second
+        std::time_t seconds = static_cast<std::time_t>(header.timestamp / 1000000000);
+        if (seconds != cached_seconds_) {
+            std::tm time{};
+            localtime_r(&seconds, &time);
+            cached_seconds_ = seconds;
+            cached_time_ = time;
+        }
+        char prefix[48];
+        int length = std::snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%06d %s ",
+                                   cached_time_.tm_hour, cached_time_.tm_min, cached_time_.tm_sec,
+                                   static_cast<int>(header.timestamp % 1000000000 / 1000), levelName(header.level));
+        batch_.append(prefix, static_cast<size_t>(length));
+        batch_.append(text);
+        batch_.push_back('\n');
+    }
+
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<LogRing>> rings_;
+
+    // Serializes the consumers of the rings: the writer thread and flush()
+    std::mutex drain_mutex_;
+    std::vector<std::pair<RecordHeader, std::string>> records_;
+    std::string batch_;
+    std::time_t cached_seconds_ = -1;
+    std::tm cached_time_{};
+    FILE* output_ = stdout;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::atomic<bool> pending_{false};
+    std::atomic<uint64_t> dropped_{0};
+
+    std::thread thread_;  // last, started once everything else is set up
+};
+
+// Started by the first line and shut down, drained, at exit
+LogWriter& writer() {
+    static LogWriter instance;
+    return instance;
+}
+
+// The calling thread's ring, orphaned again when the thread exits
+struct ThreadRing {
+    std::shared_ptr<LogRing> ring = writer().registerThread();
+
+    ~ThreadRing() { ring->orphaned = true; }
+};
+
+}
+
+void Log::write(LogLevel level, std::string_view line) {
+    thread_local ThreadRing thread_ring;
+    LogWriter& log_writer = writer();
+    if (!thread_ring.ring->push(level, line)) {
+        log_writer.dropped();
+        return;
+    }
+    log_writer.written();
+}
+
+void Log::setOutput(FILE* output) {
+    writer().setOutput(output);
+}
+
+void Log::flush() {
+    writer().drainAll();
+}
+
+uint64_t Log::dropped() {
+    return writer().droppedCount();
+}
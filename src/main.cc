@@ -2,6 +2,7 @@
 #include <chrono>
 #include <vector>
 #include <atomic>
+#include <algorithm>
 #include <boost/asio.hpp>
 #include "chat_example/chatserver.h"
 #include "chat_example/chatclient.h"
@@ -15,11 +16,16 @@ void run_server(short port, std::atomic<bool>& stop_flag) {
         ChatServer server(io_context, port, db_adapter);
         dbgln("[MAIN] Server thread started");
 
-        std::thread io_thread([&io_context]() {
-            dbgln("[MAIN] Server IO thread started");
-            io_context.run();
-            dbgln("[MAIN] Server IO thread ended");
-        });
+        // Sessions are strand-serialized, so the server scales across cores
+        unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> io_threads;
+        for (unsigned i = 0; i < thread_count; ++i) {
+            io_threads.emplace_back([&io_context]() {
+                dbgln("[MAIN] Server IO thread started");
+                io_context.run();
+                dbgln("[MAIN] Server IO thread ended");
+            });
+        }
 
         while (!stop_flag) {
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
@@ -28,7 +34,9 @@ void run_server(short port, std::atomic<bool>& stop_flag) {
         dbgln("[MAIN] Stopping server");
         server.stop();
         io_context.stop();
-        io_thread.join();
+        for (auto& io_thread : io_threads) {
+            io_thread.join();
+        }
         dbgln("[MAIN] Server thread ended");
     }
     catch (std::exception& e) {
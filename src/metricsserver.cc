@@ -0,0 +1,105 @@
+#include "metricsserver.h"
+#include "log.hh"
+
+#include <memory>
+#include <string>
+
+namespace {
+
+// Longest request head we bother reading
+constexpr size_t kMaxRequestSize = 8 * 1024;
+// Wait before accepting again after a failed accept, ChatServer's default
+constexpr std::chrono::milliseconds kAcceptBackoff{100};
+
+class MetricsConnection : public std::enable_shared_from_this<MetricsConnection> {
+public:
+    MetricsConnection(boost::asio::ip::tcp::socket socket, const MetricsRegistry& registry)
+        : socket_(std::move(socket)), deadline_(socket_.get_executor()), registry_(registry) {}
+
+    // Request and response both have to be done by `timeout`
+    void start(std::chrono::milliseconds timeout) {
+        deadline_.expires_after(timeout);
+        deadline_.async_wait([this, self = shared_from_this()](boost::system::error_code ec) {
+            if (!ec) {
+                boost::system::error_code ignored;
+                socket_.close(ignored);
+            }
+        });
+        boost::asio::async_read_until(socket_, boost::asio::dynamic_buffer(request_, kMaxRequestSize), "\r\n\r\n",
+                                      [this, self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                                          if (ec) {
+                                              deadline_.cancel();
+                                              return;
+                                          }
+                                          respond();
+                                      });
+    }
+
+private:
+    void respond() {
+        bool metrics = request_.rfind("GET /metrics ", 0) == 0 || request_.rfind("GET /metrics?", 0) == 0;
+        std::string body = metrics ? registry_.renderPrometheus() : "Not found\n";
+        response_ = std::string(metrics ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n") +
+                    "Content-Type: " + (metrics ? "text/plain; version=0.0.4" : "text/plain") + "\r\n" +
+                    "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+                    "Connection: close\r\n\r\n" + body;
+        boost::asio::async_write(socket_, boost::asio::buffer(response_),
+                                 [this, self = shared_from_this()](boost::system::error_code, std::size_t) {
+                                     boost::system::error_code ignored;
+                                     socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                                     deadline_.cancel();
+                                 });
+    }
+
+    boost::asio::ip::tcp::socket socket_;
+    boost::asio::steady_timer deadline_;
+    const MetricsRegistry& registry_;
+    std::string request_;
+    std::string response_;
+};
+
+}
+
+MetricsServer::MetricsServer(boost::asio::io_context& io_context, unsigned short port, const MetricsRegistry& registry,
+                             std::chrono::milliseconds request_timeout)
+    : io_context_(io_context),
+    strand_(boost::asio::make_strand(io_context)),
+    acceptor_(strand_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+    accept_timer_(strand_),
+    registry_(registry),
+    request_timeout_(request_timeout) {
+    do_accept();
+    logInfo("[METRICS] Serving metrics on port {}", this->port());
+}
+
+void MetricsServer::stop() {
+    stopped_ = true;
+    boost::asio::dispatch(strand_, [this] {
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+        accept_timer_.cancel();
+    });
+}
+
+void MetricsServer::do_accept() {
+    acceptor_.async_accept(
+        boost::asio::make_strand(io_context_),
+        [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+            if (stopped_ || ec == boost::asio::error::operation_aborted) {
+                return;
+            }
+            if (ec) {
+                // Out of descriptors, say. Scrapes resume once some are free.
+                logWarn("[METRICS] Accept error: {}", ec.message());
+                accept_timer_.expires_after(kAcceptBackoff);
+                accept_timer_.async_wait([this](boost::system::error_code ec) {
+                    if (!ec && !stopped_) {
+                        do_accept();
+                    }
+                });
+                return;
+            }
+            std::make_shared<MetricsConnection>(std::move(socket), registry_)->start(request_timeout_);
+            do_accept();
+        });
+}
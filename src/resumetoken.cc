@@ -0,0 +1,77 @@
+#include "resumetoken.hh"
+
+#include <cstring>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+namespace {
+
+constexpr uint8_t kTokenVersion = 1;
+// Of the SHA-256 tag, which is plenty against forgery
+constexpr size_t kTagSize = 16;
+// Version, epoch and expiry in seconds since the Unix epoch
+constexpr size_t kHeaderSize = sizeof(uint8_t) + 2 * sizeof(uint64_t);
+
+void appendValue(std::string& out, uint64_t value) {
+    char bytes[sizeof(value)];
+    std::memcpy(bytes, &value, sizeof(value));
+    out.append(bytes, sizeof(value));
+}
+
+uint64_t readValue(std::string_view in, size_t offset) {
+    uint64_t value;
+    std::memcpy(&value, in.data() + offset, sizeof(value));
+    return value;
+}
+
+uint64_t unixSeconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string sign(const std::string& key, std::string_view claims) {
+    unsigned char tag[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+         reinterpret_cast<const unsigned char*>(claims.data()), claims.size(), tag, &length);
+    return std::string(reinterpret_cast<const char*>(tag), kTagSize);
+}
+
+}
+
+ResumeTokens::ResumeTokens(const ResumeConfig& config)
+    : key_(config.key), lifetime_(config.lifetime) {
+    if (key_.empty()) {
+        key_.resize(32);
+        RAND_bytes(reinterpret_cast<unsigned char*>(key_.data()), static_cast<int>(key_.size()));
+    }
+}
+
+std::string ResumeTokens::issue(std::string_view username, uint64_t epoch) const {
+    std::string token;
+    token.reserve(kHeaderSize + username.size() + kTagSize);
+    token.push_back(static_cast<char>(kTokenVersion));
+    appendValue(token, epoch);
+    appendValue(token, unixSeconds() + lifetime_.count());
+    token.append(username);
+    token += sign(key_, token);
+    return token;
+}
+
+std::optional<ResumeClaims> ResumeTokens::verify(std::string_view token) const {
+    if (token.size() <= kHeaderSize + kTagSize || static_cast<uint8_t>(token[0]) != kTokenVersion) {
+        return std::nullopt;
+    }
+    std::string_view claims = token.substr(0, token.size() - kTagSize);
+    std::string expected = sign(key_, claims);
+    // Constant time, so timing does not tell how much of a forged tag matched
+    if (CRYPTO_memcmp(expected.data(), token.data() + claims.size(), kTagSize) != 0) {
+        return std::nullopt;
+    }
+    if (readValue(token, 1 + sizeof(uint64_t)) <= unixSeconds()) {
+        return std::nullopt;
+    }
+    return ResumeClaims{std::string(claims.substr(kHeaderSize)), readValue(token, 1)};
+}
@@ -0,0 +1,325 @@
+// Microbenchmarks for packet encode/decode, format and Signal dispatch.
+// Every benchmark reports ns/op and heap allocations/op as one JSON line on
+// stdout. Pass the output of an earlier run to --compare to fail on
+// regressions:
+//
+//   bench-packet > baseline.json
+//   bench-packet --compare baseline.json --tolerance 0.15
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "chat_example/format.hh"
+#include "chat_example/log.hh"
+#include "chat_example/packet.hh"
+#include "chat_example/signal.hh"
+
+namespace {
+
+// Counted by the replaced global operator new below. Benchmarks run on the
+// main thread only, except for what they post and then run themselves.
+thread_local uint64_t allocation_count = 0;
+thread_local uint64_t allocation_bytes = 0;
+
+}
+
+void* operator new(std::size_t size) {
+    ++allocation_count;
+    allocation_bytes += size;
+    if (void* pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete[](void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept { std::free(pointer); }
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Keeps the compiler from optimizing away a result nobody reads
+template<typename T>
+void keep(T&& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct BenchOptions {
+    std::string filter;
+    double min_time = 0.2;  // seconds per repetition
+    int repetitions = 5;
+    std::string compare;
+    double tolerance = 0.10;
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations = 0;
+    double ns_per_op = 0;
+    double allocs_per_op = 0;
+    double bytes_per_op = 0;
+};
+
+class BenchRunner {
+public:
+    explicit BenchRunner(BenchOptions options) : options_(std::move(options)) {}
+
+    // Runs `body` in batches large enough to last min_time and keeps the
+    // fastest repetition, the one least disturbed by the rest of the system
+    template<typename Body>
+    void run(const std::string& name, Body&& body) {
+        if (!options_.filter.empty() && name.find(options_.filter) == std::string::npos) {
+            return;
+        }
+        uint64_t iterations = 1;
+        while (true) {
+            double elapsed = measure(body, iterations);
+            if (elapsed >= options_.min_time / 10 || iterations >= (uint64_t(1) << 40)) {
+                iterations = std::max<uint64_t>(1, static_cast<uint64_t>(static_cast<double>(iterations) * options_.min_time / std::max(elapsed, 1e-9)));
+                break;
+            }
+            iterations *= 10;
+        }
+
+        BenchResult result;
+        result.name = name;
+        result.iterations = iterations;
+        result.ns_per_op = 1e300;
+        for (int i = 0; i < options_.repetitions; ++i) {
+            uint64_t allocations = allocation_count;
+            uint64_t bytes = allocation_bytes;
+            double elapsed = measure(body, iterations);
+            result.ns_per_op = std::min(result.ns_per_op, elapsed * 1e9 / static_cast<double>(iterations));
+            result.allocs_per_op = static_cast<double>(allocation_count - allocations) / static_cast<double>(iterations);
+            result.bytes_per_op = static_cast<double>(allocation_bytes - bytes) / static_cast<double>(iterations);
+        }
+        std::cout << format("{\"name\":\"{}\",\"iterations\":{},\"ns_per_op\":{},\"allocs_per_op\":{},\"bytes_per_op\":{}}",
+                            result.name, result.iterations, result.ns_per_op, result.allocs_per_op, result.bytes_per_op)
+                  << std::endl;
+        results_.push_back(std::move(result));
+    }
+
+    // Checks the results against a baseline written by an earlier run.
+    // Returns false if anything got slower than the tolerance allows or
+    // allocates more than before.
+    bool compare() const {
+        if (options_.compare.empty()) {
+            return true;
+        }
+        std::ifstream in(options_.compare);
+        if (!in) {
+            std::cerr << format("[BENCH] Cannot open baseline {}\n", options_.compare);
+            return false;
+        }
+        std::map<std::string, BenchResult> baseline;
+        std::string line;
+        while (std::getline(in, line)) {
+            BenchResult result;
+            result.name = field(line, "name");
+            if (result.name.empty()) {
+                continue;
+            }
+            result.ns_per_op = std::atof(field(line, "ns_per_op").c_str());
+            result.allocs_per_op = std::atof(field(line, "allocs_per_op").c_str());
+            baseline[result.name] = result;
+        }
+
+        bool ok = true;
+        for (const auto& result : results_) {
+            auto it = baseline.find(result.name);
+            if (it == baseline.end()) {
+                continue;
+            }
+            double ratio = result.ns_per_op / std::max(it->second.ns_per_op, 1e-9);
+            bool slower = ratio > 1 + options_.tolerance;
+            // Allocation counts are deterministic, any increase is a regression
+            bool allocates = result.allocs_per_op > it->second.allocs_per_op + 1e-6;
+            if (slower || allocates) {
+                std::cerr << format("[BENCH] Regression in {}: {} -> {} ns/op, {} -> {} allocs/op\n",
+                                    result.name, it->second.ns_per_op, result.ns_per_op,
+                                    it->second.allocs_per_op, result.allocs_per_op);
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+private:
+    template<typename Body>
+    static double measure(Body& body, uint64_t iterations) {
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            body();
+        }
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // Value of "key" in one of our own output lines
+    static std::string field(const std::string& line, const std::string& key) {
+        std::string needle = "\"" + key + "\":";
+        auto position = line.find(needle);
+        if (position == std::string::npos) {
+            return {};
+        }
+        position += needle.size();
+        if (line[position] == '"') {
+            auto end = line.find('"', position + 1);
+            return line.substr(position + 1, end - position - 1);
+        }
+        auto end = line.find_first_of(",}", position);
+        return line.substr(position, end - position);
+    }
+
+    BenchOptions options_;
+    std::vector<BenchResult> results_;
+};
+
+[[noreturn]] void usage() {
+    std::cerr << "usage: bench-packet [--filter SUBSTRING] [--min-time SECS] [--repetitions N]\n"
+                 "                    [--compare BASELINE] [--tolerance FRACTION]\n";
+    std::exit(2);
+}
+
+BenchOptions parse_args(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--filter") options.filter = value;
+            else if (arg == "--min-time") options.min_time = std::stod(value);
+            else if (arg == "--repetitions") options.repetitions = std::max(1, std::stoi(value));
+            else if (arg == "--compare") options.compare = value;
+            else if (arg == "--tolerance") options.tolerance = std::stod(value);
+            else usage();
+        } catch (const std::exception&) {
+            usage();
+        }
+    }
+    return options;
+}
+
+}
+
+int main(int argc, char** argv) {
+    BenchRunner bench(parse_args(argc, argv));
+#ifndef __OPTIMIZE__
+    std::cerr << "[BENCH] Built without optimizations, configure with -DCMAKE_BUILD_TYPE=Release for real numbers\n";
+#endif
+    const size_t payload_sizes[] = {16, 256, 4096};
+
+    for (size_t size : payload_sizes) {
+        std::string payload(size, 'x');
+        ChatMessagePacket packet("alice", payload);
+        const Packet& erased = packet;
+        auto frame = Packet::preparePacketForSending(packet);
+        std::span<const uint8_t> body = std::span<const uint8_t>(frame).subspan(sizeof(uint32_t));
+
+        bench.run(format("preparePacketForSending/typed/{}", size), [&] {
+            auto encoded = Packet::preparePacketForSending(packet);
+            keep(encoded);
+        });
+        bench.run(format("preparePacketForSending/virtual/{}", size), [&] {
+            auto encoded = Packet::preparePacketForSending(erased);
+            keep(encoded);
+        });
+        bench.run(format("prepareSharedPacket/{}", size), [&] {
+            auto shared = Packet::prepareSharedPacket(packet);
+            keep(shared);
+        });
+        bench.run(format("createPacketFromData/{}", size), [&] {
+            auto decoded = createPacketFromData(body);
+            keep(decoded);
+        });
+        bench.run(format("dispatchPacket/{}", size), [&] {
+            size_t length = 0;
+            dispatchPacket(body, [&](const auto& view) {
+                if constexpr (std::is_same_v<std::decay_t<decltype(view)>, ChatMessagePacketView>) {
+                    length = view.getMessage().size();
+                }
+            });
+            keep(length);
+        });
+    }
+
+    for (size_t size : payload_sizes) {
+        std::string payload(size, 'x');
+        std::vector<uint8_t> buffer(FieldCodec<std::string>::size(payload));
+        bench.run(format("writeString/{}", size), [&] {
+            uint8_t* end = FieldCodec<std::string>::write(buffer.data(), payload);
+            keep(end);
+        });
+        bench.run(format("readString/{}", size), [&] {
+            PacketReader reader(buffer);
+            std::string_view str;
+            reader.readString(str);
+            keep(str);
+        });
+    }
+
+    bench.run("format/3-args", [] {
+        auto line = format("[SERVER] {} sent {} bytes to room {}", "alice", 42, 7u);
+        keep(line);
+    });
+    bench.run("logFormat/3-args", [] {
+        thread_local std::string line;
+        line.clear();
+        logFormat(line, "[SERVER] {} sent {} bytes to room {}", "alice", 42, 7u);
+        keep(line);
+    });
+    {
+        // The caller's cost only; lines the writer cannot keep up with are
+        // dropped, which is counted and reported
+        FILE* null_output = std::fopen("/dev/null", "w");
+        Log::setOutput(null_output);
+        uint64_t dropped = Log::dropped();
+        bench.run("dbgln/3-args", [] { dbgln("[SERVER] {} sent {} bytes to room {}", "alice", 42, 7u); });
+        bench.run("logInfo/3-args", [] { logInfo("[SERVER] {} sent {} bytes to room {}", "alice", 42, 7u); });
+        bench.run("logDebug/filtered", [] { logDebug("[SERVER] {} sent {} bytes to room {}", "alice", 42, 7u); });
+        Log::setOutput(stdout);
+        std::fclose(null_output);
+        if (Log::dropped() != dropped) {
+            std::cerr << format("[BENCH] {} log lines dropped\n", Log::dropped() - dropped);
+        }
+    }
+
+    for (size_t size : payload_sizes) {
+        std::string payload(size, 'x');
+        size_t received = 0;
+
+        Signal<std::string> direct;
+        direct.connect([&](std::string message) { received += message.size(); });
+        bench.run(format("Signal::emit/direct/{}", size), [&] { direct.emit(payload); });
+
+        // Posting costs the post plus running the handler, so both are timed
+        boost::asio::io_context io_context;
+        auto work_guard = boost::asio::make_work_guard(io_context);
+        Signal<std::string> posted;
+        posted.connect([&](std::string message) { received += message.size(); }, &io_context);
+        bench.run(format("Signal::emit/posted/{}", size), [&] {
+            posted.emit(payload);
+            io_context.poll();
+        });
+        keep(received);
+    }
+
+    return bench.compare() ? 0 : 1;
+}
@@ -184,6 +184,18 @@ TEST_CASE("ChatClient basic functionality") {
         CHECK(receiver_client.wait_for_flag(WaitFlag::MessageReceived));
         CHECK(receiver_client.get_received_message() == test_message);
         CHECK(receiver_client.get_message_sender() == "sender");
+
+        // Long enough to go up and come back down compressed
+        std::string long_message;
+        for (int i = 0; long_message.size() < 2000; ++i) {
+            long_message += format("line {} of a long message. ", i);
+        }
+        receiver_client.reset_flags();
+        test_client.get_client()->SendMessage.emit(long_message);
+        CHECK(receiver_client.wait_for_flag(WaitFlag::MessageReceived));
+        CHECK(receiver_client.get_received_message() == long_message);
+        CHECK(server.metrics().packets_received[static_cast<size_t>(PacketType::Compressed)]->value() == 1);
+        CHECK(server.metrics().frames_compressed.value() >= 1);
     }
 }
 
@@ -224,3 +236,92 @@ TEST_CASE("ChatClient error handling") {
         CHECK(test_client.get_received_message().empty());
     }
 }
+
+TEST_CASE("ChatClient on a shared io_context") {
+    const short TEST_PORT = 12345;
+    boost::asio::io_context server_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(server_context);
+    ChatServerConfig config;
+    config.batch_interval = std::chrono::milliseconds(50);
+    config.timeouts.ping_interval = std::chrono::milliseconds(100);
+    config.timeouts.idle = std::chrono::milliseconds(1000);
+    ChatServer server(server_context, TEST_PORT, db_adapter, config);
+    std::thread server_thread([&server_context]() {
+        server_context.run();
+    });
+    SCOPE_EXIT ({
+        server_context.stop();
+        server_thread.join();
+    });
+
+    // Many clients, two I/O threads
+    boost::asio::io_context io_context;
+    auto work_guard = boost::asio::make_work_guard(io_context);
+    std::vector<std::thread> io_threads;
+    for (int i = 0; i < 2; ++i) {
+        io_threads.emplace_back([&io_context]() { io_context.run(); });
+    }
+    SCOPE_EXIT ({
+        work_guard.reset();
+        for (auto& thread : io_threads) {
+            thread.join();
+        }
+    });
+
+    const int client_count = 20;
+    std::atomic<int> connected{0};
+    std::atomic<int> logged_in{0};
+    std::atomic<int> received{0};
+    std::vector<std::unique_ptr<ChatClient>> clients;
+    for (int i = 0; i < client_count; ++i) {
+        auto client = std::make_unique<ChatClient>(io_context, format("shared{}", i));
+        client->on_connected.connect([&connected]() { ++connected; });
+        client->on_login_response.connect([&logged_in](bool success) {
+            if (success) {
+                ++logged_in;
+            }
+        });
+        client->on_message_received.connect([&received](const std::string&, const std::string& message) {
+            if (message == "hello everyone") {
+                ++received;
+            }
+        });
+        client->start();  // Nothing to start, the io_context is ours
+        clients.push_back(std::move(client));
+    }
+
+    auto wait_for = [](const std::atomic<int>& counter, int expected) {
+        auto start = std::chrono::steady_clock::now();
+        while (counter < expected && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return counter == expected;
+    };
+
+    for (auto& client : clients) {
+        client->Connect.emit("localhost", "12345");
+    }
+    REQUIRE(wait_for(connected, client_count));
+
+    for (int i = 0; i < client_count; ++i) {
+        clients[i]->CreateUser.emit(format("shared{}", i), "password");
+        clients[i]->Login.emit(format("shared{}", i), "password");
+    }
+    REQUIRE(wait_for(logged_in, client_count));
+    // Idle for longer than the server would wait without the pongs
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    CHECK(server.metrics().idle_timeouts.value() == 0);
+
+    // All but the first arrive in a ChatMessageBatch, unpacked line by line
+    for (int i = 0; i < 3; ++i) {
+        clients[0]->SendMessage.emit("hello everyone");
+    }
+    CHECK(wait_for(received, 3 * (client_count - 1)));
+    CHECK(server.metrics().batches.value() >= 1);
+
+    // stop() waits for the client's own handlers while the threads keep running
+    for (auto& client : clients) {
+        client->stop();
+        client.reset();
+    }
+}
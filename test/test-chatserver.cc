@@ -5,6 +5,8 @@
 #include "chat_example/format.hh"
 #include <thread>
 #include <future>
+#include <sys/socket.h>
+#include <unistd.h>
 
 class TestClient {
 public:
@@ -20,6 +22,18 @@ public:
         boost::asio::write(socket_, boost::asio::buffer(data));
     }
 
+    void send_raw(const std::vector<uint8_t>& data) {
+        boost::asio::write(socket_, boost::asio::buffer(data));
+    }
+
+    // True once the server has dropped the connection
+    bool disconnected() {
+        uint8_t byte;
+        boost::system::error_code ec;
+        boost::asio::read(socket_, boost::asio::buffer(&byte, 1), ec);
+        return ec == boost::asio::error::eof || ec == boost::asio::error::connection_reset;
+    }
+
     std::unique_ptr<Packet> receive() {
         uint32_t size;
         boost::asio::read(socket_, boost::asio::buffer(&size, sizeof(uint32_t)));
@@ -43,6 +57,9 @@ inline const char* packetTypeToString(PacketType type) {
     case PacketType::LoginFailed:   return "LoginFailed";
     case PacketType::AccountCreated: return "AccountCreated";
     case PacketType::AccountExists: return "AccountExists";
+    case PacketType::JoinRoom:      return "JoinRoom";
+    case PacketType::LeaveRoom:     return "LeaveRoom";
+    case PacketType::RateLimited:   return "RateLimited";
     default:                        return "Unknown";
     }
 }
@@ -85,6 +102,22 @@ TEST_CASE("ChatServer tests") {
         CHECK(response->getType() == PacketType::LoginFailed);
     }
 
+    SUBCASE("Pipelined frames in one write") {
+        TestClient client(io_context, TEST_PORT);
+
+        auto frames = Packet::preparePacketForSending(CreateUserPacket("piped", "pass"));
+        auto login = Packet::preparePacketForSending(LoginPacket("piped", "pass"));
+        frames.insert(frames.end(), login.begin(), login.end());
+        client.send_raw(frames);
+
+        auto response = client.receive();
+        REQUIRE(response != nullptr);
+        CHECK(response->getType() == PacketType::AccountCreated);
+        response = client.receive();
+        REQUIRE(response != nullptr);
+        CHECK(response->getType() == PacketType::LoginSuccess);
+    }
+
     SUBCASE("Message broadcasting") {
         TestClient client1(io_context, TEST_PORT);
         TestClient client2(io_context, TEST_PORT);
@@ -113,6 +146,107 @@ TEST_CASE("ChatServer tests") {
         CHECK(chat_msg->getMessage() == "Hello everyone!");
     }
 
+    SUBCASE("History replay on login") {
+        auto login = [](TestClient& client, const std::string& username) {
+            client.send(CreateUserPacket(username, "pass"));
+            client.receive(); // Account created
+            client.send(LoginPacket(username, "pass"));
+            client.receive(); // Login successful
+        };
+        // Next chat message, skipping join announcements
+        auto next_message = [](TestClient& client) {
+            while (true) {
+                auto response = client.receive();
+                REQUIRE(response != nullptr);
+                REQUIRE(response->getType() == PacketType::ChatMessage);
+                auto chat_msg = static_cast<ChatMessagePacket*>(response.get());
+                if (chat_msg->getSender() != "System") {
+                    return chat_msg->getMessage();
+                }
+            }
+        };
+
+        TestClient watcher(io_context, TEST_PORT);
+        login(watcher, "watcher");
+        TestClient client1(io_context, TEST_PORT);
+        login(client1, "history1");
+        client1.send(ChatMessagePacket("history1", "first"));
+        CHECK(next_message(watcher) == "first");
+
+        // Seeds the history from the database
+        TestClient client2(io_context, TEST_PORT);
+        login(client2, "history2");
+        CHECK(next_message(client2) == "first");
+
+        // Appended to the seeded history
+        client1.send(ChatMessagePacket("history1", "second"));
+        CHECK(next_message(watcher) == "second");
+        CHECK(next_message(client2) == "second");
+
+        TestClient client3(io_context, TEST_PORT);
+        login(client3, "history3");
+        CHECK(next_message(client3) == "first");
+        CHECK(next_message(client3) == "second");
+    }
+
+    SUBCASE("Rooms") {
+        const RoomId room = 7;
+        auto login = [](TestClient& client, const std::string& username) {
+            client.send(CreateUserPacket(username, "pass"));
+            auto response = client.receive();
+            while (response->getType() != PacketType::AccountCreated) {
+                response = client.receive();
+            }
+            client.send(LoginPacket(username, "pass"));
+            client.receive(); // Login successful
+        };
+        // Next chat message that is not a lobby announcement
+        auto next_message = [](TestClient& client) {
+            while (true) {
+                auto response = client.receive();
+                REQUIRE(response != nullptr);
+                REQUIRE(response->getType() == PacketType::ChatMessage);
+                auto chat_msg = static_cast<ChatMessagePacket*>(response.get());
+                if (chat_msg->getSender() != "System" || chat_msg->getRoom() != kLobbyRoom) {
+                    return ChatMessagePacket(chat_msg->getSender(), chat_msg->getMessage(), chat_msg->getRoom());
+                }
+            }
+        };
+
+        TestClient alice(io_context, TEST_PORT);
+        login(alice, "alice");
+        TestClient bob(io_context, TEST_PORT);
+        login(bob, "bob");
+        TestClient carol(io_context, TEST_PORT);
+        login(carol, "carol");
+
+        alice.send(JoinRoomPacket(room));
+        bob.send(JoinRoomPacket(room));
+        auto joined = next_message(alice);
+        CHECK(joined.getSender() == "System");
+        CHECK(joined.getRoom() == room);
+
+        // Not a member, dropped
+        carol.send(ChatMessagePacket("carol", "let me in", room));
+        alice.send(ChatMessagePacket("alice", "room only", room));
+        auto message = next_message(bob);
+        CHECK(message.getSender() == "alice");
+        CHECK(message.getMessage() == "room only");
+        CHECK(message.getRoom() == room);
+
+        // Carol only ever sees the lobby
+        alice.send(ChatMessagePacket("alice", "everyone"));
+        message = next_message(carol);
+        CHECK(message.getMessage() == "everyone");
+        CHECK(message.getRoom() == kLobbyRoom);
+        CHECK(next_message(bob).getMessage() == "everyone");
+
+        bob.send(LeaveRoomPacket(room));
+        auto left = next_message(alice);
+        CHECK(left.getSender() == "System");
+        CHECK(left.getMessage() == "bob has left the room.");
+    }
+
     SUBCASE("Multiple client handling") {
         std::vector<std::unique_ptr<TestClient>> clients;
         const int NUM_CLIENTS = 5;
@@ -177,7 +311,891 @@ TEST_CASE("ChatServer error handling") {
         CHECK(response->getType() == PacketType::LoginFailed);
     }
 
+    SUBCASE("Oversized frame is rejected") {
+        TestClient client(io_context, TEST_PORT);
+
+        // Claims a 100 KiB login, far beyond the per-type limit; the body never follows
+        std::vector<uint8_t> header{0x00, 0x90, 0x01, 0x00, static_cast<uint8_t>(PacketType::Login)};
+        client.send_raw(header);
+        CHECK(client.disconnected());
+    }
+
+    SUBCASE("Malformed packet is rejected") {
+        TestClient client(io_context, TEST_PORT);
+
+        // A string length pointing past the end of the frame
+        std::vector<uint8_t> frame{0x05, 0x00, 0x00, 0x00, static_cast<uint8_t>(PacketType::Login), 0xff, 0xff, 0x00, 0x00};
+        client.send_raw(frame);
+        CHECK(client.disconnected());
+    }
+
     // Clean up
     io_context.stop();
     server_thread.join();
 }
+
+TEST_CASE("ChatServer on multiple threads") {
+    const short TEST_PORT = 12348;
+    const int NUM_THREADS = 4;
+    const int NUM_CLIENTS = 8;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServer server(io_context, TEST_PORT, db_adapter);
+
+    auto work_guard = boost::asio::make_work_guard(io_context);
+    std::vector<std::thread> server_threads;
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        server_threads.emplace_back([&io_context]() {
+            io_context.run();
+        });
+    }
+
+    std::vector<std::unique_ptr<TestClient>> clients;
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        clients.push_back(std::make_unique<TestClient>(io_context, TEST_PORT));
+        std::string username = "mt_user" + std::to_string(i);
+        clients[i]->send(CreateUserPacket(username, "pass"));
+        auto response = clients[i]->receive();
+        while (response->getType() != PacketType::AccountCreated) {
+            response = clients[i]->receive();
+        }
+        clients[i]->send(LoginPacket(username, "pass"));
+        response = clients[i]->receive();
+        while (response->getType() != PacketType::LoginSuccess) {
+            response = clients[i]->receive();
+        }
+    }
+
+    // Every client talks at once, each one must see every other client's message
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        clients[i]->send(ChatMessagePacket("mt_user" + std::to_string(i), "ping"));
+    }
+
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        int pings = 0;
+        while (pings < NUM_CLIENTS - 1) {
+            auto response = clients[i]->receive();
+            REQUIRE(response != nullptr);
+            REQUIRE(response->getType() == PacketType::ChatMessage);
+            auto chat_msg = static_cast<ChatMessagePacket*>(response.get());
+            if (chat_msg->getSender() != "System") {
+                CHECK(chat_msg->getSender() != "mt_user" + std::to_string(i));
+                CHECK(chat_msg->getMessage() == "ping");
+                ++pings;
+            }
+        }
+    }
+
+    work_guard.reset();
+    io_context.stop();
+    for (auto& thread : server_threads) {
+        thread.join();
+    }
+}
+
+TEST_CASE("ChatServer slow consumer") {
+    const short TEST_PORT = 12349;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+
+    ChatServerConfig config;
+    config.backpressure.high_watermark_bytes = 16 * 1024;
+    config.backpressure.low_watermark_bytes = 4 * 1024;
+    config.backpressure.max_bytes = 64 * 1024;
+    config.backpressure.policy = SlowConsumerPolicy::Disconnect;
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    TestClient slow(io_context, TEST_PORT);
+    slow.send(CreateUserPacket("slow", "pass"));
+    slow.receive();
+    slow.send(LoginPacket("slow", "pass"));
+    slow.receive();
+
+    TestClient fast(io_context, TEST_PORT);
+    fast.send(CreateUserPacket("fast", "pass"));
+    auto response = fast.receive();
+    while (response->getType() != PacketType::AccountCreated) {
+        response = fast.receive();
+    }
+    fast.send(LoginPacket("fast", "pass"));
+
+    // `slow` never reads again, its queue fills once the socket buffers do
+    const std::string payload(4000, 'x');
+    auto& counters = server.backpressure_counters();
+    for (int i = 0; i < 20000 && counters.disconnects == 0; ++i) {
+        fast.send(ChatMessagePacket("fast", payload));
+    }
+    CHECK(counters.disconnects == 1);
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer slow consumer of batches") {
+    const short TEST_PORT = 12365;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+
+    ChatServerConfig config;
+    config.batch_interval = std::chrono::milliseconds(5);
+    config.backpressure.high_watermark_bytes = 512 * 1024;
+    config.backpressure.low_watermark_bytes = 128 * 1024;
+    config.backpressure.max_bytes = 8 * 1024 * 1024;
+    config.backpressure.policy = SlowConsumerPolicy::DropOldest;
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    TestClient slow(io_context, TEST_PORT);
+    slow.send(CreateUserPacket("slow", "pass"));
+    slow.receive();
+    slow.send(LoginPacket("slow", "pass", kCapMessageBatches));
+    REQUIRE(slow.receive()->getType() == PacketType::LoginSuccess);
+
+    TestClient fast(io_context, TEST_PORT);
+    fast.send(CreateUserPacket("fast", "pass"));
+    auto response = fast.receive();
+    while (response->getType() != PacketType::AccountCreated) {
+        response = fast.receive();
+    }
+    fast.send(LoginPacket("fast", "pass"));
+
+    // Nearly everything reaches `slow` in batches, which it never reads.
+    // They are dropped like single lines rather than piling up to max_bytes.
+    const std::string payload(1000, 'x');
+    auto& counters = server.backpressure_counters();
+    for (int i = 0; i < 100000 && counters.drop_events == 0 && counters.disconnects == 0; ++i) {
+        fast.send(ChatMessagePacket("fast", payload));
+    }
+    CHECK(counters.drop_events > 0);
+    CHECK(counters.disconnects == 0);
+    CHECK(server.metrics().batches.value() > 0);
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("Login limiter") {
+    LoginLimits limits;
+    limits.max_attempts_per_address = 5;
+    limits.max_failures_per_user = 2;
+    limits.window = std::chrono::seconds(10);
+    limits.max_tracked_keys = 4;
+    LoginLimiter limiter(limits);
+    auto now = LoginLimiter::Clock::now();
+
+    SUBCASE("Attempts per address") {
+        for (int i = 0; i < 5; ++i) {
+            CHECK(limiter.allow("10.0.0.1", "", now));
+        }
+        CHECK_FALSE(limiter.allow("10.0.0.1", "", now));
+        CHECK(limiter.allow("10.0.0.2", "", now));
+        // A new window starts over
+        CHECK(limiter.allow("10.0.0.1", "", now + std::chrono::seconds(10)));
+    }
+
+    SUBCASE("Failures per username") {
+        CHECK(limiter.allow("10.0.0.1", "alice", now));
+        limiter.fail("alice", now);
+        CHECK(limiter.allow("10.0.0.2", "alice", now));
+        limiter.fail("alice", now);
+        // Locked out from every address
+        CHECK_FALSE(limiter.allow("10.0.0.3", "alice", now));
+        CHECK(limiter.allow("10.0.0.3", "bob", now));
+        CHECK(limiter.allow("10.0.0.3", "alice", now + std::chrono::seconds(10)));
+
+        limiter.succeed("alice");
+        CHECK(limiter.allow("10.0.0.4", "alice", now));
+    }
+
+    SUBCASE("Tracking is bounded") {
+        for (int i = 0; i < 4; ++i) {
+            CHECK(limiter.allow("10.0.0." + std::to_string(i), "", now));
+        }
+        CHECK_FALSE(limiter.allow("10.0.0.9", "", now));
+        // Expired windows make room
+        CHECK(limiter.allow("10.0.0.9", "", now + std::chrono::seconds(10)));
+    }
+}
+
+TEST_CASE("ChatServer login limits") {
+    const short TEST_PORT = 12350;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServerConfig config;
+    config.login_limits.max_failures_per_user = 3;
+    config.login_limits.max_attempts_per_address = 5;
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    TestClient client(io_context, TEST_PORT);
+    client.send(CreateUserPacket("target", "right"));
+    CHECK(client.receive()->getType() == PacketType::AccountCreated);
+
+    // Pipelined guesses are still answered in order
+    std::vector<uint8_t> guesses;
+    for (int i = 0; i < 3; ++i) {
+        auto frame = Packet::preparePacketForSending(LoginPacket("target", "wrong" + std::to_string(i)));
+        guesses.insert(guesses.end(), frame.begin(), frame.end());
+    }
+    client.send_raw(guesses);
+    for (int i = 0; i < 3; ++i) {
+        CHECK(client.receive()->getType() == PacketType::LoginFailed);
+    }
+
+    // Locked out, even with the right password
+    client.send(LoginPacket("target", "right"));
+    CHECK(client.receive()->getType() == PacketType::LoginFailed);
+
+    // The lockout spent none of the address's attempts, this takes the last.
+    // Being out of them is not to be mistaken for the name being taken.
+    client.send(CreateUserPacket("newcomer", "pass"));
+    CHECK(client.receive()->getType() == PacketType::AccountCreated);
+    client.send(CreateUserPacket("latecomer", "pass"));
+    CHECK(client.receive()->getType() == PacketType::RateLimited);
+
+    io_context.stop();
+    server_thread.join();
+}
+
+// Answers every password check as a saturated hasher would, while `busy`
+class BusyDatabaseAdapter : public InMemoryDatabaseAdapter {
+public:
+    explicit BusyDatabaseAdapter(boost::asio::io_context& io_context)
+        : InMemoryDatabaseAdapter(io_context), io_context_(io_context) {}
+
+    void authenticateUser(const std::string& username, const std::string& password, AuthCallback callback) override {
+        if (busy) {
+            postCallback(io_context_, callback, AuthResult::Busy);
+            return;
+        }
+        InMemoryDatabaseAdapter::authenticateUser(username, password, std::move(callback));
+    }
+
+    void createUser(const std::string& username, const std::string& password, AuthCallback callback) override {
+        if (busy) {
+            postCallback(io_context_, callback, AuthResult::Busy);
+            return;
+        }
+        InMemoryDatabaseAdapter::createUser(username, password, std::move(callback));
+    }
+
+    std::atomic<bool> busy{false};
+
+private:
+    boost::asio::io_context& io_context_;
+};
+
+TEST_CASE("ChatServer with a busy password hasher") {
+    const short TEST_PORT = 12366;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<BusyDatabaseAdapter>(io_context);
+    ChatServerConfig config;
+    config.login_limits.max_failures_per_user = 2;
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    TestClient client(io_context, TEST_PORT);
+    client.send(CreateUserPacket("alice", "pass"));
+    CHECK(client.receive()->getType() == PacketType::AccountCreated);
+
+    db_adapter->busy = true;
+    client.send(CreateUserPacket("bob", "pass"));
+    CHECK(client.receive()->getType() == PacketType::RateLimited);
+    // More than it takes to lock alice out, were they failures
+    for (int i = 0; i < 3; ++i) {
+        client.send(LoginPacket("alice", "pass"));
+        CHECK(client.receive()->getType() == PacketType::RateLimited);
+    }
+
+    db_adapter->busy = false;
+    client.send(LoginPacket("alice", "pass"));
+    CHECK(client.receive()->getType() == PacketType::LoginSuccess);
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer metrics endpoint") {
+    const short TEST_PORT = 12351;
+    const unsigned short METRICS_PORT = 12352;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServerConfig config;
+    config.metrics_port = METRICS_PORT;
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    TestClient client(io_context, TEST_PORT);
+    client.send(CreateUserPacket("watched", "secret"));
+    CHECK(client.receive()->getType() == PacketType::AccountCreated);
+    client.send(LoginPacket("watched", "secret"));
+    CHECK(client.receive()->getType() == PacketType::LoginSuccess);
+
+    auto scrape = [&io_context](const std::string& request) {
+        boost::asio::ip::tcp::socket socket(io_context);
+        socket.connect({boost::asio::ip::address::from_string("127.0.0.1"), METRICS_PORT});
+        boost::asio::write(socket, boost::asio::buffer(request));
+        std::string response;
+        boost::system::error_code ec;
+        boost::asio::read(socket, boost::asio::dynamic_buffer(response), ec);
+        return response;
+    };
+
+    std::string response = scrape("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    CHECK(response.rfind("HTTP/1.0 200 OK\r\n", 0) == 0);
+    CHECK(response.find("chat_packets_received_total{type=\"Login\"} 1\n") != std::string::npos);
+    CHECK(response.find("chat_packets_received_total{type=\"CreateUser\"} 1\n") != std::string::npos);
+    CHECK(response.find("chat_sessions 1\n") != std::string::npos);
+    CHECK(response.find("chat_db_callback_seconds_count{op=\"authenticate_user\"} 1\n") != std::string::npos);
+
+    CHECK(scrape("GET /other HTTP/1.1\r\n\r\n").rfind("HTTP/1.0 404", 0) == 0);
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer compression") {
+    const short TEST_PORT = 12353;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServer server(io_context, TEST_PORT, db_adapter);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    auto login = [&](TestClient& client, const std::string& username, uint32_t capabilities) {
+        client.send(CreateUserPacket(username, "pass"));
+        CHECK(client.receive()->getType() == PacketType::AccountCreated);
+        client.send(LoginPacket(username, "pass", capabilities));
+        auto response = client.receive();
+        REQUIRE(response->getType() == PacketType::LoginSuccess);
+        return static_cast<LoginSuccessPacket*>(response.get())->getCapabilities();
+    };
+
+    TestClient plain(io_context, TEST_PORT);
+    CHECK(login(plain, "plain", 0) == 0);
+    TestClient compressed(io_context, TEST_PORT);
+    CHECK(login(compressed, "compressed", kCapCompressedFrames) == kCapCompressedFrames);
+    // The join announcement is short and goes out as it is
+    CHECK(plain.receive()->getType() == PacketType::ChatMessage);
+
+    std::string text;
+    for (int i = 0; text.size() < 1000; ++i) {
+        text += "a fairly long chat line, number " + std::to_string(i) + ". ";
+    }
+
+    SUBCASE("Long broadcasts are compressed for those who asked") {
+        TestClient sender(io_context, TEST_PORT);
+        login(sender, "sender", 0);
+        plain.receive();  // join announcements
+        compressed.receive();
+
+        sender.send(ChatMessagePacket("sender", text));
+        auto raw = plain.receive();
+        REQUIRE(raw->getType() == PacketType::ChatMessage);
+        CHECK(static_cast<ChatMessagePacket*>(raw.get())->getMessage() == text);
+
+        auto packet = compressed.receive();
+        REQUIRE(packet->getType() == PacketType::Compressed);
+        auto& wrapper = static_cast<CompressedPacket&>(*packet);
+        CHECK(wrapper.getData().size() < text.size() / 2);
+        auto frame = Packet::preparePacketForSending(wrapper);
+        auto view = viewPacket<CompressedPacketView>(std::span<const uint8_t>(frame).subspan(sizeof(uint32_t)));
+        REQUIRE(view.has_value());
+        std::vector<uint8_t> inflated;
+        REQUIRE(inflateFrames(*view, kMaxFrameSize, inflated));
+        auto inner = createPacketFromData(std::span<const uint8_t>(inflated).subspan(sizeof(uint32_t)));
+        REQUIRE(inner != nullptr);
+        CHECK(static_cast<ChatMessagePacket*>(inner.get())->getMessage() == text);
+        CHECK(server.metrics().frames_compressed.value() == 1);
+    }
+
+    SUBCASE("Compressed frames from a client are unpacked") {
+        std::vector<uint8_t> frames;
+        for (int i = 0; i < 3; ++i) {
+            auto line = Packet::preparePacketForSending(ChatMessagePacket("compressed", text));
+            frames.insert(frames.end(), line.begin(), line.end());
+        }
+        auto frame = compressFrames(frames, 6);
+        REQUIRE(frame.has_value());
+        uint64_t handled = server.metrics().packet_handling.count();
+        compressed.send_raw(*frame);
+        for (int i = 0; i < 3; ++i) {
+            auto received = plain.receive();
+            REQUIRE(received->getType() == PacketType::ChatMessage);
+            CHECK(static_cast<ChatMessagePacket*>(received.get())->getMessage() == text);
+        }
+        // Timed once as a whole, the ping may not have been yet
+        compressed.send(PingPacket(1));
+        CHECK(compressed.receive()->getType() == PacketType::Pong);
+        CHECK(server.metrics().packet_handling.count() >= handled + 1);
+        CHECK(server.metrics().packet_handling.count() <= handled + 2);
+    }
+
+    SUBCASE("Only after negotiating it") {
+        auto frame = compressFrames(Packet::preparePacketForSending(ChatMessagePacket("plain", text)), 6);
+        REQUIRE(frame.has_value());
+        plain.send_raw(*frame);
+        CHECK(plain.disconnected());
+    }
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer message batches") {
+    const short TEST_PORT = 12354;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServerConfig config;
+    config.batch_interval = std::chrono::milliseconds(100);
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    auto login = [&](TestClient& client, const std::string& username, uint32_t capabilities) {
+        client.send(CreateUserPacket(username, "pass"));
+        CHECK(client.receive()->getType() == PacketType::AccountCreated);
+        client.send(LoginPacket(username, "pass", capabilities));
+        auto response = client.receive();
+        REQUIRE(response->getType() == PacketType::LoginSuccess);
+        return static_cast<LoginSuccessPacket*>(response.get())->getCapabilities();
+    };
+
+    TestClient batching(io_context, TEST_PORT);
+    CHECK(login(batching, "batching", kCapMessageBatches) == kCapMessageBatches);
+    TestClient plain(io_context, TEST_PORT);
+    CHECK(login(plain, "plain", 0) == 0);
+    TestClient sender(io_context, TEST_PORT);
+    login(sender, "sender", kCapMessageBatches);
+    // Join announcements are never held back
+    CHECK(batching.receive()->getType() == PacketType::ChatMessage);
+    CHECK(batching.receive()->getType() == PacketType::ChatMessage);
+    CHECK(plain.receive()->getType() == PacketType::ChatMessage);
+
+    sender.send(ChatMessagePacket("sender", "one"));
+    sender.send(ChatMessagePacket("sender", "two"));
+    sender.send(ChatMessagePacket("sender", "three"));
+
+    // Those who did not ask get every line as it comes
+    for (const char* text : {"one", "two", "three"}) {
+        auto packet = plain.receive();
+        REQUIRE(packet->getType() == PacketType::ChatMessage);
+        CHECK(static_cast<ChatMessagePacket*>(packet.get())->getMessage() == text);
+    }
+
+    // The first line in a quiet room is not delayed, the rest wait for the tick
+    auto first = batching.receive();
+    REQUIRE(first->getType() == PacketType::ChatMessage);
+    CHECK(static_cast<ChatMessagePacket*>(first.get())->getMessage() == "one");
+    auto batch = batching.receive();
+    REQUIRE(batch->getType() == PacketType::ChatMessageBatch);
+    auto& lines = static_cast<ChatMessageBatchPacket&>(*batch);
+    CHECK(lines.getRoom() == kLobbyRoom);
+    using Lines = std::vector<std::pair<std::string, std::string>>;
+    CHECK(lines.getMessages() == Lines{{"sender", "two"}, {"sender", "three"}});
+    CHECK(server.metrics().batched_lines.value() == 2);
+
+    // The sender never gets its own lines back, so the next thing it sees
+    // is this one, alone or still in a batch
+    plain.send(ChatMessagePacket("plain", "four"));
+    auto next = sender.receive();
+    if (next->getType() == PacketType::ChatMessageBatch) {
+        CHECK(static_cast<ChatMessageBatchPacket&>(*next).getMessages() == Lines{{"plain", "four"}});
+    } else {
+        REQUIRE(next->getType() == PacketType::ChatMessage);
+        CHECK(static_cast<ChatMessagePacket*>(next.get())->getMessage() == "four");
+    }
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer cluster") {
+    const short NODE_A = 12355;
+    const short BUS_A = 12356;
+    const short NODE_B = 12357;
+    const short BUS_B = 12358;
+    boost::asio::io_context io_context;
+    // The nodes share their users and messages
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServerConfig config_a;
+    config_a.cluster.node_id = 1;
+    config_a.cluster.port = BUS_A;
+    config_a.cluster.peers = {"127.0.0.1:" + std::to_string(BUS_B)};
+    config_a.cluster.reconnect_interval = std::chrono::milliseconds(20);
+    ChatServerConfig config_b = config_a;
+    config_b.cluster.node_id = 2;
+    config_b.cluster.port = BUS_B;
+    config_b.cluster.peers = {"127.0.0.1:" + std::to_string(BUS_A)};
+    ChatServer node_a(io_context, NODE_A, db_adapter, config_a);
+    ChatServer node_b(io_context, NODE_B, db_adapter, config_b);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    TestClient alice(io_context, NODE_A);
+    TestClient bob(io_context, NODE_B);
+    for (int i = 0; i < 200 && (node_a.cluster()->connected_peers() == 0 || node_b.cluster()->connected_peers() == 0); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(node_a.cluster()->connected_peers() == 1);
+    REQUIRE(node_b.cluster()->connected_peers() == 1);
+
+    auto login = [&](TestClient& client, const std::string& username) {
+        client.send(CreateUserPacket(username, "pass"));
+        CHECK(client.receive()->getType() == PacketType::AccountCreated);
+        client.send(LoginPacket(username, "pass"));
+        REQUIRE(client.receive()->getType() == PacketType::LoginSuccess);
+    };
+    auto expect = [](TestClient& client, const std::string& sender, const std::string& text) {
+        auto packet = client.receive();
+        REQUIRE(packet->getType() == PacketType::ChatMessage);
+        auto& message = static_cast<ChatMessagePacket&>(*packet);
+        CHECK(message.getSender() == sender);
+        CHECK(message.getMessage() == text);
+    };
+
+    login(alice, "alice");
+    expect(bob, "System", "alice has joined the chat.");
+    login(bob, "bob");
+    expect(alice, "System", "bob has joined the chat.");
+
+    // Either way across, in the order each node sent them
+    alice.send(ChatMessagePacket("alice", "one"));
+    alice.send(ChatMessagePacket("alice", "two"));
+    expect(bob, "alice", "one");
+    expect(bob, "alice", "two");
+    bob.send(ChatMessagePacket("bob", "three"));
+    expect(alice, "bob", "three");
+
+    CHECK(node_a.metrics().cluster_published.value() == 3);
+    CHECK(node_b.metrics().cluster_received.value() == 3);
+
+    SUBCASE("Only other nodes speak on the bus") {
+        TestClient stranger(io_context, BUS_A);
+        stranger.send(ChatMessagePacket("mallory", "hello"));
+        CHECK(stranger.disconnected());
+    }
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer session timeouts") {
+    const short TEST_PORT = 12359;
+    boost::asio::io_context io_context;
+    // Cheap hashes, creating an account and logging in have to fit in the
+    // login timeout even on a single slow core
+    CredentialHasherConfig hasher;
+    hasher.cost = 4;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context, 10000, hasher);
+    ChatServerConfig config;
+    config.timeouts.login = std::chrono::milliseconds(200);
+    config.timeouts.frame = std::chrono::milliseconds(100);
+    config.timeouts.idle = std::chrono::milliseconds(300);
+    config.timeouts.ping_interval = std::chrono::milliseconds(100);
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    auto login = [&](TestClient& client, const std::string& username, uint32_t capabilities) {
+        client.send(CreateUserPacket(username, "pass"));
+        CHECK(client.receive()->getType() == PacketType::AccountCreated);
+        client.send(LoginPacket(username, "pass", capabilities));
+        auto response = client.receive();
+        REQUIRE(response->getType() == PacketType::LoginSuccess);
+        return static_cast<LoginSuccessPacket*>(response.get())->getCapabilities();
+    };
+
+    SUBCASE("Connections that never log in") {
+        TestClient client(io_context, TEST_PORT);
+        CHECK(client.disconnected());
+        CHECK(server.metrics().login_timeouts.value() == 1);
+    }
+
+    SUBCASE("A frame that stops halfway") {
+        TestClient client(io_context, TEST_PORT);
+        login(client, "slow", 0);
+        auto frame = Packet::preparePacketForSending(ChatMessagePacket("slow", "never finished"));
+        frame.resize(frame.size() / 2);
+        client.send_raw(frame);
+        CHECK(client.disconnected());
+        CHECK(server.metrics().frame_timeouts.value() == 1);
+    }
+
+    SUBCASE("Quiet sessions are closed") {
+        TestClient client(io_context, TEST_PORT);
+        login(client, "quiet", 0);
+        CHECK(client.disconnected());
+        CHECK(server.metrics().idle_timeouts.value() == 1);
+    }
+
+    SUBCASE("Unless they answer the pings") {
+        TestClient client(io_context, TEST_PORT);
+        CHECK(login(client, "alive", kCapKeepalive) == kCapKeepalive);
+        // Longer than the idle timeout
+        for (int i = 0; i < 6; ++i) {
+            auto ping = client.receive();
+            REQUIRE(ping->getType() == PacketType::Ping);
+            client.send(PongPacket(static_cast<PingPacket&>(*ping).getNonce()));
+        }
+        CHECK(server.metrics().idle_timeouts.value() == 0);
+        // Then stop answering
+        while (!client.disconnected()) {
+        }
+        CHECK(server.metrics().idle_timeouts.value() == 1);
+    }
+
+    SUBCASE("Pings from the client are answered") {
+        TestClient client(io_context, TEST_PORT);
+        login(client, "pinger", 0);
+        client.send(PingPacket(42));
+        auto pong = client.receive();
+        REQUIRE(pong->getType() == PacketType::Pong);
+        CHECK(static_cast<PongPacket&>(*pong).getNonce() == 42);
+    }
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer connection limit") {
+    const short TEST_PORT = 12360;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServerConfig config;
+    config.accept.max_connections = 1;
+    config.accept.backoff = std::chrono::milliseconds(20);
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    auto first = std::make_unique<TestClient>(io_context, TEST_PORT);
+    first->send(CreateUserPacket("first", "pass"));
+    CHECK(first->receive()->getType() == PacketType::AccountCreated);
+
+    // Waits in the listen backlog while the first one is there
+    TestClient second(io_context, TEST_PORT);
+    second.send(CreateUserPacket("second", "pass"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(server.metrics().sessions.value() == 1);
+    CHECK(server.metrics().accept_backoffs.value() >= 1);
+
+    first.reset();
+    CHECK(second.receive()->getType() == PacketType::AccountCreated);
+    CHECK(server.metrics().sessions.value() == 1);
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer drain") {
+    const short TEST_PORT = 12361;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServerConfig config;
+    config.reuse_port = true;
+    config.drain.spread = std::chrono::milliseconds(200);
+    config.drain.flush_timeout = std::chrono::milliseconds(1000);
+    auto server = std::make_unique<ChatServer>(io_context, TEST_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    auto login = [&](TestClient& client, const std::string& username) {
+        client.send(CreateUserPacket(username, "pass"));
+        CHECK(client.receive()->getType() == PacketType::AccountCreated);
+        client.send(LoginPacket(username, "pass"));
+        CHECK(client.receive()->getType() == PacketType::LoginSuccess);
+    };
+    TestClient alice(io_context, TEST_PORT);
+    login(alice, "alice");
+    TestClient bob(io_context, TEST_PORT);
+    login(bob, "bob");
+    CHECK(alice.receive()->getType() == PacketType::ChatMessage);
+
+    // The next release, started while this one still runs
+    ChatServerConfig next_config;
+    SUBCASE("Listener handed over") {
+        next_config.listen_fd = dup(server->listener_handle());
+    }
+    SUBCASE("Port shared") {
+        next_config.reuse_port = true;
+    }
+    ChatServer next(io_context, TEST_PORT, db_adapter, next_config);
+
+    std::promise<void> drained;
+    server->drain([&drained] { drained.set_value(); });
+    CHECK(server->draining());
+    // Nothing but an orderly end of file, not even each other leaving
+    CHECK(alice.disconnected());
+    CHECK(bob.disconnected());
+    CHECK(drained.get_future().wait_for(std::chrono::seconds(2)) == std::future_status::ready);
+    CHECK(server->metrics().sessions.value() == 0);
+
+    // And they come back to the next one
+    TestClient again(io_context, TEST_PORT);
+    again.send(LoginPacket("alice", "pass"));
+    CHECK(again.receive()->getType() == PacketType::LoginSuccess);
+    CHECK(next.metrics().sessions.value() == 1);
+
+    next.stop();
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer resume") {
+    const short TEST_PORT = 12362;
+    const short OTHER_PORT = 12363;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServerConfig config;
+    config.resume.key = "shared by every release";
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+    // The next release, or another node
+    ChatServer other(io_context, OTHER_PORT, db_adapter, config);
+
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+
+    auto login = [&](TestClient& client, const std::string& username) {
+        client.send(CreateUserPacket(username, "pass"));
+        CHECK(client.receive()->getType() == PacketType::AccountCreated);
+        client.send(LoginPacket(username, "pass"));
+        auto response = client.receive();
+        REQUIRE(response->getType() == PacketType::LoginSuccess);
+        return static_cast<LoginSuccessPacket&>(*response);
+    };
+    auto chat_line = [](TestClient& client) {
+        auto packet = client.receive();
+        REQUIRE(packet->getType() == PacketType::ChatMessage);
+        return static_cast<ChatMessagePacket&>(*packet);
+    };
+    auto resume = [](TestClient& client, const std::string& token, HistoryId last_seen) {
+        client.send(ResumePacket(token, last_seen));
+        return client.receive();
+    };
+
+    auto alice = std::make_unique<TestClient>(io_context, TEST_PORT);
+    auto alice_login = login(*alice, "alice");
+    CHECK(!alice_login.getResumeToken().empty());
+    CHECK(alice_login.getReplayAfter() == 0);
+    TestClient bob(io_context, TEST_PORT);
+    login(bob, "bob");
+    CHECK(chat_line(*alice).getHistoryId() == 0);
+
+    for (int i = 1; i <= 3; ++i) {
+        bob.send(ChatMessagePacket("bob", "line " + std::to_string(i)));
+        CHECK(chat_line(*alice).getHistoryId() == static_cast<HistoryId>(i));
+    }
+    // Alice drops off and misses two lines
+    alice.reset();
+    CHECK(chat_line(bob).getMessage() == "alice has left the chat.");
+    bob.send(ChatMessagePacket("bob", "line 4"));
+    bob.send(ChatMessagePacket("bob", "line 5"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    uint64_t authentications = server.metrics().db_authenticate.count();
+
+    SUBCASE("Only what was missed, without a password") {
+        TestClient client(io_context, TEST_PORT);
+        auto response = resume(client, alice_login.getResumeToken(), 3);
+        REQUIRE(response->getType() == PacketType::LoginSuccess);
+        // The replay picks up after what alice has
+        CHECK(static_cast<LoginSuccessPacket&>(*response).getReplayAfter() == 3);
+        auto missed = chat_line(client);
+        CHECK(missed.getMessage() == "line 4");
+        CHECK(missed.getHistoryId() == 4);
+        CHECK(chat_line(client).getMessage() == "line 5");
+        CHECK(chat_line(bob).getMessage() == "alice has joined the chat.");
+        CHECK(server.metrics().resumes.value() == 1);
+        CHECK(server.metrics().db_authenticate.count() == authentications);
+    }
+
+    SUBCASE("Forged and foreign tokens") {
+        std::string forged = alice_login.getResumeToken();
+        forged.back() ^= 1;
+        TestClient client(io_context, TEST_PORT);
+        CHECK(resume(client, forged, 3)->getType() == PacketType::LoginFailed);
+        ChatServerConfig stranger_config;
+        stranger_config.resume.key = "some other deployment";
+        ResumeTokens stranger(stranger_config.resume);
+        CHECK(resume(client, stranger.issue("alice", 0), 3)->getType() == PacketType::LoginFailed);
+        CHECK(server.metrics().resumes_rejected.value() == 2);
+    }
+
+    SUBCASE("Another process replays all of it") {
+        TestClient client(io_context, OTHER_PORT);
+        auto response = resume(client, alice_login.getResumeToken(), 3);
+        REQUIRE(response->getType() == PacketType::LoginSuccess);
+        CHECK(static_cast<LoginSuccessPacket&>(*response).getReplayAfter() == 0);
+        for (int i = 1; i <= 5; ++i) {
+            CHECK(chat_line(client).getMessage() == "line " + std::to_string(i));
+        }
+        CHECK(other.metrics().resumes.value() == 1);
+    }
+
+    io_context.stop();
+    server_thread.join();
+}
+
+TEST_CASE("ChatServer socket tuning") {
+    const short TEST_PORT = 12364;
+    boost::asio::io_context io_context;
+    auto db_adapter = std::make_shared<InMemoryDatabaseAdapter>(io_context);
+    ChatServerConfig config;
+    config.socket_tuning.receive_buffer = 256 * 1024;
+    config.socket_tuning.notsent_lowat = 16 * 1024;
+    config.accept.batch = 4;
+    ChatServer server(io_context, TEST_PORT, db_adapter, config);
+
+    // Linux doubles it for its bookkeeping
+    int receive_buffer = 0;
+    socklen_t length = sizeof(receive_buffer);
+    REQUIRE(getsockopt(server.listener_handle(), SOL_SOCKET, SO_RCVBUF, &receive_buffer, &length) == 0);
+    CHECK(receive_buffer >= config.socket_tuning.receive_buffer);
+
+    // Already waiting in the backlog when the server starts accepting, more
+    // than a batch of them
+    std::vector<std::unique_ptr<TestClient>> clients;
+    for (int i = 0; i < 10; ++i) {
+        clients.push_back(std::make_unique<TestClient>(io_context, TEST_PORT));
+    }
+    std::thread server_thread([&io_context]() {
+        io_context.run();
+    });
+    for (size_t i = 0; i < clients.size(); ++i) {
+        clients[i]->send(CreateUserPacket("user" + std::to_string(i), "pass"));
+        CHECK(clients[i]->receive()->getType() == PacketType::AccountCreated);
+    }
+    CHECK(server.metrics().sessions.value() == 10);
+
+    io_context.stop();
+    server_thread.join();
+}
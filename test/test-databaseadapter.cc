@@ -0,0 +1,517 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+#include "scope_exit.hh"
+#include "chat_example/databaseadapter.hh"
+#include "chat_example/filedatabaseadapter.hh"
+#include "chat_example/groupcommitdatabaseadapter.hh"
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sys/resource.h>
+#include <thread>
+
+namespace {
+
+std::filesystem::path temp_log_path(const std::string& name) {
+    auto path = std::filesystem::temp_directory_path() / ("chat-example-" + name + ".log");
+    std::filesystem::remove(path);
+    return path;
+}
+
+// Runs the io_context until `result` has been set by a callback
+template<typename T>
+T wait_for(boost::asio::io_context& io_context, std::optional<T>& result) {
+    auto start = std::chrono::steady_clock::now();
+    while (!result && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+        io_context.run_for(std::chrono::milliseconds(10));
+        if (io_context.stopped()) {
+            io_context.restart();
+        }
+    }
+    REQUIRE(result.has_value());
+    return *result;
+}
+
+AuthResult authenticate_result(boost::asio::io_context& io_context, DatabaseAdapter& db,
+                               const std::string& username, const std::string& password) {
+    std::optional<AuthResult> result;
+    db.authenticateUser(username, password, [&](AuthResult outcome) { result = outcome; });
+    return wait_for(io_context, result);
+}
+
+AuthResult create_user_result(boost::asio::io_context& io_context, DatabaseAdapter& db,
+                              const std::string& username, const std::string& password) {
+    std::optional<AuthResult> result;
+    db.createUser(username, password, [&](AuthResult outcome) { result = outcome; });
+    return wait_for(io_context, result);
+}
+
+bool authenticate(boost::asio::io_context& io_context, DatabaseAdapter& db,
+                  const std::string& username, const std::string& password) {
+    return authenticate_result(io_context, db, username, password) == AuthResult::Ok;
+}
+
+bool create_user(boost::asio::io_context& io_context, DatabaseAdapter& db,
+                 const std::string& username, const std::string& password) {
+    return create_user_result(io_context, db, username, password) == AuthResult::Ok;
+}
+
+bool store(boost::asio::io_context& io_context, DatabaseAdapter& db, const ChatMessage& message) {
+    std::optional<bool> result;
+    db.storeMessage(message, [&](bool success) { result = success; });
+    return wait_for(io_context, result);
+}
+
+// Counts how many batches reach the backend
+class CountingDatabaseAdapter : public InMemoryDatabaseAdapter {
+public:
+    using InMemoryDatabaseAdapter::InMemoryDatabaseAdapter;
+
+    void storeMessages(std::vector<ChatMessage> messages, StoreMessageCallback callback) override {
+        batch_sizes.push_back(messages.size());
+        InMemoryDatabaseAdapter::storeMessages(std::move(messages), std::move(callback));
+    }
+
+    std::vector<size_t> batch_sizes;
+};
+
+// Holds every batch at the door until opened, noting the first line of each
+class GatedDatabaseAdapter : public InMemoryDatabaseAdapter {
+public:
+    using InMemoryDatabaseAdapter::InMemoryDatabaseAdapter;
+
+    void storeMessages(std::vector<ChatMessage> messages, StoreMessageCallback callback) override {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            firsts.push_back(messages.front().content);
+            changed.notify_all();
+            changed.wait_for(lock, std::chrono::seconds(5), [this] { return open; });
+        }
+        InMemoryDatabaseAdapter::storeMessages(std::move(messages), std::move(callback));
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool open = false;
+    std::vector<std::string> firsts;
+};
+
+std::vector<ChatMessage> recent(boost::asio::io_context& io_context, DatabaseAdapter& db, size_t limit) {
+    std::optional<std::vector<ChatMessage>> result;
+    db.getRecentMessages(limit, [&](MessageSnapshot messages) { result = *messages; });
+    return wait_for(io_context, result);
+}
+
+MessageSnapshot range(boost::asio::io_context& io_context, DatabaseAdapter& db,
+                      std::chrono::system_clock::time_point start,
+                      std::chrono::system_clock::time_point end) {
+    std::optional<MessageSnapshot> result;
+    db.getMessagesByTimeRange(start, end, [&](MessageSnapshot messages) { result = messages; });
+    return wait_for(io_context, result);
+}
+
+}
+
+TEST_CASE("MessageRing") {
+    auto base = std::chrono::system_clock::now();
+    auto at = [&](int seconds) { return base + std::chrono::seconds(seconds); };
+
+    MessageRing ring(4);
+    for (int i = 0; i < 6; ++i) {
+        ring.push(ChatMessage("alice", std::to_string(i), at(i)));
+    }
+
+    SUBCASE("Keeps only the newest messages") {
+        REQUIRE(ring.size() == 4);
+        CHECK(ring[0].content == "2");
+        CHECK(ring[3].content == "5");
+
+        auto recent = ring.recent(2);
+        REQUIRE(recent->size() == 2);
+        CHECK((*recent)[0].content == "4");
+        CHECK((*recent)[1].content == "5");
+        CHECK(ring.recent(50)->size() == 4);
+    }
+
+    SUBCASE("Range queries include both ends") {
+        auto messages = ring.range(at(3), at(4));
+        REQUIRE(messages->size() == 2);
+        CHECK((*messages)[0].content == "3");
+        CHECK((*messages)[1].content == "4");
+        CHECK(ring.range(at(0), at(1))->empty());
+        CHECK(ring.range(at(0), at(10))->size() == 4);
+        CHECK(ring.range(at(7), at(10))->empty());
+    }
+
+    SUBCASE("Late messages are put in timestamp order") {
+        ring.push(ChatMessage("bob", "late", at(4) - std::chrono::milliseconds(1)));
+        REQUIRE(ring.size() == 4);
+        CHECK(ring[0].content == "3");
+        CHECK(ring[1].content == "late");
+        CHECK(ring[2].content == "4");
+        CHECK(ring[3].content == "5");
+    }
+}
+
+TEST_CASE("InMemoryDatabaseAdapter") {
+    boost::asio::io_context io_context;
+    InMemoryDatabaseAdapter db(io_context, 8);
+    auto base = std::chrono::system_clock::now();
+
+    for (int i = 0; i < 20; ++i) {
+        CHECK(store(io_context, db, ChatMessage("alice", std::to_string(i), base + std::chrono::seconds(i))));
+    }
+
+    SUBCASE("History is bounded") {
+        auto messages = recent(io_context, db, 50);
+        REQUIRE(messages.size() == 8);
+        CHECK(messages.front().content == "12");
+        CHECK(messages.back().content == "19");
+    }
+
+    SUBCASE("Recent history is shared until the next store") {
+        std::optional<MessageSnapshot> first, second, third;
+        db.getRecentMessages(5, [&](MessageSnapshot messages) { first = messages; });
+        db.getRecentMessages(5, [&](MessageSnapshot messages) { second = messages; });
+        wait_for(io_context, second);
+        CHECK(*first == *second);
+
+        CHECK(store(io_context, db, ChatMessage("alice", "20", base + std::chrono::seconds(20))));
+        db.getRecentMessages(5, [&](MessageSnapshot messages) { third = messages; });
+        wait_for(io_context, third);
+        CHECK(*third != *first);
+        CHECK((*third)->back().content == "20");
+        CHECK((*first)->back().content == "19");
+    }
+
+    SUBCASE("Time range") {
+        auto messages = range(io_context, db, base + std::chrono::seconds(15), base + std::chrono::seconds(16));
+        REQUIRE(messages->size() == 2);
+        CHECK((*messages)[0].content == "15");
+        CHECK((*messages)[1].content == "16");
+    }
+    SUBCASE("Awaitable from a coroutine") {
+        auto strand = boost::asio::make_strand(io_context);
+        std::optional<bool> on_strand;
+        boost::asio::co_spawn(strand, [&]() -> boost::asio::awaitable<void> {
+            using boost::asio::use_awaitable;
+            bool created = co_await db.asyncCreateUser("bob", "secret", use_awaitable) == AuthResult::Ok;
+            bool authenticated = co_await db.asyncAuthenticateUser("bob", "secret", use_awaitable) == AuthResult::Ok;
+            bool rejected = co_await db.asyncAuthenticateUser("bob", "wrong", use_awaitable) == AuthResult::Rejected;
+            std::vector<ChatMessage> messages;
+            messages.emplace_back("bob", "20", base + std::chrono::seconds(20));
+            messages.emplace_back("bob", "21", base + std::chrono::seconds(21));
+            bool stored = co_await db.asyncStoreMessages(std::move(messages), use_awaitable);
+            auto recent = co_await db.asyncGetRecentMessages(1, use_awaitable);
+            auto range = co_await db.asyncGetMessagesByTimeRange(base + std::chrono::seconds(20),
+                                                                 base + std::chrono::seconds(30), use_awaitable);
+            CHECK(created);
+            CHECK(authenticated);
+            CHECK(rejected);
+            CHECK(stored);
+            CHECK(recent->back().content == "21");
+            CHECK(range->size() == 2);
+            // The hashes finish on the hasher's thread
+            on_strand = strand.running_in_this_thread();
+        }, boost::asio::detached);
+        CHECK(wait_for(io_context, on_strand));
+    }
+}
+
+TEST_CASE("FileDatabaseAdapter") {
+    boost::asio::io_context io_context;
+    auto path = temp_log_path("file-adapter");
+    SCOPE_EXIT({ std::filesystem::remove(path); });
+
+    SUBCASE("Users and messages") {
+        FileDatabaseAdapter db(io_context, path);
+        CHECK(create_user(io_context, db, "alice", "secret"));
+        CHECK_FALSE(create_user(io_context, db, "alice", "other"));
+        CHECK(authenticate(io_context, db, "alice", "secret"));
+        CHECK_FALSE(authenticate(io_context, db, "alice", "wrong"));
+        CHECK_FALSE(authenticate(io_context, db, "bob", "secret"));
+
+        for (int i = 0; i < 5; ++i) {
+            CHECK(store(io_context, db, ChatMessage("alice", "message " + std::to_string(i))));
+        }
+        auto messages = recent(io_context, db, 3);
+        REQUIRE(messages.size() == 3);
+        CHECK(messages[0].content == "message 2");
+        CHECK(messages[2].content == "message 4");
+    }
+
+    SUBCASE("Time range") {
+        auto base = std::chrono::system_clock::now();
+        {
+            FileDatabaseAdapter db(io_context, path);
+            // Stored out of order, queries still see timestamp order
+            for (int i : {0, 1, 3, 2, 4}) {
+                CHECK(store(io_context, db, ChatMessage("alice", std::to_string(i), base + std::chrono::seconds(i))));
+            }
+            auto messages = range(io_context, db, base + std::chrono::seconds(1), base + std::chrono::seconds(3));
+            REQUIRE(messages->size() == 3);
+            CHECK((*messages)[0].content == "1");
+            CHECK((*messages)[1].content == "2");
+            CHECK((*messages)[2].content == "3");
+        }
+
+        FileDatabaseAdapter db(io_context, path);
+        auto messages = range(io_context, db, base + std::chrono::seconds(2), base + std::chrono::seconds(10));
+        REQUIRE(messages->size() == 3);
+        CHECK((*messages)[0].content == "2");
+        CHECK((*messages)[2].content == "4");
+    }
+
+    SUBCASE("Survives a restart") {
+        auto timestamp = std::chrono::system_clock::now() - std::chrono::hours(1);
+        {
+            FileDatabaseAdapter db(io_context, path);
+            CHECK(create_user(io_context, db, "alice", "secret"));
+            CHECK(store(io_context, db, ChatMessage("alice", "persisted", timestamp)));
+            ChatMessage in_room("alice", "in a room", timestamp + std::chrono::seconds(1));
+            in_room.room = 7;
+            CHECK(store(io_context, db, in_room));
+        }
+
+        FileDatabaseAdapter db(io_context, path);
+        CHECK(authenticate(io_context, db, "alice", "secret"));
+        auto messages = recent(io_context, db, 50);
+        REQUIRE(messages.size() == 2);
+        CHECK(messages[0].sender == "alice");
+        CHECK(messages[0].content == "persisted");
+        CHECK(messages[0].timestamp == timestamp);
+        CHECK(messages[0].room == 0);
+        CHECK(messages[1].content == "in a room");
+        CHECK(messages[1].room == 7);
+    }
+
+    SUBCASE("Only recent history stays in memory") {
+        auto base = std::chrono::system_clock::now() - std::chrono::hours(1);
+        CredentialHasherConfig hasher;
+        {
+            FileDatabaseAdapter db(io_context, path, 2, true, hasher, 2);
+            for (int i : {0, 1, 3, 2, 4}) {
+                CHECK(store(io_context, db, ChatMessage("alice", std::to_string(i), base + std::chrono::seconds(i))));
+            }
+            auto messages = recent(io_context, db, 50);
+            REQUIRE(messages.size() == 2);
+            CHECK(messages[0].content == "3");
+            CHECK(messages[1].content == "4");
+        }
+
+        // Older than the ring, read back from the log
+        FileDatabaseAdapter db(io_context, path, 2, true, hasher, 2);
+        auto messages = range(io_context, db, base, base + std::chrono::seconds(3));
+        REQUIRE(messages->size() == 4);
+        CHECK((*messages)[0].content == "0");
+        CHECK((*messages)[2].content == "2");
+        CHECK((*messages)[3].content == "3");
+        CHECK(range(io_context, db, base + std::chrono::seconds(4), base + std::chrono::seconds(9))->size() == 1);
+    }
+
+    SUBCASE("Drops a torn record at the tail") {
+        {
+            FileDatabaseAdapter db(io_context, path);
+            CHECK(store(io_context, db, ChatMessage("alice", "complete")));
+        }
+        auto intact_size = std::filesystem::file_size(path);
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::app);
+            out.write("M\x40\x00\x00\x00partial", 12);
+        }
+
+        FileDatabaseAdapter db(io_context, path);
+        CHECK(std::filesystem::file_size(path) == intact_size);
+        CHECK(store(io_context, db, ChatMessage("alice", "after restart")));
+        auto messages = recent(io_context, db, 50);
+        REQUIRE(messages.size() == 2);
+        CHECK(messages[1].content == "after restart");
+    }
+
+    SUBCASE("A saturated hasher is not a wrong password") {
+        CredentialHasherConfig hasher;
+        hasher.cost = 4;
+        {
+            FileDatabaseAdapter db(io_context, path, 2, true, hasher);
+            CHECK(create_user(io_context, db, "alice", "secret"));
+        }
+        hasher.max_pending = 0;
+        FileDatabaseAdapter db(io_context, path, 2, true, hasher);
+        CHECK(authenticate_result(io_context, db, "alice", "secret") == AuthResult::Busy);
+        CHECK(create_user_result(io_context, db, "bob", "secret") == AuthResult::Busy);
+        // Neither needs a hash
+        CHECK(authenticate_result(io_context, db, "nobody", "secret") == AuthResult::Rejected);
+        CHECK(create_user_result(io_context, db, "alice", "other") == AuthResult::Rejected);
+    }
+
+    SUBCASE("Skips a malformed record in the middle") {
+        uintmax_t second_record = 0;
+        {
+            FileDatabaseAdapter db(io_context, path);
+            CHECK(store(io_context, db, ChatMessage("alice", "first")));
+            second_record = std::filesystem::file_size(path);
+            CHECK(store(io_context, db, ChatMessage("alice", "corrupted")));
+            CHECK(store(io_context, db, ChatMessage("alice", "last")));
+        }
+        auto intact_size = std::filesystem::file_size(path);
+        {
+            // An unknown kind, the length still says where the next one starts
+            std::fstream out(path, std::ios::binary | std::ios::in | std::ios::out);
+            out.seekp(static_cast<std::streamoff>(second_record));
+            out.put('X');
+        }
+
+        FileDatabaseAdapter db(io_context, path);
+        CHECK(std::filesystem::file_size(path) == intact_size);
+        auto messages = recent(io_context, db, 50);
+        REQUIRE(messages.size() == 2);
+        CHECK(messages[0].content == "first");
+        CHECK(messages[1].content == "last");
+    }
+
+    SUBCASE("A failed append is rolled back") {
+        FileDatabaseAdapter db(io_context, path);
+        CHECK(store(io_context, db, ChatMessage("alice", "before")));
+        auto intact_size = std::filesystem::file_size(path);
+        {
+            // Room for part of the next record only, the write fails with EFBIG
+            auto previous_handler = std::signal(SIGXFSZ, SIG_IGN);
+            rlimit previous;
+            REQUIRE(getrlimit(RLIMIT_FSIZE, &previous) == 0);
+            rlimit limited = previous;
+            limited.rlim_cur = intact_size + 4;
+            REQUIRE(setrlimit(RLIMIT_FSIZE, &limited) == 0);
+            CHECK_FALSE(store(io_context, db, ChatMessage("alice", "does not fit")));
+            setrlimit(RLIMIT_FSIZE, &previous);
+            std::signal(SIGXFSZ, previous_handler);
+        }
+        CHECK(std::filesystem::file_size(path) == intact_size);
+        CHECK(store(io_context, db, ChatMessage("alice", "after")));
+
+        FileDatabaseAdapter reopened(io_context, path);
+        auto messages = recent(io_context, reopened, 50);
+        REQUIRE(messages.size() == 2);
+        CHECK(messages[0].content == "before");
+        CHECK(messages[1].content == "after");
+    }
+}
+
+TEST_CASE("GroupCommitDatabaseAdapter") {
+    boost::asio::io_context io_context;
+    auto inner = std::make_shared<CountingDatabaseAdapter>(io_context);
+
+    SUBCASE("Full batches commit immediately, the tail after the delay") {
+        GroupCommitConfig config;
+        config.max_batch = 4;
+        config.max_delay = std::chrono::milliseconds(5);
+        auto db = std::make_shared<GroupCommitDatabaseAdapter>(io_context, inner, config);
+
+        size_t completed = 0;
+        for (int i = 0; i < 10; ++i) {
+            db->storeMessage(ChatMessage("alice", "message " + std::to_string(i)), [&](bool success) {
+                CHECK(success);
+                ++completed;
+            });
+        }
+        CHECK(inner->batch_sizes == std::vector<size_t>{4, 4});
+
+        auto start = std::chrono::steady_clock::now();
+        while (completed < 10 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+            io_context.run_for(std::chrono::milliseconds(10));
+            io_context.restart();
+        }
+        CHECK(completed == 10);
+        CHECK(inner->batch_sizes == std::vector<size_t>{4, 4, 2});
+
+        auto messages = recent(io_context, *db, 50);
+        REQUIRE(messages.size() == 10);
+        CHECK(messages.front().content == "message 0");
+        CHECK(messages.back().content == "message 9");
+    }
+
+    SUBCASE("Flush and destruction commit what is pending") {
+        GroupCommitConfig config;
+        config.max_delay = std::chrono::seconds(10);
+        {
+            auto db = std::make_shared<GroupCommitDatabaseAdapter>(io_context, inner, config);
+            db->storeMessage(ChatMessage("alice", "flushed"), [](bool) {});
+            db->flush();
+            CHECK(inner->batch_sizes == std::vector<size_t>{1});
+            db->storeMessage(ChatMessage("alice", "on destruction"), [](bool) {});
+        }
+        CHECK(inner->batch_sizes == std::vector<size_t>{1, 1});
+        CHECK(recent(io_context, *inner, 50).size() == 2);
+    }
+
+    SUBCASE("Batches reach the wrapped adapter in the order they were taken") {
+        auto gated = std::make_shared<GatedDatabaseAdapter>(io_context);
+        GroupCommitConfig config;
+        config.max_batch = 2;
+        config.max_delay = std::chrono::seconds(10);
+        auto db = std::make_shared<GroupCommitDatabaseAdapter>(io_context, gated, config);
+
+        std::thread first([&] {
+            db->storeMessage(ChatMessage("alice", "1"), [](bool) {});
+            db->storeMessage(ChatMessage("alice", "2"), [](bool) {});
+        });
+        {
+            std::unique_lock<std::mutex> lock(gated->mutex);
+            gated->changed.wait(lock, [&] { return !gated->firsts.empty(); });
+        }
+        // The first batch is still on its way, the second waits behind it
+        db->storeMessage(ChatMessage("alice", "3"), [](bool) {});
+        db->storeMessage(ChatMessage("alice", "4"), [](bool) {});
+        db->storeMessages({ChatMessage("alice", "5")}, [](bool) {});
+        {
+            std::lock_guard<std::mutex> lock(gated->mutex);
+            CHECK(gated->firsts == std::vector<std::string>{"1"});
+            gated->open = true;
+            gated->changed.notify_all();
+        }
+        first.join();
+        CHECK(gated->firsts == std::vector<std::string>{"1", "3", "5"});
+        auto messages = recent(io_context, *gated, 50);
+        REQUIRE(messages.size() == 5);
+        for (size_t i = 0; i < messages.size(); ++i) {
+            CHECK(messages[i].content == std::to_string(i + 1));
+        }
+    }
+}
+
+TEST_CASE("CredentialHasher") {
+    SUBCASE("Hashes verify and are salted") {
+        std::string first, second;
+        REQUIRE(CredentialHasher::hashNow("secret", 4, first));
+        REQUIRE(CredentialHasher::hashNow("secret", 4, second));
+        CHECK(first != second);
+        CHECK(first.find("secret") == std::string::npos);
+        CHECK(CredentialHasher::verifyNow("secret", first));
+        CHECK(CredentialHasher::verifyNow("secret", second));
+        CHECK_FALSE(CredentialHasher::verifyNow("Secret", first));
+        CHECK_FALSE(CredentialHasher::verifyNow("secret", "plaintext"));
+        CHECK_FALSE(CredentialHasher::verifyNow(std::string("secret\0more", 11), first));
+    }
+
+    SUBCASE("Queue depth is capped") {
+        CredentialHasherConfig config;
+        config.threads = 1;
+        config.max_pending = 2;
+        config.cost = 4;
+        CredentialHasher hasher(config);
+
+        std::atomic<int> completed{0};
+        auto count = [&](bool, std::string) { ++completed; };
+        int accepted = 0;
+        for (int i = 0; i < 10; ++i) {
+            accepted += hasher.hash("password", count);
+        }
+        CHECK(accepted >= 2);
+        CHECK(accepted < 10);
+        hasher.join();
+        CHECK(completed == accepted);
+        CHECK(hasher.pending() == 0);
+    }
+}
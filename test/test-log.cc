@@ -0,0 +1,131 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+#include "chat_example/log.hh"
+#include "chat_example/format.hh"
+#include "chat_example/packet.hh"
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Everything written to `output` so far
+std::string readAll(FILE* output) {
+    Log::flush();
+    std::fflush(output);
+    std::rewind(output);
+    std::string text;
+    char buffer[4096];
+    size_t length;
+    while ((length = std::fread(buffer, 1, sizeof(buffer), output)) > 0) {
+        text.append(buffer, length);
+    }
+    return text;
+}
+
+size_t countOf(const std::string& text, const std::string& needle) {
+    size_t count = 0;
+    for (size_t position = text.find(needle); position != std::string::npos; position = text.find(needle, position + 1)) {
+        ++count;
+    }
+    return count;
+}
+
+}
+
+TEST_CASE("Log formatting") {
+    SUBCASE("Arguments fill the holes in order") {
+        std::string out;
+        logFormat(out, "[SERVER] {} joined room {} ({})", std::string("alice"), 7u, true);
+        CHECK(out == "[SERVER] alice joined room 7 (true)");
+    }
+
+    SUBCASE("Numbers, characters and views") {
+        std::string out;
+        std::string_view view = "view";
+        logFormat(out, "{} {} {} {} {}", -42, 2.5, 'c', view, "literal");
+        CHECK(out == "-42 2.5 c view literal");
+    }
+
+    SUBCASE("Enums print their value") {
+        std::string out;
+        logFormat(out, "type {}", PacketType::CreateUser);
+        CHECK(out == "type 1");
+    }
+
+    SUBCASE("Text without holes is copied as is") {
+        std::string out;
+        logFormat(out, "no arguments {not a hole}");
+        CHECK(out == "no arguments {not a hole}");
+    }
+}
+
+TEST_CASE("Async log") {
+    FILE* output = std::tmpfile();
+    REQUIRE(output != nullptr);
+    Log::setOutput(output);
+    LogLevel previous = Log::level();
+    Log::setLevel(LogLevel::Debug);
+
+    SUBCASE("Lines reach the output with level and text") {
+        logInfo("[TEST] hello {}", 1);
+        logWarn("[TEST] careful {}", 2);
+        std::string text = readAll(output);
+        CHECK(text.find("INFO  [TEST] hello 1\n") != std::string::npos);
+        CHECK(text.find("WARN  [TEST] careful 2\n") != std::string::npos);
+    }
+
+    SUBCASE("Levels below the runtime level are skipped") {
+        Log::setLevel(LogLevel::Warn);
+        logInfo("[TEST] filtered");
+        logError("[TEST] kept");
+        std::string text = readAll(output);
+        CHECK(text.find("filtered") == std::string::npos);
+        CHECK(text.find("ERROR [TEST] kept") != std::string::npos);
+    }
+
+    SUBCASE("Trace is compiled out by default") {
+        logTrace("[TEST] trace line");
+        CHECK(readAll(output).find("trace line") == std::string::npos);
+    }
+
+    SUBCASE("dbgln goes through the log") {
+        dbgln("[TEST] legacy {}", "call");
+        CHECK(readAll(output).find("INFO  [TEST] legacy call") != std::string::npos);
+    }
+
+    SUBCASE("Every thread's lines arrive, in time order per thread") {
+        const int threads = 4;
+        const int lines = 500;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([t] {
+                for (int i = 0; i < lines; ++i) {
+                    logInfo("[TEST] thread {} line {}", t, i);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        std::string text = readAll(output);
+        CHECK(countOf(text, "[TEST] thread ") + Log::dropped() == threads * lines);
+        for (int t = 0; t < threads; ++t) {
+            size_t first = text.find(format("[TEST] thread {} line 0\n", t));
+            size_t last = text.find(format("[TEST] thread {} line {}\n", t, lines - 1));
+            CHECK(first < last);
+        }
+    }
+
+    SUBCASE("A full ring drops lines instead of blocking") {
+        uint64_t dropped = Log::dropped();
+        std::string big(Log::kRingCapacity, 'x');
+        logInfo("{}", big);
+        CHECK(Log::dropped() == dropped + 1);
+    }
+
+    Log::setLevel(previous);
+    Log::setOutput(stdout);
+    std::fclose(output);
+}
@@ -0,0 +1,137 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+#include "chat_example/metrics.hh"
+#include "chat_example/metricsserver.h"
+#include <chrono>
+#include <initializer_list>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Counter and gauge") {
+    SUBCASE("Counts from every thread are summed") {
+        Counter counter;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t) {
+            threads.emplace_back([&counter] {
+                for (int i = 0; i < 10000; ++i) {
+                    counter.add();
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        CHECK(counter.value() == 80000);
+    }
+
+    SUBCASE("Gauges go up and down") {
+        Gauge gauge;
+        gauge.add(5);
+        gauge.add(-7);
+        CHECK(gauge.value() == -2);
+        gauge.set(3);
+        CHECK(gauge.value() == 3);
+    }
+}
+
+TEST_CASE("Histogram") {
+    SUBCASE("Every value falls into a bucket whose limit is above it") {
+        for (uint64_t value : std::initializer_list<uint64_t>{0, 1, 7, 8, 9, 15, 16, 1000, 123456789, uint64_t(1) << 40, UINT64_MAX}) {
+            size_t index = Histogram::bucketOf(value);
+            REQUIRE(index < Histogram::kBuckets);
+            uint64_t limit = Histogram::bucketLimit(index);
+            CHECK((value < limit || limit == UINT64_MAX));
+            if (index > 0) {
+                CHECK(Histogram::bucketLimit(index - 1) <= value);
+            }
+        }
+    }
+
+    SUBCASE("Buckets are within 12.5% of the value") {
+        for (uint64_t value = 8; value < (1ull << 30); value = value * 3 + 1) {
+            uint64_t limit = Histogram::bucketLimit(Histogram::bucketOf(value));
+            CHECK(static_cast<double>(limit - value) <= 0.125 * static_cast<double>(value) + 1);
+        }
+    }
+
+    SUBCASE("Quantiles") {
+        Histogram histogram;
+        CHECK(histogram.quantile(0.5) == 0);
+        for (uint64_t i = 1; i <= 1000; ++i) {
+            histogram.record(i * 1000);
+        }
+        CHECK(histogram.count() == 1000);
+        CHECK(histogram.sum() == 500500000);
+        uint64_t median = histogram.quantile(0.5);
+        CHECK(median >= 500000);
+        CHECK(median <= 500000 * 1.125);
+        CHECK(histogram.quantile(1.0) >= 1000000);
+    }
+}
+
+TEST_CASE("Prometheus rendering") {
+    MetricsRegistry registry;
+    registry.counter("test_packets_total", "Packets by type", "type=\"Login\"").add(3);
+    registry.counter("test_packets_total", "Packets by type", "type=\"ChatMessage\"").add(2);
+    registry.gauge("test_sessions", "Sessions").set(4);
+    registry.callback("test_dropped_total", "Read when rendered", MetricType::Counter, [] { return 9.0; });
+    Histogram& histogram = registry.histogram("test_latency_seconds", "Latency");
+    histogram.record(1500);       // 1.5 us
+    histogram.record(3000000);    // 3 ms
+
+    // The same name and labels give back the same metric
+    CHECK(&registry.gauge("test_sessions", "Sessions") == &registry.gauge("test_sessions", "Sessions"));
+
+    std::string text = registry.renderPrometheus();
+    CHECK(text.find("# HELP test_packets_total Packets by type\n# TYPE test_packets_total counter\n") != std::string::npos);
+    CHECK(text.find("test_packets_total{type=\"Login\"} 3\n") != std::string::npos);
+    CHECK(text.find("test_packets_total{type=\"ChatMessage\"} 2\n") != std::string::npos);
+    CHECK(text.find("# TYPE test_sessions gauge\ntest_sessions 4\n") != std::string::npos);
+    CHECK(text.find("test_dropped_total 9\n") != std::string::npos);
+    CHECK(text.find("# TYPE test_latency_seconds histogram\n") != std::string::npos);
+    CHECK(text.find("test_latency_seconds_bucket{le=\"1.024e-06\"} 0\n") != std::string::npos);
+    CHECK(text.find("test_latency_seconds_bucket{le=\"2.048e-06\"} 1\n") != std::string::npos);
+    CHECK(text.find("test_latency_seconds_bucket{le=\"+Inf\"} 2\n") != std::string::npos);
+    CHECK(text.find("test_latency_seconds_count 2\n") != std::string::npos);
+}
+
+TEST_CASE("Metrics server") {
+    boost::asio::io_context io_context;
+    MetricsRegistry registry;
+    registry.gauge("test_sessions", "Sessions").set(1);
+    MetricsServer server(io_context, 0, registry, std::chrono::milliseconds(100));
+    std::thread server_thread([&io_context] {
+        io_context.run();
+    });
+
+    auto connect = [&] {
+        boost::asio::ip::tcp::socket socket(io_context);
+        socket.connect({boost::asio::ip::address::from_string("127.0.0.1"), server.port()});
+        return socket;
+    };
+    auto read_all = [](boost::asio::ip::tcp::socket& socket) {
+        std::string response;
+        boost::system::error_code ec;
+        boost::asio::read(socket, boost::asio::dynamic_buffer(response), ec);
+        CHECK(ec == boost::asio::error::eof);
+        return response;
+    };
+
+    SUBCASE("Scraped") {
+        auto socket = connect();
+        boost::asio::write(socket, boost::asio::buffer(std::string("GET /metrics HTTP/1.0\r\n\r\n")));
+        CHECK(read_all(socket).find("test_sessions 1\n") != std::string::npos);
+    }
+
+    SUBCASE("A client that never asks is closed") {
+        auto socket = connect();
+        auto start = std::chrono::steady_clock::now();
+        CHECK(read_all(socket).empty());
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+    }
+
+    server.stop();
+    io_context.stop();
+    server_thread.join();
+}
@@ -1,6 +1,16 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 #include "chat_example/packet.hh"
+#include "chat_example/bufferpool.hh"
+#include "chat_example/compression.hh"
+#include "chat_example/historycache.hh"
+#include "chat_example/receivebuffer.hh"
+#include "chat_example/signal.hh"
+#include "chat_example/slottable.hh"
+#include "chat_example/writequeue.hh"
+#include <algorithm>
+#include <deque>
+#include <thread>
 
 TEST_CASE("Packet serialization and deserialization") {
     SUBCASE("LoginPacket") {
@@ -14,6 +24,14 @@ TEST_CASE("Packet serialization and deserialization") {
         auto login_packet = static_cast<LoginPacket*>(packet.get());
         CHECK(login_packet->getUsername() == "testuser");
         CHECK(login_packet->getPassword() == "testpass");
+        CHECK(login_packet->getCapabilities() == 0);
+    }
+
+    SUBCASE("LoginPacket with capabilities") {
+        auto buffer = Packet::preparePacketForSending(LoginPacket("testuser", "testpass", kCapCompressedFrames));
+        auto view = viewPacket<LoginPacketView>(std::span<const uint8_t>(buffer).subspan(4));
+        REQUIRE(view.has_value());
+        CHECK(view->getCapabilities() == kCapCompressedFrames);
     }
 
     SUBCASE("ChatMessagePacket") {
@@ -27,6 +45,27 @@ TEST_CASE("Packet serialization and deserialization") {
         auto chat_packet = static_cast<ChatMessagePacket*>(packet.get());
         CHECK(chat_packet->getSender() == "sender");
         CHECK(chat_packet->getMessage() == "Hello, world!");
+        CHECK(chat_packet->getRoom() == kLobbyRoom);
+    }
+
+    SUBCASE("Room packets") {
+        auto chat = Packet::preparePacketForSending(ChatMessagePacket("sender", "in a room", 42));
+        auto packet = createPacketFromData(std::vector<uint8_t>(chat.begin() + 4, chat.end()));
+        REQUIRE(packet != nullptr);
+        CHECK(static_cast<ChatMessagePacket*>(packet.get())->getRoom() == 42);
+
+        auto join = Packet::preparePacketForSending(JoinRoomPacket(7));
+        packet = createPacketFromData(std::vector<uint8_t>(join.begin() + 4, join.end()));
+        REQUIRE(packet != nullptr);
+        REQUIRE(packet->getType() == PacketType::JoinRoom);
+        CHECK(static_cast<JoinRoomPacket*>(packet.get())->getRoom() == 7);
+
+        auto leave = Packet::preparePacketForSending(LeaveRoomPacket(7));
+        std::span<const uint8_t> body(leave.data() + 4, leave.size() - 4);
+        auto view = viewPacket<LeaveRoomPacketView>(body);
+        REQUIRE(view.has_value());
+        CHECK(view->getRoom() == 7);
+        CHECK(checkFrameHeader(body.size(), body[0], PacketLimits::forClients()) == DecodeResult::Ok);
     }
 
     SUBCASE("CreateUserPacket") {
@@ -45,12 +84,27 @@ TEST_CASE("Packet serialization and deserialization") {
 
 TEST_CASE("Status packets") {
     SUBCASE("LoginSuccessPacket") {
-        LoginSuccessPacket original;
+        LoginSuccessPacket original(kCapCompressedFrames, "token", 9);
         std::vector<uint8_t> buffer = Packet::preparePacketForSending(original);
 
         auto packet = createPacketFromData(std::vector<uint8_t>(buffer.begin() + 4, buffer.end()));
         REQUIRE(packet != nullptr);
         CHECK(packet->getType() == PacketType::LoginSuccess);
+        auto login_success = static_cast<LoginSuccessPacket*>(packet.get());
+        CHECK(login_success->getCapabilities() == kCapCompressedFrames);
+        CHECK(login_success->getResumeToken() == "token");
+        CHECK(login_success->getReplayAfter() == 9);
+    }
+
+    SUBCASE("ResumePacket") {
+        auto resume = Packet::preparePacketForSending(ResumePacket(std::string(64, 't'), 9, kCapKeepalive));
+        std::span<const uint8_t> body(resume.data() + 4, resume.size() - 4);
+        auto view = viewPacket<ResumePacketView>(body);
+        REQUIRE(view.has_value());
+        CHECK(view->getToken() == std::string(64, 't'));
+        CHECK(view->getLastSeen() == 9);
+        CHECK(view->getCapabilities() == kCapKeepalive);
+        CHECK(checkFrameHeader(body.size(), body[0], PacketLimits::forClients()) == DecodeResult::Ok);
     }
 
     SUBCASE("LoginFailedPacket") {
@@ -97,3 +151,794 @@ TEST_CASE("Edge cases") {
         CHECK(packet == nullptr);
     }
 }
+
+TEST_CASE("Shared frames") {
+    SUBCASE("Matches the owned encoding") {
+        ChatMessagePacket original("sender", "Hello, world!");
+        SharedFrame frame = Packet::prepareSharedPacket(original);
+        REQUIRE(frame != nullptr);
+        auto owned = Packet::preparePacketForSending(original);
+        CHECK(std::equal(frame->begin(), frame->end(), owned.begin(), owned.end()));
+    }
+
+    SUBCASE("Copies share one buffer") {
+        SharedFrame frame = Packet::prepareSharedPacket(LoginSuccessPacket());
+        SharedFrame copy = frame;
+        CHECK(copy.get() == frame.get());
+        CHECK(frame.use_count() == 2);
+    }
+}
+
+TEST_CASE("Write batching") {
+    std::deque<SharedFrame> queue;
+    for (int i = 0; i < 10; ++i) {
+        queue.push_back(Packet::prepareSharedPacket(ChatMessagePacket("sender", "message")));
+    }
+    const size_t frame_size = queue.front()->size();
+    std::vector<boost::asio::const_buffer> buffers;
+
+    SUBCASE("Drains the whole queue by default") {
+        CHECK(gatherFrames(queue, WriteBatchLimits{}, buffers) == 10);
+        CHECK(boost::asio::buffer_size(buffers) == 10 * frame_size);
+    }
+
+    SUBCASE("Respects the buffer cap") {
+        CHECK(gatherFrames(queue, WriteBatchLimits{1024, 3}, buffers) == 3);
+    }
+
+    SUBCASE("Respects the byte cap") {
+        CHECK(gatherFrames(queue, WriteBatchLimits{frame_size * 4 + 1, 64}, buffers) == 4);
+    }
+
+    SUBCASE("Always takes the first frame") {
+        CHECK(gatherFrames(queue, WriteBatchLimits{1, 64}, buffers) == 1);
+        CHECK(buffers.front().data() == queue.front()->data());
+    }
+}
+
+TEST_CASE("Frame queue") {
+    FrameQueue queue;
+    auto chat = [] { return Packet::prepareSharedPacket(ChatMessagePacket("sender", "message")); };
+    auto is_chat = [](const PooledBytes& frame) {
+        return frame[4] == static_cast<uint8_t>(PacketType::ChatMessage);
+    };
+    for (int i = 0; i < 8; ++i) {
+        queue.push(chat());
+    }
+    const size_t frame_size = chat()->size();
+    std::vector<boost::asio::const_buffer> buffers;
+
+    SUBCASE("Tracks bytes and frames") {
+        CHECK(queue.frames() == 8);
+        CHECK(queue.bytes() == 8 * frame_size);
+        CHECK(queue.above(7 * frame_size, 100));
+        CHECK_FALSE(queue.above(8 * frame_size, 8));
+
+        queue.gather(WriteBatchLimits{1024, 3}, buffers);
+        CHECK(queue.writing());
+        queue.complete();
+        CHECK_FALSE(queue.writing());
+        CHECK(queue.frames() == 5);
+        CHECK(queue.bytes() == 5 * frame_size);
+    }
+
+    SUBCASE("Drops the oldest frames but never the ones in flight") {
+        queue.gather(WriteBatchLimits{1024, 2}, buffers);
+        const void* in_flight = buffers.front().data();
+
+        CHECK(queue.dropOldest(1024, 3, is_chat) == 5);
+        CHECK(queue.frames() == 3);
+        CHECK(queue.bytes() == 3 * frame_size);
+
+        queue.complete();
+        CHECK(queue.frames() == 1);
+        CHECK(in_flight != nullptr);
+    }
+
+    SUBCASE("Keeps frames the predicate protects") {
+        queue.push(Packet::prepareSharedPacket(LoginSuccessPacket()));
+        CHECK(queue.dropOldest(0, 0, is_chat) == 8);
+        CHECK(queue.frames() == 1);
+    }
+}
+
+TEST_CASE("Packet views") {
+    SUBCASE("LoginPacketView") {
+        std::vector<uint8_t> buffer = Packet::preparePacketForSending(LoginPacket("testuser", "testpass"));
+        std::span<const uint8_t> body(buffer.data() + 4, buffer.size() - 4);
+
+        auto view = viewPacket<LoginPacketView>(body);
+        REQUIRE(view.has_value());
+        CHECK(view->getUsername() == "testuser");
+        CHECK(view->getPassword() == "testpass");
+        // Fields point into the receive buffer instead of copying it
+        CHECK(reinterpret_cast<const uint8_t*>(view->getUsername().data()) > body.data());
+        CHECK(reinterpret_cast<const uint8_t*>(view->getPassword().data()) < body.data() + body.size());
+    }
+
+    SUBCASE("ChatMessagePacketView") {
+        std::vector<uint8_t> buffer = Packet::preparePacketForSending(ChatMessagePacket("sender", "Hello, world!"));
+        std::span<const uint8_t> body(buffer.data() + 4, buffer.size() - 4);
+
+        REQUIRE(peekPacketType(body) == PacketType::ChatMessage);
+        auto view = viewPacket<ChatMessagePacketView>(body);
+        REQUIRE(view.has_value());
+        CHECK(view->getSender() == "sender");
+        CHECK(view->getMessage() == "Hello, world!");
+    }
+
+    SUBCASE("Mismatched type") {
+        std::vector<uint8_t> buffer = Packet::preparePacketForSending(CreateUserPacket("newuser", "newpass"));
+        std::span<const uint8_t> body(buffer.data() + 4, buffer.size() - 4);
+        CHECK_FALSE(viewPacket<LoginPacketView>(body).has_value());
+        CHECK(viewPacket<CreateUserPacketView>(body).has_value());
+    }
+
+    SUBCASE("Truncated packet") {
+        std::vector<uint8_t> buffer = Packet::preparePacketForSending(ChatMessagePacket("sender", "Hello, world!"));
+        std::span<const uint8_t> body(buffer.data() + 4, buffer.size() - 5);
+        CHECK_FALSE(viewPacket<ChatMessagePacketView>(body).has_value());
+    }
+
+    SUBCASE("Empty packet data") {
+        CHECK_FALSE(peekPacketType({}).has_value());
+    }
+}
+
+TEST_CASE("Packet schema") {
+    SUBCASE("Encoded size is exact") {
+        ChatMessagePacket original("sender", "Hello, world!");
+        std::vector<uint8_t> buffer = Packet::preparePacketForSending(original);
+        CHECK(original.encodedSize() == 1 + 4 + 6 + 4 + 13 + 4 + 8);
+        CHECK(buffer.size() == 4 + original.encodedSize());
+        CHECK(buffer.capacity() == buffer.size());
+    }
+
+    SUBCASE("Typed and type-erased encoders agree") {
+        LoginPacket original("testuser", "testpass");
+        const Packet& erased = original;
+        CHECK(Packet::preparePacketForSending(original) == Packet::preparePacketForSending(erased));
+    }
+
+    SUBCASE("Dispatch picks the matching view") {
+        std::vector<uint8_t> buffer = Packet::preparePacketForSending(CreateUserPacket("newuser", "newpass"));
+        std::span<const uint8_t> body(buffer.data() + 4, buffer.size() - 4);
+
+        std::string username;
+        int other = 0;
+        DecodeResult result = dispatchPacket(body, [&](const auto& packet) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(packet)>, CreateUserPacketView>) {
+                username = packet.getUsername();
+            } else {
+                ++other;
+            }
+        });
+        CHECK(result == DecodeResult::Ok);
+        CHECK(username == "newuser");
+        CHECK(other == 0);
+    }
+
+    SUBCASE("Dispatch rejects unknown and malformed packets") {
+        int calls = 0;
+        auto handler = [&](const auto&) { ++calls; };
+        std::vector<uint8_t> unknown{255};
+        CHECK(dispatchPacket(unknown, handler) == DecodeResult::UnknownType);
+
+        std::vector<uint8_t> buffer = Packet::preparePacketForSending(LoginPacket("testuser", "testpass"));
+        std::span<const uint8_t> truncated(buffer.data() + 4, buffer.size() - 6);
+        CHECK(dispatchPacket(truncated, handler) == DecodeResult::Truncated);
+        CHECK(createPacketFromData(truncated) == nullptr);
+        CHECK(calls == 0);
+    }
+}
+
+TEST_CASE("Packet validation") {
+    SUBCASE("Oversized string length") {
+        // A length prefix pointing far past the end of the frame
+        std::vector<uint8_t> data{static_cast<uint8_t>(PacketType::ChatMessage), 0xff, 0xff, 0xff, 0x7f};
+        ChatMessagePacketView view;
+        CHECK(decodePacket(data, view) == DecodeResult::Truncated);
+        CHECK(createPacketFromData(data) == nullptr);
+    }
+
+    SUBCASE("Trailing data") {
+        std::vector<uint8_t> buffer = Packet::preparePacketForSending(LoginPacket("testuser", "testpass"));
+        std::vector<uint8_t> body(buffer.begin() + 4, buffer.end());
+        body.push_back(0);
+        LoginPacketView view;
+        CHECK(decodePacket(body, view) == DecodeResult::TrailingData);
+        CHECK(createPacketFromData(body) == nullptr);
+    }
+
+    SUBCASE("Per-type frame limits") {
+        PacketLimits limits = PacketLimits::forClients(64, 4096);
+        auto login = static_cast<uint8_t>(PacketType::Login);
+        auto chat = static_cast<uint8_t>(PacketType::ChatMessage);
+        auto success = static_cast<uint8_t>(PacketType::LoginSuccess);
+
+        CHECK(checkFrameHeader(LoginPacket(std::string(64, 'u'), std::string(64, 'p')).encodedSize(), login, limits) == DecodeResult::Ok);
+        CHECK(checkFrameHeader(LoginPacket(std::string(65, 'u'), std::string(64, 'p')).encodedSize(), login, limits) == DecodeResult::TooLarge);
+        CHECK(checkFrameHeader(ChatMessagePacket(std::string(64, 's'), std::string(4096, 'm')).encodedSize(), chat, limits) == DecodeResult::Ok);
+        CHECK(checkFrameHeader(kMaxFrameSize, chat, limits) == DecodeResult::TooLarge);
+        CHECK(checkFrameHeader(1, success, limits) == DecodeResult::Ok);
+        CHECK(checkFrameHeader(PongPacket(7).encodedSize(), static_cast<uint8_t>(PacketType::Pong), limits) == DecodeResult::Ok);
+        CHECK(checkFrameHeader(0, login, limits) == DecodeResult::Empty);
+        CHECK(checkFrameHeader(10, 200, limits) == DecodeResult::UnknownType);
+    }
+}
+
+TEST_CASE("Message batches") {
+    std::string lines;
+    ChatMessageBatchPacket::appendLine(lines, "alice", "hello");
+    ChatMessageBatchPacket::appendLine(lines, "bob", "");
+    ChatMessageBatchPacket::appendLine(lines, "alice", "again");
+
+    SUBCASE("Round trip") {
+        auto data = Packet::preparePacketForSending(ChatMessageBatchPacket(3, lines));
+        std::span<const uint8_t> body = std::span<const uint8_t>(data).subspan(sizeof(uint32_t));
+        ChatMessageBatchPacketView view;
+        REQUIRE(decodePacket(body, view) == DecodeResult::Ok);
+        CHECK(view.getRoom() == 3);
+        std::vector<std::string> seen;
+        CHECK(view.forEachLine([&](std::string_view sender, std::string_view message) {
+            seen.push_back(std::string(sender) + ":" + std::string(message));
+        }));
+        CHECK(seen == std::vector<std::string>{"alice:hello", "bob:", "alice:again"});
+
+        auto packet = createPacketFromData(body);
+        REQUIRE(packet != nullptr);
+        REQUIRE(packet->getType() == PacketType::ChatMessageBatch);
+        auto messages = static_cast<ChatMessageBatchPacket&>(*packet).getMessages();
+        REQUIRE(messages.size() == 3);
+        CHECK(messages[1] == std::pair<std::string, std::string>{"bob", ""});
+    }
+
+    SUBCASE("Malformed lines are rejected with the frame") {
+        std::string cut = lines.substr(0, lines.size() - 2);
+        auto data = Packet::preparePacketForSending(ChatMessageBatchPacket(3, cut));
+        std::span<const uint8_t> body = std::span<const uint8_t>(data).subspan(sizeof(uint32_t));
+        ChatMessageBatchPacketView view;
+        CHECK(decodePacket(body, view) != DecodeResult::Ok);
+        CHECK(createPacketFromData(body) == nullptr);
+        CHECK(ChatMessageBatchPacket(3, cut).getMessages().empty());
+    }
+
+    SUBCASE("Only the server sends them") {
+        auto size = ChatMessageBatchPacket(3, lines).encodedSize();
+        CHECK(checkFrameHeader(size, static_cast<uint8_t>(PacketType::ChatMessageBatch), PacketLimits::forClients()) ==
+              DecodeResult::TooLarge);
+    }
+}
+
+TEST_CASE("Cluster packets") {
+    auto chat = Packet::preparePacketForSending(ChatMessagePacket("alice", "hi", 4));
+    std::string frame(chat.begin(), chat.end());
+    auto data = Packet::preparePacketForSending(ClusterForwardPacket(4, ClusterFrameKind::ChatLine, frame));
+    std::span<const uint8_t> body = std::span<const uint8_t>(data).subspan(sizeof(uint32_t));
+
+    auto view = viewPacket<ClusterForwardPacketView>(body);
+    REQUIRE(view.has_value());
+    CHECK(view->getRoom() == 4);
+    CHECK(view->getKind() == ClusterFrameKind::ChatLine);
+    CHECK(view->getFrame() == frame);
+
+    // Nodes accept nothing else from each other, clients none of it
+    PacketLimits cluster = PacketLimits::forCluster();
+    auto forward = static_cast<uint8_t>(PacketType::ClusterForward);
+    auto hello = static_cast<uint8_t>(PacketType::ClusterHello);
+    CHECK(checkFrameHeader(body.size(), forward, cluster) == DecodeResult::Ok);
+    CHECK(checkFrameHeader(ClusterHelloPacket(1).encodedSize(), hello, cluster) == DecodeResult::Ok);
+    CHECK(checkFrameHeader(body.size(), forward, PacketLimits::forClients()) == DecodeResult::TooLarge);
+    CHECK(checkFrameHeader(ClusterHelloPacket(1).encodedSize(), hello, PacketLimits::forClients()) == DecodeResult::TooLarge);
+    CHECK(checkFrameHeader(chat.size() - sizeof(uint32_t), static_cast<uint8_t>(PacketType::ChatMessage), cluster) ==
+          DecodeResult::TooLarge);
+}
+
+TEST_CASE("Compressed frames") {
+    std::string text;
+    for (int i = 0; text.size() < 2000; ++i) {
+        text += "this line repeats itself, more or less " + std::to_string(i) + ". ";
+    }
+    auto chat = Packet::preparePacketForSending(ChatMessagePacket("sender", text));
+    auto join = Packet::preparePacketForSending(JoinRoomPacket(7));
+    std::vector<uint8_t> frames = chat;
+    frames.insert(frames.end(), join.begin(), join.end());
+
+    // The inner frames, handed over one by one
+    auto unpack = [](std::span<const uint8_t> frame, std::vector<uint8_t>& inflated) {
+        auto view = viewPacket<CompressedPacketView>(frame.subspan(sizeof(uint32_t)));
+        REQUIRE(view.has_value());
+        return inflateFrames(*view, kMaxFrameSize, inflated);
+    };
+
+    SUBCASE("Round trip through a single frame") {
+        auto compressed = compressFrames(frames, 6);
+        REQUIRE(compressed.has_value());
+        CHECK(compressed->size() < frames.size() / 4);
+
+        std::vector<uint8_t> inflated;
+        REQUIRE(unpack(*compressed, inflated));
+        CHECK(inflated == frames);
+
+        std::vector<PacketType> types;
+        CHECK(consumeFrames(inflated, PacketLimits::unbounded(), [&](std::span<const uint8_t> body) {
+            types.push_back(*peekPacketType(body));
+            return DecodeResult::Ok;
+        }) == DecodeResult::Ok);
+        CHECK(types == std::vector<PacketType>{PacketType::ChatMessage, PacketType::JoinRoom});
+    }
+
+    SUBCASE("Same bytes as the schema would encode") {
+        auto compressed = compressFrames(chat, 6);
+        REQUIRE(compressed.has_value());
+        auto view = viewPacket<CompressedPacketView>(std::span<const uint8_t>(*compressed).subspan(sizeof(uint32_t)));
+        REQUIRE(view.has_value());
+        CHECK(view->getInflatedSize() == chat.size());
+        auto encoded = Packet::preparePacketForSending(CompressedPacket(view->getInflatedSize(), std::string(view->getData())));
+        CHECK(encoded == *compressed);
+    }
+
+    SUBCASE("Short or incompressible frames are left alone") {
+        CHECK_FALSE(compressFrames(join, 6).has_value());
+        std::vector<uint8_t> noise(512);
+        uint32_t state = 12345;
+        for (auto& byte : noise) {
+            state = state * 1103515245 + 12345;
+            byte = static_cast<uint8_t>(state >> 24);
+        }
+        CHECK_FALSE(compressFrames(noise, 6).has_value());
+    }
+
+    SUBCASE("Inflating is bounded by the stated size") {
+        auto compressed = compressFrames(frames, 6);
+        REQUIRE(compressed.has_value());
+        std::vector<uint8_t> inflated;
+        auto view = viewPacket<CompressedPacketView>(std::span<const uint8_t>(*compressed).subspan(sizeof(uint32_t)));
+        REQUIRE(view.has_value());
+        CHECK_FALSE(inflateFrames(*view, static_cast<uint32_t>(frames.size()) - 1, inflated));
+
+        // A size that understates the payload is caught as well
+        auto lying = Packet::preparePacketForSending(CompressedPacket(100, std::string(view->getData())));
+        CHECK_FALSE(unpack(lying, inflated));
+        auto garbage = Packet::preparePacketForSending(CompressedPacket(100, "not deflate data"));
+        CHECK_FALSE(unpack(garbage, inflated));
+    }
+
+    SUBCASE("Frames inside must cover the payload exactly") {
+        std::vector<uint8_t> cut(frames.begin(), frames.end() - 1);
+        auto ok = [](std::span<const uint8_t>) { return DecodeResult::Ok; };
+        CHECK(consumeFrames(cut, PacketLimits::unbounded(), ok) == DecodeResult::Truncated);
+        CHECK(consumeFrames(chat, PacketLimits::forClients(64, 100), ok) == DecodeResult::TooLarge);
+    }
+}
+
+TEST_CASE("Receive buffer") {
+    std::vector<uint8_t> stream;
+    for (int i = 0; i < 5; ++i) {
+        auto frame = Packet::preparePacketForSending(ChatMessagePacket("sender", "message " + std::to_string(i)));
+        stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+
+    ReceiveBuffer buffer(64);
+    std::vector<std::string> messages;
+    auto collect = [&](std::span<const uint8_t> frame) {
+        auto view = viewPacket<ChatMessagePacketView>(frame);
+        REQUIRE(view.has_value());
+        messages.emplace_back(view->getMessage());
+        return DecodeResult::Ok;
+    };
+    PacketLimits limits = PacketLimits::forClients();
+
+    // Copies `length` bytes of the stream in, the way async_read_some would
+    auto feed = [&](size_t offset, size_t length) {
+        auto space = buffer.prepare();
+        REQUIRE(space.size() >= length);
+        std::memcpy(space.data(), stream.data() + offset, length);
+        buffer.commit(length);
+    };
+
+    SUBCASE("Several frames in one read") {
+        ReceiveBuffer large(4096);
+        auto space = large.prepare();
+        std::memcpy(space.data(), stream.data(), stream.size());
+        large.commit(stream.size());
+        CHECK(large.consume(limits, collect) == DecodeResult::Ok);
+        CHECK(messages.size() == 5);
+        CHECK(messages.back() == "message 4");
+        CHECK(large.buffered() == 0);
+    }
+
+    SUBCASE("Frames split across reads") {
+        size_t offset = 0;
+        while (offset < stream.size()) {
+            size_t n = std::min<size_t>(7, stream.size() - offset);
+            feed(offset, n);
+            offset += n;
+            CHECK(buffer.consume(limits, collect) == DecodeResult::Ok);
+        }
+        REQUIRE(messages.size() == 5);
+        CHECK(messages[2] == "message 2");
+        CHECK(buffer.buffered() == 0);
+    }
+
+    SUBCASE("Grows for a frame larger than its capacity") {
+        auto frame = Packet::preparePacketForSending(ChatMessagePacket("sender", std::string(1000, 'x')));
+        stream.assign(frame.begin(), frame.end());
+        size_t offset = 0;
+        while (offset < stream.size()) {
+            auto space = buffer.prepare();
+            size_t n = std::min(space.size(), stream.size() - offset);
+            std::memcpy(space.data(), stream.data() + offset, n);
+            buffer.commit(n);
+            offset += n;
+            CHECK(buffer.consume(limits, collect) == DecodeResult::Ok);
+        }
+        REQUIRE(messages.size() == 1);
+        CHECK(messages[0].size() == 1000);
+    }
+
+    SUBCASE("Rejects an oversized header before the body arrives") {
+        std::vector<uint8_t> header{0x00, 0x00, 0x10, 0x00, static_cast<uint8_t>(PacketType::ChatMessage)};
+        stream = header;
+        feed(0, header.size());
+        CHECK(buffer.consume(limits, collect) == DecodeResult::TooLarge);
+        CHECK(messages.empty());
+    }
+
+    SUBCASE("Stops at the first rejected frame") {
+        ReceiveBuffer large(4096);
+        auto space = large.prepare();
+        std::memcpy(space.data(), stream.data(), stream.size());
+        large.commit(stream.size());
+        int calls = 0;
+        CHECK(large.consume(limits, [&](std::span<const uint8_t>) {
+            ++calls;
+            return DecodeResult::Truncated;
+        }) == DecodeResult::Truncated);
+        CHECK(calls == 1);
+    }
+}
+
+TEST_CASE("History cache") {
+    HistoryCache history(3);
+    // For append(), the line encoded with whatever id it is given
+    auto line = [](const std::string& message) {
+        return [message](HistoryId id) {
+            return Packet::prepareSharedPacket(ChatMessagePacket("sender", message, kLobbyRoom, id));
+        };
+    };
+    auto seed = [&](const std::vector<std::string>& lines) {
+        return history.seed(lines.size(), [&](size_t i, HistoryId id) { return line(lines[i])(id); });
+    };
+    // Splits a blob back into its messages, each with its id
+    auto messages = [](const SharedFrame& blob) {
+        std::vector<std::string> result;
+        ReceiveBuffer buffer(std::max<size_t>(1, blob->size()));
+        auto space = buffer.prepare();
+        std::memcpy(space.data(), blob->data(), blob->size());
+        buffer.commit(blob->size());
+        buffer.consume(PacketLimits::unbounded(), [&](std::span<const uint8_t> data) {
+            auto view = viewPacket<ChatMessagePacketView>(data);
+            REQUIRE(view.has_value());
+            result.push_back(std::string(view->getMessage()) + "@" + std::to_string(view->getHistoryId()));
+            return DecodeResult::Ok;
+        });
+        return result;
+    };
+    // What replay() delivers for `last_seen`, uncompressed
+    struct Replayed {
+        SharedFrame frames;
+        HistoryId after;
+        HistoryId last;
+    };
+    auto replay = [&](HistoryId last_seen) {
+        Replayed replayed;
+        history.replay(last_seen, false, [](const PooledBytes&) { return SharedFrame(); },
+                       [&](SharedFrame frames, HistoryId after, HistoryId last) {
+                           replayed = {std::move(frames), after, last};
+                       });
+        return replayed;
+    };
+
+    SUBCASE("Nothing until seeded") {
+        history.append(line("before seeding"));
+        CHECK(history.blob() == nullptr);
+        auto unseeded = replay(0);
+        CHECK(unseeded.frames == nullptr);
+        // Past the ids left for the seed
+        CHECK(unseeded.after == 4);
+        CHECK(unseeded.last == 4);
+        CHECK(history.lastId() == 4);
+    }
+
+    SUBCASE("Appends and trims incrementally") {
+        CHECK(seed({"a", "b"}));
+        auto seeded = history.blob();
+        REQUIRE(seeded != nullptr);
+        CHECK(messages(seeded) == std::vector<std::string>{"a@1", "b@2"});
+        // Shared until something changes
+        CHECK(history.blob() == seeded);
+
+        history.append(line("c"));
+        auto frame = history.append(line("d"));
+        CHECK(messages(frame) == std::vector<std::string>{"d@4"});
+        auto blob = history.blob();
+        CHECK(blob != seeded);
+        CHECK(messages(blob) == std::vector<std::string>{"b@2", "c@3", "d@4"});
+        CHECK(messages(seeded) == std::vector<std::string>{"a@1", "b@2"});
+    }
+
+    SUBCASE("Only what is newer than the client has") {
+        CHECK(seed({"a", "b", "c"}));
+        history.append(line("d"));
+        auto missed = replay(2);
+        CHECK(messages(missed.frames) == std::vector<std::string>{"c@3", "d@4"});
+        CHECK(missed.after == 2);
+        CHECK(missed.last == 4);
+        auto current = replay(4);
+        CHECK(current.frames->empty());
+        CHECK(current.after == 4);
+        // Missed more than is kept, gets all of it and learns where it starts
+        auto everything = replay(0);
+        CHECK(everything.frames == history.blob());
+        CHECK(everything.after == 1);
+        CHECK(replay(1).frames == history.blob());
+        CHECK(replay(1).after == 1);
+    }
+
+    // seed() for a session let in at `admitted`, with what it delivers
+    auto seed_for = [&](const std::vector<std::string>& lines, HistoryId admitted, Replayed& replayed) {
+        return history.seed(
+            lines.size(), [&](size_t i, HistoryId id) { return line(lines[i])(id); }, admitted, false,
+            [](const PooledBytes&) { return SharedFrame(); },
+            [&](SharedFrame frames, HistoryId after, HistoryId last) { replayed = {std::move(frames), after, last}; });
+    };
+
+    SUBCASE("Lines appended while fetching are kept") {
+        HistoryId admitted = replay(0).last;
+        history.append(line("raced"));
+        Replayed seeded{};
+        CHECK(seed_for({"a"}, admitted, seeded));
+        CHECK(messages(history.blob()) == std::vector<std::string>{"a@3", "raced@4"});
+        // The session had the raced line live
+        CHECK(messages(seeded.frames) == std::vector<std::string>{"a@3"});
+        CHECK(seeded.after == 2);
+        CHECK(seeded.last == 3);
+        CHECK(messages(history.append(line("b"))) == std::vector<std::string>{"b@5"});
+    }
+
+    SUBCASE("A line the fetch caught as well is kept once") {
+        HistoryId admitted = replay(0).last;
+        history.append(line("raced"));
+        HistoryId later = replay(0).last;
+        history.append(line("after"));
+        Replayed seeded{};
+        CHECK(seed_for({"a", "b", "raced"}, admitted, seeded));
+        CHECK(messages(history.blob()) == std::vector<std::string>{"b@3", "raced@4", "after@5"});
+        CHECK(messages(seeded.frames) == std::vector<std::string>{"b@3"});
+        // Let in between the two lines, lost the race to seed
+        Replayed lost{};
+        CHECK_FALSE(seed_for({"a", "b", "raced", "after"}, later, lost));
+        CHECK(messages(lost.frames) == std::vector<std::string>{"b@3", "raced@4"});
+        CHECK(lost.after == 2);
+        CHECK(lost.last == 4);
+        CHECK_FALSE(seed({"again"}));
+    }
+
+    SUBCASE("Seeding hands over the replay under the same lock") {
+        Replayed seeded{};
+        CHECK(seed_for({"a", "b", "c", "d"}, history.lastId(), seeded));
+        CHECK(messages(seeded.frames) == std::vector<std::string>{"b@1", "c@2", "d@3"});
+        CHECK(seeded.after == 0);
+        CHECK(seeded.last == 3);
+    }
+
+    SUBCASE("Compressed blob is shared until the next append") {
+        CHECK(seed({std::string(300, 'a'), std::string(300, 'b')}));
+        int calls = 0;
+        auto compress = [&](const PooledBytes& blob) {
+            ++calls;
+            return compressSharedFrame(blob, 6);
+        };
+        auto compressed = history.compressedBlob(compress);
+        REQUIRE(compressed != nullptr);
+        CHECK(compressed->size() < history.blob()->size());
+        CHECK(history.compressedBlob(compress) == compressed);
+        CHECK(calls == 1);
+
+        history.append(line("c"));
+        CHECK(history.compressedBlob(compress) != compressed);
+        CHECK(calls == 2);
+    }
+
+    SUBCASE("Seed keeps the newest frames") {
+        CHECK(seed({"1", "2", "3", "4"}));
+        CHECK(messages(history.blob()) == std::vector<std::string>{"2@1", "3@2", "4@3"});
+    }
+}
+
+TEST_CASE("Slot table") {
+    SlotTable<std::string> table;
+    auto a = table.insert("a");
+    auto b = table.insert("b");
+    auto c = table.insert("c");
+    REQUIRE(table.size() == 3);
+
+    SUBCASE("Erase moves the last value into the hole") {
+        CHECK(table.erase(a));
+        CHECK(table.values() == std::vector<std::string>{"c", "b"});
+        REQUIRE(table.find(c) != nullptr);
+        CHECK(*table.find(c) == "c");
+        CHECK(*table.find(b) == "b");
+        CHECK(table.find(a) == nullptr);
+    }
+
+    SUBCASE("Stale handles stay stale when a slot is reused") {
+        CHECK(table.erase(b));
+        CHECK_FALSE(table.erase(b));
+        auto d = table.insert("d");
+        CHECK(d.index == b.index);
+        CHECK_FALSE(d == b);
+        CHECK(table.find(b) == nullptr);
+        CHECK(*table.find(d) == "d");
+        CHECK(table.size() == 3);
+    }
+
+    SUBCASE("Clear invalidates every handle") {
+        table.clear();
+        CHECK(table.empty());
+        CHECK_FALSE(table.contains(a));
+        CHECK_FALSE(table.erase(c));
+        auto d = table.insert("d");
+        CHECK(table.values() == std::vector<std::string>{"d"});
+        CHECK(table.contains(d));
+    }
+
+    SUBCASE("Default handle matches nothing") {
+        CHECK_FALSE(SlotHandle().valid());
+        CHECK_FALSE(table.erase(SlotHandle()));
+    }
+}
+
+TEST_CASE("Buffer pool") {
+    SUBCASE("Size classes") {
+        CHECK(BufferPool::classOf(1) == 0);
+        CHECK(BufferPool::classOf(64) == 0);
+        CHECK(BufferPool::classOf(65) == 1);
+        CHECK(BufferPool::classOf(128) == 1);
+        CHECK(BufferPool::blockSize(BufferPool::classOf(1000)) == 1024);
+        CHECK(BufferPool::classOf(BufferPool::kMaxBlock) == BufferPool::kClasses - 1);
+    }
+
+    SUBCASE("Freed blocks are reused by the same class") {
+        void* first = BufferPool::allocate(100);
+        size_t cached = BufferPool::cachedBlocks();
+        BufferPool::deallocate(first, 100);
+        CHECK(BufferPool::cachedBlocks() == cached + 1);
+        void* second = BufferPool::allocate(120);
+        CHECK(second == first);
+        CHECK(BufferPool::cachedBlocks() == cached);
+        BufferPool::deallocate(second, 120);
+    }
+
+    SUBCASE("Large blocks bypass the pool") {
+        size_t cached = BufferPool::cachedBlocks();
+        void* block = BufferPool::allocate(BufferPool::kMaxBlock + 1);
+        BufferPool::deallocate(block, BufferPool::kMaxBlock + 1);
+        CHECK(BufferPool::cachedBlocks() == cached);
+    }
+
+    SUBCASE("Free lists are capped") {
+        std::vector<void*> blocks;
+        for (int i = 0; i < 64; ++i) {
+            blocks.push_back(BufferPool::allocate(BufferPool::kMaxBlock));
+        }
+        for (void* block : blocks) {
+            BufferPool::deallocate(block, BufferPool::kMaxBlock);
+        }
+        CHECK(BufferPool::cachedBlocks() <= 64 - 4);
+    }
+
+    SUBCASE("Frames recycle their storage") {
+        // Warm up, then a steady state encode must not need a new block
+        Packet::prepareSharedPacket(ChatMessagePacket("sender", "warm up")).reset();
+        size_t cached = BufferPool::cachedBlocks();
+        auto frame = Packet::prepareSharedPacket(ChatMessagePacket("sender", "steady"));
+        CHECK(BufferPool::cachedBlocks() < cached);
+        frame.reset();
+        CHECK(BufferPool::cachedBlocks() == cached);
+    }
+
+    SUBCASE("Blocks may be freed on another thread") {
+        SharedFrame frame = Packet::prepareSharedPacket(LoginSuccessPacket());
+        std::thread([frame = std::move(frame)]() mutable { frame.reset(); }).join();
+        CHECK(frame == nullptr);
+    }
+}
+
+TEST_CASE("Signal") {
+    SUBCASE("Direct slots run on emit") {
+        Signal<const std::string&, int> signal;
+        CHECK_FALSE(signal.connected());
+        signal.emit("nobody listens", 0);
+
+        std::string received;
+        int count = 0;
+        signal.connect([&](const std::string& message, int n) {
+            received = message;
+            count += n;
+        });
+        CHECK(signal.connected());
+        signal.emit("hello", 2);
+        CHECK(received == "hello");
+        CHECK(count == 2);
+
+        signal.disconnect();
+        CHECK_FALSE(signal.connected());
+        signal.emit("ignored", 1);
+        CHECK(count == 2);
+    }
+
+    SUBCASE("Reconnecting replaces the slot") {
+        Signal<int> signal;
+        int first = 0, second = 0;
+        signal.connect([&](int n) { first += n; });
+        signal.connect([&](int n) { second += n; });
+        signal.emit(5);
+        CHECK(first == 0);
+        CHECK(second == 5);
+    }
+
+    SUBCASE("Replaced slots are freed once no emit can see them") {
+        Signal<int> signal;
+        auto first = std::make_shared<int>(0);
+        signal.connect([first](int) {});
+        CHECK(first.use_count() == 2);
+        signal.connect([](int) {});
+        CHECK(first.use_count() == 1);
+
+        // Reconnected by the slot itself, so kept until the next connect
+        auto second = std::make_shared<int>(0);
+        signal.connect([&signal, second](int) { signal.connect([](int) {}); });
+        signal.emit(1);
+        CHECK(second.use_count() == 2);
+        signal.disconnect();
+        CHECK(second.use_count() == 1);
+    }
+
+    SUBCASE("Posted slots get their own copy of the arguments") {
+        boost::asio::io_context io_context;
+        Signal<const std::string&> signal;
+        std::string received;
+        signal.connect([&](const std::string& message) { received = message; }, &io_context);
+        {
+            std::string temporary(100, 'x');
+            signal.emit(temporary);
+        }
+        CHECK(received.empty());
+        io_context.run();
+        CHECK(received == std::string(100, 'x'));
+    }
+
+    SUBCASE("Move-only arguments are moved through") {
+        boost::asio::io_context io_context;
+        Signal<std::unique_ptr<int>> signal;
+        int received = 0;
+        signal.connect([&](std::unique_ptr<int> value) { received = *value; }, io_context.get_executor());
+        signal.emit(std::make_unique<int>(7));
+        io_context.run();
+        CHECK(received == 7);
+    }
+
+    SUBCASE("A posted slot outlives its signal") {
+        boost::asio::io_context io_context;
+        int count = 0;
+        {
+            Signal<> signal;
+            signal.connect([&] { ++count; }, &io_context);
+            signal.emit();
+        }
+        io_context.run();
+        CHECK(count == 1);
+    }
+}